@@ -0,0 +1,312 @@
+/*
+ * comlink_backend_bench: message rate of the comlink event loop backends
+ *
+ *     - A sender process opens N connections to a comlink server and
+ *       pushes small framed messages in bursts, the way listeners report
+ *       status/output to the launcher.
+ *
+ *     - The receiving comlink process counts frames and reports messages
+ *       per second of wall time and per second of its own cpu time.
+ */
+
+/* comlink_backend_bench.c -- ./comlink_backend_bench [-b epoll|uring]
+ *                            [-c conns] [-n msgs per conn] [-s payload] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+
+#include "comlink.h"
+#include "common.h"
+
+/*****************************************************************************/
+
+#define BENCH_PORT      (25100)
+#define BENCH_BURST     (64)  /* frames per write on the sender side */
+#define BENCH_BUF_SIZE  (64 * 1024)
+
+/*****************************************************************************/
+
+typedef struct bench_params_s {
+    int backend;
+    int conns;
+    int msgs;
+    int size;
+}bench_params_t;
+
+typedef struct bench_result_s {
+    long long expected;
+    long long received;
+    double t_start;
+    double cpu_start;
+    double t_end;
+    double cpu_end;
+}bench_result_t;
+
+/*****************************************************************************/
+
+static char bench_buf[BENCH_BUF_SIZE];
+static bench_result_t bench_result;
+
+/*****************************************************************************/
+
+static double bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*****************************************************************************/
+
+static double bench_cpu(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+        ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/*****************************************************************************/
+
+static void bench_rx_callback(int fd, unsigned int type, char *buf, int len)
+{
+    bench_result_t *r = &bench_result;
+
+    if (r->received == 0) {
+        r->t_start = bench_now();
+        r->cpu_start = bench_cpu();
+    }
+
+    r->received += 1;
+    if (r->received == r->expected) {
+        r->t_end = bench_now();
+        r->cpu_end = bench_cpu();
+        comlink_server_shutdown();
+    }
+}
+
+/*****************************************************************************/
+/* receiving side; runs the comlink loop with the chosen backend */
+
+static int bench_receiver(bench_params_t *bp, int ready_fd)
+{
+    double wall;
+    double cpu;
+    FILE *out;
+    comlink_params_t cl_params;
+    bench_result_t *r = &bench_result;
+
+    /* keep comlink's connection logs out of the result stream */
+    out = fdopen(dup(STDOUT_FILENO), "w");
+    if (out == NULL || freopen("/dev/null", "w", stdout) == NULL)
+        return -1;
+
+    memset(&cl_params, 0, sizeof(comlink_params_t));
+    cl_params.buffer = bench_buf;
+    cl_params.buf_len = BENCH_BUF_SIZE;
+    cl_params.local_port = BENCH_PORT + bp->backend;
+    cl_params.backend = bp->backend;
+    cl_params.receive_cb = bench_rx_callback;
+    if (comlink_server_setup(&cl_params) == -1)
+        return -1;
+
+    r->expected = (long long)bp->conns * bp->msgs;
+    if (write(ready_fd, "r", 1) != 1)
+        return -1;
+    close(ready_fd);
+
+    comlink_server_start();
+
+    wall = r->t_end - r->t_start;
+    cpu = r->cpu_end - r->cpu_start;
+    fprintf(out, "backend=%s conns=%d msgs=%lld size=%d wall_s=%.4f "
+        "cpu_s=%.4f msgs_per_s=%.0f msgs_per_cpu_s=%.0f \n",
+        comlink_backend_name(), bp->conns, r->received, bp->size,
+        wall, cpu, wall > 0 ? r->received / wall : 0,
+        cpu > 0 ? r->received / cpu : 0);
+    fclose(out);
+
+    comlink_server_shutdown();
+
+    return 0;
+}
+
+/*****************************************************************************/
+/* sending side; plain sockets so only the receiver is measured */
+
+static int bench_sender(bench_params_t *bp)
+{
+    int i;
+    int j;
+    int k;
+    int ret;
+    int frame;
+    int burst;
+    int *fds;
+    int *left;
+    int active;
+    char *frames;
+    comlink_header_t header;
+    struct sockaddr_in addr;
+
+    fds = calloc(bp->conns, sizeof(int));
+    left = calloc(bp->conns, sizeof(int));
+    frame = sizeof(comlink_header_t) + bp->size;
+    frames = calloc(BENCH_BURST, frame);
+    if (fds == NULL || left == NULL || frames == NULL)
+        return -1;
+
+    header.type = htonl(STATUS_MESSAGE);
+    header.len = htonl(bp->size);
+    for(i = 0; i < BENCH_BURST; i++) {
+        memcpy(frames + i * frame, &header, sizeof(header));
+        memset(frames + i * frame + sizeof(header), 'x', bp->size);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(BENCH_PORT + bp->backend);
+    for(i = 0; i < bp->conns; i++) {
+        fds[i] = socket(AF_INET, SOCK_STREAM, 0);
+        if (fds[i] == -1 || connect(fds[i], (struct sockaddr *)&addr,
+                sizeof(addr)) == -1) {
+            fprintf(stderr, "bench: connect, %s(%d) \n",
+                strerror(errno), errno);
+            return -1;
+        }
+        left[i] = bp->msgs;
+    }
+
+    /* round robin bursts over all connections */
+    active = bp->conns;
+    while (active > 0) {
+        for(i = 0; i < bp->conns; i++) {
+            if (left[i] == 0)
+                continue;
+
+            burst = left[i] < BENCH_BURST ? left[i] : BENCH_BURST;
+            for(j = 0, k = burst * frame; j < k; j += ret) {
+                ret = write(fds[i], frames + j, k - j);
+                if (ret <= 0)
+                    return -1;
+            }
+
+            left[i] -= burst;
+            if (left[i] == 0)
+                active -= 1;
+        }
+    }
+
+    /* keep the sockets open until the receiver is done */
+    for(i = 0; i < bp->conns; i++)
+        while (read(fds[i], bench_buf, sizeof(bench_buf)) > 0)
+            ;
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+static int bench_run(bench_params_t *bp)
+{
+    int status;
+    int pfd[2];
+    char c;
+    pid_t rx_pid;
+    pid_t tx_pid;
+
+    if (pipe(pfd) == -1)
+        return -1;
+
+    rx_pid = fork();
+    if (rx_pid == 0) {
+        close(pfd[0]);
+        exit(bench_receiver(bp, pfd[1]) == 0 ? 0 : 1);
+    }
+
+    close(pfd[1]);
+    if (read(pfd[0], &c, 1) != 1) {
+        fprintf(stderr, "bench: receiver failed to start \n");
+        waitpid(rx_pid, &status, 0);
+        return -1;
+    }
+    close(pfd[0]);
+
+    tx_pid = fork();
+    if (tx_pid == 0)
+        exit(bench_sender(bp) == 0 ? 0 : 1);
+
+    waitpid(rx_pid, &status, 0);
+    waitpid(tx_pid, NULL, 0);
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+/*****************************************************************************/
+
+static int usage(char *program)
+{
+    fprintf(stderr, "\n%s: [-b epoll|uring] [-c conns] [-n msgs per conn]"
+        " [-s payload size] \n", program);
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+int main(int argc, char *argv[])
+{
+    int i;
+    int ret = 0;
+    int backends[2] = { COMLINK_BACKEND_EPOLL, COMLINK_BACKEND_URING };
+    int nr_backends = 2;
+    bench_params_t bp = { 0, 64, 20000, 32 };
+
+    for(i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-b") == 0) {
+            nr_backends = 1;
+            backends[0] = strcmp(argv[i + 1], "uring") == 0 ?
+                COMLINK_BACKEND_URING : COMLINK_BACKEND_EPOLL;
+        }
+        else if (strcmp(argv[i], "-c") == 0)
+            bp.conns = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-n") == 0)
+            bp.msgs = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-s") == 0)
+            bp.size = atoi(argv[i + 1]);
+        else {
+            usage(argv[0]);
+            exit(2);
+        }
+    }
+
+    if (i != argc || bp.conns <= 0 || bp.msgs <= 0 || bp.size < 0 ||
+            bp.size > COMLINK_MAX_FRAME) {
+        usage(argv[0]);
+        exit(2);
+    }
+
+    for(i = 0; i < nr_backends; i++) {
+        bp.backend = backends[i];
+        if (bench_run(&bp) == -1)
+            ret = 1;
+    }
+
+    return ret;
+}
+
+/*****************************************************************************/
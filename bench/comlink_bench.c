@@ -0,0 +1,683 @@
+/*
+ * comlink_bench: latency, message rate, bandwidth and connection setup of
+ *                comlink over loopback
+ *
+ *     - A comlink server echoes pings and acknowledges windows of data
+ *       frames; the client side opens 1, 2, 4 .. N connections with
+ *       comlink_client_setup and drives them from its own comlink loop.
+ *
+ *     - latency: one ping in flight per connection, round trip times
+ *       as percentiles. throughput: small frames, two windows in flight
+ *       per connection. bandwidth: the same with large frames. connect:
+ *       connections opened and closed, the time of each connect.
+ *       priority: the latency pings on the control channel while windows
+ *       of large frames keep the bulk channel of the same connection full.
+ *
+ *     - Every run prints one line of key=value pairs to stdout, so
+ *       results of backends and builds can be compared with a script.
+ */
+
+/* comlink_bench.c -- ./comlink_bench [-b epoll|uring] [-t tests] [-c conns]
+ *                    [-n msgs per conn] [-s size] [-S size] [-m mbytes] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+
+#include "comlink.h"
+
+/*****************************************************************************/
+
+#define BENCH_PORT      (25200)
+#define BENCH_BUF_SIZE  (64 * 1024)
+#define BENCH_WINDOW    (256)       /* small frames per acknowledged window */
+#define BENCH_WINDOW_BYTES (4 << 20) /* large frames per window, in bytes */
+#define BENCH_CONNECTS  (2000)      /* connects per connect run */
+#define BENCH_TIMEOUT_S (120)       /* a run that hangs is killed */
+
+/* frame types of the bench, not the launcher's */
+enum {
+    BENCH_PING = 1, /* bench_tag_t + padding, echoed */
+    BENCH_DATA,     /* counted and dropped */
+    BENCH_SYNC,     /* bench_tag_t, answered with BENCH_ACK */
+    BENCH_ACK
+};
+
+enum {
+    BENCH_LATENCY = 0x1,
+    BENCH_THROUGHPUT = 0x2,
+    BENCH_BANDWIDTH = 0x4,
+    BENCH_CONNECT = 0x8,
+    BENCH_PRIORITY = 0x10
+};
+
+/*****************************************************************************/
+
+typedef struct bench_params_s {
+    int backend;
+    int tests;   /* BENCH_* */
+    int conns;   /* runs go 1, 2, 4 .. conns */
+    int msgs;    /* round trips and small frames per connection */
+    int size;    /* small frame payload */
+    int bulk;    /* bandwidth frame payload */
+    int mbytes;  /* bandwidth bytes per run, over all connections */
+}bench_params_t;
+
+/* carried in pings and syncs so replies find their connection */
+typedef struct bench_tag_s {
+    int conn;
+    long long sent_ns;
+}bench_tag_t;
+
+typedef struct bench_conn_s {
+    int fd;
+    int left;    /* round trips or frames still to send */
+    int pending; /* windows not acknowledged yet */
+    int pinged;  /* priority: the last ping is back */
+}bench_conn_t;
+
+typedef struct bench_run_s {
+    int test;
+    int nr_conns;
+    int nr_done;
+    int size;
+    int window;
+    int bulk;    /* priority: frame payload on the bulk channel */
+    long long bulk_frames;
+    long long wait_max_ns; /* priority: control wait, from comlink_stats */
+    long long overtakes;
+    bench_conn_t *conns;
+    char *payload;
+    char *bulk_payload;
+    long long *samples;
+    long long nr_samples;
+    long long start_ns;
+    long long end_ns;
+}bench_run_t;
+
+/*****************************************************************************/
+
+static char bench_buf[BENCH_BUF_SIZE];
+static bench_run_t bench_run;
+static FILE *bench_out;
+
+/*****************************************************************************/
+
+static long long bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*****************************************************************************/
+
+static int bench_send(int fd, int type, char *buf, int len)
+{
+    comlink_header_t header;
+
+    header.type = type;
+    header.len = len;
+
+    return comlink_send(fd, &header, buf, len);
+}
+
+/*****************************************************************************/
+
+static int bench_send_bulk(int fd, int type, char *buf, int len)
+{
+    comlink_header_t header;
+
+    header.type = type;
+    header.len = len;
+
+    return comlink_send_bulk(fd, &header, buf, len);
+}
+
+/*****************************************************************************/
+/* server side; echoes pings and acknowledges windows */
+
+static void bench_server_rx(int fd, unsigned int type, char *buf, int len)
+{
+    switch(type) {
+        case BENCH_PING:
+            bench_send(fd, BENCH_PING, buf, len);
+            break;
+
+        case BENCH_SYNC:
+            bench_send(fd, BENCH_ACK, buf, len);
+            break;
+    }
+}
+
+/*****************************************************************************/
+
+static int bench_server(bench_params_t *bp, int ready_fd)
+{
+    comlink_params_t cl_params;
+
+    memset(&cl_params, 0, sizeof(comlink_params_t));
+    cl_params.buffer = bench_buf;
+    cl_params.buf_len = BENCH_BUF_SIZE;
+    cl_params.local_ip = INADDR_LOOPBACK;
+    cl_params.local_port = BENCH_PORT + bp->backend;
+    cl_params.backend = bp->backend;
+    cl_params.receive_cb = bench_server_rx;
+    if (comlink_server_setup(&cl_params) == -1)
+        return -1;
+
+    if (write(ready_fd, "r", 1) != 1)
+        return -1;
+    close(ready_fd);
+
+    /* runs until the bench is over and kills it */
+    return comlink_server_start();
+}
+
+/*****************************************************************************/
+/* one window of data frames and the sync that closes it */
+
+static void bench_window(bench_run_t *r, int c)
+{
+    int i;
+    int n;
+    bench_tag_t tag;
+    bench_conn_t *conn = &r->conns[c];
+
+    n = conn->left < r->window ? conn->left : r->window;
+    for(i = 0; i < n; i++)
+        bench_send(conn->fd, BENCH_DATA, r->payload, r->size);
+    conn->left -= n;
+
+    tag.conn = c;
+    tag.sent_ns = 0;
+    bench_send(conn->fd, BENCH_SYNC, (char *)&tag, sizeof(tag));
+    conn->pending += 1;
+}
+
+/*****************************************************************************/
+/* a window of large frames on the bulk channel, the sync behind them */
+
+static void bench_bulk_window(bench_run_t *r, int c)
+{
+    int i;
+    bench_tag_t tag;
+    bench_conn_t *conn = &r->conns[c];
+
+    for(i = 0; i < r->window; i++)
+        bench_send_bulk(conn->fd, BENCH_DATA, r->bulk_payload, r->bulk);
+    r->bulk_frames += r->window;
+
+    tag.conn = c;
+    tag.sent_ns = 0;
+    bench_send_bulk(conn->fd, BENCH_SYNC, (char *)&tag, sizeof(tag));
+    conn->pending += 1;
+}
+
+/*****************************************************************************/
+
+static void bench_ping(bench_run_t *r, int c)
+{
+    bench_tag_t *tag = (bench_tag_t *)r->payload;
+
+    tag->conn = c;
+    tag->sent_ns = bench_now();
+    bench_send(r->conns[c].fd, BENCH_PING, r->payload, r->size);
+    r->conns[c].left -= 1;
+}
+
+/*****************************************************************************/
+
+static void bench_conn_done(bench_run_t *r)
+{
+    int i;
+    comlink_chan_stats_t stats;
+
+    r->nr_done += 1;
+    if (r->nr_done < r->nr_conns)
+        return;
+
+    r->end_ns = bench_now();
+    for(i = 0; i < r->nr_conns && r->test == BENCH_PRIORITY; i++) {
+        if (comlink_stats(r->conns[i].fd, COMLINK_CHAN_CONTROL,
+                &stats) == -1)
+            continue;
+        if (stats.wait_max_ns > r->wait_max_ns)
+            r->wait_max_ns = stats.wait_max_ns;
+        r->overtakes += stats.overtakes;
+    }
+    comlink_client_shutdown();
+}
+
+/*****************************************************************************/
+/* client side; every reply moves its connection on */
+
+static void bench_client_rx(int fd, unsigned int type, char *buf, int len)
+{
+    long long now = bench_now();
+    bench_tag_t tag;
+    bench_conn_t *conn;
+    bench_run_t *r = &bench_run;
+
+    if (len < (int)sizeof(tag))
+        return;
+    memcpy(&tag, buf, sizeof(tag));
+    if (tag.conn < 0 || tag.conn >= r->nr_conns)
+        return;
+    conn = &r->conns[tag.conn];
+
+    if (type == BENCH_PING) {
+        r->samples[r->nr_samples++] = now - tag.sent_ns;
+        if (conn->left > 0)
+            bench_ping(r, tag.conn);
+        else if (r->test != BENCH_PRIORITY || conn->pending == 0)
+            bench_conn_done(r);
+        else
+            conn->pinged = 1;
+        return;
+    }
+
+    if (type != BENCH_ACK)
+        return;
+
+    conn->pending -= 1;
+    if (r->test == BENCH_PRIORITY) {
+        /* the bulk channel stays busy for as long as the pings go on */
+        if (!conn->pinged)
+            bench_bulk_window(r, tag.conn);
+        else if (conn->pinged && conn->pending == 0)
+            bench_conn_done(r);
+        return;
+    }
+    if (conn->left > 0)
+        bench_window(r, tag.conn);
+    else if (conn->pending == 0)
+        bench_conn_done(r);
+}
+
+/*****************************************************************************/
+
+static int bench_cmp(const void *a, const void *b)
+{
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*****************************************************************************/
+/* percentiles of the samples in microseconds */
+
+static void bench_print_pcts(long long *samples, long long n)
+{
+    int i;
+    long long sum = 0;
+    double pcts[] = { 50, 90, 99, 99.9 };
+    const char *names[] = { "p50", "p90", "p99", "p999" };
+
+    if (n == 0)
+        return;
+
+    qsort(samples, n, sizeof(long long), bench_cmp);
+    for(i = 0; i < n; i++)
+        sum += samples[i];
+
+    for(i = 0; i < 4; i++)
+        fprintf(bench_out, " %s_us=%.2f", names[i],
+            samples[(long long)((n - 1) * pcts[i] / 100)] / 1e3);
+    fprintf(bench_out, " max_us=%.2f mean_us=%.2f", samples[n - 1] / 1e3,
+        (double)sum / n / 1e3);
+}
+
+/*****************************************************************************/
+
+static void bench_report(bench_run_t *r, long long msgs)
+{
+    double wall = (r->end_ns - r->start_ns) / 1e9;
+
+    switch(r->test) {
+        case BENCH_LATENCY:
+            fprintf(bench_out, "test=latency backend=%s conns=%d msgs=%lld"
+                " size=%d wall_s=%.4f", comlink_backend_name(), r->nr_conns,
+                r->nr_samples, r->size, wall);
+            bench_print_pcts(r->samples, r->nr_samples);
+            break;
+
+        case BENCH_THROUGHPUT:
+        case BENCH_BANDWIDTH:
+            fprintf(bench_out, "test=%s backend=%s conns=%d msgs=%lld"
+                " size=%d wall_s=%.4f msgs_per_s=%.0f mb_per_s=%.1f",
+                r->test == BENCH_THROUGHPUT ? "throughput" : "bandwidth",
+                comlink_backend_name(), r->nr_conns, msgs, r->size, wall,
+                wall > 0 ? msgs / wall : 0,
+                wall > 0 ? msgs * (double)r->size / 1e6 / wall : 0);
+            break;
+
+        case BENCH_CONNECT:
+            fprintf(bench_out, "test=connect backend=%s conns=%d connects=%lld"
+                " wall_s=%.4f connects_per_s=%.0f", comlink_backend_name(),
+                r->nr_conns, r->nr_samples, wall,
+                wall > 0 ? r->nr_samples / wall : 0);
+            bench_print_pcts(r->samples, r->nr_samples);
+            break;
+
+        case BENCH_PRIORITY:
+            fprintf(bench_out, "test=priority backend=%s conns=%d msgs=%lld"
+                " size=%d bulk=%d wall_s=%.4f bulk_mb_per_s=%.1f"
+                " ctrl_wait_max_us=%.2f overtakes=%lld",
+                comlink_backend_name(), r->nr_conns, r->nr_samples, r->size,
+                r->bulk, wall,
+                wall > 0 ? r->bulk_frames * (double)r->bulk / 1e6 / wall : 0,
+                r->wait_max_ns / 1e3, r->overtakes);
+            bench_print_pcts(r->samples, r->nr_samples);
+            break;
+    }
+    fprintf(bench_out, " \n");
+    fflush(bench_out);
+}
+
+/*****************************************************************************/
+/* batches of nr_conns connections opened and closed again; the loop
+ * never runs, so this is connect plus comlink's own setup */
+
+static int bench_connect(comlink_params_t *cl_params, bench_run_t *r)
+{
+    int i;
+    int fd;
+    long long t;
+
+    /* the first setup brings up the backend; keep it out of the numbers */
+    fd = comlink_client_setup(cl_params);
+    if (fd == -1)
+        return -1;
+    comlink_client_close(fd);
+
+    r->start_ns = bench_now();
+    while (r->nr_samples + r->nr_conns <= BENCH_CONNECTS) {
+        for(i = 0; i < r->nr_conns; i++) {
+            t = bench_now();
+            r->conns[i].fd = comlink_client_setup(cl_params);
+            if (r->conns[i].fd == -1)
+                return -1;
+            r->samples[r->nr_samples++] = bench_now() - t;
+        }
+        for(i = 0; i < r->nr_conns; i++)
+            comlink_client_close(r->conns[i].fd);
+    }
+    r->end_ns = bench_now();
+
+    return 0;
+}
+
+/*****************************************************************************/
+/* one run in a process of its own, so comlink starts out fresh */
+
+static int bench_client(bench_params_t *bp, int test, int nr_conns)
+{
+    int i;
+    int msgs;
+    long long nr_samples;
+    comlink_params_t cl_params;
+    bench_run_t *r = &bench_run;
+
+    memset(r, 0, sizeof(bench_run_t));
+    r->test = test;
+    r->nr_conns = nr_conns;
+
+    msgs = bp->msgs;
+    r->size = bp->size;
+    r->window = BENCH_WINDOW;
+    if ((test == BENCH_LATENCY || test == BENCH_PRIORITY) &&
+            r->size < (int)sizeof(bench_tag_t))
+        r->size = sizeof(bench_tag_t);
+    if (test == BENCH_PRIORITY) {
+        r->bulk = bp->bulk;
+        r->window = BENCH_WINDOW_BYTES / r->bulk > 0 ?
+            BENCH_WINDOW_BYTES / r->bulk : 1;
+    }
+    if (test == BENCH_BANDWIDTH) {
+        r->size = bp->bulk;
+        r->window = BENCH_WINDOW_BYTES / r->size > 0 ?
+            BENCH_WINDOW_BYTES / r->size : 1;
+        msgs = (long long)bp->mbytes * (1 << 20) / r->size / nr_conns;
+        msgs = msgs > 0 ? msgs : 1;
+    }
+
+    nr_samples = test == BENCH_CONNECT ? BENCH_CONNECTS :
+        test == BENCH_LATENCY || test == BENCH_PRIORITY ?
+        (long long)nr_conns * msgs : 0;
+    r->conns = calloc(nr_conns, sizeof(bench_conn_t));
+    r->payload = calloc(1, r->size + 1);
+    r->bulk_payload = calloc(1, r->bulk + 1);
+    r->samples = calloc(nr_samples + 1, sizeof(long long));
+    if (r->conns == NULL || r->payload == NULL || r->bulk_payload == NULL ||
+            r->samples == NULL)
+        return -1;
+
+    memset(&cl_params, 0, sizeof(comlink_params_t));
+    cl_params.buffer = bench_buf;
+    cl_params.buf_len = BENCH_BUF_SIZE;
+    cl_params.remote_ip = INADDR_LOOPBACK;
+    cl_params.remote_port = BENCH_PORT + bp->backend;
+    cl_params.backend = bp->backend;
+    cl_params.receive_cb = bench_client_rx;
+
+    if (test == BENCH_CONNECT) {
+        if (bench_connect(&cl_params, r) == -1)
+            return -1;
+        bench_report(r, 0);
+        return 0;
+    }
+
+    for(i = 0; i < nr_conns; i++) {
+        r->conns[i].fd = comlink_client_setup(&cl_params);
+        if (r->conns[i].fd == -1)
+            return -1;
+        r->conns[i].left = msgs;
+    }
+
+    /* queued here, out in one batch once the loop runs */
+    r->start_ns = bench_now();
+    for(i = 0; i < nr_conns; i++) {
+        if (test == BENCH_LATENCY) {
+            bench_ping(r, i);
+            continue;
+        }
+        if (test == BENCH_PRIORITY) {
+            bench_bulk_window(r, i);
+            bench_bulk_window(r, i);
+            bench_ping(r, i);
+            continue;
+        }
+        bench_window(r, i);
+        if (r->conns[i].left > 0)
+            bench_window(r, i);
+    }
+
+    if (comlink_client_start() == -1 || r->nr_done < nr_conns)
+        return -1;
+    bench_report(r, (long long)nr_conns * msgs);
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+static int bench_one(bench_params_t *bp, int test, int nr_conns)
+{
+    int status;
+    pid_t pid;
+
+    pid = fork();
+    if (pid == -1)
+        return -1;
+
+    if (pid == 0) {
+        alarm(BENCH_TIMEOUT_S);
+        exit(bench_client(bp, test, nr_conns) == 0 ? 0 : 1);
+    }
+
+    waitpid(pid, &status, 0);
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+        return 0;
+
+    fprintf(stderr, "bench: test %d with %d conns failed \n",
+        test, nr_conns);
+
+    return -1;
+}
+
+/*****************************************************************************/
+/* every selected test for 1, 2, 4 .. conns against one server */
+
+static int bench_backend(bench_params_t *bp)
+{
+    int c;
+    int t;
+    int ret = 0;
+    int pfd[2];
+    char ch;
+    pid_t pid;
+
+    if (pipe(pfd) == -1)
+        return -1;
+
+    pid = fork();
+    if (pid == 0) {
+        close(pfd[0]);
+        exit(bench_server(bp, pfd[1]) == 0 ? 0 : 1);
+    }
+
+    close(pfd[1]);
+    if (read(pfd[0], &ch, 1) != 1) {
+        fprintf(stderr, "bench: server failed to start \n");
+        waitpid(pid, NULL, 0);
+        close(pfd[0]);
+        return -1;
+    }
+    close(pfd[0]);
+
+    for(t = BENCH_LATENCY; t <= BENCH_PRIORITY; t <<= 1) {
+        if (!(bp->tests & t))
+            continue;
+        for(c = 1; c < bp->conns; c *= 2) {
+            if (bench_one(bp, t, c) == -1)
+                ret = -1;
+        }
+        if (bench_one(bp, t, bp->conns) == -1)
+            ret = -1;
+    }
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+
+    return ret;
+}
+
+/*****************************************************************************/
+
+static int bench_tests(char *list)
+{
+    int tests = 0;
+    char *name;
+    char *save = NULL;
+
+    for(name = strtok_r(list, ",", &save); name != NULL;
+            name = strtok_r(NULL, ",", &save)) {
+        if (strcmp(name, "latency") == 0)
+            tests |= BENCH_LATENCY;
+        else if (strcmp(name, "throughput") == 0)
+            tests |= BENCH_THROUGHPUT;
+        else if (strcmp(name, "bandwidth") == 0)
+            tests |= BENCH_BANDWIDTH;
+        else if (strcmp(name, "connect") == 0)
+            tests |= BENCH_CONNECT;
+        else if (strcmp(name, "priority") == 0)
+            tests |= BENCH_PRIORITY;
+        else
+            return 0;
+    }
+
+    return tests;
+}
+
+/*****************************************************************************/
+
+static int usage(char *program)
+{
+    fprintf(stderr, "\n%s: [-b epoll|uring] [-t latency,throughput,"
+        "bandwidth,connect,priority] [-c max conns] [-n msgs per conn]"
+        " [-s small size] [-S bulk size] [-m bandwidth mbytes] \n",
+        program);
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+int main(int argc, char *argv[])
+{
+    int i;
+    int ret = 0;
+    int backends[2] = { COMLINK_BACKEND_EPOLL, COMLINK_BACKEND_URING };
+    int nr_backends = 2;
+    bench_params_t bp = { 0, BENCH_LATENCY | BENCH_THROUGHPUT |
+        BENCH_BANDWIDTH | BENCH_CONNECT | BENCH_PRIORITY, 16, 10000, 32,
+        1 << 20, 512 };
+
+    for(i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-b") == 0) {
+            nr_backends = 1;
+            backends[0] = strcmp(argv[i + 1], "uring") == 0 ?
+                COMLINK_BACKEND_URING : COMLINK_BACKEND_EPOLL;
+        }
+        else if (strcmp(argv[i], "-t") == 0)
+            bp.tests = bench_tests(argv[i + 1]);
+        else if (strcmp(argv[i], "-c") == 0)
+            bp.conns = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-n") == 0)
+            bp.msgs = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-s") == 0)
+            bp.size = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-S") == 0)
+            bp.bulk = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-m") == 0)
+            bp.mbytes = atoi(argv[i + 1]);
+        else {
+            usage(argv[0]);
+            exit(2);
+        }
+    }
+
+    if (i != argc || bp.tests == 0 || bp.conns <= 0 ||
+            bp.conns > MAX_CONNECTIONS || bp.msgs <= 0 || bp.size < 0 ||
+            bp.size > COMLINK_MAX_FRAME || bp.bulk <= 0 ||
+            bp.bulk > COMLINK_MAX_FRAME || bp.mbytes <= 0) {
+        usage(argv[0]);
+        exit(2);
+    }
+
+    /* results only on stdout; comlink's connection logs go away */
+    bench_out = fdopen(dup(STDOUT_FILENO), "w");
+    if (bench_out == NULL || freopen("/dev/null", "w", stdout) == NULL)
+        exit(1);
+
+    for(i = 0; i < nr_backends; i++) {
+        bp.backend = backends[i];
+        if (bench_backend(&bp) == -1)
+            ret = 1;
+    }
+
+    return ret;
+}
+
+/*****************************************************************************/
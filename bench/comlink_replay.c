@@ -0,0 +1,534 @@
+/*
+ * comlink_replay: a comlink capture fed back into a launcher or listener
+ *
+ *     - A process run with COMLINK_CAPTURE=<path> logs every frame it
+ *       received and sent. The frames it received are what its peers
+ *       said; replaying them at the captured times, or faster, puts the
+ *       same load on a new launcher or listener.
+ *
+ *     - -c host:port replays a listener's capture: one connection per
+ *       connection the listener accepted, opened when it was. -l port
+ *       replays a launcher's capture: the launcher's hostfile points at
+ *       this port, and the connections it opens take the place of the
+ *       ones it opened in the capture, in the same order.
+ *
+ *     - -x scales the time, 2 runs twice as fast and 0 as fast as the
+ *       target takes the frames. Payloads the capture left out go as
+ *       zeros. What the target sends back is read and counted only.
+ *
+ *     - One line of key=value pairs at the end, like comlink_bench, with
+ *       how late the frames went out against the schedule.
+ */
+
+/* comlink_replay.c -- ./comlink_replay -f <capture> -c <host[:port]> |
+ *                     -l <port> [-x speed] [-w linger ms] */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "comlink.h"
+#include "comlink_capture.h"
+
+/*****************************************************************************/
+
+#define COMLINK_PORT     (25000)
+#define REPLAY_ACCEPT_MS (10000) /* the launcher connects to every host */
+#define REPLAY_LINGER_MS (1000)  /* replies read after the last frame */
+#define REPLAY_RX_BUF    (64 * 1024)
+#define REPLAY_ZEROS     (64 * 1024)
+
+/*****************************************************************************/
+/* a captured connection; fd is -1 until opened and after it is closed */
+
+typedef struct replay_conn_s {
+    int wanted; /* replayed in this mode */
+    int fd;
+}replay_conn_t;
+
+typedef struct replay_s {
+    char file[256];
+    char host[256];
+    int port;
+    int listen;        /* -l, else -c */
+    double speed;
+    int linger_ms;
+
+    replay_conn_t *conns; /* by capture id */
+    int nr_conns;
+    int nr_wanted;
+    int nr_open;
+    int nr_failed;     /* connections refused */
+    int skt_listen;
+    struct sockaddr_in addr;
+
+    long long start_ns;
+    long long first_ns; /* capture time the schedule starts from */
+    long long last_ns;
+    long long frames;
+    long long bytes;
+    long long elided;
+    long long tx_captured; /* bytes the captured side sent back then */
+    long long rx_bytes;    /* what the target sent back now */
+    long long max_late_ns;
+}replay_t;
+
+static char rx_buf[REPLAY_RX_BUF];
+static char zeros[REPLAY_ZEROS];
+
+/*****************************************************************************/
+
+static long long mono_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*****************************************************************************/
+
+static replay_conn_t * replay_conn(replay_t *rp, unsigned int id)
+{
+    int n;
+    replay_conn_t *p;
+
+    if ((int)id < rp->nr_conns)
+        return &rp->conns[id];
+
+    n = id + 64;
+    p = realloc(rp->conns, n * sizeof(replay_conn_t));
+    if (p == NULL)
+        return NULL;
+    memset(p + rp->nr_conns, 0, (n - rp->nr_conns) * sizeof(replay_conn_t));
+    rp->conns = p;
+    for(; rp->nr_conns < n; rp->nr_conns++)
+        rp->conns[rp->nr_conns].fd = -1;
+
+    return &rp->conns[id];
+}
+
+/*****************************************************************************/
+/* the connections of the capture this mode stands in for: what the
+ * listener accepted, or what the launcher opened; local peers are the
+ * instances and come with the replayed job */
+
+static int replay_wanted(replay_t *rp, int flags)
+{
+    if ((flags & COMLINK_CAPTURE_KIND) != COMLINK_CAPTURE_OPEN ||
+            (flags & COMLINK_CAPTURE_LOCAL))
+        return 0;
+
+    return rp->listen == !!(flags & COMLINK_CAPTURE_OUTBOUND);
+}
+
+/*****************************************************************************/
+/* first pass; which connections there are and when the replay starts */
+
+static int replay_scan(replay_t *rp)
+{
+    int ret;
+    replay_conn_t *c;
+    comlink_capture_rec_t rec;
+    comlink_capture_reader_t r;
+
+    if (comlink_capture_load(&r, rp->file) == -1)
+        return -1;
+
+    rp->first_ns = -1;
+    while ((ret = comlink_capture_next(&r, &rec)) == 1) {
+        if ((c = replay_conn(rp, rec.conn)) == NULL)
+            break;
+        if (replay_wanted(rp, rec.flags)) {
+            c->wanted = 1;
+            rp->nr_wanted += 1;
+            if (rp->first_ns == -1)
+                rp->first_ns = rec.time_ns;
+        }
+        if (c->wanted && (rec.flags & COMLINK_CAPTURE_KIND) ==
+                COMLINK_CAPTURE_TX)
+            rp->tx_captured += sizeof(comlink_header_t) + rec.len;
+        rp->last_ns = rec.time_ns;
+    }
+    comlink_capture_unload(&r);
+
+    if (ret == -1)
+        fprintf(stderr, "replay: %s is cut short, replaying what is there"
+            " \n", rp->file);
+    if (rp->nr_wanted == 0) {
+        fprintf(stderr, "replay: no %s connections in %s \n",
+            rp->listen ? "outbound" : "inbound", rp->file);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+static void replay_close(replay_t *rp, replay_conn_t *c)
+{
+    if (c->fd == -1)
+        return;
+
+    close(c->fd);
+    c->fd = -1;
+    rp->nr_open -= 1;
+}
+
+/*****************************************************************************/
+/* reads whatever the target sent; waits up to timeout for that, or for
+ * room to write on out_fd. timeout -1 waits for either */
+
+static void replay_poll(replay_t *rp, int out_fd, long long timeout_ns)
+{
+    int i;
+    int n;
+    int nfds = 0;
+    struct pollfd *pfd;
+    struct timespec ts;
+
+    pfd = calloc(rp->nr_open + 1, sizeof(struct pollfd));
+    if (pfd == NULL)
+        return;
+
+    for(i = 0; i < rp->nr_conns; i++) {
+        if (rp->conns[i].fd == -1)
+            continue;
+        pfd[nfds].fd = rp->conns[i].fd;
+        pfd[nfds].events = POLLIN | (rp->conns[i].fd == out_fd ? POLLOUT : 0);
+        nfds += 1;
+    }
+
+    ts.tv_sec = timeout_ns / 1000000000LL;
+    ts.tv_nsec = timeout_ns % 1000000000LL;
+    if (ppoll(pfd, nfds, timeout_ns < 0 ? NULL : &ts, NULL) > 0) {
+        for(i = 0; i < rp->nr_conns; i++) {
+            if (rp->conns[i].fd == -1)
+                continue;
+            while ((n = recv(rp->conns[i].fd, rx_buf, sizeof(rx_buf),
+                    MSG_DONTWAIT)) > 0)
+                rp->rx_bytes += n;
+            if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR))
+                replay_close(rp, &rp->conns[i]);
+        }
+    }
+    free(pfd);
+}
+
+/*****************************************************************************/
+/* all of buf, reading replies while the target's window is full; buf
+ * NULL sends len zeros */
+
+static int replay_write(replay_t *rp, replay_conn_t *c, const char *buf,
+        int len)
+{
+    int n;
+
+    while (len > 0 && c->fd != -1) {
+        n = len < REPLAY_ZEROS ? len : REPLAY_ZEROS;
+        n = send(c->fd, buf != NULL ? buf : zeros, buf != NULL ? len : n,
+            MSG_NOSIGNAL);
+        if (n > 0) {
+            if (buf != NULL)
+                buf += n;
+            len -= n;
+            continue;
+        }
+        if (n == -1 && errno != EAGAIN && errno != EINTR) {
+            replay_close(rp, c);
+            return -1;
+        }
+        replay_poll(rp, c->fd, -1);
+    }
+
+    return c->fd == -1 ? -1 : 0;
+}
+
+/*****************************************************************************/
+
+static void replay_nodelay(int fd)
+{
+    int optval = 1;
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+}
+
+/*****************************************************************************/
+/* -c; a connection opened when the listener accepted one */
+
+static int replay_connect(replay_t *rp, replay_conn_t *c)
+{
+    int fd;
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&rp->addr,
+            sizeof(rp->addr)) == -1) {
+        fprintf(stderr, "replay: connect to %s:%d, %s(%d) \n", rp->host,
+            rp->port, strerror(errno), errno);
+        if (fd != -1)
+            close(fd);
+        rp->nr_failed += 1;
+        return -1;
+    }
+
+    replay_nodelay(fd);
+    c->fd = fd;
+    rp->nr_open += 1;
+
+    return 0;
+}
+
+/*****************************************************************************/
+/* -l; the launcher's connections stand in for the captured ones in the
+ * order they come, so all of them are taken before the clock starts */
+
+static int replay_accept_all(replay_t *rp)
+{
+    int i;
+    int fd;
+    struct pollfd pfd;
+
+    pfd.fd = rp->skt_listen;
+    pfd.events = POLLIN;
+    for(i = 0; i < rp->nr_conns; i++) {
+        if (!rp->conns[i].wanted)
+            continue;
+        if (poll(&pfd, 1, REPLAY_ACCEPT_MS) != 1 ||
+                (fd = accept4(rp->skt_listen, NULL, NULL,
+                    SOCK_CLOEXEC)) == -1) {
+            fprintf(stderr, "replay: %d of %d connections came in \n",
+                rp->nr_open, rp->nr_wanted);
+            return -1;
+        }
+        replay_nodelay(fd);
+        rp->conns[i].fd = fd;
+        rp->nr_open += 1;
+    }
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+static int replay_setup(replay_t *rp)
+{
+    int optval = 1;
+
+    memset(&rp->addr, 0, sizeof(rp->addr));
+    rp->addr.sin_family = AF_INET;
+    rp->addr.sin_port = htons(rp->port);
+
+    if (!rp->listen) {
+        if (hostname_to_netaddr(rp->host, (struct sockaddr *)&rp->addr) == -1)
+            return -1;
+        rp->addr.sin_port = htons(rp->port);
+        return 0;
+    }
+
+    rp->skt_listen = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (rp->skt_listen == -1 ||
+            setsockopt(rp->skt_listen, SOL_SOCKET, SO_REUSEADDR, &optval,
+                sizeof(optval)) == -1 ||
+            bind(rp->skt_listen, (struct sockaddr *)&rp->addr,
+                sizeof(rp->addr)) == -1 ||
+            listen(rp->skt_listen, SOMAXCONN) == -1) {
+        fprintf(stderr, "replay: listen on %d, %s(%d) \n", rp->port,
+            strerror(errno), errno);
+        return -1;
+    }
+    fprintf(stderr, "replay: waiting for %d connections on %d \n",
+        rp->nr_wanted, rp->port);
+
+    return 0;
+}
+
+/*****************************************************************************/
+/* holds the record back until its time on the scaled schedule */
+
+static void replay_wait(replay_t *rp, long long time_ns)
+{
+    long long due;
+    long long now;
+
+    if (rp->speed <= 0)
+        return;
+
+    due = rp->start_ns + (long long)((time_ns - rp->first_ns) / rp->speed);
+    while ((now = mono_ns()) < due)
+        replay_poll(rp, -1, due - now);
+
+    if (now - due > rp->max_late_ns)
+        rp->max_late_ns = now - due;
+}
+
+/*****************************************************************************/
+
+static int replay_frame(replay_t *rp, replay_conn_t *c,
+        comlink_capture_rec_t *rec)
+{
+    comlink_header_t header;
+
+    header.type = htonl(rec->type);
+    header.len = htonl(rec->len);
+    if (replay_write(rp, c, (char *)&header, sizeof(header)) == -1 ||
+            replay_write(rp, c, rec->payload, rec->len) == -1)
+        return -1;
+
+    rp->frames += 1;
+    rp->bytes += sizeof(header) + rec->len;
+    rp->elided += rec->payload == NULL;
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+static int replay_run(replay_t *rp)
+{
+    int i;
+    int ret;
+    long long end;
+    replay_conn_t *c;
+    comlink_capture_rec_t rec;
+    comlink_capture_reader_t r;
+
+    if (rp->listen && replay_accept_all(rp) == -1)
+        return -1;
+    if (comlink_capture_load(&r, rp->file) == -1)
+        return -1;
+
+    rp->start_ns = mono_ns();
+    while ((ret = comlink_capture_next(&r, &rec)) == 1) {
+        c = replay_conn(rp, rec.conn);
+        if (c == NULL || !c->wanted || rec.time_ns < rp->first_ns)
+            continue;
+
+        switch(rec.flags & COMLINK_CAPTURE_KIND) {
+            case COMLINK_CAPTURE_OPEN:
+                replay_wait(rp, rec.time_ns);
+                if (!rp->listen)
+                    replay_connect(rp, c);
+                break;
+
+            case COMLINK_CAPTURE_RX:
+                replay_wait(rp, rec.time_ns);
+                if (c->fd != -1)
+                    replay_frame(rp, c, &rec);
+                break;
+
+            case COMLINK_CAPTURE_CLOSE:
+                /* with no schedule the close would beat every reply;
+                 * it waits for the linger then */
+                replay_wait(rp, rec.time_ns);
+                if (rp->speed > 0)
+                    replay_close(rp, c);
+                break;
+        }
+    }
+    comlink_capture_unload(&r);
+
+    /* the target's last replies */
+    end = mono_ns() + rp->linger_ms * 1000000LL;
+    while (rp->nr_open > 0 && mono_ns() < end)
+        replay_poll(rp, -1, end - mono_ns());
+    for(i = 0; i < rp->nr_conns; i++)
+        replay_close(rp, &rp->conns[i]);
+
+    fprintf(stdout, "replay file=%s mode=%s conns=%d frames=%lld bytes=%lld"
+        " elided=%lld captured_s=%.3f replay_s=%.3f speed=%g"
+        " max_late_ms=%.3f rx_bytes=%lld captured_tx_bytes=%lld \n",
+        rp->file, rp->listen ? "listen" : "connect", rp->nr_wanted,
+        rp->frames, rp->bytes, rp->elided,
+        (rp->last_ns - rp->first_ns) / 1e9,
+        (end - rp->linger_ms * 1000000LL - rp->start_ns) / 1e9, rp->speed,
+        rp->max_late_ns / 1e6, rp->rx_bytes, rp->tx_captured);
+
+    return ret == -1 || rp->nr_failed > 0 ? -1 : 0;
+}
+
+/*****************************************************************************/
+
+static int usage(char *program)
+{
+    fprintf(stderr, "\n%s: -f <capture> -c <host[:port]> | -l <port>"
+        " [-x speed] [-w linger ms] \n"
+        "    -c  replay a listener's capture into the listener there \n"
+        "    -l  replay a launcher's capture to a launcher connecting here \n"
+        "    -x  faster than captured by this much, 0 as fast as taken \n",
+        program);
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+int main(int argc, char *argv[])
+{
+    int i;
+    char *colon;
+    replay_t rp;
+
+    memset(&rp, 0, sizeof(rp));
+    rp.port = -1;
+    rp.speed = 1;
+    rp.linger_ms = REPLAY_LINGER_MS;
+    rp.skt_listen = -1;
+
+    for(i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-f") == 0)
+            snprintf(rp.file, sizeof(rp.file), "%s", argv[i + 1]);
+        else if (strcmp(argv[i], "-c") == 0) {
+            snprintf(rp.host, sizeof(rp.host), "%s", argv[i + 1]);
+            rp.port = COMLINK_PORT;
+            colon = strrchr(rp.host, ':');
+            if (colon != NULL) {
+                *colon = '\0';
+                rp.port = atoi(colon + 1);
+            }
+        }
+        else if (strcmp(argv[i], "-l") == 0) {
+            rp.listen = 1;
+            rp.port = atoi(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "-x") == 0)
+            rp.speed = atof(argv[i + 1]);
+        else if (strcmp(argv[i], "-w") == 0)
+            rp.linger_ms = atoi(argv[i + 1]);
+        else {
+            usage(argv[0]);
+            exit(2);
+        }
+    }
+
+    if (i != argc || rp.file[0] == '\0' || rp.port <= 0 ||
+            rp.port > 65535 || rp.speed < 0 || rp.linger_ms < 0 ||
+            (rp.listen && rp.host[0] != '\0')) {
+        usage(argv[0]);
+        exit(2);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    if (replay_scan(&rp) == -1 || replay_setup(&rp) == -1 ||
+            replay_run(&rp) == -1)
+        exit(1);
+
+    return 0;
+}
+
+/*****************************************************************************/
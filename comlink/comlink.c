@@ -10,17 +10,50 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <endian.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 
 #include "comlink.h"
+#include "comlink_backend.h"
+#include "comlink_zip.h"
+#include "comlink_capture.h"
 #include "common.h"
 
 /*****************************************************************************/
 
+#define COMLINK_FLUSH_WAIT_MS (50)
+#define COMLINK_FLUSH_TRIES   (40)
+#define COMLINK_FILE_CHUNK    (256 * 1024) /* file payload copied at once */
+#define COMLINK_BULK_BATCH    (256 * 1024) /* bulk frames handed over at once */
+
+/* unsent bytes the kernel takes per socket; bulk data parked in the socket
+ * buffer is out of reach of the channel priority */
+#define COMLINK_NOTSENT_LOWAT (128 * 1024)
+
+/* clock probes carry CLOCK_REALTIME stamps as big endian 64 bit words */
+#define COMLINK_CLOCK_PROBE   (COMLINK_TYPE_RESERVED + 1) /* t1 */
+#define COMLINK_CLOCK_REPLY   (COMLINK_TYPE_RESERVED + 2) /* t1, t2, t3 */
+
+/* codecs a side can decode, a big endian mask of 1 << COMLINK_CODEC_* */
+#define COMLINK_CODECS        (COMLINK_TYPE_RESERVED + 3)
+/* a compressed frame: big endian type and length of the frame, the codec
+ * byte, then the compressed payload */
+#define COMLINK_ZFRAME        (COMLINK_TYPE_RESERVED + 4)
+#define COMLINK_ZFRAME_HEAD   (9)
+
+/*****************************************************************************/
+
 static comlink_t comlink;
+static pthread_t comlink_loop_thread;
+static pthread_mutex_t comlink_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /*****************************************************************************/
 /* get the comlink params instance */
@@ -47,131 +80,1051 @@ static comlink_client_t * get_comlink_client(void)
 }
 
 /*****************************************************************************/
-/* server side implementation */
+/* buffer helpers; one spare byte is kept for terminating payloads */
 
-static int comlink_server_init(comlink_params_t *cl_params)
+static int comlink_buf_reserve(comlink_buf_t *b, int len)
 {
-    int i;
+    int size;
+    char *data;
 
-    comlink_server_t *cl_server = get_comlink_server();
+    if (b->len + len < b->size)
+        return 0;
 
-    if (cl_params->init_done)
+    size = b->size ? b->size : 256;
+    while (size <= b->len + len)
+        size *= 2;
+
+    data = realloc(b->data, size);
+    if (data == NULL) {
+        fprintf(stderr, "comlink: out of memory for %d bytes \n", size);
+        return -1;
+    }
+
+    b->data = data;
+    b->size = size;
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+static int comlink_buf_append(comlink_buf_t *b, void *data, int len)
+{
+    if (comlink_buf_reserve(b, len) == -1)
+        return -1;
+
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+static void comlink_buf_free(comlink_buf_t *b)
+{
+    free(b->data);
+    memset(b, 0, sizeof(comlink_buf_t));
+}
+
+/*****************************************************************************/
+/* connection table, indexed by fd */
+
+comlink_conn_t * comlink_core_conn(int fd)
+{
+    if (fd < 0 || fd >= comlink.nr_slots)
+        return NULL;
+
+    return comlink.conns[fd];
+}
+
+/*****************************************************************************/
+
+static int comlink_conn_slots(int fd)
+{
+    int n;
+    void *p;
+
+    if (fd < comlink.nr_slots)
         return 0;
 
-    cl_server->skt_listen = -1;
-    cl_server->nr_clients = 0;
+    n = comlink.nr_slots ? comlink.nr_slots : 64;
+    while (n <= fd)
+        n *= 2;
 
-    for(i = 0; i < MAX_CONNECTIONS; i++)
-        cl_server->skt_clients[i] = -1;
+    p = realloc(comlink.conns, n * sizeof(comlink_conn_t *));
+    if (p == NULL)
+        return -1;
+    comlink.conns = p;
+    memset(comlink.conns + comlink.nr_slots, 0,
+        (n - comlink.nr_slots) * sizeof(comlink_conn_t *));
+
+    p = realloc(comlink.dirty, n * sizeof(int));
+    if (p == NULL)
+        return -1;
+    comlink.dirty = p;
+    comlink.nr_slots = n;
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+static comlink_conn_t * comlink_conn_new(int fd, int kind)
+{
+    static int gen;
+    comlink_conn_t *conn;
+
+    conn = calloc(1, sizeof(comlink_conn_t));
+    if (conn == NULL)
+        return NULL;
+
+    conn->fd = fd;
+    conn->kind = kind;
+    conn->gen = ++gen & 0xffffff;
+
+    pthread_mutex_lock(&comlink_lock);
+    if (comlink_conn_slots(fd) == -1) {
+        pthread_mutex_unlock(&comlink_lock);
+        free(conn);
+        return NULL;
+    }
+    comlink.conns[fd] = conn;
+    pthread_mutex_unlock(&comlink_lock);
+
+    if (comlink.backend->add(conn) == -1) {
+        pthread_mutex_lock(&comlink_lock);
+        comlink.conns[fd] = NULL;
+        pthread_mutex_unlock(&comlink_lock);
+        free(conn);
+        return NULL;
+    }
+
+    return conn;
+}
+
+/*****************************************************************************/
+/* buffers and all; the fd is closed by then */
+
+void comlink_core_free(comlink_conn_t *conn)
+{
+    comlink_buf_free(&conn->rx);
+    comlink_buf_free(&conn->tx);
+    comlink_buf_free(&conn->bulk);
+    comlink_buf_free(&conn->out);
+    comlink_buf_free(&conn->ztx);
+    comlink_buf_free(&conn->zrx);
+    free(conn);
+}
+
+/*****************************************************************************/
+
+static void comlink_conn_release(comlink_conn_t *conn)
+{
+    int i;
+    int deferred;
+    comlink_file_t *file;
+
+    deferred = comlink.backend->del(conn);
+    if (conn->kind == COMLINK_FD_CONN)
+        comlink_capture_close(conn);
+
+    while ((file = conn->files) != NULL) {
+        conn->files = file->next;
+        if (!file->keep)
+            close(file->fd);
+        free(file);
+    }
+
+    /* released outside the loop, it may still be on the flush list; a
+     * conn that gets the fd next would be queued a second time */
+    pthread_mutex_lock(&comlink_lock);
+    comlink.conns[conn->fd] = NULL;
+    for(i = 0; conn->dirty && i < comlink.nr_dirty; i++) {
+        if (comlink.dirty[i] == conn->fd) {
+            comlink.dirty[i] = comlink.dirty[--comlink.nr_dirty];
+            conn->dirty = 0;
+        }
+    }
+    pthread_mutex_unlock(&comlink_lock);
+
+    close(conn->fd);
+    if (!deferred)
+        comlink_core_free(conn);
+}
+
+/*****************************************************************************/
+/* queue the conn for the flush pass; caller holds the lock */
+
+static void comlink_mark_dirty(comlink_conn_t *conn)
+{
+    if (conn->dirty)
+        return;
+
+    conn->dirty = 1;
+    comlink.dirty[comlink.nr_dirty++] = conn->fd;
+}
+
+/*****************************************************************************/
+/* hand queued frames to the backend and reap closed connections */
+
+static void comlink_flush_dirty(void)
+{
+    int fd;
+    comlink_conn_t *conn;
+
+    for (;;) {
+        pthread_mutex_lock(&comlink_lock);
+        if (comlink.nr_dirty == 0) {
+            pthread_mutex_unlock(&comlink_lock);
+            break;
+        }
+        fd = comlink.dirty[--comlink.nr_dirty];
+        conn = comlink.conns[fd];
+        if (conn != NULL)
+            conn->dirty = 0;
+        pthread_mutex_unlock(&comlink_lock);
+
+        if (conn == NULL)
+            continue;
+
+        if (conn->closing)
+            comlink_conn_release(conn);
+        else
+            comlink.backend->flush(conn);
+    }
+}
+
+/*****************************************************************************/
+/* pick the event loop backend */
+
+static const comlink_backend_t * comlink_pick_backend(int backend)
+{
+    char *env;
+
+    if (backend == COMLINK_BACKEND_AUTO) {
+        env = getenv("COMLINK_BACKEND");
+        if (env != NULL && strcmp(env, "uring") == 0)
+            backend = COMLINK_BACKEND_URING;
+    }
+
+#ifdef COMLINK_HAVE_URING
+    if (backend == COMLINK_BACKEND_URING) {
+        if (comlink_uring_backend.init() == 0)
+            return &comlink_uring_backend;
+        fprintf(stderr, "comlink: io_uring unavailable, using epoll \n");
+    }
+#else
+    if (backend == COMLINK_BACKEND_URING)
+        fprintf(stderr, "comlink: built without io_uring, using epoll \n");
+#endif
+
+    if (comlink_epoll_backend.init() == 0)
+        return &comlink_epoll_backend;
+
+    return NULL;
+}
+
+/*****************************************************************************/
+/* common init for both the server and the client side */
+
+static int comlink_core_init(comlink_params_t *cl_params)
+{
+    int fd;
+
+    if (comlink.core_ready)
+        return 0;
 
     comlink.params = *cl_params;
-    cl_params->init_done = 1;
-    
+    comlink.wake_fd = -1;
+    comlink_zip_init();
+    comlink_capture_init();
+
+    comlink.backend = comlink_pick_backend(cl_params->backend);
+    if (comlink.backend == NULL) {
+        fprintf(stderr, "comlink: no usable event loop backend \n");
+        return -1;
+    }
+
+    fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd == -1 || comlink_conn_new(fd, COMLINK_FD_WAKE) == NULL) {
+        fprintf(stderr, "comlink: wakeup fd, %s(%d) \n",
+            strerror(errno), errno);
+        return -1;
+    }
+
+    comlink.wake_fd = fd;
+    comlink.core_ready = 1;
+
     return 0;
 }
 
 /*****************************************************************************/
+/* hand over one decoded frame; the payload is terminated for string users */
 
-static void comlink_server_cleanup(void)
+static void comlink_deliver(comlink_conn_t *conn, unsigned int type,
+        char *buf, int len)
+{
+    char saved;
+
+    comlink_params_t *cl = get_comlink_params();
+
+    if (cl->receive_cb == NULL)
+        return;
+
+    comlink_capture_frame(conn, COMLINK_CAPTURE_RX, COMLINK_CHAN_CONTROL,
+        type, buf, len);
+    saved = buf[len];
+    buf[len] = '\0';
+    cl->receive_cb(conn->fd, type, buf, len);
+    buf[len] = saved;
+}
+
+/*****************************************************************************/
+
+static long long comlink_clock_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*****************************************************************************/
+
+static int comlink_clock_send(int fd, unsigned int type, long long *t, int n)
 {
     int i;
+    uint64_t be[3];
+    comlink_header_t header;
 
-    comlink_server_t *server = get_comlink_server();
+    for(i = 0; i < n; i++)
+        be[i] = htobe64((uint64_t)t[i]);
+
+    header.type = type;
+    header.len = n * sizeof(uint64_t);
+
+    return comlink_send(fd, &header, (char *)be, header.len);
+}
+
+/*****************************************************************************/
+/* t1 sent, t2 peer received, t3 peer replied, t4 back here. The peer's
+ * turnaround is taken out of the round trip; the offset can be off by
+ * at most half of what is left. A stepped clock gives a negative rtt */
+
+static void comlink_clock_sample(comlink_conn_t *conn, long long *t)
+{
+    int next;
+    long long t1;
+    comlink_clock_t c;
+
+    c.offset_ns = ((t[1] - t[0]) + (t[2] - t[3])) / 2;
+    c.rtt_ns = (t[3] - t[0]) - (t[2] - t[1]);
+    c.err_ns = (c.rtt_ns + 1) / 2;
+
+    pthread_mutex_lock(&comlink_lock);
+    if (c.rtt_ns >= 0 &&
+            (conn->round.samples == 0 || c.rtt_ns < conn->round.rtt_ns)) {
+        c.samples = conn->round.samples;
+        conn->round = c;
+    }
+    if (c.rtt_ns >= 0)
+        conn->round.samples += 1;
+
+    /* the first estimate is usable before its round is over */
+    if (conn->clock.samples == 0)
+        conn->clock = conn->round;
+
+    next = conn->probes > 1;
+    if (conn->probes > 0)
+        conn->probes -= 1;
+    if (!next) {
+        if (conn->round.samples > 0)
+            conn->clock = conn->round;
+        memset(&conn->round, 0, sizeof(conn->round));
+    }
+    pthread_mutex_unlock(&comlink_lock);
+
+    if (next) {
+        t1 = comlink_clock_now();
+        comlink_clock_send(conn->fd, COMLINK_CLOCK_PROBE, &t1, 1);
+    }
+}
+
+/*****************************************************************************/
+/* probes are answered right here, whatever the application is doing */
+
+static void comlink_clock_rx(comlink_conn_t *conn, unsigned int type,
+        char *buf, int len)
+{
+    int i;
+    uint64_t be[3];
+    long long t[4];
+    long long now = comlink_clock_now();
+
+    if (type == COMLINK_CLOCK_PROBE && len == sizeof(uint64_t)) {
+        memcpy(be, buf, sizeof(uint64_t));
+        t[0] = (long long)be64toh(be[0]);
+        t[1] = now;
+        t[2] = comlink_clock_now();
+        comlink_clock_send(conn->fd, COMLINK_CLOCK_REPLY, t, 3);
+        return;
+    }
+
+    if (type != COMLINK_CLOCK_REPLY || len != sizeof(be) || conn->probes == 0)
+        return;
+
+    memcpy(be, buf, sizeof(be));
+    for(i = 0; i < 3; i++)
+        t[i] = (long long)be64toh(be[i]);
+    t[3] = now;
+
+    comlink_clock_sample(conn, t);
+}
+
+/*****************************************************************************/
+/* sent on every tcp connection; local peers may not speak comlink */
 
-    if (server->skt_listen != -1)
-        close(server->skt_listen);
+static void comlink_zip_offer(int fd)
+{
+    uint32_t mask = htonl(comlink_zip_codecs());
+    comlink_header_t header;
+
+    header.type = COMLINK_CODECS;
+    header.len = sizeof(mask);
+    comlink_send(fd, &header, (char *)&mask, sizeof(mask));
+}
+
+/*****************************************************************************/
+/* a compressed frame goes to the application as it was sent */
 
-    for(i = 0; i < MAX_CONNECTIONS; i++) {
-        if (server->skt_clients[i] != -1)
-            close(server->skt_clients[i]);
+static void comlink_zip_rx(comlink_conn_t *conn, char *buf, int len)
+{
+    int n = -1;
+    unsigned int type;
+    unsigned int raw;
+
+    if (len >= COMLINK_ZFRAME_HEAD) {
+        memcpy(&type, buf, sizeof(type));
+        memcpy(&raw, buf + sizeof(type), sizeof(raw));
+        type = ntohl(type);
+        raw = ntohl(raw);
+        if (type < COMLINK_TYPE_RESERVED && raw <= COMLINK_MAX_FRAME &&
+                comlink_buf_reserve(&conn->zrx, raw) == 0)
+            n = comlink_unzip(buf[8], buf + COMLINK_ZFRAME_HEAD,
+                    len - COMLINK_ZFRAME_HEAD, conn->zrx.data, raw);
+    }
+
+    if (n == -1 || n != (int)raw) {
+        fprintf(stderr, "comlink: bad compressed frame on fd %d \n",
+            conn->fd);
+        comlink_core_drop(conn);
+        return;
     }
+
+    comlink_deliver(conn, type, conn->zrx.data, raw);
 }
 
 /*****************************************************************************/
-/* returns the length for subsequent read */
+/* comlink's own frames; unknown ones are from a newer peer */
 
-static int comlink_read_header(int fd, comlink_header_t *header, int len)
+static void comlink_reserved_rx(comlink_conn_t *conn, unsigned int type,
+        char *buf, int len)
+{
+    uint32_t mask;
+
+    switch(type) {
+        case COMLINK_CLOCK_PROBE:
+        case COMLINK_CLOCK_REPLY:
+            comlink_clock_rx(conn, type, buf, len);
+            break;
+
+        case COMLINK_CODECS:
+            if (len != sizeof(mask))
+                break;
+            memcpy(&mask, buf, sizeof(mask));
+            conn->zip.codec = comlink_zip_pick(ntohl(mask));
+            conn->zip.level = 1;
+            break;
+
+        case COMLINK_ZFRAME:
+            comlink_zip_rx(conn, buf, len);
+            break;
+    }
+}
+
+/*****************************************************************************/
+/* splits the byte stream into frames; returns bytes consumed or -1 */
+
+static int comlink_parse(comlink_conn_t *conn, char *data, int len)
+{
+    int used = 0;
+    comlink_header_t header;
+
+    while (len - used >= (int)sizeof(comlink_header_t) && !conn->closing) {
+        memcpy(&header, data + used, sizeof(comlink_header_t));
+        header.type = ntohl(header.type);
+        header.len = ntohl(header.len);
+
+        if (header.len > COMLINK_MAX_FRAME) {
+            fprintf(stderr, "comlink: oversized frame (%u) on fd %d \n",
+                header.len, conn->fd);
+            return -1;
+        }
+
+        if (len - used < (int)(sizeof(comlink_header_t) + header.len))
+            break;
+
+        used += sizeof(comlink_header_t);
+        if (header.type >= COMLINK_TYPE_RESERVED)
+            comlink_reserved_rx(conn, header.type, data + used, header.len);
+        else
+            comlink_deliver(conn, header.type, data + used, header.len);
+        used += header.len;
+    }
+
+    return used;
+}
+
+/*****************************************************************************/
+/* bytes received on a connection; len <= 0 means the peer went away */
+
+void comlink_core_rx(comlink_conn_t *conn, char *data, int len)
+{
+    int used;
+    comlink_buf_t *rx = &conn->rx;
+
+    if (conn->closing)
+        return;
+
+    if (len <= 0) {
+        comlink_core_drop(conn);
+        return;
+    }
+
+    if (rx->len == 0) {
+        /* fast path, frames are decoded straight from the backend buffer */
+        used = comlink_parse(conn, data, len);
+        if (used == -1 ||
+                comlink_buf_append(rx, data + used, len - used) == -1) {
+            comlink_core_drop(conn);
+        }
+        return;
+    }
+
+    if (comlink_buf_append(rx, data, len) == -1) {
+        comlink_core_drop(conn);
+        return;
+    }
+
+    used = comlink_parse(conn, rx->data, rx->len);
+    if (used == -1) {
+        comlink_core_drop(conn);
+        return;
+    }
+
+    memmove(rx->data, rx->data + used, rx->len - used);
+    rx->len -= used;
+}
+
+/*****************************************************************************/
+/* peer closed or errored; the conn is released on the next flush pass */
+
+void comlink_core_drop(comlink_conn_t *conn)
+{
+    if (conn->closing)
+        return;
+
+    if (conn->kind == COMLINK_FD_CONN &&
+            comlink.params.shutdown_cb != NULL)
+        comlink.params.shutdown_cb(conn->fd);
+
+    pthread_mutex_lock(&comlink_lock);
+    conn->closing = 1;
+    comlink_mark_dirty(conn);
+    pthread_mutex_unlock(&comlink_lock);
+}
+
+/*****************************************************************************/
+/* new connection accepted by the backend */
+
+void comlink_core_accept(int fd)
+{
+    int optval = 1;
+    socklen_t skt_len;
+    struct sockaddr_in skt_addr;
+
+    comlink_server_t *cl_server = get_comlink_server();
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    if (comlink_conn_new(fd, COMLINK_FD_CONN) == NULL) {
+        fprintf(stderr, "server: failed to track connection %d \n", fd);
+        close(fd);
+        return;
+    }
+
+    cl_server->nr_clients += 1;
+    comlink_capture_open(comlink_core_conn(fd), 0);
+
+    /* local (unix socket) peers are not logged */
+    skt_len = sizeof(struct sockaddr_in);
+    if (getpeername(fd, (struct sockaddr *)&skt_addr, &skt_len) == 0 &&
+            skt_addr.sin_family == AF_INET) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+        optval = COMLINK_NOTSENT_LOWAT;
+        setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &optval,
+            sizeof(optval));
+        comlink_zip_offer(fd);
+        fprintf(stdout, "server: new connection from %08x:%05d \n",
+            ntohl(skt_addr.sin_addr.s_addr), ntohs(skt_addr.sin_port));
+    }
+}
+
+/*****************************************************************************/
+/* receive buffer supplied by the application */
+
+char * comlink_core_rxbuf(int *len)
+{
+    comlink_params_t *cl = get_comlink_params();
+
+    *len = cl->buf_len;
+
+    return cl->buffer;
+}
+
+/*****************************************************************************/
+/* wakeup eventfd or an application fd became readable */
+
+void comlink_core_ready(comlink_conn_t *conn)
+{
+    uint64_t val;
+
+    if (conn->closing)
+        return;
+
+    if (conn->kind == COMLINK_FD_USER) {
+        if (conn->user_cb != NULL)
+            conn->user_cb(conn->fd);
+        return;
+    }
+
+    while (read(comlink.wake_fd, &val, sizeof(val)) > 0)
+        ;
+}
+
+/*****************************************************************************/
+/* the file payload due next once out is drained, NULL unless its header
+ * is out already; backends that can send from a file use this */
+
+comlink_file_t * comlink_core_tx_file(comlink_conn_t *conn)
+{
+    comlink_file_t *file;
+
+    if (conn->out.off < conn->out.len)
+        return NULL;
+
+    pthread_mutex_lock(&comlink_lock);
+    file = conn->files;
+    if (file != NULL && file->at > conn->bulk.off)
+        file = NULL;
+    pthread_mutex_unlock(&comlink_lock);
+
+    return file;
+}
+
+/*****************************************************************************/
+/* len bytes of the head file went out; the caller moved file->off */
+
+void comlink_core_tx_file_sent(comlink_conn_t *conn, int len)
+{
+    comlink_file_t *file = conn->files;
+
+    file->left -= len;
+    if (file->left > 0)
+        return;
+
+    pthread_mutex_lock(&comlink_lock);
+    conn->files = file->next;
+    pthread_mutex_unlock(&comlink_lock);
+
+    if (!file->keep)
+        close(file->fd);
+    free(file);
+}
+
+/*****************************************************************************/
+/* file payload through conn->out, for backends that only send buffers */
+
+static int comlink_tx_file_copy(comlink_conn_t *conn, comlink_file_t *file)
 {
     int ret;
-    
-    ret = recv(fd, (char *)header, len, 0);
+    int len = file->left < COMLINK_FILE_CHUNK ? file->left :
+        COMLINK_FILE_CHUNK;
+
+    if (comlink_buf_reserve(&conn->out, len) == -1)
+        ret = -1;
+    else
+        ret = pread(file->fd, conn->out.data, len, file->off);
+
+    if (ret <= 0) {
+        fprintf(stderr, "comlink: file payload on fd %d cut short \n",
+            conn->fd);
+        comlink_core_drop(conn);
+        return 0;
+    }
+
+    conn->out.len = ret;
+    file->off += ret;
+    comlink_core_tx_file_sent(conn, ret);
+
+    return ret;
+}
+
+/*****************************************************************************/
+
+static long long comlink_mono_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*****************************************************************************/
+/* a batch of chan goes to the backend; more if frames are left behind.
+ * Caller holds the lock */
+
+static void comlink_tx_batch(comlink_conn_t *conn, int chan, int more)
+{
+    long long now = comlink_mono_ns();
+    long long wait = now - conn->queued_ns[chan];
+    comlink_chan_stats_t *stats = &conn->stats[chan];
+
+    stats->batches += 1;
+    stats->wait_ns += wait;
+    if (wait > stats->wait_max_ns)
+        stats->wait_max_ns = wait;
+    conn->queued_ns[chan] = more ? now : 0;
+}
+
+/*****************************************************************************/
+/* bytes of whole bulk frames from off, up to COMLINK_BULK_BATCH unless the
+ * first frame is larger; a file frame ends the batch after its header */
+
+static int comlink_bulk_span(comlink_conn_t *conn)
+{
+    int len;
+    int pos = conn->bulk.off;
+    comlink_header_t header;
+    comlink_file_t *file = conn->files;
+
+    while (pos < conn->bulk.len) {
+        memcpy(&header, conn->bulk.data + pos, sizeof(comlink_header_t));
+        len = sizeof(comlink_header_t);
+        if (file == NULL || pos + len != file->at)
+            len += ntohl(header.len);
+        if (pos > conn->bulk.off &&
+                pos + len - conn->bulk.off > COMLINK_BULK_BATCH)
+            break;
+        pos += len;
+        if (file != NULL && pos == file->at)
+            break;
+    }
+
+    return pos - conn->bulk.off;
+}
+
+/*****************************************************************************/
+/* drops the sent head of the bulk queue once it is half of it; caller
+ * holds the lock */
+
+static void comlink_bulk_compact(comlink_conn_t *conn)
+{
+    int off = conn->bulk.off;
+    comlink_file_t *file;
+
+    if (off < conn->bulk.len - off)
+        return;
+
+    memmove(conn->bulk.data, conn->bulk.data + off, conn->bulk.len - off);
+    conn->bulk.len -= off;
+    conn->bulk.off = 0;
+    for(file = conn->files; file != NULL; file = file->next)
+        file->at -= off;
+}
+
+/*****************************************************************************/
+/* moves the next bulk batch to out; caller holds the lock. With zip, a
+ * file payload that ends the batch is taken off the list, to be read in
+ * and compressed with the rest; it is returned */
+
+static comlink_file_t * comlink_bulk_next(comlink_conn_t *conn, int zip)
+{
+    int n;
+    comlink_buf_t tmp;
+    comlink_buf_t *bulk = &conn->bulk;
+    comlink_file_t *file = conn->files;
+
+    n = comlink_bulk_span(conn);
+    if (!zip || file == NULL || bulk->off + n != file->at)
+        file = NULL;
+    else
+        conn->files = file->next;
+
+    if (bulk->off == 0 && n == bulk->len && conn->files == NULL) {
+        /* all of it, no copy */
+        tmp = conn->out;
+        conn->out = *bulk;
+        *bulk = tmp;
+        comlink_tx_batch(conn, COMLINK_CHAN_BULK, 0);
+    } else if (comlink_buf_append(&conn->out, bulk->data + bulk->off,
+            n) == 0) {
+        bulk->off += n;
+        comlink_tx_batch(conn, COMLINK_CHAN_BULK, bulk->len > bulk->off);
+        comlink_bulk_compact(conn);
+    } else if (file != NULL) {
+        conn->files = file;
+        file = NULL;
+    }
+
+    return file;
+}
+
+/*****************************************************************************/
+/* a file payload read in behind its header in out */
+
+static int comlink_tx_file_read(comlink_conn_t *conn, comlink_file_t *file)
+{
+    int n;
+    int ret = comlink_buf_reserve(&conn->out, file->left);
+
+    while (ret == 0 && file->left > 0) {
+        n = pread(file->fd, conn->out.data + conn->out.len, file->left,
+                file->off);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            ret = -1;
+        else {
+            conn->out.len += n;
+            file->off += n;
+            file->left -= n;
+        }
+    }
+
+    if (!file->keep)
+        close(file->fd);
+    free(file);
+
     if (ret == -1) {
-        fprintf(stderr, "server: recv error, %s(%d) \n",
-            strerror(errno), errno);
-        return -1;
+        fprintf(stderr, "comlink: file payload on fd %d cut short \n",
+            conn->fd);
+        comlink_core_drop(conn);
+    }
+
+    return ret;
+}
+
+/*****************************************************************************/
+/* compresses the frames of the batch in out that are worth it */
+
+static void comlink_zip_batch(comlink_conn_t *conn)
+{
+    int n;
+    int len;
+    int pos;
+    int raw = 0;
+    int packed = 0;
+    int zip_in = 0;
+    int zip_out = 0;
+    char *p;
+    long long t = comlink_mono_ns();
+    comlink_buf_t tmp;
+    comlink_header_t header;
+    comlink_buf_t *z = &conn->ztx;
+    comlink_buf_t *out = &conn->out;
+
+    z->len = 0;
+    for(pos = 0; pos < out->len; pos += sizeof(comlink_header_t) + len) {
+        memcpy(&header, out->data + pos, sizeof(comlink_header_t));
+        len = ntohl(header.len);
+        if (comlink_buf_reserve(z, sizeof(comlink_header_t) + len) == -1)
+            return;
+
+        /* it has to come out smaller, its header included */
+        n = -1;
+        p = z->data + z->len + sizeof(comlink_header_t);
+        if (len >= COMLINK_ZIP_MIN)
+            n = comlink_zip(conn->zip.codec, conn->zip.level,
+                    out->data + pos + sizeof(comlink_header_t), len,
+                    p + COMLINK_ZFRAME_HEAD, len - COMLINK_ZFRAME_HEAD - 1);
+        if (len >= COMLINK_ZIP_MIN) {
+            raw += len;
+            packed += n == -1 ? len : n;
+        }
+
+        if (n == -1) {
+            memcpy(z->data + z->len, out->data + pos,
+                sizeof(comlink_header_t) + len);
+            z->len += sizeof(comlink_header_t) + len;
+            continue;
+        }
+
+        memcpy(p, &header.type, sizeof(header.type));
+        memcpy(p + sizeof(header.type), &header.len, sizeof(header.len));
+        p[8] = conn->zip.codec;
+        header.type = htonl(COMLINK_ZFRAME);
+        header.len = htonl(COMLINK_ZFRAME_HEAD + n);
+        memcpy(z->data + z->len, &header, sizeof(comlink_header_t));
+        z->len += sizeof(comlink_header_t) + COMLINK_ZFRAME_HEAD + n;
+        zip_in += len;
+        zip_out += COMLINK_ZFRAME_HEAD + n;
     }
 
-    if (ret == 0) {
-        if (comlink.params.shutdown_cb != NULL)
-            comlink.params.shutdown_cb(fd);
+    tmp = *out;
+    *out = *z;
+    *z = tmp;
+    comlink_zip_done(&conn->zip, raw, packed, comlink_mono_ns() - t);
+
+    pthread_mutex_lock(&comlink_lock);
+    conn->stats[COMLINK_CHAN_BULK].zip_in += zip_in;
+    conn->stats[COMLINK_CHAN_BULK].zip_out += zip_out;
+    pthread_mutex_unlock(&comlink_lock);
+}
+
+/*****************************************************************************/
+/* moves queued frames to conn->out; returns the bytes left to send.
+ * Control frames go first, unless a file payload is half way out */
+
+int comlink_core_tx_next(comlink_conn_t *conn)
+{
+    int zip = 0;
+    int more = 0;
+    long long left = 0;
+    long long bulk_ns = 0;
+    comlink_buf_t tmp;
+    comlink_file_t *file;
+    comlink_file_t *zfile = NULL;
+    comlink_buf_t *bulk = &conn->bulk;
+
+    if (conn->out.off < conn->out.len)
+        return conn->out.len - conn->out.off;
+
+    pthread_mutex_lock(&comlink_lock);
+    conn->out.len = 0;
+    conn->out.off = 0;
+    file = conn->files;
+    if (file != NULL && file->at == bulk->off) {
+        /* the rest of the file frame */
+    } else if (conn->tx.len > 0) {
+        if (bulk->len > bulk->off)
+            conn->stats[COMLINK_CHAN_CONTROL].overtakes += 1;
+        tmp = conn->out;
+        conn->out = conn->tx;
+        conn->tx = tmp;
+        comlink_tx_batch(conn, COMLINK_CHAN_CONTROL, 0);
+        file = NULL;
+    } else if (bulk->len > bulk->off) {
+        bulk_ns = comlink_mono_ns();
+        zip = comlink_zip_want(&conn->zip);
+        zfile = comlink_bulk_next(conn, zip);
+        more = bulk->len > bulk->off;
+        /* a file payload sent as it is goes out before the next batch */
+        file = conn->files;
+        if (file != NULL && file->at == bulk->off)
+            left = file->left;
+        file = NULL;
+    }
+    pthread_mutex_unlock(&comlink_lock);
+
+    if (file != NULL)
+        return comlink_tx_file_copy(conn, file);
+
+    if (zfile != NULL && comlink_tx_file_read(conn, zfile) == -1)
+        return 0;
+    if (zip)
+        comlink_zip_batch(conn);
+    if (bulk_ns != 0)
+        comlink_zip_sent(&conn->zip, bulk_ns, comlink_mono_ns(),
+            conn->out.len + left, more);
+
+    return conn->out.len;
+}
+
+/*****************************************************************************/
+/* main loop shared by the server and the client side */
+
+static int comlink_loop(void)
+{
+    int ret = 0;
 
+    if (!comlink.core_ready)
         return -1;
+
+    comlink_loop_thread = pthread_self();
+    comlink.in_loop = 1;
+
+    while (comlink.comlink_break == 0) {
+        comlink_flush_dirty();
+        if (comlink.backend->wait(-1) == -1) {
+            ret = -1;
+            break;
+        }
     }
 
-    header->type = ntohl(header->type);
-    header->len = ntohl(header->len);
-    
-    return header->len;
+    comlink_flush_dirty();
+    comlink.in_loop = 0;
+
+    return ret;
 }
 
 /*****************************************************************************/
-/* read the actual comlink data */
+/* server side implementation */
 
-static int comlink_read_data(int fd, char *buf, int len)
+static int comlink_server_init(comlink_params_t *cl_params)
 {
-    int ret;
+    comlink_server_t *cl_server = get_comlink_server();
 
-    memset(buf, 0, len);
-    ret = recv(fd, buf, len, 0);
-    if (ret == -1) {
-        fprintf(stderr, "server: recv error, %s(%d) \n",
-            strerror(errno), errno);
-        return -1;
-    }
+    if (cl_params->init_done)
+        return 0;
 
-    if (ret == 0) {
-        if (comlink.params.shutdown_cb != NULL)
-            comlink.params.shutdown_cb(fd);
+    cl_server->skt_listen = -1;
+    cl_server->nr_clients = 0;
 
+    if (comlink_core_init(cl_params) == -1)
         return -1;
-    }
 
-    return ret;
+    cl_params->init_done = 1;
+
+    return 0;
 }
 
 /*****************************************************************************/
-/* main server task; busy loop */
+/* drop every tracked socket */
 
-static int comlink_server_task(int fd, struct sockaddr_in *addr)
+static void comlink_cleanup(void)
 {
-    int ret = 0;
-    int rx_len;
-    comlink_header_t header;
-    
-    char *buf = comlink.params.buffer;
-    int buf_len = comlink.params.buf_len;
-    
-    comlink_params_t *cl = get_comlink_params();
-    
-    if (cl->rx_len == 0) { /* start of a message */
-    /* read header to get type and length */
-        if ((ret = comlink_read_header(fd, &header,
-                sizeof(comlink_header_t))) == -1)
-            return -1;
+    int fd;
+    comlink_conn_t *conn;
 
-        /* now we know the len to read */
-        cl->rx_len = ret;
+    for(fd = 0; fd < comlink.nr_slots; fd++) {
+        conn = comlink.conns[fd];
+        if (conn != NULL && conn->kind != COMLINK_FD_WAKE)
+            comlink_conn_release(conn);
     }
+}
 
-    rx_len = comlink_read_data(fd, buf, cl->rx_len);
+/*****************************************************************************/
 
-    /* normal operation, data received; pas it to the callback */
-    if (comlink.params.receive_cb != NULL && rx_len > 0)
-        comlink.params.receive_cb(fd, header.type, buf, buf_len);
+static void comlink_server_cleanup(void)
+{
+    comlink_server_t *server = get_comlink_server();
 
-    cl->rx_len = 0;    
-    
-    return 0;
+    comlink_cleanup();
+    server->skt_listen = -1;
 }
 
 /*****************************************************************************/
@@ -190,19 +1143,18 @@ int comlink_server_setup(comlink_params_t *cl_params)
         abort();
     }
 
-    fd = socket(AF_INET, SOCK_STREAM, 0);
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (fd == -1) {
         fprintf(stderr, "server: error in listener socket, %s(%d) \n",
             strerror(errno), errno);
         return -1;
     }
 
-    cl_server->skt_listen = fd;
     if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
             &optval, sizeof(optval)) == -1) {
         fprintf(stderr, "server: error in setsockopt, %s(%d) \n",
             strerror(errno), errno);
-        comlink_server_cleanup();
+        close(fd);
         return -1;
     }
 
@@ -214,51 +1166,80 @@ int comlink_server_setup(comlink_params_t *cl_params)
             sizeof(struct sockaddr_in)) == -1) {
         fprintf(stderr, "server: bind error, %s(%d) \n",
             strerror(errno), errno);
-        comlink_server_cleanup();
+        close(fd);
         return -1;
     }
 
-    if (listen(fd, 3) == -1) {
+    if (listen(fd, SOMAXCONN) == -1) {
         fprintf(stderr, "server: error in listen, %s(%d) \n",
             strerror(errno), errno);
-        comlink_server_cleanup();
+        close(fd);
         return -1;
     }
 
+    if (comlink_conn_new(fd, COMLINK_FD_LISTEN) == NULL) {
+        fprintf(stderr, "server: failed to watch listener socket \n");
+        close(fd);
+        return -1;
+    }
+
+    cl_server->skt_listen = fd;
     comlink.comlink_break = 0;
 
     return 0;
 }
 
 /*****************************************************************************/
-/* exposed function to start the server task */
+/* additional unix socket endpoint for local peers; same frames and
+ * callbacks as the tcp side. Needs comlink_server_setup first */
 
-int comlink_server_start(void)
+int comlink_local_setup(char *path)
 {
     int fd;
-    socklen_t skt_len;
-    struct sockaddr_in skt_addr;
+    struct sockaddr_un skt_addr;
 
-    comlink_server_t *cl_server = get_comlink_server();
-    
-    skt_len = sizeof(sizeof(struct sockaddr_in));
-    fd = accept(cl_server->skt_listen, (struct sockaddr *)&skt_addr,
-            &skt_len);
+    if (!comlink.core_ready || strlen(path) >= sizeof(skt_addr.sun_path)) {
+        fprintf(stderr, "server: invalid local endpoint %s \n", path);
+        return -1;
+    }
 
-    /* store the fd for replying later */        
-    cl_server->skt_clients[cl_server->nr_clients] = fd;
-    cl_server->nr_clients += 1;
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        fprintf(stderr, "server: error in local socket, %s(%d) \n",
+            strerror(errno), errno);
+        return -1;
+    }
 
-    fprintf(stdout, "server: new connection from %08x:%05d \n",
-        ntohl(skt_addr.sin_addr.s_addr), ntohs(skt_addr.sin_port));
+    memset(&skt_addr, 0, sizeof(struct sockaddr_un));
+    skt_addr.sun_family = AF_UNIX;
+    strcpy(skt_addr.sun_path, path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&skt_addr,
+            sizeof(struct sockaddr_un)) == -1 ||
+            listen(fd, SOMAXCONN) == -1) {
+        fprintf(stderr, "server: local endpoint %s, %s(%d) \n",
+            path, strerror(errno), errno);
+        close(fd);
+        return -1;
+    }
 
-    while(comlink.comlink_break == 0) {
-        if (comlink_server_task(fd, &skt_addr) == -1)
-            break;
-        usleep(200 * 1000); /*200ms polling period */
+    if (comlink_conn_new(fd, COMLINK_FD_LISTEN) == NULL) {
+        close(fd);
+        return -1;
     }
 
-    return 0;
+    return fd;
+}
+
+/*****************************************************************************/
+/* exposed function to start the server task */
+
+int comlink_server_start(void)
+{
+    fprintf(stdout, "server: waiting for connections (%s) \n",
+        comlink_backend_name());
+
+    return comlink_loop();
 }
 
 /*****************************************************************************/
@@ -266,10 +1247,12 @@ int comlink_server_start(void)
 int comlink_server_shutdown(void)
 {
     fprintf(stdout, "server: shutdown, cleaning-up \n");
-    if (comlink.comlink_break == 0) {
-        comlink.comlink_break = 1;
+    comlink.comlink_break = 1;
+
+    if (comlink.in_loop)
+        comlink_wakeup();
+    else
         comlink_server_cleanup();
-    }
 
     return 0;
 }
@@ -280,21 +1263,21 @@ int comlink_server_shutdown(void)
 static int comlink_client_init(comlink_params_t *cl_params)
 {
     int i;
-    
+
     comlink_client_t *cl_client = get_comlink_client();
 
     if (cl_params->init_done)
         return 0;
-    
+
     cl_client->nr_conns = 0;
     for(i = 0; i < MAX_CONNECTIONS; i++)
         cl_client->skt_conns[i] = -1;
 
-    comlink.params = *cl_params;
+    if (comlink_core_init(cl_params) == -1)
+        return -1;
+
     cl_params->init_done = 1;
-    FD_ZERO(&cl_client->rd_fds);
-    FD_ZERO(&cl_client->t_fds);
-    
+
     return 0;
 }
 
@@ -302,62 +1285,45 @@ static int comlink_client_init(comlink_params_t *cl_params)
 
 static void comlink_client_cleanup(void)
 {
-    int i;
-    
-    comlink_client_t *cl_client = get_comlink_client();
-
-    for(i = 0; i < cl_client->nr_conns; i++) {
-        if (cl_client->skt_conns[i] != -1)
-            close(cl_client->skt_conns[i]);
-    }
+    comlink_cleanup();
 }
 
 /*****************************************************************************/
-/* add new connections to the read fd_set */
+/* the kernel alone takes minutes to give up on a host that doesn't
+ * answer; with a timeout the connect is made nonblocking and waited for */
 
-static void update_client_fdset(comlink_client_t *cl, int fd)
+static int comlink_connect(int fd, struct sockaddr_in *addr, int timeout_ms)
 {
-    if (fd > MAX_CONNECTIONS) {
-        fprintf(stderr,
-            "comlink: reached the connection limit at client\n");
-        return;
-    }
-
-    FD_SET(fd, &cl->rd_fds);
+    int n;
+    int err = 0;
+    socklen_t len = sizeof(err);
+    struct pollfd pfd;
 
-    /* update the max fd */
-    if (cl->max_fds <= fd)
-        cl->max_fds = fd + 1;
-}
+    if (timeout_ms <= 0)
+        return connect(fd, (struct sockaddr *)addr, sizeof(*addr));
 
-/*****************************************************************************/
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if (connect(fd, (struct sockaddr *)addr, sizeof(*addr)) == 0)
+        return 0;
+    if (errno != EINPROGRESS)
+        return -1;
 
-static int comlink_client_task(void)
-{
-    int i;
-    int rx_len;
-    int buf_len = comlink.params.buf_len;
-    char *buf = comlink.params.buffer;
-    
-    comlink_client_t *cl = get_comlink_client();
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    while ((n = poll(&pfd, 1, timeout_ms)) == -1 && errno == EINTR)
+        ;
+    if (n == 0)
+        errno = ETIMEDOUT;
+    if (n <= 0)
+        return -1;
 
-    memcpy(&cl->t_fds, &cl->rd_fds, sizeof(fd_set));
-    if (select(cl->max_fds, &cl->t_fds, NULL, NULL, NULL) == -1) {
-        fprintf(stderr, "comlink: select, %s(%d) \n",
-            strerror(errno), errno);
-        return -1;    
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+        return -1;
+    if (err != 0) {
+        errno = err;
+        return -1;
     }
 
-    for(i = 0; i < cl->nr_conns; i++) {
-        if(FD_ISSET(cl->skt_conns[i], &cl->t_fds)) {
-            rx_len = comlink_read_data(cl->skt_conns[i], buf, buf_len);
-            if (comlink.params.receive_cb != NULL && rx_len > 0)
-                /* text status message; FIX */
-                comlink.params.receive_cb(cl->skt_conns[i],
-                    STATUS_MESSAGE, buf, buf_len);
-        }
-    }
-   
     return 0;
 }
 
@@ -366,8 +1332,9 @@ static int comlink_client_task(void)
 int comlink_client_setup(comlink_params_t *cl_params)
 {
     int fd;
+    int optval = 1;
     struct sockaddr_in skt_addr;
-    
+
     comlink_client_t *cl_client = get_comlink_client();
 
     if (comlink_client_init(cl_params)) {
@@ -375,7 +1342,7 @@ int comlink_client_setup(comlink_params_t *cl_params)
         abort();
     }
 
-    fd = socket(AF_INET, SOCK_STREAM, 0);
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (fd == -1) {
         fprintf(stderr, "client: error opening connect socket, %s(%d) \n",
             strerror(errno), errno);
@@ -386,21 +1353,33 @@ int comlink_client_setup(comlink_params_t *cl_params)
     skt_addr.sin_family = AF_INET;
     skt_addr.sin_addr.s_addr = htonl(cl_params->remote_ip);
     skt_addr.sin_port = htons(cl_params->remote_port);
-    if (connect(fd, (struct sockaddr *)&skt_addr,
-            sizeof(struct sockaddr_in)) == -1) {
+    if (comlink_connect(fd, &skt_addr, cl_params->connect_timeout_ms) == -1) {
         fprintf(stderr, "client: connect error, %s(%d) \n",
             strerror(errno), errno);
-        comlink_client_cleanup();
+        close(fd);
+        return -1;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+    optval = COMLINK_NOTSENT_LOWAT;
+    setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &optval, sizeof(optval));
+
+    if (comlink_conn_new(fd, COMLINK_FD_CONN) == NULL) {
+        fprintf(stderr, "client: failed to track connection \n");
+        close(fd);
         return -1;
     }
+    comlink_capture_open(comlink_core_conn(fd), 1);
+    comlink_zip_offer(fd);
 
     /* new connection, store it for receiving the replies */
-    cl_client->skt_conns[cl_client->nr_conns] = fd;
+    if (cl_client->nr_conns < MAX_CONNECTIONS)
+        cl_client->skt_conns[cl_client->nr_conns] = fd;
     cl_client->nr_conns += 1; /* TODO: find a bettwer way for the index */
-    update_client_fdset(cl_client, fd);
 
     comlink.comlink_break = 0;
-        
+
     return fd;
 }
 
@@ -408,12 +1387,7 @@ int comlink_client_setup(comlink_params_t *cl_params)
 
 int comlink_client_start(void)
 {
-    while(comlink.comlink_break == 0) {
-        comlink_client_task();
-        usleep(200 * 1000); /*200ms polling period */
-    }
-
-    return 0;
+    return comlink_loop();
 }
 
 /*****************************************************************************/
@@ -421,22 +1395,48 @@ int comlink_client_start(void)
 int comlink_client_shutdown(void)
 {
     fprintf(stdout, "client: shutdown, cleaning-up \n");
-    if (comlink.comlink_break == 0)
-        comlink.comlink_break = 1;
-        
-    comlink_client_cleanup();
+    comlink.comlink_break = 1;
+
+    if (comlink.in_loop)
+        comlink_wakeup();
+    else
+        comlink_client_cleanup();
 
     return 0;
 }
 
 /*****************************************************************************/
+/* closing is deferred to the flush pass when called from the loop */
 
 void comlink_client_close(int fd)
 {
-    comlink_client_t *cl = get_comlink_client();
+    comlink_conn_t *conn = comlink_core_conn(fd);
+
+    if (conn == NULL)
+        return;
+
+    if (!comlink.in_loop) {
+        comlink_conn_release(conn);
+        return;
+    }
+
+    pthread_mutex_lock(&comlink_lock);
+    conn->closing = 1;
+    comlink_mark_dirty(conn);
+    pthread_mutex_unlock(&comlink_lock);
+}
+
+/*****************************************************************************/
+/* a new connection on a reused fd gets a new generation; from the loop */
+
+int comlink_conn_gen(int fd)
+{
+    comlink_conn_t *conn = comlink_core_conn(fd);
+
+    if (conn == NULL || conn->kind != COMLINK_FD_CONN || conn->closing)
+        return -1;
 
-    close(fd);
-    FD_CLR(fd, &cl->rd_fds);
+    return conn->gen;
 }
 
 /*****************************************************************************/
@@ -444,39 +1444,319 @@ void comlink_client_close(int fd)
 int comlink_sendto_server(int con_index, comlink_header_t *hdr,
         char *buf, int buf_len)
 {
-    int ret;
-    comlink_header_t header;
-    
     comlink_client_t *cl = get_comlink_client();
 
-    if (con_index > cl->nr_conns) {
+    if (con_index < 0 || con_index >= cl->nr_conns ||
+            con_index >= MAX_CONNECTIONS) {
         fprintf(stderr, "client: invalid con_index \n");
         return -1;
     }
 
-    header.type = ntohl(hdr->type);
-    header.len = ntohl(hdr->len);
-    
-    ret = send(cl->skt_conns[con_index], (void *)&header,
-            sizeof(comlink_header_t), 0);
-    if (ret == -1) {
-        fprintf(stderr, "client: send failed %s(%d) \n",
-            strerror(errno), errno);
+    return comlink_send(cl->skt_conns[con_index], hdr, buf, buf_len);
+}
+
+/*****************************************************************************/
+/* counts a frame queued on chan; caller holds the lock */
+
+static void comlink_tx_queued(comlink_conn_t *conn, int chan, int len)
+{
+    comlink_buf_t *q = chan == COMLINK_CHAN_CONTROL ? &conn->tx : &conn->bulk;
+
+    if (q->len == q->off && conn->queued_ns[chan] == 0)
+        conn->queued_ns[chan] = comlink_mono_ns();
+    conn->stats[chan].frames += 1;
+    conn->stats[chan].bytes += sizeof(comlink_header_t) + len;
+}
+
+/*****************************************************************************/
+/* frames are queued and written by the loop thread in batches */
+
+static int comlink_send_chan(int fd, int chan, comlink_header_t *hdr,
+        char *buf, int buf_len)
+{
+    int ret = buf_len;
+    int wake;
+    comlink_header_t header;
+    comlink_conn_t *conn;
+    comlink_buf_t *q;
+
+    header.type = htonl(hdr->type);
+    header.len = htonl(hdr->len);
+
+    pthread_mutex_lock(&comlink_lock);
+    conn = (fd >= 0 && fd < comlink.nr_slots) ? comlink.conns[fd] : NULL;
+    if (conn == NULL || conn->closing || conn->kind != COMLINK_FD_CONN) {
+        pthread_mutex_unlock(&comlink_lock);
+        fprintf(stderr, "comlink: send on invalid connection %d \n", fd);
         return -1;
     }
-    
-    ret = send(cl->skt_conns[con_index], buf, buf_len, 0);
-    if (ret != buf_len) {
-        fprintf(stderr, "client: send failed %s(%d) \n",
-            strerror(errno), errno);
+
+    q = chan == COMLINK_CHAN_CONTROL ? &conn->tx : &conn->bulk;
+    if (comlink_buf_reserve(q, sizeof(comlink_header_t) + buf_len) == -1) {
+        ret = -1;
+    } else {
+        comlink_tx_queued(conn, chan, buf_len);
+        comlink_capture_frame(conn, COMLINK_CAPTURE_TX, chan, hdr->type,
+            buf, buf_len);
+        comlink_buf_append(q, &header, sizeof(comlink_header_t));
+        comlink_buf_append(q, buf, buf_len);
+        comlink_mark_dirty(conn);
+    }
+    pthread_mutex_unlock(&comlink_lock);
+
+    wake = comlink.in_loop &&
+        !pthread_equal(pthread_self(), comlink_loop_thread);
+    if (wake)
+        comlink_wakeup();
+
+    return ret;
+}
+
+/*****************************************************************************/
+
+int comlink_send(int fd, comlink_header_t *hdr, char *buf, int buf_len)
+{
+    return comlink_send_chan(fd, COMLINK_CHAN_CONTROL, hdr, buf, buf_len);
+}
+
+/*****************************************************************************/
+
+int comlink_send_bulk(int fd, comlink_header_t *hdr, char *buf, int buf_len)
+{
+    return comlink_send_chan(fd, COMLINK_CHAN_BULK, hdr, buf, buf_len);
+}
+
+/*****************************************************************************/
+
+int comlink_send_file(int fd, comlink_header_t *hdr, int file_fd,
+        off_t off, int len, int flags)
+{
+    int wake;
+    comlink_header_t header;
+    comlink_conn_t *conn;
+    comlink_file_t *file;
+    comlink_file_t **tail;
+
+    file = calloc(1, sizeof(comlink_file_t));
+    if (file == NULL) {
+        if (!(flags & COMLINK_FILE_KEEP))
+            close(file_fd);
+        return -1;
+    }
+    file->fd = file_fd;
+    file->keep = flags & COMLINK_FILE_KEEP;
+    file->off = off;
+    file->left = len;
+
+    header.type = htonl(hdr->type);
+    header.len = htonl(len);
+
+    pthread_mutex_lock(&comlink_lock);
+    conn = (fd >= 0 && fd < comlink.nr_slots) ? comlink.conns[fd] : NULL;
+    if (conn == NULL || conn->closing || conn->kind != COMLINK_FD_CONN ||
+            comlink_buf_reserve(&conn->bulk,
+                sizeof(comlink_header_t)) == -1) {
+        pthread_mutex_unlock(&comlink_lock);
+        fprintf(stderr, "comlink: send on invalid connection %d \n", fd);
+        if (!file->keep)
+            close(file_fd);
+        free(file);
+        return -1;
+    }
+
+    comlink_tx_queued(conn, COMLINK_CHAN_BULK, len);
+    comlink_capture_frame(conn, COMLINK_CAPTURE_TX, COMLINK_CHAN_BULK,
+        hdr->type, NULL, len);
+    comlink_buf_append(&conn->bulk, &header, sizeof(comlink_header_t));
+    file->at = conn->bulk.len;
+    for(tail = &conn->files; *tail != NULL; tail = &(*tail)->next)
+        ;
+    *tail = file;
+    comlink_mark_dirty(conn);
+    pthread_mutex_unlock(&comlink_lock);
+
+    wake = comlink.in_loop &&
+        !pthread_equal(pthread_self(), comlink_loop_thread);
+    if (wake)
+        comlink_wakeup();
+
+    return len;
+}
+
+/*****************************************************************************/
+/* pending bytes across all connections */
+
+static int comlink_tx_pending(void)
+{
+    int fd;
+    int pending = 0;
+    comlink_conn_t *conn;
+    comlink_file_t *file;
+
+    pthread_mutex_lock(&comlink_lock);
+    for(fd = 0; fd < comlink.nr_slots; fd++) {
+        conn = comlink.conns[fd];
+        if (conn == NULL || conn->closing)
+            continue;
+        pending += conn->tx.len + (conn->bulk.len - conn->bulk.off) +
+            (conn->out.len - conn->out.off);
+        for(file = conn->files; file != NULL; file = file->next)
+            pending += file->left;
+    }
+    pthread_mutex_unlock(&comlink_lock);
+
+    return pending;
+}
+
+/*****************************************************************************/
+/* drains the send queues outside of the main loop; used at teardown */
+
+int comlink_flush(void)
+{
+    int i;
+
+    if (!comlink.core_ready)
+        return 0;
+
+    for(i = 0; i < COMLINK_FLUSH_TRIES; i++) {
+        comlink_flush_dirty();
+        if (comlink_tx_pending() == 0)
+            return 0;
+        comlink.backend->wait(COMLINK_FLUSH_WAIT_MS);
+    }
+
+    fprintf(stderr, "comlink: flush timed out \n");
+
+    return -1;
+}
+
+/*****************************************************************************/
+
+int comlink_clock_probe(int fd, int count)
+{
+    long long t1;
+    comlink_conn_t *conn;
+
+    if (count < 1)
+        return -1;
+
+    pthread_mutex_lock(&comlink_lock);
+    conn = (fd >= 0 && fd < comlink.nr_slots) ? comlink.conns[fd] : NULL;
+    if (conn == NULL || conn->closing || conn->kind != COMLINK_FD_CONN) {
+        pthread_mutex_unlock(&comlink_lock);
+        return -1;
+    }
+    if (conn->probes > 0) {
+        pthread_mutex_unlock(&comlink_lock);
+        return 0;
+    }
+    conn->probes = count;
+    pthread_mutex_unlock(&comlink_lock);
+
+    t1 = comlink_clock_now();
+    if (comlink_clock_send(fd, COMLINK_CLOCK_PROBE, &t1, 1) == -1) {
+        /* the conn may be gone by now */
+        pthread_mutex_lock(&comlink_lock);
+        if (fd < comlink.nr_slots && comlink.conns[fd] != NULL)
+            comlink.conns[fd]->probes = 0;
+        pthread_mutex_unlock(&comlink_lock);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+int comlink_clock_get(int fd, comlink_clock_t *clock)
+{
+    int ret = -1;
+    comlink_conn_t *conn;
+
+    pthread_mutex_lock(&comlink_lock);
+    conn = (fd >= 0 && fd < comlink.nr_slots) ? comlink.conns[fd] : NULL;
+    if (conn != NULL && conn->clock.samples > 0) {
+        *clock = conn->clock;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&comlink_lock);
+
+    return ret;
+}
+
+/*****************************************************************************/
+
+int comlink_stats(int fd, int chan, comlink_chan_stats_t *stats)
+{
+    int ret = -1;
+    comlink_conn_t *conn;
+
+    if (chan < 0 || chan >= COMLINK_NR_CHANS)
         return -1;
+
+    pthread_mutex_lock(&comlink_lock);
+    conn = (fd >= 0 && fd < comlink.nr_slots) ? comlink.conns[fd] : NULL;
+    if (conn != NULL && conn->kind == COMLINK_FD_CONN) {
+        *stats = conn->stats[chan];
+        stats->codec = chan == COMLINK_CHAN_BULK ? conn->zip.codec : 0;
+        ret = 0;
     }
+    pthread_mutex_unlock(&comlink_lock);
 
     return ret;
 }
 
 /*****************************************************************************/
 
+int comlink_watch_fd(int fd, void (*cb)(int fd))
+{
+    comlink_conn_t *conn;
+
+    if (!comlink.core_ready)
+        return -1;
+
+    conn = comlink_conn_new(fd, COMLINK_FD_USER);
+    if (conn == NULL) {
+        fprintf(stderr, "comlink: failed to watch fd %d \n", fd);
+        return -1;
+    }
+    conn->user_cb = cb;
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+void comlink_unwatch_fd(int fd)
+{
+    comlink_conn_t *conn = comlink_core_conn(fd);
+
+    if (conn == NULL || conn->kind != COMLINK_FD_USER)
+        return;
+
+    comlink_client_close(fd);
+}
+
+/*****************************************************************************/
+/* async-signal-safe; kicks the loop out of its wait */
+
+void comlink_wakeup(void)
+{
+    uint64_t val = 1;
+
+    if (comlink.core_ready && write(comlink.wake_fd, &val, sizeof(val)) < 0)
+        return;
+}
+
+/*****************************************************************************/
+
+const char * comlink_backend_name(void)
+{
+    return comlink.backend ? comlink.backend->name : "none";
+}
+
+/*****************************************************************************/
+
 int hostname_to_netaddr(char *hostname, struct sockaddr *addr)
 {
     struct addrinfo *res;
@@ -1,30 +1,76 @@
 #ifndef _COMLINK_H_
 #define _COMLINK_H_
 
+#include <sys/types.h>
 #include <netinet/in.h>
 
 /*****************************************************************************/
 
 #define MAX_CONNECTIONS (100)
 
+/* largest payload accepted in a single frame; more has to be cut */
+#define COMLINK_MAX_FRAME (1 << 20)
+
+/* frame types from here up are comlink's own and never reach receive_cb */
+#define COMLINK_TYPE_RESERVED (0xffff0000u)
+
+/* comlink_send_file flags */
+#define COMLINK_FILE_KEEP (1) /* the caller keeps file_fd open until sent */
+
+/* bulk payloads cut into frames of this size keep a control frame from
+ * waiting behind more than one of them */
+#define COMLINK_BULK_FRAME (1 << 20)
+
+/*****************************************************************************/
+/* event loop backends; AUTO honours COMLINK_BACKEND=epoll|uring */
+
+enum {
+    COMLINK_BACKEND_AUTO = 0,
+    COMLINK_BACKEND_EPOLL,
+    COMLINK_BACKEND_URING
+};
+
+/*****************************************************************************/
+/* logical channels of a connection; queued control frames go out ahead
+ * of queued bulk frames at the next frame boundary */
+
+enum {
+    COMLINK_CHAN_CONTROL = 0, /* comlink_send */
+    COMLINK_CHAN_BULK,        /* comlink_send_bulk, comlink_send_file */
+    COMLINK_NR_CHANS
+};
+
+/*****************************************************************************/
+/* bulk channel compression, agreed per connection; best last */
+
+enum {
+    COMLINK_CODEC_NONE = 0,
+    COMLINK_CODEC_LZ,   /* built in */
+    COMLINK_CODEC_LZ4,  /* make COMLINK_LZ4=1 */
+    COMLINK_CODEC_ZSTD, /* make COMLINK_ZSTD=1 */
+    COMLINK_NR_CODECS
+};
+
 /*****************************************************************************/
 /* params for comlink */
 
 typedef struct comlink_params_s {
-    char *buffer;
+    char *buffer; /* scratch receive buffer for the epoll backend */
     int buf_len;
     int rx_len;
-    
+
     /* for the server sock initialization */
     unsigned int local_ip;
     unsigned short local_port;
 
-    /* for client side */  
+    /* for client side */
     unsigned int remote_ip;
     unsigned short remote_port;
+    int connect_timeout_ms; /* 0 waits as long as the kernel does */
 
     int init_done; /* To avoid multiple init of comlink */
-    
+    int backend;   /* COMLINK_BACKEND_* */
+
     void (*receive_cb)(int fd,
             unsigned int type, char *buf, int len);
     void (*shutdown_cb)(int fd);
@@ -35,10 +81,7 @@ typedef struct comlink_params_s {
 
 typedef struct comlink_server_s {
     int skt_listen; /* listener socket */
-
-    /* params for reply to client */
     int nr_clients;
-    int skt_clients[MAX_CONNECTIONS]; /* connected clients for reply */
 }comlink_server_t;
 
 /*****************************************************************************/
@@ -47,27 +90,140 @@ typedef struct comlink_server_s {
 typedef struct comlink_client_s {
     int nr_conns;
     int skt_conns[MAX_CONNECTIONS]; /* connections */
-
-    /* for select */
-    int max_fds;
-    fd_set rd_fds;
-    fd_set t_fds;
 }comlink_client_t;
 
+/*****************************************************************************/
+/* byte buffer used for frame reassembly and send queues */
+
+typedef struct comlink_buf_s {
+    char *data;
+    int len;
+    int off;
+    int size;
+}comlink_buf_t;
+
+/*****************************************************************************/
+/* payload of a frame taken from a file; it goes out once the bulk queue
+ * is sent up to at, zero-copy where the backend can */
+
+typedef struct comlink_file_s {
+    int fd;        /* closed by comlink once sent, unless keep */
+    int keep;
+    off_t off;
+    long long left;
+    int at;        /* bulk offset its header ends at */
+    struct comlink_file_s *next;
+}comlink_file_t;
+
+/*****************************************************************************/
+/* the peer's CLOCK_REALTIME against ours, from timestamped probes as NTP
+ * does: the sample with the least round trip of a round bounds the error */
+
+typedef struct comlink_clock_s {
+    long long offset_ns; /* peer time = local time + offset_ns */
+    long long rtt_ns;
+    long long err_ns;    /* the true offset is within offset_ns +- err_ns */
+    int samples;         /* probes that came back in the round */
+}comlink_clock_t;
+
+/*****************************************************************************/
+/* traffic of one channel of a connection. A batch is what is handed to
+ * the backend at once; its wait is how long its oldest frame was queued */
+
+typedef struct comlink_chan_stats_s {
+    long long frames;  /* queued */
+    long long bytes;   /* queued, headers included */
+    long long batches;
+    long long wait_ns; /* summed over the batches */
+    long long wait_max_ns;
+    long long overtakes; /* control batches sent ahead of queued bulk */
+    long long zip_in;  /* bytes of the frames that went compressed */
+    long long zip_out; /* what they came to */
+    int codec;         /* COMLINK_CODEC_* in use on the bulk channel */
+}comlink_chan_stats_t;
+
+/*****************************************************************************/
+/* compression state of a connection; rates are in bytes per us */
+
+typedef struct comlink_zip_s {
+    int codec;        /* COMLINK_CODEC_NONE until the peer offers one */
+    int level;
+    int skip;         /* batches to send as they are before a probe */
+    double ratio;     /* compressed / raw */
+    double zip_rate;  /* raw bytes packed */
+    double link_rate; /* bytes the backend got rid of while backlogged */
+    long long sent_ns; /* last bulk batch out, 0 if nothing was behind it */
+    int sent_len;
+}comlink_zip_t;
+
+/*****************************************************************************/
+/* per-socket state, indexed by fd */
+
+enum {
+    COMLINK_FD_LISTEN = 1,
+    COMLINK_FD_CONN,
+    COMLINK_FD_WAKE,
+    COMLINK_FD_USER   /* timerfd/eventfd etc. watched for the application */
+};
+
+typedef struct comlink_conn_s {
+    int fd;
+    int kind;     /* COMLINK_FD_* */
+    int gen;      /* guards against stale backend completions */
+    int closing;
+    int dirty;    /* queued on the flush list */
+    int busy;     /* backend is waiting to write out */
+    int cancelling; /* backend is waiting for its cancel to complete */
+    struct comlink_conn_s *next; /* released, kept until the kernel is done */
+
+    comlink_buf_t rx;  /* partial frame carried between reads */
+    comlink_buf_t tx;   /* control frames */
+    comlink_buf_t bulk; /* bulk frames, sent from off on */
+    comlink_buf_t out;  /* frames owned by the backend while sending */
+    comlink_file_t *files; /* file payloads, in bulk order */
+
+    comlink_chan_stats_t stats[COMLINK_NR_CHANS];
+    long long queued_ns[COMLINK_NR_CHANS]; /* oldest frame waiting since */
+
+    comlink_zip_t zip;
+    comlink_buf_t ztx; /* a bulk batch being compressed */
+    comlink_buf_t zrx; /* a frame being decompressed */
+
+    int probes;            /* clock probes left in the round */
+    comlink_clock_t round; /* best sample so far in the round */
+    comlink_clock_t clock; /* last finished round */
+
+    void (*user_cb)(int fd); /* COMLINK_FD_USER, called when readable */
+
+    unsigned int cap_id; /* in the frame capture, 0 if not captured */
+}comlink_conn_t;
+
 /*****************************************************************************/
 /* comlink context */
 
+struct comlink_backend_s;
+
 typedef struct comlink_s {
     /* params for the comlink main task */
-    int comlink_break;
-    
+    volatile int comlink_break;
+    int in_loop;
+    int core_ready;
+
     comlink_params_t params;
     comlink_server_t server;
     comlink_client_t client;
+
+    /* event loop state */
+    const struct comlink_backend_s *backend;
+    int wake_fd;
+    int nr_slots;
+    comlink_conn_t **conns;
+    int nr_dirty;
+    int *dirty;
 }comlink_t;
 
 /*****************************************************************************/
-/* header for comlink; needs further improvement to add serialization etc */
+/* header for comlink; structured payloads are wire records, see wire.h */
 
 typedef struct comlink_header_s {
     unsigned int type;
@@ -79,6 +235,7 @@ typedef struct comlink_header_s {
 int comlink_server_setup(comlink_params_t *cl_params);
 int comlink_server_start(void);
 int comlink_server_shutdown(void);
+int comlink_local_setup(char *path);
 
 int comlink_client_setup(comlink_params_t *cl_params);
 int comlink_client_start(void);
@@ -86,6 +243,36 @@ int comlink_client_shutdown(void);
 int comlink_sendto_server(int con_index, comlink_header_t *header,
         char *buf, int buf_len);
 void comlink_client_close(int fd);
+/* tells a connection from a later one on the same fd, -1 if none */
+int comlink_conn_gen(int fd);
+
+/* queue a frame to any connected peer; safe from other threads */
+int comlink_send(int fd, comlink_header_t *header, char *buf, int buf_len);
+/* same on the bulk channel; frames keep their order within a channel */
+int comlink_send_bulk(int fd, comlink_header_t *header, char *buf,
+        int buf_len);
+/* a bulk frame whose payload is len bytes of file_fd at off; comlink owns
+ * file_fd unless flags has COMLINK_FILE_KEEP */
+int comlink_send_file(int fd, comlink_header_t *header, int file_fd,
+        off_t off, int len, int flags);
+/* counters of a channel (COMLINK_CHAN_*) of a connection */
+int comlink_stats(int fd, int chan, comlink_chan_stats_t *stats);
+const char * comlink_codec_name(int codec);
+int comlink_flush(void);
+void comlink_wakeup(void);
+
+/* starts a round of count clock probes, sent one after the other; the
+ * peer's comlink answers them. A round in progress is left alone */
+int comlink_clock_probe(int fd, int count);
+/* the estimate of the last finished round, -1 if none yet */
+int comlink_clock_get(int fd, comlink_clock_t *clock);
+
+/* run cb on the loop thread whenever fd is readable; call from the loop
+ * thread or before start. comlink closes the fd on unwatch and shutdown */
+int comlink_watch_fd(int fd, void (*cb)(int fd));
+void comlink_unwatch_fd(int fd);
+
+const char * comlink_backend_name(void);
 
 int hostname_to_netaddr(char *hostname, struct sockaddr *addr);
 
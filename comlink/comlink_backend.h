@@ -0,0 +1,52 @@
+/*
+ * comlink_backend: event loop backends used by the comlink core
+ */
+#ifndef _COMLINK_BACKEND_H_
+#define _COMLINK_BACKEND_H_
+
+#include "comlink.h"
+
+/*****************************************************************************/
+/* backend operations; all of them run on the loop thread */
+
+typedef struct comlink_backend_s {
+    const char *name;
+
+    int (*init)(void);
+    void (*fini)(void);
+
+    int (*add)(comlink_conn_t *conn);
+
+    /* stop watching conn; 1 if the kernel may still read its buffers, the
+     * backend then frees it with comlink_core_free once it is done */
+    int (*del)(comlink_conn_t *conn);
+
+    /* start sending conn->out; may only queue the work */
+    int (*flush)(comlink_conn_t *conn);
+
+    /* wait for events and dispatch them; timeout in ms, -1 blocks */
+    int (*wait)(int timeout_ms);
+}comlink_backend_t;
+
+/*****************************************************************************/
+
+extern const comlink_backend_t comlink_epoll_backend;
+#ifdef COMLINK_HAVE_URING
+extern const comlink_backend_t comlink_uring_backend;
+#endif
+
+/*****************************************************************************/
+/* core entry points used by the backends */
+
+comlink_conn_t * comlink_core_conn(int fd);
+void comlink_core_accept(int fd);
+void comlink_core_rx(comlink_conn_t *conn, char *data, int len);
+void comlink_core_ready(comlink_conn_t *conn);
+char * comlink_core_rxbuf(int *len);
+int comlink_core_tx_next(comlink_conn_t *conn);
+comlink_file_t * comlink_core_tx_file(comlink_conn_t *conn);
+void comlink_core_tx_file_sent(comlink_conn_t *conn, int len);
+void comlink_core_drop(comlink_conn_t *conn);
+void comlink_core_free(comlink_conn_t *conn);
+
+#endif /* _COMLINK_BACKEND_H_ */
@@ -0,0 +1,463 @@
+/*
+ * comlink_capture: every frame of a process logged for replay
+ */
+
+/* comlink_capture.c -- frames are logged where comlink hands them to the
+ *                      application and where it queues them for sending,
+ *                      so compression and batching don't show. Records
+ *                      go into a ring without a lock: a producer claims
+ *                      its bytes with a CAS on head and publishes them by
+ *                      storing the record length last. A writer thread
+ *                      appends the published ones to the file; a full
+ *                      ring drops records rather than stall the sender.
+ *
+ *                      The file is the magic and the start time, then
+ *                      one record after the other: a flags byte, then
+ *                      varints of the time, connection, type and length,
+ *                      then the payload unless it was elided.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include "comlink_capture.h"
+
+/*****************************************************************************/
+
+#define CAPTURE_RING     (16 << 20)          /* power of 2 */
+#define CAPTURE_MAX_KEEP (CAPTURE_RING / 4)  /* larger payloads are elided */
+#define CAPTURE_HEAD_MAX (48)                /* flags and four varints */
+#define CAPTURE_WRITE_MS (20)                /* writer wakes at least this */
+#define CAPTURE_FILE_BUF (1 << 20)
+
+/*****************************************************************************/
+/* head is claimed by the producers, tail only moved by the writer; both
+ * run freely and are masked on use. A record starts 8 byte aligned with
+ * its length word, 0 until it is published */
+
+typedef struct capture_s {
+    int on;
+    FILE *fp;
+    char path[256];
+    long long start_ns;
+    unsigned int next_id;
+
+    unsigned long long head __attribute__((aligned(64)));
+    unsigned long long tail __attribute__((aligned(64)));
+    char *ring __attribute__((aligned(64)));
+    int wake_fd;
+    int kicked;
+    int stop;
+    pthread_t thread;
+
+    long long frames;
+    long long bytes;
+    long long dropped;
+}capture_t;
+
+static capture_t cap;
+
+/*****************************************************************************/
+
+static long long capture_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*****************************************************************************/
+
+static int capture_varint(char *p, unsigned long long v)
+{
+    int n = 0;
+
+    while (v >= 0x80) {
+        p[n++] = (char)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (char)v;
+
+    return n;
+}
+
+/*****************************************************************************/
+/* len bytes into the ring at pos, wrapping at its end */
+
+static void capture_copy(unsigned long long pos, const char *src, int len)
+{
+    int off = pos & (CAPTURE_RING - 1);
+    int n = len < CAPTURE_RING - off ? len : CAPTURE_RING - off;
+
+    memcpy(cap.ring + off, src, n);
+    memcpy(cap.ring, src + n, len - n);
+}
+
+/*****************************************************************************/
+/* claims room for the record, fills it in and publishes it */
+
+static void capture_put(int flags, unsigned int conn, unsigned int type,
+        const char *buf, int len)
+{
+    int n = 0;
+    int keep = len;
+    unsigned int word;
+    unsigned long long pos;
+    unsigned long long tail;
+    unsigned long long need;
+    char head[CAPTURE_HEAD_MAX];
+
+    if (buf == NULL || len > CAPTURE_MAX_KEEP) {
+        flags |= (flags & COMLINK_CAPTURE_KIND) >= COMLINK_CAPTURE_RX ?
+            COMLINK_CAPTURE_ELIDED : 0;
+        keep = 0;
+    }
+
+    head[n++] = (char)flags;
+    n += capture_varint(head + n, capture_now() - cap.start_ns);
+    n += capture_varint(head + n, conn);
+    n += capture_varint(head + n, type);
+    n += capture_varint(head + n, len);
+    need = (sizeof(word) + n + keep + 7) & ~7ULL;
+
+    pos = __atomic_load_n(&cap.head, __ATOMIC_RELAXED);
+    do {
+        tail = __atomic_load_n(&cap.tail, __ATOMIC_ACQUIRE);
+        if (pos + need - tail > CAPTURE_RING) {
+            __atomic_add_fetch(&cap.dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(&cap.head, &pos, pos + need, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    capture_copy(pos + sizeof(word), head, n);
+    if (keep > 0)
+        capture_copy(pos + sizeof(word) + n, buf, keep);
+    word = n + keep;
+    __atomic_store_n((unsigned int *)(cap.ring + (pos & (CAPTURE_RING - 1))),
+        word, __ATOMIC_RELEASE);
+
+    __atomic_add_fetch(&cap.frames, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&cap.bytes, word, __ATOMIC_RELAXED);
+
+    /* the writer polls anyway; half a ring is worth the syscall */
+    if (pos + need - tail > CAPTURE_RING / 2 &&
+            !__atomic_exchange_n(&cap.kicked, 1, __ATOMIC_RELAXED))
+        eventfd_write(cap.wake_fd, 1);
+}
+
+/*****************************************************************************/
+/* writes out what is published, in ring order; a record still being
+ * filled in holds back the ones after it */
+
+static void capture_drain(void)
+{
+    int off;
+    int n;
+    unsigned int word;
+    unsigned long long need;
+    unsigned long long tail = cap.tail;
+
+    for (;;) {
+        off = tail & (CAPTURE_RING - 1);
+        word = __atomic_load_n((unsigned int *)(cap.ring + off),
+            __ATOMIC_ACQUIRE);
+        if (word == 0)
+            break;
+        need = (sizeof(word) + word + 7) & ~7ULL;
+
+        off = (tail + sizeof(word)) & (CAPTURE_RING - 1);
+        n = (int)word < CAPTURE_RING - off ? (int)word : CAPTURE_RING - off;
+        fwrite(cap.ring + off, 1, n, cap.fp);
+        fwrite(cap.ring, 1, word - n, cap.fp);
+
+        /* zeroed, so the length word reads 0 when the ring comes round */
+        off = tail & (CAPTURE_RING - 1);
+        n = (int)need < CAPTURE_RING - off ? (int)need : CAPTURE_RING - off;
+        memset(cap.ring + off, 0, n);
+        memset(cap.ring, 0, need - n);
+
+        tail += need;
+        __atomic_store_n(&cap.tail, tail, __ATOMIC_RELEASE);
+    }
+}
+
+/*****************************************************************************/
+
+static void * capture_main(void *arg)
+{
+    eventfd_t val;
+    struct pollfd pfd;
+
+    pfd.fd = cap.wake_fd;
+    pfd.events = POLLIN;
+    while (!__atomic_load_n(&cap.stop, __ATOMIC_ACQUIRE)) {
+        if (poll(&pfd, 1, CAPTURE_WRITE_MS) == 1)
+            eventfd_read(cap.wake_fd, &val);
+        __atomic_store_n(&cap.kicked, 0, __ATOMIC_RELAXED);
+        capture_drain();
+    }
+    capture_drain();
+
+    return NULL;
+}
+
+/*****************************************************************************/
+/* at exit, whichever way comlink went down */
+
+static void capture_finish(void)
+{
+    if (!cap.on)
+        return;
+
+    cap.on = 0;
+    __atomic_store_n(&cap.stop, 1, __ATOMIC_RELEASE);
+    eventfd_write(cap.wake_fd, 1);
+    pthread_join(cap.thread, NULL);
+
+    if (fclose(cap.fp) != 0)
+        fprintf(stderr, "comlink: capture %s, %s(%d) \n", cap.path,
+            strerror(errno), errno);
+    else
+        fprintf(stdout, "comlink: captured %lld records to %s, %.1f MB,"
+            " %lld dropped \n", cap.frames, cap.path, cap.bytes / 1e6,
+            cap.dropped);
+
+    /* the ring stays, a thread of the exiting process may still be
+     * past the check of on */
+}
+
+/*****************************************************************************/
+
+static void capture_path(const char *pattern)
+{
+    int n = 0;
+    const char *p;
+
+    for(p = pattern; *p != '\0' && n < (int)sizeof(cap.path) - 1; p++) {
+        if (p[0] == '%' && p[1] == 'p') {
+            n += snprintf(cap.path + n, sizeof(cap.path) - n, "%d",
+                (int)getpid());
+            if (n >= (int)sizeof(cap.path))
+                n = sizeof(cap.path) - 1;
+            p++;
+            continue;
+        }
+        cap.path[n++] = *p;
+    }
+    cap.path[n] = '\0';
+}
+
+/*****************************************************************************/
+
+void comlink_capture_init(void)
+{
+    int n;
+    int ret;
+    char head[16];
+    struct timespec ts;
+    char *env = getenv("COMLINK_CAPTURE");
+
+    if (cap.on || env == NULL || env[0] == '\0')
+        return;
+
+    capture_path(env);
+    cap.ring = calloc(1, CAPTURE_RING);
+    cap.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    cap.fp = fopen(cap.path, "w");
+    if (cap.ring == NULL || cap.wake_fd == -1 || cap.fp == NULL) {
+        fprintf(stderr, "comlink: capture %s, %s(%d) \n", cap.path,
+            strerror(errno), errno);
+        goto fail;
+    }
+    setvbuf(cap.fp, NULL, _IOFBF, CAPTURE_FILE_BUF);
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    n = capture_varint(head, ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+    fwrite(COMLINK_CAPTURE_MAGIC, 1, sizeof(COMLINK_CAPTURE_MAGIC), cap.fp);
+    fwrite(head, 1, n, cap.fp);
+    cap.start_ns = capture_now();
+
+    ret = pthread_create(&cap.thread, NULL, capture_main, NULL);
+    if (ret != 0) {
+        fprintf(stderr, "comlink: capture thread, %s(%d) \n",
+            strerror(ret), ret);
+        goto fail;
+    }
+
+    cap.on = 1;
+    atexit(capture_finish);
+    fprintf(stdout, "comlink: capturing frames to %s \n", cap.path);
+    return;
+
+fail:
+    if (cap.fp != NULL)
+        fclose(cap.fp);
+    if (cap.wake_fd != -1)
+        close(cap.wake_fd);
+    free(cap.ring);
+    cap.fp = NULL;
+    cap.ring = NULL;
+}
+
+/*****************************************************************************/
+/* ids aren't fds, which the kernel hands out again */
+
+void comlink_capture_open(comlink_conn_t *conn, int outbound)
+{
+    int flags = COMLINK_CAPTURE_OPEN;
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+
+    if (!cap.on)
+        return;
+
+    conn->cap_id = __atomic_add_fetch(&cap.next_id, 1, __ATOMIC_RELAXED);
+    if (outbound)
+        flags |= COMLINK_CAPTURE_OUTBOUND;
+    if (getsockname(conn->fd, (struct sockaddr *)&addr, &len) == 0 &&
+            addr.ss_family == AF_UNIX)
+        flags |= COMLINK_CAPTURE_LOCAL;
+
+    capture_put(flags, conn->cap_id, 0, NULL, 0);
+}
+
+/*****************************************************************************/
+
+void comlink_capture_close(comlink_conn_t *conn)
+{
+    if (cap.on && conn->cap_id != 0)
+        capture_put(COMLINK_CAPTURE_CLOSE, conn->cap_id, 0, NULL, 0);
+}
+
+/*****************************************************************************/
+/* buf NULL keeps the length only, for payloads sent from a file. comlink's
+ * own frames are left out, the replaying side has a comlink of its own */
+
+void comlink_capture_frame(comlink_conn_t *conn, int kind, int chan,
+        unsigned int type, const char *buf, int len)
+{
+    if (!cap.on || conn->cap_id == 0 || type >= COMLINK_TYPE_RESERVED)
+        return;
+
+    capture_put(kind | (chan == COMLINK_CHAN_BULK ? COMLINK_CAPTURE_BULK : 0),
+        conn->cap_id, type, buf, len);
+}
+
+/*****************************************************************************/
+/* reading a capture back */
+
+static int capture_read_varint(FILE *fp, unsigned long long *v)
+{
+    int c;
+    int shift = 0;
+
+    *v = 0;
+    do {
+        if ((c = getc(fp)) == EOF || shift > 63)
+            return -1;
+        *v |= (unsigned long long)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+int comlink_capture_load(comlink_capture_reader_t *r, const char *path)
+{
+    unsigned long long v;
+    char magic[sizeof(COMLINK_CAPTURE_MAGIC)];
+
+    memset(r, 0, sizeof(*r));
+    r->fp = fopen(path, "r");
+    if (r->fp == NULL) {
+        fprintf(stderr, "comlink: capture %s, %s(%d) \n", path,
+            strerror(errno), errno);
+        return -1;
+    }
+
+    if (fread(magic, 1, sizeof(magic), r->fp) != sizeof(magic) ||
+            memcmp(magic, COMLINK_CAPTURE_MAGIC, sizeof(magic)) != 0 ||
+            capture_read_varint(r->fp, &v) == -1) {
+        fprintf(stderr, "comlink: %s is not a capture \n", path);
+        fclose(r->fp);
+        r->fp = NULL;
+        return -1;
+    }
+    r->start_ns = v;
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+int comlink_capture_next(comlink_capture_reader_t *r,
+        comlink_capture_rec_t *rec)
+{
+    int c;
+    int kind;
+    char *p;
+    unsigned long long v[4];
+
+    if ((c = getc(r->fp)) == EOF)
+        return 0;
+
+    if (capture_read_varint(r->fp, &v[0]) == -1 ||
+            capture_read_varint(r->fp, &v[1]) == -1 ||
+            capture_read_varint(r->fp, &v[2]) == -1 ||
+            capture_read_varint(r->fp, &v[3]) == -1 ||
+            v[3] > COMLINK_MAX_FRAME)
+        return -1;
+
+    rec->flags = c;
+    rec->time_ns = v[0];
+    rec->conn = v[1];
+    rec->type = v[2];
+    rec->len = v[3];
+    rec->payload = NULL;
+
+    kind = c & COMLINK_CAPTURE_KIND;
+    if (kind < COMLINK_CAPTURE_RX || (c & COMLINK_CAPTURE_ELIDED))
+        return 1;
+
+    /* one spare byte, receivers expect the payload terminated */
+    if ((int)rec->len + 1 > r->buf.size) {
+        p = realloc(r->buf.data, rec->len + 1);
+        if (p == NULL)
+            return -1;
+        r->buf.data = p;
+        r->buf.size = rec->len + 1;
+    }
+    if (fread(r->buf.data, 1, rec->len, r->fp) != rec->len)
+        return -1;
+    r->buf.data[rec->len] = '\0';
+    rec->payload = r->buf.data;
+
+    return 1;
+}
+
+/*****************************************************************************/
+
+void comlink_capture_unload(comlink_capture_reader_t *r)
+{
+    if (r->fp != NULL)
+        fclose(r->fp);
+    free(r->buf.data);
+    memset(r, 0, sizeof(*r));
+}
+
+/*****************************************************************************/
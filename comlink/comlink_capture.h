@@ -0,0 +1,65 @@
+/*
+ * comlink_capture: every frame of a process logged for replay
+ */
+#ifndef _COMLINK_CAPTURE_H_
+#define _COMLINK_CAPTURE_H_
+
+#include <stdio.h>
+#include "comlink.h"
+
+/*****************************************************************************/
+
+#define COMLINK_CAPTURE_MAGIC "JLCAP1\n" /* with its \0, 8 bytes */
+
+/* what a record is, in the low bits of its flags byte */
+enum {
+    COMLINK_CAPTURE_OPEN = 0,
+    COMLINK_CAPTURE_CLOSE,
+    COMLINK_CAPTURE_RX,       /* handed to receive_cb */
+    COMLINK_CAPTURE_TX,       /* queued by comlink_send and friends */
+    COMLINK_CAPTURE_KIND = 0x03
+};
+
+enum {
+    COMLINK_CAPTURE_BULK     = 0x04, /* frame of the bulk channel */
+    COMLINK_CAPTURE_ELIDED   = 0x08, /* payload not kept, len still is */
+    COMLINK_CAPTURE_LOCAL    = 0x10, /* OPEN of a unix socket peer */
+    COMLINK_CAPTURE_OUTBOUND = 0x20  /* OPEN of a connection we made */
+};
+
+/*****************************************************************************/
+/* one record read back; payload stays valid until the next read */
+
+typedef struct comlink_capture_rec_s {
+    long long time_ns;  /* monotonic, from the start of the capture */
+    unsigned int conn;  /* capture id of the connection, never reused */
+    int flags;          /* kind | COMLINK_CAPTURE_* */
+    unsigned int type;
+    unsigned int len;
+    char *payload;      /* NULL if elided */
+}comlink_capture_rec_t;
+
+typedef struct comlink_capture_reader_s {
+    FILE *fp;
+    long long start_ns; /* CLOCK_REALTIME when the capture started */
+    comlink_buf_t buf;
+}comlink_capture_reader_t;
+
+/*****************************************************************************/
+
+/* COMLINK_CAPTURE=<path>, %p in it becomes the pid; off if unset */
+void comlink_capture_init(void);
+
+/* any thread; a no-op while capture is off */
+void comlink_capture_open(comlink_conn_t *conn, int outbound);
+void comlink_capture_close(comlink_conn_t *conn);
+void comlink_capture_frame(comlink_conn_t *conn, int kind, int chan,
+        unsigned int type, const char *buf, int len);
+
+int comlink_capture_load(comlink_capture_reader_t *r, const char *path);
+/* 1 with the next record, 0 at the end, -1 on a damaged log */
+int comlink_capture_next(comlink_capture_reader_t *r,
+        comlink_capture_rec_t *rec);
+void comlink_capture_unload(comlink_capture_reader_t *r);
+
+#endif /* _COMLINK_CAPTURE_H_ */
@@ -0,0 +1,257 @@
+/*
+ * comlink_epoll: readiness based event loop backend
+ */
+
+/* comlink_epoll.c  -- default backend, one recv/send syscall per event */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+
+#include "comlink_backend.h"
+
+/*****************************************************************************/
+
+#define EPOLL_MAX_EVENTS   (256)
+#define EPOLL_RXBUF_SIZE   (64 * 1024)
+#define EPOLL_SENDFILE_MAX (1 << 30)
+#define EPOLL_READ_BUDGET  (16) /* reads per wakeup, then sends get a turn */
+
+/*****************************************************************************/
+
+static int epoll_fd = -1;
+static char epoll_rxbuf[EPOLL_RXBUF_SIZE + 1];
+
+/*****************************************************************************/
+
+static int comlink_epoll_init(void)
+{
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        fprintf(stderr, "comlink: epoll_create, %s(%d) \n",
+            strerror(errno), errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+static void comlink_epoll_fini(void)
+{
+    if (epoll_fd != -1)
+        close(epoll_fd);
+    epoll_fd = -1;
+}
+
+/*****************************************************************************/
+
+static int comlink_epoll_ctl(int op, comlink_conn_t *conn, unsigned int events)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = conn->fd;
+
+    if (epoll_ctl(epoll_fd, op, conn->fd, &ev) == -1) {
+        fprintf(stderr, "comlink: epoll_ctl(%d) fd %d, %s(%d) \n",
+            op, conn->fd, strerror(errno), errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+static int comlink_epoll_add(comlink_conn_t *conn)
+{
+    return comlink_epoll_ctl(EPOLL_CTL_ADD, conn, EPOLLIN);
+}
+
+/*****************************************************************************/
+
+static int comlink_epoll_del(comlink_conn_t *conn)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+
+    return 0;
+}
+
+/*****************************************************************************/
+/* writes as much as the socket takes; waits for EPOLLOUT otherwise. File
+ * payloads go from the page cache to the socket with sendfile */
+
+static int comlink_epoll_flush(comlink_conn_t *conn)
+{
+    int ret;
+    comlink_file_t *file;
+    comlink_buf_t *out = &conn->out;
+
+    for (;;) {
+        file = comlink_core_tx_file(conn);
+        if (file != NULL)
+            ret = sendfile(conn->fd, file->fd, &file->off,
+                    file->left < EPOLL_SENDFILE_MAX ? file->left :
+                    EPOLL_SENDFILE_MAX);
+        else if (comlink_core_tx_next(conn) > 0)
+            ret = send(conn->fd, out->data + out->off, out->len - out->off,
+                    MSG_NOSIGNAL);
+        else
+            break;
+
+        if (ret == -1 && errno == EINTR)
+            continue;
+
+        if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (conn->busy)
+                return 0;
+            conn->busy = 1;
+            return comlink_epoll_ctl(EPOLL_CTL_MOD, conn,
+                    EPOLLIN | EPOLLOUT);
+        }
+
+        if (ret == -1) {
+            fprintf(stderr, "comlink: send failed %s(%d) \n",
+                strerror(errno), errno);
+            comlink_core_drop(conn);
+            return -1;
+        }
+
+        /* the file shrank under us; the stream can't be completed */
+        if (ret == 0 && file != NULL) {
+            fprintf(stderr, "comlink: file payload on fd %d cut short \n",
+                conn->fd);
+            comlink_core_drop(conn);
+            return -1;
+        }
+
+        if (file != NULL)
+            comlink_core_tx_file_sent(conn, ret);
+        else
+            out->off += ret;
+    }
+
+    if (!conn->busy)
+        return 0;
+    conn->busy = 0;
+
+    return comlink_epoll_ctl(EPOLL_CTL_MOD, conn, EPOLLIN);
+}
+
+/*****************************************************************************/
+
+static void comlink_epoll_accept(int fd)
+{
+    int new_fd;
+
+    while ((new_fd = accept4(fd, NULL, NULL, SOCK_CLOEXEC)) != -1)
+        comlink_core_accept(new_fd);
+
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+        fprintf(stderr, "server: accept error, %s(%d) \n",
+            strerror(errno), errno);
+}
+
+/*****************************************************************************/
+/* reads until the socket is drained or the budget is used up; level
+ * triggered, so a busy socket is picked up again after the flush pass */
+
+static void comlink_epoll_read(comlink_conn_t *conn)
+{
+    int ret;
+    int len;
+    int budget = EPOLL_READ_BUDGET;
+    char *buf;
+
+    buf = comlink_core_rxbuf(&len);
+    if (buf == NULL || len < 2) {
+        buf = epoll_rxbuf;
+        len = sizeof(epoll_rxbuf);
+    }
+
+    for (;;) {
+        ret = recv(conn->fd, buf, len - 1, 0);
+        if (ret == -1 && errno == EINTR)
+            continue;
+
+        if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+
+        if (ret == -1)
+            fprintf(stderr, "comlink: recv error, %s(%d) \n",
+                strerror(errno), errno);
+
+        comlink_core_rx(conn, buf, ret);
+        if (ret <= 0 || conn->closing || --budget == 0)
+            return;
+    }
+}
+
+/*****************************************************************************/
+
+static int comlink_epoll_wait(int timeout_ms)
+{
+    int i;
+    int n;
+    comlink_conn_t *conn;
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+
+    n = epoll_wait(epoll_fd, events, EPOLL_MAX_EVENTS, timeout_ms);
+    if (n == -1) {
+        if (errno == EINTR)
+            return 0;
+        fprintf(stderr, "comlink: epoll_wait, %s(%d) \n",
+            strerror(errno), errno);
+        return -1;
+    }
+
+    for(i = 0; i < n; i++) {
+        conn = comlink_core_conn(events[i].data.fd);
+        if (conn == NULL || conn->closing)
+            continue;
+
+        switch(conn->kind) {
+            case COMLINK_FD_LISTEN:
+                comlink_epoll_accept(conn->fd);
+                break;
+
+            case COMLINK_FD_WAKE:
+            case COMLINK_FD_USER:
+                comlink_core_ready(conn);
+                break;
+
+            default:
+                if (events[i].events & EPOLLOUT)
+                    comlink_epoll_flush(conn);
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                    comlink_epoll_read(conn);
+        }
+    }
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+const comlink_backend_t comlink_epoll_backend = {
+    .name  = "epoll",
+    .init  = comlink_epoll_init,
+    .fini  = comlink_epoll_fini,
+    .add   = comlink_epoll_add,
+    .del   = comlink_epoll_del,
+    .flush = comlink_epoll_flush,
+    .wait  = comlink_epoll_wait,
+};
+
+/*****************************************************************************/
@@ -0,0 +1,595 @@
+/*
+ * comlink_uring: completion based event loop backend using io_uring
+ */
+
+/* comlink_uring.c  -- multishot accept/recv on a provided buffer ring and
+ *                     batched sends; a single io_uring_enter per loop pass
+ *                     submits the queued sends and reaps the completions.
+ *                     Talks to the kernel directly, no liburing needed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "comlink_backend.h"
+
+/*****************************************************************************/
+
+#define URING_ENTRIES    (512)
+#define URING_BUF_COUNT  (256)   /* power of 2 */
+#define URING_BUF_SIZE   (16 * 1024)
+#define URING_BUF_STRIDE (URING_BUF_SIZE + 64) /* room for the terminator */
+#define URING_BGID       (1)
+
+/* user_data layout: gen(32) | fd(24) | op(8) */
+#define URING_UDATA(conn, op) (((__u64)(conn)->gen << 32) | \
+        ((__u64)(conn)->fd << 8) | (op))
+#define URING_UDATA_OP(ud)    ((int)((ud) & 0xff))
+#define URING_UDATA_FD(ud)    ((int)(((ud) >> 8) & 0xffffff))
+#define URING_UDATA_GEN(ud)   ((int)((ud) >> 32))
+
+enum {
+    URING_OP_ACCEPT = 1,
+    URING_OP_RECV,
+    URING_OP_POLL,
+    URING_OP_SEND,
+    URING_OP_CANCEL
+};
+
+/*****************************************************************************/
+
+typedef struct uring_s {
+    int fd;
+    unsigned int features;
+
+    /* submission queue */
+    void *sq_ptr;
+    size_t sq_sz;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int sq_entries;
+    unsigned int sq_local; /* next free sqe, published on enter */
+    struct io_uring_sqe *sqes;
+    size_t sqes_sz;
+
+    /* completion queue */
+    void *cq_ptr;
+    size_t cq_sz;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /* provided buffer ring for multishot receives */
+    struct io_uring_buf_ring *br;
+    size_t br_sz;
+    unsigned short br_tail;
+    char *bufs;
+
+    /* closed conns a send or the cancel of them is still out for */
+    comlink_conn_t *released;
+}uring_t;
+
+/*****************************************************************************/
+
+static uring_t uring = { .fd = -1 };
+
+/*****************************************************************************/
+
+static int uring_enter(unsigned int submit, unsigned int wait,
+        unsigned int flags, struct io_uring_getevents_arg *arg)
+{
+    int ret;
+
+    ret = syscall(__NR_io_uring_enter, uring.fd, submit, wait, flags,
+            arg, arg ? sizeof(*arg) : 0);
+
+    return ret;
+}
+
+/*****************************************************************************/
+/* publishes the prepared sqes; returns how many the kernel has not seen */
+
+static unsigned int uring_publish(void)
+{
+    __atomic_store_n(uring.sq_tail, uring.sq_local, __ATOMIC_RELEASE);
+
+    return uring.sq_local - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE);
+}
+
+/*****************************************************************************/
+
+static struct io_uring_sqe * uring_get_sqe(void)
+{
+    unsigned int head;
+    struct io_uring_sqe *sqe;
+
+    for (;;) {
+        head = __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE);
+        if (uring.sq_local - head < uring.sq_entries)
+            break;
+
+        /* ring is full, push what we have */
+        if (uring_enter(uring_publish(), 0, 0, NULL) == -1 &&
+                errno != EINTR && errno != EBUSY) {
+            fprintf(stderr, "comlink: io_uring_enter, %s(%d) \n",
+                strerror(errno), errno);
+            return NULL;
+        }
+    }
+
+    sqe = &uring.sqes[uring.sq_local & *uring.sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    uring.sq_local += 1;
+
+    return sqe;
+}
+
+/*****************************************************************************/
+/* hand a receive buffer back to the kernel */
+
+static void uring_recycle(unsigned short bid)
+{
+    struct io_uring_buf *buf;
+
+    buf = &uring.br->bufs[uring.br_tail & (URING_BUF_COUNT - 1)];
+    buf->addr = (unsigned long)(uring.bufs + (size_t)bid * URING_BUF_STRIDE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    uring.br_tail += 1;
+
+    __atomic_store_n(&uring.br->tail, uring.br_tail, __ATOMIC_RELEASE);
+}
+
+/*****************************************************************************/
+
+static int uring_setup_bufs(void)
+{
+    int i;
+    struct io_uring_buf_reg reg;
+
+    uring.br_sz = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    uring.br = mmap(NULL, uring.br_sz, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (uring.br == MAP_FAILED) {
+        uring.br = NULL;
+        return -1;
+    }
+
+    uring.bufs = malloc((size_t)URING_BUF_COUNT * URING_BUF_STRIDE);
+    if (uring.bufs == NULL)
+        return -1;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)uring.br;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BGID;
+    if (syscall(__NR_io_uring_register, uring.fd,
+            IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+        return -1;
+
+    for(i = 0; i < URING_BUF_COUNT; i++)
+        uring_recycle(i);
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+static void comlink_uring_fini(void)
+{
+    if (uring.sq_ptr != NULL && uring.sq_ptr != MAP_FAILED)
+        munmap(uring.sq_ptr, uring.sq_sz);
+    if (uring.sqes != NULL && uring.sqes != MAP_FAILED)
+        munmap(uring.sqes, uring.sqes_sz);
+    if (uring.br != NULL)
+        munmap(uring.br, uring.br_sz);
+    free(uring.bufs);
+    if (uring.fd != -1)
+        close(uring.fd);
+
+    memset(&uring, 0, sizeof(uring));
+    uring.fd = -1;
+}
+
+/*****************************************************************************/
+
+static int comlink_uring_init(void)
+{
+    unsigned int i;
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    uring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (uring.fd == -1)
+        return -1;
+
+    uring.features = p.features;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+            !(p.features & IORING_FEAT_NODROP)) {
+        comlink_uring_fini();
+        return -1;
+    }
+
+    uring.sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    uring.cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (uring.cq_sz > uring.sq_sz)
+        uring.sq_sz = uring.cq_sz;
+    uring.cq_sz = uring.sq_sz;
+
+    uring.sq_ptr = mmap(NULL, uring.sq_sz, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+    if (uring.sq_ptr == MAP_FAILED) {
+        comlink_uring_fini();
+        return -1;
+    }
+    uring.cq_ptr = uring.sq_ptr;
+
+    uring.sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    uring.sqes = mmap(NULL, uring.sqes_sz, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+    if (uring.sqes == MAP_FAILED) {
+        comlink_uring_fini();
+        return -1;
+    }
+
+    uring.sq_head = (unsigned int *)((char *)uring.sq_ptr + p.sq_off.head);
+    uring.sq_tail = (unsigned int *)((char *)uring.sq_ptr + p.sq_off.tail);
+    uring.sq_mask = (unsigned int *)((char *)uring.sq_ptr + p.sq_off.ring_mask);
+    uring.sq_array = (unsigned int *)((char *)uring.sq_ptr + p.sq_off.array);
+    uring.sq_entries = p.sq_entries;
+    uring.sq_local = *uring.sq_tail;
+    for(i = 0; i < p.sq_entries; i++)
+        uring.sq_array[i] = i;
+
+    uring.cq_head = (unsigned int *)((char *)uring.cq_ptr + p.cq_off.head);
+    uring.cq_tail = (unsigned int *)((char *)uring.cq_ptr + p.cq_off.tail);
+    uring.cq_mask = (unsigned int *)((char *)uring.cq_ptr + p.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *)((char *)uring.cq_ptr + p.cq_off.cqes);
+
+    /* multishot receives need a kernel with provided buffer rings */
+    if (uring_setup_bufs() == -1) {
+        comlink_uring_fini();
+        return -1;
+    }
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+static int uring_arm_recv(comlink_conn_t *conn)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe();
+
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = URING_UDATA(conn, URING_OP_RECV);
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+static int uring_arm_accept(comlink_conn_t *conn)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe();
+
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = URING_UDATA(conn, URING_OP_ACCEPT);
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+static int uring_arm_poll(comlink_conn_t *conn)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe();
+
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = conn->fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = URING_UDATA(conn, URING_OP_POLL);
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+static int comlink_uring_add(comlink_conn_t *conn)
+{
+    switch(conn->kind) {
+        case COMLINK_FD_LISTEN:
+            return uring_arm_accept(conn);
+
+        case COMLINK_FD_CONN:
+            return uring_arm_recv(conn);
+
+        default:
+            return uring_arm_poll(conn);
+    }
+}
+
+/*****************************************************************************/
+/* cancel everything on the fd; submitted now since the fd closes next.
+ * A send in flight still reads conn->out, so the conn is kept until its
+ * completion and that of the cancel are in */
+
+static int comlink_uring_del(comlink_conn_t *conn)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe();
+
+    if (sqe != NULL) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = conn->fd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        sqe->user_data = URING_UDATA(conn, URING_OP_CANCEL);
+        conn->cancelling = 1;
+
+        uring_enter(uring_publish(), 0, 0, NULL);
+    }
+
+    if (!conn->busy && !conn->cancelling)
+        return 0;
+
+    conn->next = uring.released;
+    uring.released = conn;
+
+    return 1;
+}
+
+/*****************************************************************************/
+/* one send in flight per connection keeps the byte stream ordered */
+
+static int comlink_uring_flush(comlink_conn_t *conn)
+{
+    int len;
+    struct io_uring_sqe *sqe;
+    comlink_buf_t *out = &conn->out;
+
+    if (conn->busy)
+        return 0;
+
+    len = comlink_core_tx_next(conn);
+    if (len <= 0)
+        return 0;
+
+    sqe = uring_get_sqe();
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (unsigned long)(out->data + out->off);
+    sqe->len = len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = URING_UDATA(conn, URING_OP_SEND);
+    conn->busy = 1;
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+static void uring_handle_recv(comlink_conn_t *conn, struct io_uring_cqe *cqe)
+{
+    char *data = NULL;
+    unsigned short bid = 0;
+    int has_buf = cqe->flags & IORING_CQE_F_BUFFER;
+
+    if (has_buf) {
+        bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        data = uring.bufs + (size_t)bid * URING_BUF_STRIDE;
+    }
+
+    if (conn != NULL && !conn->closing) {
+        if (cqe->res > 0)
+            comlink_core_rx(conn, data, cqe->res);
+        else if (cqe->res != -ENOBUFS)
+            comlink_core_rx(conn, NULL, cqe->res == 0 ? 0 : -1);
+    }
+
+    if (has_buf)
+        uring_recycle(bid);
+
+    /* multishot ended early; re-arm while the peer is alive */
+    if (conn != NULL && !conn->closing &&
+            !(cqe->flags & IORING_CQE_F_MORE))
+        uring_arm_recv(conn);
+}
+
+/*****************************************************************************/
+
+static void uring_handle_send(comlink_conn_t *conn, struct io_uring_cqe *cqe)
+{
+    conn->busy = 0;
+    if (conn->closing)
+        return;
+
+    if (cqe->res < 0) {
+        fprintf(stderr, "comlink: send failed %s(%d) \n",
+            strerror(-cqe->res), -cqe->res);
+        comlink_core_drop(conn);
+        return;
+    }
+
+    conn->out.off += cqe->res;
+    comlink_uring_flush(conn);
+}
+
+/*****************************************************************************/
+/* a send or cancel of a released conn is in; free it after the last one */
+
+static void uring_handle_released(struct io_uring_cqe *cqe)
+{
+    comlink_conn_t *conn;
+    comlink_conn_t **prev;
+    int fd = URING_UDATA_FD(cqe->user_data);
+    int gen = URING_UDATA_GEN(cqe->user_data);
+
+    for(prev = &uring.released; (conn = *prev) != NULL; prev = &conn->next)
+        if (conn->fd == fd && conn->gen == gen)
+            break;
+
+    if (conn == NULL)
+        return;
+
+    if (URING_UDATA_OP(cqe->user_data) == URING_OP_SEND)
+        conn->busy = 0;
+    else
+        conn->cancelling = 0;
+
+    if (conn->busy || conn->cancelling)
+        return;
+
+    *prev = conn->next;
+    comlink_core_free(conn);
+}
+
+/*****************************************************************************/
+
+static void uring_handle_cqe(struct io_uring_cqe *cqe)
+{
+    int op = URING_UDATA_OP(cqe->user_data);
+    comlink_conn_t *conn = comlink_core_conn(URING_UDATA_FD(cqe->user_data));
+
+    /* completions of a closed connection whose fd got reused */
+    if (conn != NULL && conn->gen != URING_UDATA_GEN(cqe->user_data))
+        conn = NULL;
+
+    if (conn == NULL && (op == URING_OP_SEND || op == URING_OP_CANCEL)) {
+        uring_handle_released(cqe);
+        return;
+    }
+
+    switch(op) {
+        case URING_OP_RECV:
+            uring_handle_recv(conn, cqe);
+            break;
+
+        case URING_OP_SEND:
+            uring_handle_send(conn, cqe);
+            break;
+
+        case URING_OP_ACCEPT:
+            if (cqe->res >= 0) {
+                if (conn != NULL && !conn->closing)
+                    comlink_core_accept(cqe->res);
+                else
+                    close(cqe->res);
+            }
+            if (conn != NULL && !conn->closing &&
+                    !(cqe->flags & IORING_CQE_F_MORE))
+                uring_arm_accept(conn);
+            break;
+
+        case URING_OP_POLL:
+            if (conn != NULL && !conn->closing) {
+                comlink_core_ready(conn);
+                if (!(cqe->flags & IORING_CQE_F_MORE))
+                    uring_arm_poll(conn);
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+/*****************************************************************************/
+/* submits queued work and reaps completions in one syscall */
+
+static int comlink_uring_wait(int timeout_ms)
+{
+    int ret;
+    unsigned int head;
+    unsigned int tail;
+    unsigned int submit;
+    unsigned int wait = 0;
+    unsigned int flags = 0;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    struct io_uring_getevents_arg *argp = NULL;
+
+    head = *uring.cq_head;
+    tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+    submit = uring_publish();
+
+    if (head == tail && timeout_ms != 0) {
+        wait = 1;
+        flags |= IORING_ENTER_GETEVENTS;
+        if (timeout_ms > 0 && (uring.features & IORING_FEAT_EXT_ARG)) {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+            memset(&arg, 0, sizeof(arg));
+            arg.ts = (unsigned long)&ts;
+            argp = &arg;
+            flags |= IORING_ENTER_EXT_ARG;
+        }
+    }
+
+    if (submit > 0 || wait) {
+        ret = uring_enter(submit, wait, flags, argp);
+        if (ret == -1 && errno != EINTR && errno != ETIME &&
+                errno != EBUSY && errno != EAGAIN) {
+            fprintf(stderr, "comlink: io_uring_enter, %s(%d) \n",
+                strerror(errno), errno);
+            return -1;
+        }
+    }
+
+    head = *uring.cq_head;
+    tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        uring_handle_cqe(&uring.cqes[head & *uring.cq_mask]);
+        head += 1;
+        __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+        tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+    }
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+const comlink_backend_t comlink_uring_backend = {
+    .name  = "io_uring",
+    .init  = comlink_uring_init,
+    .fini  = comlink_uring_fini,
+    .add   = comlink_uring_add,
+    .del   = comlink_uring_del,
+    .flush = comlink_uring_flush,
+    .wait  = comlink_uring_wait,
+};
+
+/*****************************************************************************/
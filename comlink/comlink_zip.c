@@ -0,0 +1,447 @@
+/*
+ * comlink_zip: compression codecs of the comlink bulk channel
+ */
+
+/* comlink_zip.c -- zstd and lz4 when built with COMLINK_ZSTD=1 or
+ *                  COMLINK_LZ4=1, and a small LZ77 of our own that is
+ *                  always there. Each bulk batch is compressed frame by
+ *                  frame; the policy here turns compression off while
+ *                  the link takes raw bytes faster than we can pack
+ *                  them, and trades level against speed otherwise.
+ *                  COMLINK_COMPRESS=off|on|auto (default) overrides it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <endian.h>
+#ifdef COMLINK_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef COMLINK_HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#include "comlink_zip.h"
+
+/*****************************************************************************/
+
+#define LZ_HASH_BITS  (14)
+#define LZ_MIN_MATCH  (4)
+#define LZ_MAX_OFFSET (65535)
+
+#define ZIP_PROBE_EVERY (32)  /* batches sent as they are between probes */
+#define ZIP_GAIN        (1.1) /* compressing has to be this much faster */
+#define ZIP_WEIGHT      (0.25) /* of a new sample in the averages */
+
+enum {
+    ZIP_AUTO = 0,
+    ZIP_OFF,
+    ZIP_ON
+};
+
+/*****************************************************************************/
+
+static int zip_mode;
+
+static const char *zip_names[COMLINK_NR_CODECS] = {
+    "none", "lz", "lz4", "zstd"
+};
+
+/* highest level of each codec */
+static const int zip_levels[COMLINK_NR_CODECS] = { 0, 3, 3, 6 };
+
+/*****************************************************************************/
+
+void comlink_zip_init(void)
+{
+    char *env = getenv("COMLINK_COMPRESS");
+
+    zip_mode = ZIP_AUTO;
+    if (env != NULL && strcmp(env, "off") == 0)
+        zip_mode = ZIP_OFF;
+    else if (env != NULL && strcmp(env, "on") == 0)
+        zip_mode = ZIP_ON;
+}
+
+/*****************************************************************************/
+
+int comlink_zip_codecs(void)
+{
+    int mask = 1 << COMLINK_CODEC_LZ;
+
+#ifdef COMLINK_HAVE_LZ4
+    mask |= 1 << COMLINK_CODEC_LZ4;
+#endif
+#ifdef COMLINK_HAVE_ZSTD
+    mask |= 1 << COMLINK_CODEC_ZSTD;
+#endif
+
+    return mask;
+}
+
+/*****************************************************************************/
+
+int comlink_zip_pick(int mask)
+{
+    int codec;
+
+    mask &= comlink_zip_codecs();
+    for(codec = COMLINK_NR_CODECS - 1; codec > COMLINK_CODEC_NONE; codec--) {
+        if (mask & (1 << codec))
+            return codec;
+    }
+
+    return COMLINK_CODEC_NONE;
+}
+
+/*****************************************************************************/
+
+const char * comlink_codec_name(int codec)
+{
+    if (codec < 0 || codec >= COMLINK_NR_CODECS)
+        return "unknown";
+
+    return zip_names[codec];
+}
+
+/*****************************************************************************/
+/* lz: sequences of a token (literal run << 4 | match length - 4, 15 means
+ * more length bytes follow), the literals, then a 2 byte offset and the
+ * extra match length bytes. The last sequence is literals only */
+
+static int lz_put_len(unsigned char **op, unsigned char *end, int len)
+{
+    for(; len >= 255; len -= 255) {
+        if (*op == end)
+            return -1;
+        *(*op)++ = 255;
+    }
+    if (*op == end)
+        return -1;
+    *(*op)++ = len;
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+static int lz_get_len(const unsigned char **ip, const unsigned char *end,
+        int *len)
+{
+    unsigned char c;
+
+    do {
+        if (*ip == end || *len > COMLINK_MAX_FRAME)
+            return -1;
+        c = *(*ip)++;
+        *len += c;
+    } while (c == 255);
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+static int lz_emit(unsigned char **op, unsigned char *end,
+        const unsigned char *lit, int nr_lit, int offset, int match)
+{
+    unsigned char *token = *op;
+    int m = match - LZ_MIN_MATCH;
+
+    if (*op == end)
+        return -1;
+    (*op)++;
+
+    *token = (nr_lit < 15 ? nr_lit : 15) << 4;
+    if (nr_lit >= 15 && lz_put_len(op, end, nr_lit - 15) == -1)
+        return -1;
+    if (end - *op < nr_lit)
+        return -1;
+    memcpy(*op, lit, nr_lit);
+    *op += nr_lit;
+
+    if (match == 0)
+        return 0;
+
+    if (end - *op < 2)
+        return -1;
+    *(*op)++ = offset & 0xff;
+    *(*op)++ = offset >> 8;
+    *token |= m < 15 ? m : 15;
+    if (m >= 15 && lz_put_len(op, end, m - 15) == -1)
+        return -1;
+
+    return 0;
+}
+
+/*****************************************************************************/
+/* length of the common prefix, 8 bytes at a time */
+
+static int lz_match(const unsigned char *a, const unsigned char *b, int max)
+{
+    int n = 0;
+    uint64_t x;
+    uint64_t y;
+
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+    for(; n + 8 <= max; n += 8) {
+        memcpy(&x, a + n, sizeof(x));
+        memcpy(&y, b + n, sizeof(y));
+        if (x != y)
+            return n + (__builtin_ctzll(x ^ y) >> 3);
+    }
+#endif
+    while (n < max && a[n] == b[n])
+        n += 1;
+
+    return n;
+}
+
+/*****************************************************************************/
+/* greedy, one hash probe per position; a lower level skips ahead faster
+ * through data that doesn't match */
+
+static int lz_compress(int level, const char *src, int len, char *dst,
+        int cap)
+{
+    int ip = 0;
+    int ref;
+    int anchor = 0;
+    int match;
+    int misses = 0;
+    uint32_t seq;
+    uint32_t h;
+    int table[1 << LZ_HASH_BITS];
+    const unsigned char *in = (const unsigned char *)src;
+    unsigned char *op = (unsigned char *)dst;
+    unsigned char *end = op + cap;
+
+    memset(table, 0xff, sizeof(table));
+
+    while (ip + LZ_MIN_MATCH <= len) {
+        memcpy(&seq, in + ip, sizeof(seq));
+        h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        ref = table[h];
+        table[h] = ip;
+
+        if (ref < 0 || ip - ref > LZ_MAX_OFFSET ||
+                memcmp(in + ref, in + ip, LZ_MIN_MATCH) != 0) {
+            misses += 1;
+            ip += 1 + (misses >> (level + 3));
+            continue;
+        }
+
+        match = LZ_MIN_MATCH + lz_match(in + ref + LZ_MIN_MATCH,
+                in + ip + LZ_MIN_MATCH, len - ip - LZ_MIN_MATCH);
+
+        if (lz_emit(&op, end, in + anchor, ip - anchor, ip - ref,
+                match) == -1)
+            return -1;
+        ip += match;
+        anchor = ip;
+        misses = 0;
+    }
+
+    if (lz_emit(&op, end, in + anchor, len - anchor, 0, 0) == -1)
+        return -1;
+
+    return op - (unsigned char *)dst;
+}
+
+/*****************************************************************************/
+/* every length and offset is checked; the payload comes off the wire */
+
+static int lz_decompress(const char *src, int len, char *dst, int cap)
+{
+    int n;
+    int nr_lit;
+    int match;
+    int offset;
+    const unsigned char *ip = (const unsigned char *)src;
+    const unsigned char *end = ip + len;
+    unsigned char *op = (unsigned char *)dst;
+    unsigned char *out = op;
+    unsigned char *ref;
+
+    while (ip < end) {
+        nr_lit = *ip >> 4;
+        match = *ip++ & 0xf;
+        if (nr_lit == 15 && lz_get_len(&ip, end, &nr_lit) == -1)
+            return -1;
+        if (nr_lit > end - ip || nr_lit > cap - (op - out))
+            return -1;
+        memcpy(op, ip, nr_lit);
+        ip += nr_lit;
+        op += nr_lit;
+
+        if (ip == end)
+            break;
+
+        if (end - ip < 2)
+            return -1;
+        offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (match == 15 && lz_get_len(&ip, end, &match) == -1)
+            return -1;
+        match += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op - out ||
+                match > cap - (op - out))
+            return -1;
+
+        /* the match may overlap what it writes; the bytes from ref on
+         * repeat every offset, so the copy can grow as it goes */
+        ref = op - offset;
+        while (match > 0) {
+            n = match < op - ref ? match : op - ref;
+            memcpy(op, ref, n);
+            op += n;
+            match -= n;
+        }
+    }
+
+    return op - out;
+}
+
+/*****************************************************************************/
+
+int comlink_zip(int codec, int level, const char *src, int len,
+        char *dst, int cap)
+{
+    int n = -1;
+#ifdef COMLINK_HAVE_ZSTD
+    size_t z;
+#endif
+
+    switch(codec) {
+        case COMLINK_CODEC_LZ:
+            n = lz_compress(level, src, len, dst, cap);
+            break;
+
+#ifdef COMLINK_HAVE_LZ4
+        case COMLINK_CODEC_LZ4:
+            /* acceleration 1 is the best ratio */
+            n = LZ4_compress_fast(src, dst, len, cap, 1 << (3 - level));
+            n = n > 0 ? n : -1;
+            break;
+#endif
+
+#ifdef COMLINK_HAVE_ZSTD
+        case COMLINK_CODEC_ZSTD:
+            z = ZSTD_compress(dst, cap, src, len, level);
+            n = ZSTD_isError(z) ? -1 : (int)z;
+            break;
+#endif
+    }
+
+    return n;
+}
+
+/*****************************************************************************/
+
+int comlink_unzip(int codec, const char *src, int len, char *dst, int cap)
+{
+    int n = -1;
+#ifdef COMLINK_HAVE_ZSTD
+    size_t z;
+#endif
+
+    switch(codec) {
+        case COMLINK_CODEC_LZ:
+            n = lz_decompress(src, len, dst, cap);
+            break;
+
+#ifdef COMLINK_HAVE_LZ4
+        case COMLINK_CODEC_LZ4:
+            n = LZ4_decompress_safe(src, dst, len, cap);
+            n = n >= 0 ? n : -1;
+            break;
+#endif
+
+#ifdef COMLINK_HAVE_ZSTD
+        case COMLINK_CODEC_ZSTD:
+            z = ZSTD_decompress(dst, cap, src, len);
+            n = ZSTD_isError(z) ? -1 : (int)z;
+            break;
+#endif
+    }
+
+    return n;
+}
+
+/*****************************************************************************/
+/* compressed bulk moves at the slower of packing and the link, counted in
+ * raw bytes; worth it when that beats the link with raw bytes */
+
+int comlink_zip_want(comlink_zip_t *z)
+{
+    double rate;
+
+    if (z->codec == COMLINK_CODEC_NONE || zip_mode == ZIP_OFF)
+        return 0;
+    if (zip_mode == ZIP_ON || z->ratio == 0 || z->link_rate == 0)
+        return 1;
+
+    /* now and then one batch is compressed to see if things changed */
+    if (z->skip > 0) {
+        z->skip -= 1;
+        return z->skip == 0;
+    }
+
+    rate = z->link_rate / z->ratio;
+    if (z->zip_rate < rate)
+        rate = z->zip_rate;
+    if (rate > z->link_rate * ZIP_GAIN)
+        return 1;
+
+    z->skip = ZIP_PROBE_EVERY;
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+static double zip_average(double avg, double sample)
+{
+    return avg == 0 ? sample : avg + (sample - avg) * ZIP_WEIGHT;
+}
+
+/*****************************************************************************/
+/* a level up while packing easily outruns the link, down when it barely
+ * keeps up */
+
+void comlink_zip_done(comlink_zip_t *z, int raw, int packed, long long ns)
+{
+    double need;
+
+    if (raw == 0)
+        return;
+
+    z->ratio = zip_average(z->ratio, (double)packed / raw);
+    z->zip_rate = zip_average(z->zip_rate, raw * 1e3 / (ns > 0 ? ns : 1));
+
+    if (z->link_rate == 0)
+        return;
+
+    need = z->link_rate / z->ratio;
+    if (z->zip_rate > need * 4 && z->level < zip_levels[z->codec])
+        z->level += 1;
+    else if (z->zip_rate < need * 1.5 && z->level > 1)
+        z->level -= 1;
+}
+
+/*****************************************************************************/
+
+void comlink_zip_sent(comlink_zip_t *z, long long drained, long long now,
+        int len, int more)
+{
+    if (z->sent_ns != 0 && drained > z->sent_ns)
+        z->link_rate = zip_average(z->link_rate,
+            z->sent_len * 1e3 / (drained - z->sent_ns));
+
+    z->sent_ns = more ? now : 0;
+    z->sent_len = len;
+}
+
+/*****************************************************************************/
@@ -0,0 +1,37 @@
+/*
+ * comlink_zip: compression codecs of the comlink bulk channel
+ */
+#ifndef _COMLINK_ZIP_H_
+#define _COMLINK_ZIP_H_
+
+#include "comlink.h"
+
+/*****************************************************************************/
+
+#define COMLINK_ZIP_MIN (512) /* smaller frames always go as they are */
+
+/*****************************************************************************/
+
+void comlink_zip_init(void);
+
+/* mask of the codecs built in, 1 << COMLINK_CODEC_* */
+int comlink_zip_codecs(void);
+/* the best codec of mask that is built in here, NONE if none */
+int comlink_zip_pick(int mask);
+
+/* compressed length or -1 if it doesn't fit in cap */
+int comlink_zip(int codec, int level, const char *src, int len,
+        char *dst, int cap);
+/* decompressed length or -1 on a malformed payload */
+int comlink_unzip(int codec, const char *src, int len, char *dst, int cap);
+
+/* adaptive policy, run on the loop thread: whether the next bulk batch
+ * goes compressed and how long compressing one took. A batch of len
+ * bytes went to the backend at now, the one before was done at drained;
+ * with more queued behind it, the next one times the link */
+int comlink_zip_want(comlink_zip_t *z);
+void comlink_zip_done(comlink_zip_t *z, int raw, int packed, long long ns);
+void comlink_zip_sent(comlink_zip_t *z, long long drained, long long now,
+        int len, int more);
+
+#endif /* _COMLINK_ZIP_H_ */
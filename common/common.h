@@ -4,14 +4,358 @@
 #define _COMMON_H_
 
 /*****************************************************************************/
+/* structured payloads go out as wire records (wire.h); each struct below
+ * has its field list next to it. Tags are never reused, new fields get
+ * new tags and new message types go at the end of the enum */
 
+#define WIRE_VERSION (1)
+
+/* what a listener can do, exchanged in HELLO before the job goes out */
 enum {
-    PROC_INSTANCES = 100,
+    WIRE_CAP_GANG      = 0x01,
+    WIRE_CAP_SPECULATE = 0x02, /* SPAWN_RANK, KILL_RANK */
+    WIRE_CAP_STAGE     = 0x04,
+    WIRE_CAP_BCAST     = 0x08,
+    WIRE_CAP_CLOCK     = 0x10, /* comlink answers clock probes */
+    WIRE_CAP_JOBS      = 0x20, /* runs one job after another, -graph */
+    WIRE_CAP_STDIN     = 0x40, /* fans the launcher's stdin out, -stdin */
+    WIRE_CAP_INVENTORY = 0x80, /* NODE_INVENTORY after HELLO */
+    WIRE_CAP_LIMITS    = 0x100, /* enforces JOB_LIMITS */
+    WIRE_CAP_SAMPLE    = 0x200  /* NODE_SAMPLE at the JOB_SAMPLE interval */
+};
+
+#define WIRE_CAPS (WIRE_CAP_GANG | WIRE_CAP_SPECULATE | WIRE_CAP_STAGE | \
+        WIRE_CAP_BCAST | WIRE_CAP_CLOCK | WIRE_CAP_JOBS | WIRE_CAP_STDIN | \
+        WIRE_CAP_INVENTORY | WIRE_CAP_LIMITS | WIRE_CAP_SAMPLE)
+
+/*****************************************************************************/
+
+enum {
+    PROC_INSTANCES = 100, /* int_msg_t */
     EXEC_FILENAME,
     CTRL_MESSAGE,
-    STATUS_MESSAGE
+    STATUS_MESSAGE,
+
+    /* launcher <-> listener wire-up */
+    JOB_LAYOUT,      /* job_layout_t */
+    KVS_FENCE,       /* node's puts since the last fence, key\0value\0... */
+    KVS_ALLGATHER,   /* everyone's puts, same encoding */
+
+    /* listener <-> local instance (unix socket) */
+    PMI_PUT,         /* key\0value\0 */
+    PMI_GET,         /* key\0 */
+    PMI_GET_REPLY,   /* value\0, empty if not found */
+    PMI_FENCE,
+    PMI_FENCE_DONE,
+
+    /* gang start */
+    GANG_READY,      /* int_msg_t, instances staged on the node */
+    GANG_TIMES,      /* gang_times_t */
+
+    /* per rank progress and speculative re-execution */
+    RANK_START,      /* rank_event_t[], listener -> launcher */
+    RANK_EXIT,       /* rank_event_t[], status and runtime filled in */
+    SPAWN_RANK,      /* rank_event_t, launcher -> listener, extra copy */
+    KILL_RANK,       /* rank_event_t, the copy that lost the race */
+
+    /* listener admission control */
+    NODE_QUEUE,      /* node_queue_t, on every change of the queue depth */
+
+    /* job teardown */
+    STOP_DONE,       /* stop_report_t, the node's instances are all gone */
+
+    /* content addressed executable staging, replaces EXEC_FILENAME */
+    STAGE_OFFER,     /* stage_offer_t, launcher -> listener */
+    STAGE_FETCH,     /* stage_offer_t, listener misses it in its cache */
+    STAGE_DATA,      /* raw executable bytes, in order, in chunks */
+
+    /* input file broadcast, relayed down a chain or tree of listeners */
+    BCAST_PLAN,      /* bcast_plan_t, bcast_node_t each, launcher or parent */
+    BCAST_DATA,      /* raw file bytes, in order, in chunks */
+    BCAST_DONE,      /* bcast_report_t, listener -> launcher */
+    BCAST_LOST,      /* int_msg_t, tree index of a child out of reach */
+
+    /* version and capabilities, both ways once connected */
+    HELLO,           /* hello_t */
+
+    /* launcher's stdin, streamed to the listeners on the bulk channel */
+    STDIN_OPEN,      /* the next job reads it, ahead of its start */
+    STDIN_DATA,      /* raw bytes, in order, in chunks */
+    STDIN_EOF,
+    STDIN_ACK,       /* stdin_ack_t, listener -> launcher */
+
+    /* what a node has, for placement; gathered once HELLO is answered */
+    NODE_INVENTORY,  /* node_inventory_t, listener -> launcher */
+
+    /* time limits of the next job, ahead of its start */
+    JOB_LIMITS,      /* job_limits_t, launcher -> listener */
+
+    /* live resource use of the running instances, summed per node */
+    JOB_SAMPLE,      /* int_msg_t, sampling interval in ms, 0 stops */
+    NODE_SAMPLE,     /* node_sample_t, listener -> launcher */
+
+    /* wire-up payloads go on the bulk channel, cut between keys into
+     * frames of at most COMLINK_BULK_FRAME; the last one of a fence is
+     * KVS_FENCE or KVS_ALLGATHER */
+    KVS_FENCE_PART,
+    KVS_ALLGATHER_PART,
+    KVS_FAILED       /* launcher -> listener, the fence can't complete */
+};
+
+/*****************************************************************************/
+
+typedef struct hello_s {
+    unsigned int version; /* WIRE_VERSION of the sender */
+    unsigned int caps;    /* WIRE_CAP_* */
+}hello_t;
+
+#define HELLO_FIELDS(T, X) \
+    X(T, 1, WIRE_UINT, version) \
+    X(T, 2, WIRE_UINT, caps)
+
+/* single counts and indices */
+
+typedef struct int_msg_s {
+    int value;
+}int_msg_t;
+
+#define INT_MSG_FIELDS(T, X) \
+    X(T, 1, WIRE_SINT, value)
+
+/* rank range handed to a listener */
+
+typedef struct job_layout_s {
+    int rank_base; /* global rank of the first local instance */
+    int job_size;  /* total instances across all hosts */
+}job_layout_t;
+
+#define JOB_LAYOUT_FIELDS(T, X) \
+    X(T, 1, WIRE_SINT, rank_base) \
+    X(T, 2, WIRE_SINT, job_size)
+
+/* wake-up times of a node's instances after the gang release */
+
+typedef struct gang_times_s {
+    long long first_ns; /* CLOCK_REALTIME of the node */
+    long long last_ns;
+    int count;
+}gang_times_t;
+
+#define GANG_TIMES_FIELDS(T, X) \
+    X(T, 1, WIRE_SINT, first_ns) \
+    X(T, 2, WIRE_SINT, last_ns) \
+    X(T, 3, WIRE_SINT, count)
+
+/* one copy of a rank; copy 0 is the original, 1 a speculative re-run */
+
+enum {
+    TIMEOUT_NONE = 0,
+    TIMEOUT_INSTANCE, /* ran past the instance timeout */
+    TIMEOUT_WALLTIME  /* running or queued when the job's walltime was up */
 };
 
+typedef struct rank_event_s {
+    int rank;
+    int copy;
+    int status;        /* wait status, RANK_EXIT only */
+    long long time_ns; /* RANK_START: time queued, RANK_EXIT: runtime */
+    int timeout;       /* TIMEOUT_*, RANK_EXIT only */
+}rank_event_t;
+
+#define RANK_EVENT_FIELDS(T, X) \
+    X(T, 1, WIRE_SINT, rank) \
+    X(T, 2, WIRE_SINT, copy) \
+    X(T, 3, WIRE_SINT, status) \
+    X(T, 4, WIRE_SINT, time_ns) \
+    X(T, 5, WIRE_SINT, timeout)
+
+/* slot budget of a node and the ranks waiting for it */
+
+typedef struct node_queue_s {
+    int slots;
+    int running;
+    int queued;
+    int peak_queued;
+    long long max_wait_ns;
+}node_queue_t;
+
+#define NODE_QUEUE_FIELDS(T, X) \
+    X(T, 1, WIRE_SINT, slots) \
+    X(T, 2, WIRE_SINT, running) \
+    X(T, 3, WIRE_SINT, queued) \
+    X(T, 4, WIRE_SINT, peak_queued) \
+    X(T, 5, WIRE_SINT, max_wait_ns)
+
+/* teardown of a node; every instance leads its own process group */
+
+typedef struct stop_report_s {
+    int groups;        /* process groups sent SIGTERM */
+    int killed;        /* groups still around after the grace period */
+    long long time_ns; /* stop received to last instance reaped */
+}stop_report_t;
+
+#define STOP_REPORT_FIELDS(T, X) \
+    X(T, 1, WIRE_SINT, groups) \
+    X(T, 2, WIRE_SINT, killed) \
+    X(T, 3, WIRE_SINT, time_ns)
+
+/* executable offered for staging; path is used as is if staging fails */
+
+typedef struct stage_offer_s {
+    unsigned char hash[32]; /* SHA-256 of the contents */
+    long long size;
+    unsigned int mode;
+    char path[256];
+}stage_offer_t;
+
+#define STAGE_OFFER_FIELDS(T, X) \
+    X(T, 1, WIRE_BYTES, hash) \
+    X(T, 2, WIRE_SINT, size) \
+    X(T, 3, WIRE_UINT, mode) \
+    X(T, 4, WIRE_STRING, path)
+
+/* file broadcast; the plan record is followed by a node record for every
+ * receiver in tree order. The children of index i are fanout * (i + 1)
+ * + 0 .. fanout - 1 and the launcher feeds 0 .. fanout - 1 */
+
+#define BCAST_MAX_FANOUT (8)
+
+typedef struct bcast_plan_s {
+    unsigned int id;   /* same plan relayed by the parent is ignored */
+    int index;         /* receiver's position in nodes[] */
+    int nr_nodes;
+    int fanout;        /* 1 is a chain */
+    long long size;
+    unsigned int mode;
+    char path[256];    /* written under the same path on every node */
+}bcast_plan_t;
+
+#define BCAST_PLAN_FIELDS(T, X) \
+    X(T, 1, WIRE_UINT, id) \
+    X(T, 2, WIRE_SINT, index) \
+    X(T, 3, WIRE_SINT, nr_nodes) \
+    X(T, 4, WIRE_SINT, fanout) \
+    X(T, 5, WIRE_SINT, size) \
+    X(T, 6, WIRE_UINT, mode) \
+    X(T, 7, WIRE_STRING, path)
+
+typedef struct bcast_node_s {
+    unsigned int ip;
+    int port;
+}bcast_node_t;
+
+#define BCAST_NODE_FIELDS(T, X) \
+    X(T, 1, WIRE_UINT, ip) \
+    X(T, 2, WIRE_SINT, port)
+
+typedef struct bcast_report_s {
+    int index;
+    int failed;        /* the file could not be written on this node */
+    long long time_ns; /* plan received to the last byte on disk */
+}bcast_report_t;
+
+#define BCAST_REPORT_FIELDS(T, X) \
+    X(T, 1, WIRE_SINT, index) \
+    X(T, 2, WIRE_SINT, failed) \
+    X(T, 3, WIRE_SINT, time_ns)
+
+/* how much of the stream every local instance has been handed; the
+ * launcher keeps at most window bytes past it in flight */
+
+typedef struct stdin_ack_s {
+    long long drained;
+    int window;
+}stdin_ack_t;
+
+#define STDIN_ACK_FIELDS(T, X) \
+    X(T, 1, WIRE_SINT, drained) \
+    X(T, 2, WIRE_SINT, window)
+
+/* a node's cpus, memory and load when the session started */
+
+typedef struct node_inventory_s {
+    int cpus;          /* online */
+    int sockets;
+    int cores;         /* physical ones; cpus / cores threads each */
+    int numa_nodes;
+    long long mem_total_kb;
+    long long mem_avail_kb;
+    int load1;         /* load averages, in hundredths */
+    int load5;
+    int load15;
+    int slots;         /* admission budget of the listener */
+    int running;       /* instances running on it already */
+    int queued;
+    long long time;    /* CLOCK_REALTIME seconds when gathered */
+}node_inventory_t;
+
+#define NODE_INVENTORY_FIELDS(T, X) \
+    X(T, 1, WIRE_SINT, cpus) \
+    X(T, 2, WIRE_SINT, sockets) \
+    X(T, 3, WIRE_SINT, cores) \
+    X(T, 4, WIRE_SINT, numa_nodes) \
+    X(T, 5, WIRE_SINT, mem_total_kb) \
+    X(T, 6, WIRE_SINT, mem_avail_kb) \
+    X(T, 7, WIRE_SINT, load1) \
+    X(T, 8, WIRE_SINT, load5) \
+    X(T, 9, WIRE_SINT, load15) \
+    X(T, 10, WIRE_SINT, slots) \
+    X(T, 11, WIRE_SINT, running) \
+    X(T, 12, WIRE_SINT, queued) \
+    X(T, 13, WIRE_SINT, time)
+
+/* limits the listener enforces on the next job; 0 is none. The walltime
+ * is what is left of the whole job's when the job goes out */
+
+typedef struct job_limits_s {
+    long long walltime_ms;
+    long long instance_timeout_ms; /* from each instance's start */
+}job_limits_t;
+
+#define JOB_LIMITS_FIELDS(T, X) \
+    X(T, 1, WIRE_SINT, walltime_ms) \
+    X(T, 2, WIRE_SINT, instance_timeout_ms)
+
+/* what a node's instances used over the last interval; the counters are
+ * deltas since the previous sample, the sizes are as of this one. An
+ * instance is its leader process and the children it has waited for */
+
+typedef struct node_sample_s {
+    unsigned int seq;
+    long long interval_ns;  /* since the previous sample */
+    int instances;          /* sampled, running */
+    long long cpu_ns;       /* user and system time of all of them */
+    long long rss_kb;
+    long long max_rss_kb;   /* of the largest instance */
+    int max_rss_rank;
+    long long top_cpu_ns;   /* of the busiest instance */
+    int top_cpu_rank;
+    long long read_bytes;   /* read and written by any call, files, */
+    long long write_bytes;  /* pipes and sockets alike */
+    long long cost_ns;      /* cpu time of the sampling itself */
+}node_sample_t;
+
+#define NODE_SAMPLE_FIELDS(T, X) \
+    X(T, 1, WIRE_UINT, seq) \
+    X(T, 2, WIRE_SINT, interval_ns) \
+    X(T, 3, WIRE_SINT, instances) \
+    X(T, 4, WIRE_SINT, cpu_ns) \
+    X(T, 5, WIRE_SINT, rss_kb) \
+    X(T, 6, WIRE_SINT, max_rss_kb) \
+    X(T, 7, WIRE_SINT, max_rss_rank) \
+    X(T, 8, WIRE_SINT, top_cpu_ns) \
+    X(T, 9, WIRE_SINT, top_cpu_rank) \
+    X(T, 10, WIRE_SINT, read_bytes) \
+    X(T, 11, WIRE_SINT, write_bytes) \
+    X(T, 12, WIRE_SINT, cost_ns)
+
+/* environment seen by every launched instance */
+#define PMI_ENV_RANK       "JL_RANK"
+#define PMI_ENV_SIZE       "JL_SIZE"
+#define PMI_ENV_LOCAL_RANK "JL_LOCAL_RANK"
+#define PMI_ENV_LOCAL_SIZE "JL_LOCAL_SIZE"
+#define PMI_ENV_SOCKET     "JL_PMI_SOCKET"
+
 /*****************************************************************************/
 
 #endif /* _COMMON_H_ */
@@ -0,0 +1,147 @@
+/*
+ * sha256: FIPS 180-4 message digest
+ */
+
+/* sha256.c -- plain C, no dependencies; fast enough that hashing an
+ *             executable costs far less than sending it.
+ */
+
+#include <string.h>
+
+#include "sha256.h"
+
+/*****************************************************************************/
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static const uint32_t k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/*****************************************************************************/
+
+static void sha256_block(uint32_t *state, const unsigned char *p)
+{
+    int i;
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, h;
+    uint32_t s0, s1, t1, t2;
+
+    for(i = 0; i < 16; i++)
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 |
+            (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+
+    for(i = 16; i < 64; i++) {
+        s0 = ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        s1 = ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    a = state[0]; b = state[1]; c = state[2]; d = state[3];
+    e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+    for(i = 0; i < 64; i++) {
+        s1 = ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25);
+        t1 = h + s1 + ((e & f) ^ (~e & g)) + k[i] + w[i];
+        s0 = ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22);
+        t2 = s0 + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+/*****************************************************************************/
+
+void sha256_init(sha256_ctx_t *ctx)
+{
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memcpy(ctx->state, iv, sizeof(iv));
+    ctx->bytes = 0;
+}
+
+/*****************************************************************************/
+
+void sha256_update(sha256_ctx_t *ctx, const void *data, size_t len)
+{
+    size_t n;
+    size_t fill = ctx->bytes & 63;
+    const unsigned char *p = data;
+
+    ctx->bytes += len;
+
+    if (fill > 0) {
+        n = 64 - fill < len ? 64 - fill : len;
+        memcpy(ctx->block + fill, p, n);
+        p += n;
+        len -= n;
+        if (fill + n < 64)
+            return;
+        sha256_block(ctx->state, ctx->block);
+    }
+
+    for(; len >= 64; p += 64, len -= 64)
+        sha256_block(ctx->state, p);
+
+    memcpy(ctx->block, p, len);
+}
+
+/*****************************************************************************/
+
+void sha256_final(sha256_ctx_t *ctx, unsigned char digest[SHA256_LEN])
+{
+    int i;
+    size_t fill = ctx->bytes & 63;
+    uint64_t bits = ctx->bytes * 8;
+
+    ctx->block[fill++] = 0x80;
+    if (fill > 56) {
+        memset(ctx->block + fill, 0, 64 - fill);
+        sha256_block(ctx->state, ctx->block);
+        fill = 0;
+    }
+    memset(ctx->block + fill, 0, 56 - fill);
+    for(i = 0; i < 8; i++)
+        ctx->block[56 + i] = bits >> (56 - 8 * i);
+    sha256_block(ctx->state, ctx->block);
+
+    for(i = 0; i < 8; i++) {
+        digest[4 * i] = ctx->state[i] >> 24;
+        digest[4 * i + 1] = ctx->state[i] >> 16;
+        digest[4 * i + 2] = ctx->state[i] >> 8;
+        digest[4 * i + 3] = ctx->state[i];
+    }
+}
+
+/*****************************************************************************/
+
+void sha256_hex(const unsigned char digest[SHA256_LEN],
+        char hex[SHA256_HEX_LEN])
+{
+    int i;
+    static const char digits[] = "0123456789abcdef";
+
+    for(i = 0; i < SHA256_LEN; i++) {
+        hex[2 * i] = digits[digest[i] >> 4];
+        hex[2 * i + 1] = digits[digest[i] & 15];
+    }
+    hex[2 * i] = '\0';
+}
+
+/*****************************************************************************/
@@ -0,0 +1,32 @@
+/* SHA-256, used to name staged executables by their content */
+
+#ifndef _SHA256_H_
+#define _SHA256_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*****************************************************************************/
+
+#define SHA256_LEN     (32)
+#define SHA256_HEX_LEN (SHA256_LEN * 2 + 1)
+
+typedef struct sha256_ctx_s {
+    uint32_t state[8];
+    uint64_t bytes;
+    unsigned char block[64];
+}sha256_ctx_t;
+
+/*****************************************************************************/
+
+void sha256_init(sha256_ctx_t *ctx);
+void sha256_update(sha256_ctx_t *ctx, const void *data, size_t len);
+void sha256_final(sha256_ctx_t *ctx, unsigned char digest[SHA256_LEN]);
+
+/* lower case hex, terminated */
+void sha256_hex(const unsigned char digest[SHA256_LEN],
+        char hex[SHA256_HEX_LEN]);
+
+/*****************************************************************************/
+
+#endif /* _SHA256_H_ */
@@ -0,0 +1,99 @@
+/*
+ * spsc: single-producer/single-consumer ring used to hand events from a
+ *       worker thread to the comlink loop without a lock
+ */
+
+/* spsc.c -- fixed size slots, indices run freely and are masked on use.
+ *           The idle flag lets the producer skip the wake-up syscall while
+ *           the consumer is still draining; both sides order the flag
+ *           against the indices with a full fence, so a push can never
+ *           land unseen behind a parked consumer.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "spsc.h"
+
+/*****************************************************************************/
+
+int spsc_init(spsc_ring_t *r, unsigned int count, size_t elem)
+{
+    unsigned int n = 1;
+
+    while (n < count)
+        n <<= 1;
+
+    memset(r, 0, sizeof(*r));
+    r->buf = calloc(n, elem);
+    if (r->buf == NULL)
+        return -1;
+
+    r->mask = n - 1;
+    r->elem = elem;
+    r->idle = 1;
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+void spsc_fini(spsc_ring_t *r)
+{
+    free(r->buf);
+    r->buf = NULL;
+}
+
+/*****************************************************************************/
+
+int spsc_push(spsc_ring_t *r, const void *item)
+{
+    unsigned int tail = r->tail;
+
+    if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) > r->mask)
+        return -1;
+
+    memcpy(r->buf + (size_t)(tail & r->mask) * r->elem, item, r->elem);
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->idle, __ATOMIC_RELAXED) &&
+            __atomic_exchange_n(&r->idle, 0, __ATOMIC_ACQ_REL))
+        return 1;
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+int spsc_pop(spsc_ring_t *r, void *item)
+{
+    unsigned int head = r->head;
+
+    if (head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+        return -1;
+
+    memcpy(item, r->buf + (size_t)(head & r->mask) * r->elem, r->elem);
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+int spsc_idle(spsc_ring_t *r)
+{
+    __atomic_store_n(&r->idle, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (r->head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+        return 1;
+
+    /* the producer may or may not have seen the flag; either way we are
+     * awake again */
+    __atomic_store_n(&r->idle, 0, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+/*****************************************************************************/
@@ -0,0 +1,38 @@
+/* single-producer/single-consumer lock-free ring */
+
+#ifndef _SPSC_H_
+#define _SPSC_H_
+
+#include <stddef.h>
+
+/*****************************************************************************/
+/* head is only written by the consumer and tail by the producer; each
+ * sits on its own cache line */
+
+typedef struct spsc_ring_s {
+    unsigned int head __attribute__((aligned(64)));
+    int idle;  /* consumer is parked, the next push must wake it */
+    unsigned int tail __attribute__((aligned(64)));
+    unsigned int mask __attribute__((aligned(64)));
+    size_t elem;
+    char *buf;
+}spsc_ring_t;
+
+/*****************************************************************************/
+
+/* count is rounded up to a power of 2 */
+int spsc_init(spsc_ring_t *r, unsigned int count, size_t elem);
+void spsc_fini(spsc_ring_t *r);
+
+/* -1 if full, 1 if the consumer went idle and has to be woken, else 0 */
+int spsc_push(spsc_ring_t *r, const void *item);
+
+/* -1 if empty */
+int spsc_pop(spsc_ring_t *r, void *item);
+
+/* consumer is about to park; 0 if items raced in and it should drain on */
+int spsc_idle(spsc_ring_t *r);
+
+/*****************************************************************************/
+
+#endif /* _SPSC_H_ */
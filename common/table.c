@@ -0,0 +1,64 @@
+/*
+ * table: growable structure-of-arrays storage for the per rank and per
+ *        host state of the launcher and the listener
+ */
+
+/* table.c -- columns grow together by doubling, so a row index stays valid
+ *            across growth and a pass over one field touches only that
+ *            field's memory.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "table.h"
+
+/*****************************************************************************/
+
+#define TABLE_INIT (64)
+
+/*****************************************************************************/
+
+int table_reserve(table_col_t *cols, int nr_cols, int *capacity, int need)
+{
+    int i;
+    int n;
+    void *p;
+
+    if (need <= *capacity)
+        return 0;
+
+    n = *capacity ? *capacity : TABLE_INIT;
+    while (n < need)
+        n *= 2;
+
+    /* a failed column leaves the others larger, which is harmless */
+    for(i = 0; i < nr_cols; i++) {
+        p = realloc(*cols[i].base, (size_t)n * cols[i].elem);
+        if (p == NULL)
+            return -1;
+        memset((char *)p + (size_t)*capacity * cols[i].elem, 0,
+            (size_t)(n - *capacity) * cols[i].elem);
+        *cols[i].base = p;
+    }
+
+    *capacity = n;
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+void table_free(table_col_t *cols, int nr_cols, int *capacity)
+{
+    int i;
+
+    for(i = 0; i < nr_cols; i++) {
+        free(*cols[i].base);
+        *cols[i].base = NULL;
+    }
+
+    *capacity = 0;
+}
+
+/*****************************************************************************/
@@ -0,0 +1,26 @@
+/* growable structure-of-arrays tables */
+
+#ifndef _TABLE_H_
+#define _TABLE_H_
+
+#include <stddef.h>
+
+/*****************************************************************************/
+/* one column of a table; each field of a row lives in its own array */
+
+typedef struct table_col_s {
+    void **base;
+    size_t elem;
+}table_col_t;
+
+#define TABLE_COL(ptr) { (void **)&(ptr), sizeof(*(ptr)) }
+
+/*****************************************************************************/
+
+/* grows every column to hold at least need rows, new rows zeroed */
+int table_reserve(table_col_t *cols, int nr_cols, int *capacity, int need);
+void table_free(table_col_t *cols, int nr_cols, int *capacity);
+
+/*****************************************************************************/
+
+#endif /* _TABLE_H_ */
@@ -0,0 +1,290 @@
+/*
+ * wire: tagged varint encoding of the structured comlink payloads
+ */
+
+/* wire.c -- table driven; every message struct has a field list next to
+ *           it in common.h and a schema built from it here. Records are
+ *           decoded straight from the receive buffer into the caller's
+ *           struct, with no allocation.
+ */
+
+#include <string.h>
+
+#include "wire.h"
+#include "common.h"
+
+/*****************************************************************************/
+
+WIRE_SCHEMA(wire_hello, hello_t, HELLO_FIELDS);
+WIRE_SCHEMA(wire_int, int_msg_t, INT_MSG_FIELDS);
+WIRE_SCHEMA(wire_job_layout, job_layout_t, JOB_LAYOUT_FIELDS);
+WIRE_SCHEMA(wire_gang_times, gang_times_t, GANG_TIMES_FIELDS);
+WIRE_SCHEMA(wire_rank_event, rank_event_t, RANK_EVENT_FIELDS);
+WIRE_SCHEMA(wire_node_queue, node_queue_t, NODE_QUEUE_FIELDS);
+WIRE_SCHEMA(wire_stop_report, stop_report_t, STOP_REPORT_FIELDS);
+WIRE_SCHEMA(wire_stage_offer, stage_offer_t, STAGE_OFFER_FIELDS);
+WIRE_SCHEMA(wire_bcast_plan, bcast_plan_t, BCAST_PLAN_FIELDS);
+WIRE_SCHEMA(wire_bcast_node, bcast_node_t, BCAST_NODE_FIELDS);
+WIRE_SCHEMA(wire_bcast_report, bcast_report_t, BCAST_REPORT_FIELDS);
+WIRE_SCHEMA(wire_stdin_ack, stdin_ack_t, STDIN_ACK_FIELDS);
+WIRE_SCHEMA(wire_node_inventory, node_inventory_t, NODE_INVENTORY_FIELDS);
+WIRE_SCHEMA(wire_job_limits, job_limits_t, JOB_LIMITS_FIELDS);
+WIRE_SCHEMA(wire_node_sample, node_sample_t, NODE_SAMPLE_FIELDS);
+
+/*****************************************************************************/
+/* out is NULL when only counting */
+
+static int wire_put_varint(char *out, unsigned long long v)
+{
+    int n = 0;
+
+    while (v >= 0x80) {
+        if (out != NULL)
+            out[n] = (char)(v | 0x80);
+        v >>= 7;
+        n += 1;
+    }
+    if (out != NULL)
+        out[n] = (char)v;
+
+    return n + 1;
+}
+
+/*****************************************************************************/
+
+static int wire_get_varint(char **cur, char *end, unsigned long long *v)
+{
+    int shift;
+    unsigned char c;
+    unsigned char *p = (unsigned char *)*cur;
+
+    *v = 0;
+    for(shift = 0; shift < 64; shift += 7) {
+        if (p == (unsigned char *)end)
+            return -1;
+        c = *p++;
+        *v |= (unsigned long long)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            *cur = (char *)p;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/*****************************************************************************/
+/* integer fields are int, unsigned int or long long */
+
+static unsigned long long wire_load(const wire_field_t *f, const char *p)
+{
+    int i;
+    unsigned int u;
+    long long ll;
+
+    if (f->size == sizeof(long long)) {
+        memcpy(&ll, p, sizeof(ll));
+        return f->kind == WIRE_SINT ?
+            ((unsigned long long)ll << 1) ^ (unsigned long long)(ll >> 63) :
+            (unsigned long long)ll;
+    }
+
+    if (f->kind == WIRE_UINT) {
+        memcpy(&u, p, sizeof(u));
+        return u;
+    }
+
+    memcpy(&i, p, sizeof(i));
+    ll = i;
+
+    return ((unsigned long long)ll << 1) ^ (unsigned long long)(ll >> 63);
+}
+
+/*****************************************************************************/
+
+static void wire_store(const wire_field_t *f, char *p, unsigned long long v)
+{
+    int i;
+    unsigned int u;
+    long long ll;
+
+    if (f->kind == WIRE_SINT)
+        ll = (long long)(v >> 1) ^ -(long long)(v & 1);
+    else
+        ll = (long long)v;
+
+    if (f->size == sizeof(long long)) {
+        memcpy(p, &ll, sizeof(ll));
+    } else if (f->kind == WIRE_UINT) {
+        u = (unsigned int)ll;
+        memcpy(p, &u, sizeof(u));
+    } else {
+        i = (int)ll;
+        memcpy(p, &i, sizeof(i));
+    }
+}
+
+/*****************************************************************************/
+/* bytes of the fields, written to out unless it is NULL */
+
+static int wire_fields(const wire_schema_t *s, const char *msg, char *out)
+{
+    int i;
+    int n = 0;
+    int len;
+    unsigned long long v;
+    const char *p;
+    const wire_field_t *f;
+
+    for(i = 0; i < s->nr_fields; i++) {
+        f = &s->fields[i];
+        p = msg + f->off;
+
+        if (f->kind == WIRE_SINT || f->kind == WIRE_UINT) {
+            v = wire_load(f, p);
+            if (v == 0)
+                continue;
+            n += wire_put_varint(out ? out + n : NULL, f->tag << 1);
+            n += wire_put_varint(out ? out + n : NULL, v);
+            continue;
+        }
+
+        len = f->kind == WIRE_STRING ? strnlen(p, f->size) : f->size;
+        while (f->kind == WIRE_BYTES && len > 0 && p[len - 1] == 0)
+            len -= 1;
+        if (len == 0)
+            continue;
+        len = f->kind == WIRE_BYTES ? f->size : len;
+
+        n += wire_put_varint(out ? out + n : NULL, f->tag << 1 | 1);
+        n += wire_put_varint(out ? out + n : NULL, len);
+        if (out != NULL)
+            memcpy(out + n, p, len);
+        n += len;
+    }
+
+    return n;
+}
+
+/*****************************************************************************/
+
+int wire_put(const wire_schema_t *s, const void *msg, char *buf, int size)
+{
+    int n;
+    int len;
+
+    len = wire_fields(s, msg, NULL);
+    n = wire_put_varint(NULL, len);
+    if (n + len > size)
+        return -1;
+
+    wire_put_varint(buf, len);
+    wire_fields(s, msg, buf + n);
+
+    return n + len;
+}
+
+/*****************************************************************************/
+
+int wire_put_array(const wire_schema_t *s, const void *msgs, int count,
+        char *buf, int size)
+{
+    int i;
+    int n;
+    int len = 0;
+
+    for(i = 0; i < count; i++) {
+        n = wire_put(s, (const char *)msgs + i * s->size, buf + len,
+                size - len);
+        if (n == -1)
+            return -1;
+        len += n;
+    }
+
+    return len;
+}
+
+/*****************************************************************************/
+
+static const wire_field_t * wire_find(const wire_schema_t *s, int tag)
+{
+    int i;
+
+    for(i = 0; i < s->nr_fields; i++) {
+        if (s->fields[i].tag == tag)
+            return &s->fields[i];
+    }
+
+    return NULL;
+}
+
+/*****************************************************************************/
+
+int wire_get(const wire_schema_t *s, char **cur, char *end, void *msg)
+{
+    int bytes;
+    char *p = *cur;
+    char *rec_end;
+    unsigned long long v;
+    unsigned long long key;
+    const wire_field_t *f;
+
+    if (p == end)
+        return 0;
+
+    if (wire_get_varint(&p, end, &v) == -1 || v > (unsigned)(end - p))
+        return -1;
+    rec_end = p + v;
+
+    memset(msg, 0, s->size);
+    while (p < rec_end) {
+        if (wire_get_varint(&p, rec_end, &key) == -1 ||
+                wire_get_varint(&p, rec_end, &v) == -1)
+            return -1;
+
+        bytes = key & 1;
+        if (bytes && v > (unsigned)(rec_end - p))
+            return -1;
+
+        /* unknown tags are from a newer peer */
+        f = wire_find(s, key >> 1);
+        if (f != NULL && bytes == (f->kind >= WIRE_BYTES)) {
+            if (!bytes)
+                wire_store(f, (char *)msg + f->off, v);
+            else
+                memcpy((char *)msg + f->off, p, v < f->size ?
+                    v : f->size - (f->kind == WIRE_STRING));
+        }
+
+        if (bytes)
+            p += v;
+    }
+
+    *cur = rec_end;
+
+    return 1;
+}
+
+/*****************************************************************************/
+
+int wire_kvs_cut(const char *buf, int len, int max)
+{
+    int n = 0;
+    const char *p;
+    const char *end = buf + len;
+
+    if (len <= max)
+        return len;
+
+    while (n < len) {
+        p = memchr(buf + n, '\0', len - n);
+        if (p == NULL || (p = memchr(p + 1, '\0', end - p - 1)) == NULL ||
+                p + 1 - buf > max)
+            break;
+        n = p + 1 - buf;
+    }
+
+    return n;
+}
+
+/*****************************************************************************/
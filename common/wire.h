@@ -0,0 +1,93 @@
+/* wire: tagged varint encoding of the structured comlink payloads */
+
+#ifndef _WIRE_H_
+#define _WIRE_H_
+
+#include <stddef.h>
+
+/*****************************************************************************/
+/* a payload is a run of records, each a varint length and the fields of
+ * one struct. A field is a varint key (tag << 1 | is-bytes) and either a
+ * varint value or a length and that many bytes. Zero fields are left out
+ * and unknown tags are skipped, so either side can add fields without
+ * breaking the other */
+
+enum {
+    WIRE_SINT = 0, /* int, long long; zigzag varint */
+    WIRE_UINT,     /* unsigned int; varint */
+    WIRE_BYTES,    /* fixed size array, sent whole */
+    WIRE_STRING    /* char array, sent up to the terminator */
+};
+
+typedef struct wire_field_s {
+    unsigned short tag;
+    unsigned short kind; /* WIRE_* */
+    unsigned short off;
+    unsigned short size;
+}wire_field_t;
+
+typedef struct wire_schema_s {
+    const char *name;
+    int nr_fields;
+    const wire_field_t *fields;
+    int size;    /* of the struct */
+    int max_len; /* upper bound of an encoded record */
+}wire_schema_t;
+
+/* FIELDS(T, X) lists X(T, tag, kind, member) once per field; see the
+ * message types in common.h */
+#define WIRE_FIELD(T, tag, kind, member) \
+    { tag, kind, offsetof(T, member), sizeof(((T *)0)->member) },
+
+#define WIRE_MAX_FIELD(T, tag, kind, member) \
+    + 3 + ((kind) >= WIRE_BYTES ? 5 + sizeof(((T *)0)->member) : 10)
+
+#define WIRE_MAX_LEN(T, FIELDS) (5 FIELDS(T, WIRE_MAX_FIELD))
+
+#define WIRE_SCHEMA(var, T, FIELDS) \
+    static const wire_field_t var##_fields[] = { FIELDS(T, WIRE_FIELD) }; \
+    const wire_schema_t var = { #T, \
+        sizeof(var##_fields) / sizeof(wire_field_t), var##_fields, \
+        sizeof(T), WIRE_MAX_LEN(T, FIELDS) }
+
+/* fits any single record below, for buffers on the stack */
+#define WIRE_MAX_RECORD (512)
+
+/*****************************************************************************/
+/* one schema per message struct, defined in wire.c */
+
+extern const wire_schema_t wire_hello;
+extern const wire_schema_t wire_int;
+extern const wire_schema_t wire_job_layout;
+extern const wire_schema_t wire_gang_times;
+extern const wire_schema_t wire_rank_event;
+extern const wire_schema_t wire_node_queue;
+extern const wire_schema_t wire_stop_report;
+extern const wire_schema_t wire_stage_offer;
+extern const wire_schema_t wire_bcast_plan;
+extern const wire_schema_t wire_bcast_node;
+extern const wire_schema_t wire_bcast_report;
+extern const wire_schema_t wire_stdin_ack;
+extern const wire_schema_t wire_node_inventory;
+extern const wire_schema_t wire_job_limits;
+extern const wire_schema_t wire_node_sample;
+
+/*****************************************************************************/
+
+/* appends one record of msg; bytes written, -1 if it doesn't fit */
+int wire_put(const wire_schema_t *s, const void *msg, char *buf, int size);
+
+/* one record per element of an array of count structs */
+int wire_put_array(const wire_schema_t *s, const void *msgs, int count,
+        char *buf, int size);
+
+/* decodes the record at *cur straight into msg and moves *cur past it;
+ * 1 for a record, 0 at the end, -1 if the payload is malformed */
+int wire_get(const wire_schema_t *s, char **cur, char *end, void *msg);
+
+/* the longest run of whole key\0value\0 pairs at buf within max bytes */
+int wire_kvs_cut(const char *buf, int len, int max);
+
+/*****************************************************************************/
+
+#endif /* _WIRE_H_ */
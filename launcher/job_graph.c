@@ -0,0 +1,315 @@
+/*
+ * job_graph: the stages of a job and the order they run in
+ */
+
+/* job_graph.c -- a -graph file has one stage per line:
+ *
+ *                    # name   np    hosts  after       executable
+ *                    prep     1     0      -           ./prep
+ *                    solve    auto  1-7    prep        ./solve
+ *                    reduce   1     0      solve       ./reduce
+ *
+ *                np is per host as with -np, hosts are hostfile lines
+ *                counted from 0 ("0-3,6", or "*" for all of them) and
+ *                after names earlier stages, so the graph can't have a
+ *                cycle. A plain job is a single stage on every host.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+
+#include "job_launcher.h"
+#include "common.h"
+
+/*****************************************************************************/
+
+#define GRAPH_LINE_LEN (2048)
+
+/*****************************************************************************/
+/* 1 if host is in the spec, 0 if not, -1 if the spec is malformed or goes
+ * past the hostfile; host -1 only checks the spec */
+
+static int graph_in_spec(const char *spec, int host, int count)
+{
+    long lo;
+    long hi;
+    int found = 0;
+    char *end;
+    const char *p = spec;
+
+    if (strcmp(spec, "*") == 0)
+        return host >= 0;
+
+    for (;;) {
+        lo = strtol(p, &end, 10);
+        if (end == p || lo < 0)
+            return -1;
+        hi = lo;
+        if (*end == '-') {
+            p = end + 1;
+            hi = strtol(p, &end, 10);
+            if (end == p || hi < lo)
+                return -1;
+        }
+        if (hi >= count)
+            return -1;
+
+        if (host >= lo && host <= hi)
+            found = 1;
+        if (*end == '\0')
+            return found;
+        if (*end != ',')
+            return -1;
+        p = end + 1;
+    }
+}
+
+/*****************************************************************************/
+
+static int graph_find(launcher_session_t *s, const char *name)
+{
+    int i;
+
+    for(i = 0; i < s->nr_stages; i++) {
+        if (strcmp(s->stages[i].name, name) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+/*****************************************************************************/
+/* after is "-" or a comma separated list of earlier stages */
+
+static int graph_deps(launcher_session_t *s, job_stage_t *st, char *after)
+{
+    int dep;
+    char *name;
+    char *save = NULL;
+
+    if (strcmp(after, "-") == 0)
+        return 0;
+
+    for(name = strtok_r(after, ",", &save); name != NULL;
+            name = strtok_r(NULL, ",", &save)) {
+        dep = graph_find(s, name);
+        if (dep == -1 || st->nr_deps == MAX_STAGE_DEPS)
+            return -1;
+        st->deps[st->nr_deps++] = dep;
+    }
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+static job_stage_t * graph_add(launcher_session_t *s)
+{
+    job_stage_t *p;
+
+    p = realloc(s->stages, (s->nr_stages + 1) * sizeof(job_stage_t));
+    if (p == NULL)
+        return NULL;
+    s->stages = p;
+
+    p = &s->stages[s->nr_stages++];
+    memset(p, 0, sizeof(job_stage_t));
+
+    return p;
+}
+
+/*****************************************************************************/
+/* the hostfile is read by now, host specs are checked against it */
+
+int graph_parse(launcher_session_t *s, char *file)
+{
+    int n;
+    int np;
+    int line = 0;
+    char *end;
+    FILE *fp;
+    job_stage_t *st;
+    char extra;
+    char buf[GRAPH_LINE_LEN];
+    char np_str[16];
+    char name[MAX_STAGE_NAME];
+    char hosts[MAX_HOSTNAME_LEN];
+    char after[GRAPH_LINE_LEN];
+    char exe[MAX_FILENAME_LEN];
+
+    if ((fp = fopen(file, "r")) == NULL) {
+        fprintf(stderr, "launcher: error opening graph %s: %s(%d) \n",
+            file, strerror(errno), errno);
+        return -1;
+    }
+
+    while (fgets(buf, sizeof(buf), fp) != NULL) {
+        line += 1;
+        n = strspn(buf, " \t\r\n");
+        if (buf[n] == '\0' || buf[n] == '#')
+            continue;
+
+        np_str[0] = '\0';
+        n = sscanf(buf, "%31s %15s %255s %2047s %255s %c", name, np_str,
+                hosts, after, exe, &extra);
+        /* np 0 is auto */
+        if (strcmp(np_str, "auto") == 0)
+            np = 0;
+        else if ((np = strtol(np_str, &end, 10)) <= 0 || *end != '\0')
+            np = -1;
+        if (n != 5 || np < 0 || np > MAX_RANKS ||
+                strcmp(name, "-") == 0 || graph_find(s, name) != -1 ||
+                graph_in_spec(hosts, -1, s->hosts.count) == -1) {
+            fprintf(stderr, "launcher: %s line %d: expected a new stage name,"
+                " np, hosts and after, then the executable \n", file, line);
+            break;
+        }
+
+        st = graph_add(s);
+        if (st == NULL) {
+            fprintf(stderr, "launcher: error allocating stage, %s(%d) \n",
+                strerror(errno), errno);
+            break;
+        }
+        snprintf(st->name, sizeof(st->name), "%s", name);
+        snprintf(st->exe_name, sizeof(st->exe_name), "%s", exe);
+        snprintf(st->host_spec, sizeof(st->host_spec), "%s", hosts);
+        st->instances = np;
+        s->np_auto |= np == 0;
+        if (graph_deps(s, st, after) == -1) {
+            fprintf(stderr, "launcher: %s line %d: after names an unknown"
+                " stage, or more than %d \n", file, line, MAX_STAGE_DEPS);
+            break;
+        }
+        fprintf(stdout, "launcher: stage %s, %s per host on %s, exec = %s \n",
+            st->name, np_str, st->host_spec, st->exe_name);
+    }
+
+    n = feof(fp);
+    fclose(fp);
+    if (n && s->nr_stages == 0)
+        fprintf(stderr, "launcher: no stages in %s \n", file);
+
+    return n && s->nr_stages > 0 ? 0 : -1;
+}
+
+/*****************************************************************************/
+/* the job given on the command line */
+
+int graph_single(launcher_session_t *s)
+{
+    job_stage_t *st;
+
+    st = graph_add(s);
+    if (st == NULL)
+        return -1;
+
+    snprintf(st->name, sizeof(st->name), "job");
+    snprintf(st->exe_name, sizeof(st->exe_name), "%s", s->exe_name);
+    snprintf(st->host_spec, sizeof(st->host_spec), "*");
+    st->instances = s->instances;
+
+    return 0;
+}
+
+/*****************************************************************************/
+/* picks the connected hosts of the spec; the stage's ranks are numbered
+ * over them in hostfile order. An auto stage is sized from the host
+ * inventories */
+
+int graph_hosts(launcher_session_t *s, job_stage_t *st)
+{
+    int i;
+    int h;
+
+    st->host = calloc(s->hosts.count, sizeof(int));
+    st->np = calloc(s->hosts.count, sizeof(int));
+    if (st->host == NULL || st->np == NULL)
+        return -1;
+
+    st->nr_hosts = 0;
+    st->job_size = 0;
+    for(i = 0; i < s->hosts.count; i++) {
+        if (s->hosts.fd[i] == -1 ||
+                graph_in_spec(st->host_spec, i, s->hosts.count) != 1)
+            continue;
+        h = st->nr_hosts++;
+        st->host[h] = i;
+        st->np[h] = st->instances ? st->instances : inventory_np(s, i);
+        st->job_size += st->np[h];
+        if (st->instances == 0)
+            fprintf(stdout, "launcher: %s%s%s gets %d instances \n",
+                s->nr_stages > 1 ? st->name : "",
+                s->nr_stages > 1 ? " on " : "", s->hosts.name[i],
+                st->np[h]);
+    }
+
+    return st->nr_hosts;
+}
+
+/*****************************************************************************/
+/* 1 once the stage can go out; a stage that never can is finished here */
+
+int graph_ready(launcher_session_t *s, job_stage_t *st)
+{
+    int i;
+    job_stage_t *dep;
+
+    for(i = 0; i < st->nr_deps; i++) {
+        dep = &s->stages[st->deps[i]];
+        if (dep->state == STAGE_FAILED || dep->state == STAGE_SKIPPED) {
+            fprintf(stdout, "launcher: stage %s skipped, %s did not"
+                " succeed \n", st->name, dep->name);
+            st->state = STAGE_SKIPPED;
+            s->nr_finished += 1;
+            return 0;
+        }
+        if (dep->state != STAGE_DONE)
+            return 0;
+    }
+
+    if (st->nr_hosts == 0) {
+        fprintf(stderr, "launcher: stage %s has no hosts left \n", st->name);
+        st->state = STAGE_FAILED;
+        s->nr_finished += 1;
+        return 0;
+    }
+
+    /* a host runs one stage at a time */
+    for(i = 0; i < st->nr_hosts; i++) {
+        if (s->hosts.stage[st->host[i]] != -1)
+            return 0;
+    }
+
+    return 1;
+}
+
+/*****************************************************************************/
+
+job_stage_t * graph_host_stage(launcher_session_t *s, int host)
+{
+    if (host < 0 || host >= s->hosts.count || s->hosts.stage[host] == -1)
+        return NULL;
+
+    return &s->stages[s->hosts.stage[host]];
+}
+
+/*****************************************************************************/
+
+void graph_free(launcher_session_t *s)
+{
+    int i;
+
+    for(i = 0; i < s->nr_stages; i++) {
+        free(s->stages[i].host);
+        free(s->stages[i].np);
+        free(s->stages[i].kvs_buf);
+    }
+    free(s->stages);
+    s->stages = NULL;
+    s->nr_stages = 0;
+}
+
+/*****************************************************************************/
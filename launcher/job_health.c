@@ -0,0 +1,359 @@
+/*
+ * job_health: how each host fared in earlier runs, for skipping dead ones
+ */
+
+/* job_health.c -- every run records per host when it last answered, when
+ *                 it last failed to (no connect, or no HELLO), how many
+ *                 times in a row that was, and its connect time, in a
+ *                 cache file next to the inventories:
+ *
+ *                 # host last_ok last_fail fails rtt_us
+ *                 node07 1792400000 1792300000 0 182
+ *
+ *                 A host that failed last time is connected to after the
+ *                 others, with a short timeout. One that failed twice in
+ *                 a row or more is skipped for a backoff that doubles with
+ *                 every failure, so a launch doesn't wait on connects the
+ *                 last runs already waited on. A thread probes the skipped
+ *                 hosts while the job runs; one that accepts comes back on
+ *                 probation in the next run, and out of it with a HELLO.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "job_launcher.h"
+#include "common.h"
+
+/*****************************************************************************/
+
+#define HEALTH_FILE "/tmp/jl_health" /* .<uid> */
+#define HEALTH_LINE (512)
+
+#define HEALTH_SKIP_FAILS    (2)    /* in a row before a host is skipped */
+#define HEALTH_BACKOFF_S     (30)   /* doubled with every further one */
+#define HEALTH_BACKOFF_MAX_S (3600)
+
+#define HEALTH_PROBE_MS (3000) /* a skipped host gets this long to accept */
+#define HEALTH_SLICE_MS (100)  /* the probe checks for the end of the job */
+
+/*****************************************************************************/
+
+static int health_parse(char *line, char *name, host_health_t *hh)
+{
+    memset(hh, 0, sizeof(*hh));
+
+    return sscanf(line, "%255s %lld %lld %d %d", name, &hh->last_ok,
+        &hh->last_fail, &hh->fails, &hh->rtt_us) == 5 ? 0 : -1;
+}
+
+/*****************************************************************************/
+
+static long long health_backoff(int fails)
+{
+    long long s = HEALTH_BACKOFF_S;
+
+    for(; fails > HEALTH_SKIP_FAILS && s < HEALTH_BACKOFF_MAX_S; fails--)
+        s *= 2;
+
+    return s < HEALTH_BACKOFF_MAX_S ? s : HEALTH_BACKOFF_MAX_S;
+}
+
+/*****************************************************************************/
+/* what this run makes of the host, from its cached health */
+
+static int health_state(host_health_t *hh, long long now)
+{
+    if (hh->fails >= HEALTH_SKIP_FAILS &&
+            now - hh->last_fail < health_backoff(hh->fails))
+        return HEALTH_SKIP;
+
+    return hh->fails > 0 ? HEALTH_SUSPECT : HEALTH_OK;
+}
+
+/*****************************************************************************/
+/* the cached health of every host in the hostfile; if that would skip
+ * all of them they are all tried */
+
+void health_load(launcher_session_t *s)
+{
+    int h;
+    int *idx;
+    FILE *fp;
+    long long now = time(NULL);
+    host_health_t hh;
+    char name[MAX_HOSTNAME_LEN];
+    char line[HEALTH_LINE];
+
+    if (s->health_file[0] == '\0')
+        snprintf(s->health_file, sizeof(s->health_file), HEALTH_FILE ".%d",
+            (int)getuid());
+
+    if ((fp = fopen(s->health_file, "r")) == NULL)
+        return;
+    if ((idx = host_index(s)) == NULL) {
+        fclose(fp);
+        return;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (line[0] == '#' || health_parse(line, name, &hh) == -1)
+            continue;
+        h = host_find(s, idx, name);
+        if (h != -1)
+            s->hosts.health[h] = hh;
+    }
+    fclose(fp);
+
+    /* a host listed twice fares the same on every line */
+    s->nr_skipped = 0;
+    for(h = 0; h < s->hosts.count; h++) {
+        s->hosts.health[h] = s->hosts.health[host_find(s, idx,
+            s->hosts.name[h])];
+        s->hosts.health_state[h] = s->all_hosts ? HEALTH_OK :
+            health_state(&s->hosts.health[h], now);
+        s->nr_skipped += s->hosts.health_state[h] == HEALTH_SKIP;
+    }
+    free(idx);
+
+    if (s->nr_skipped > 0 && s->nr_skipped == s->hosts.count) {
+        fprintf(stderr, "launcher: every host failed lately, trying them"
+            " all \n");
+        for(h = 0; h < s->hosts.count; h++)
+            s->hosts.health_state[h] = HEALTH_SUSPECT;
+        s->nr_skipped = 0;
+    }
+}
+
+/*****************************************************************************/
+/* connects that went through; smoothed like a tcp srtt */
+
+void health_rtt(launcher_session_t *s, int h, long long ns)
+{
+    host_health_t *hh = &s->hosts.health[h];
+    int us = ns / 1000;
+
+    hh->rtt_us = hh->rtt_us == 0 ? us : (hh->rtt_us * 7 + us) / 8;
+}
+
+/*****************************************************************************/
+/* the listener answered HELLO */
+
+void health_ok(launcher_session_t *s, int h)
+{
+    s->hosts.health[h].last_ok = time(NULL);
+    s->hosts.health[h].fails = 0;
+}
+
+/*****************************************************************************/
+/* no connect, or no HELLO within the timeout */
+
+void health_fail(launcher_session_t *s, int h)
+{
+    host_health_t *hh = &s->hosts.health[h];
+
+    hh->last_fail = time(NULL);
+    if (hh->fails < 1000)
+        hh->fails += 1;
+}
+
+/*****************************************************************************/
+/* a nonblocking connect to the host's listener, -1 if it failed at once */
+
+static int health_probe_connect(launcher_session_t *s, int h)
+{
+    int fd;
+    struct sockaddr_in addr;
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(s->hosts.ip[h]);
+    addr.sin_port = htons(s->hosts.port[h]);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 &&
+            errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*****************************************************************************/
+/* a host that accepts again is one failure short of being skipped, so
+ * the next run tries it, last; the next HELLO clears it */
+
+static void health_probe_done(launcher_session_t *s, int h, int ok)
+{
+    if (!ok) {
+        health_fail(s, h);
+        return;
+    }
+
+    s->hosts.health[h].fails = HEALTH_SKIP_FAILS - 1;
+    s->nr_probed_ok += 1;
+    fprintf(stderr, "launcher: %s accepts connections again, it is tried"
+        " next run \n", s->hosts.name[h]);
+}
+
+/*****************************************************************************/
+/* all skipped hosts at once; what is still pending when the job ends is
+ * left as it was */
+
+static void * health_probe_main(void *arg)
+{
+    int i;
+    int n = 0;
+    int left;
+    int err;
+    int *host;
+    socklen_t len;
+    struct pollfd *pfd;
+    long long waited = 0;
+    launcher_session_t *s = (launcher_session_t *)arg;
+
+    pfd = calloc(s->nr_skipped, sizeof(struct pollfd));
+    host = calloc(s->nr_skipped, sizeof(int));
+    if (pfd == NULL || host == NULL)
+        goto out;
+
+    for(i = 0; i < s->hosts.count && n < s->nr_skipped; i++) {
+        if (s->hosts.health_state[i] != HEALTH_SKIP || s->hosts.port[i] == 0)
+            continue;
+        pfd[n].fd = health_probe_connect(s, i);
+        pfd[n].events = POLLOUT;
+        host[n] = i;
+        if (pfd[n].fd == -1)
+            health_probe_done(s, i, 0);
+        else
+            n += 1;
+    }
+
+    for(left = n; left > 0 && !s->probe_stop &&
+            waited < HEALTH_PROBE_MS; waited += HEALTH_SLICE_MS) {
+        if (poll(pfd, n, HEALTH_SLICE_MS) <= 0)
+            continue;
+        for(i = 0; i < n; i++) {
+            if (pfd[i].fd < 0 || pfd[i].revents == 0)
+                continue;
+            err = 0;
+            len = sizeof(err);
+            getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            health_probe_done(s, host[i], err == 0);
+            close(pfd[i].fd);
+            pfd[i].fd = -1;
+            left -= 1;
+        }
+    }
+
+    /* no answer at all within the probe time is a failure too */
+    for(i = 0; i < n; i++) {
+        if (pfd[i].fd < 0)
+            continue;
+        if (!s->probe_stop)
+            health_probe_done(s, host[i], 0);
+        close(pfd[i].fd);
+    }
+
+out:
+    free(pfd);
+    free(host);
+
+    return NULL;
+}
+
+/*****************************************************************************/
+
+int health_probe_start(launcher_session_t *s)
+{
+    int ret;
+
+    if (s->nr_skipped == 0)
+        return 0;
+
+    s->probe_stop = 0;
+    ret = pthread_create(&s->probe_thread, NULL, health_probe_main,
+            (void *)s);
+    if (ret != 0) {
+        fprintf(stderr, "launcher: health probe thread, %s(%d) \n",
+            strerror(ret), ret);
+        return -1;
+    }
+    s->probe_live = 1;
+
+    return 0;
+}
+
+/*****************************************************************************/
+/* rewrites the cache once the probe is done; lines of hosts not in this
+ * hostfile are kept */
+
+void health_save(launcher_session_t *s)
+{
+    int i;
+    int *idx;
+    FILE *in;
+    FILE *out;
+    host_health_t hh;
+    char name[MAX_HOSTNAME_LEN];
+    char line[HEALTH_LINE];
+    char tmp[MAX_FILENAME_LEN + 16];
+
+    if (s->probe_live) {
+        s->probe_stop = 1;
+        pthread_join(s->probe_thread, NULL);
+        s->probe_live = 0;
+    }
+
+    if (s->health_file[0] == '\0' || (idx = host_index(s)) == NULL)
+        return;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", s->health_file, (int)getpid());
+    if ((out = fopen(tmp, "w")) == NULL) {
+        fprintf(stderr, "launcher: health cache %s, %s(%d) \n",
+            tmp, strerror(errno), errno);
+        free(idx);
+        return;
+    }
+
+    fprintf(out, "# host last_ok last_fail fails rtt_us\n");
+    for(i = 0; i < s->hosts.count; i++) {
+        hh = s->hosts.health[i];
+        if ((hh.last_ok != 0 || hh.last_fail != 0) &&
+                host_find(s, idx, s->hosts.name[i]) == i)
+            fprintf(out, "%s %lld %lld %d %d\n", s->hosts.name[i],
+                hh.last_ok, hh.last_fail, hh.fails, hh.rtt_us);
+    }
+
+    if ((in = fopen(s->health_file, "r")) != NULL) {
+        while (fgets(line, sizeof(line), in) != NULL) {
+            if (line[0] != '#' && health_parse(line, name, &hh) == 0 &&
+                    host_find(s, idx, name) == -1)
+                fputs(line, out);
+        }
+        fclose(in);
+    }
+    free(idx);
+
+    if (fclose(out) != 0 || rename(tmp, s->health_file) == -1) {
+        fprintf(stderr, "launcher: health cache %s, %s(%d) \n",
+            s->health_file, strerror(errno), errno);
+        unlink(tmp);
+    }
+}
+
+/*****************************************************************************/
@@ -0,0 +1,75 @@
+/*
+ * job_hosts: hostfile lines looked up by host name
+ */
+
+/* job_hosts.c -- the per host caches (inventories, health) key their
+ *                lines by host name; a sorted index of the hostfile
+ *                finds the line of a name. A host listed more than once
+ *                is found at its first line.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "job_launcher.h"
+#include "common.h"
+
+/*****************************************************************************/
+
+static host_table_t *sort_hosts;
+
+static int cmp_host(const void *a, const void *b)
+{
+    return strcmp(sort_hosts->name[*(const int *)a],
+        sort_hosts->name[*(const int *)b]);
+}
+
+/*****************************************************************************/
+/* host indices sorted by name; the caller frees it */
+
+int * host_index(launcher_session_t *s)
+{
+    int i;
+    int *idx;
+
+    idx = malloc(s->hosts.count * sizeof(int));
+    if (idx == NULL)
+        return NULL;
+
+    for(i = 0; i < s->hosts.count; i++)
+        idx[i] = i;
+    sort_hosts = &s->hosts;
+    qsort(idx, s->hosts.count, sizeof(int), cmp_host);
+
+    return idx;
+}
+
+/*****************************************************************************/
+/* the first hostfile line with the name, -1 if none */
+
+int host_find(launcher_session_t *s, int *idx, const char *name)
+{
+    int lo = 0;
+    int mid;
+    int cmp;
+    int hi = s->hosts.count - 1;
+
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        cmp = strcmp(s->hosts.name[idx[mid]], name);
+        if (cmp == 0) {
+            while (mid > 0 && strcmp(s->hosts.name[idx[mid - 1]], name) == 0)
+                mid -= 1;
+            return idx[mid];
+        }
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+
+    return -1;
+}
+
+/*****************************************************************************/
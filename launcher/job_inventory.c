@@ -0,0 +1,225 @@
+/*
+ * job_inventory: node inventories, cached across runs, for placement
+ */
+
+/* job_inventory.c -- every listener sends its cpus, memory, load and
+ *                    slots after HELLO. The last inventory of each host
+ *                    is kept in a cache file, one line per host, so a
+ *                    host that is slow to answer still has one:
+ *
+ *                    # host time cpus sockets cores numa mem_total_kb ...
+ *                    node07 1792400000 64 2 32 2 263856348 250113212 ...
+ *
+ *                A cached load is stale, so only a fresh inventory can
+ *                leave a host out; -np auto sizes from either.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "job_launcher.h"
+#include "common.h"
+
+/*****************************************************************************/
+
+#define INVENTORY_FILE "/tmp/jl_inventory" /* .<uid> */
+#define INVENTORY_LINE (512)
+
+/*****************************************************************************/
+/* host name and inventory of a cache line; 0 if it is one */
+
+static int inventory_parse(char *line, char *name, node_inventory_t *inv)
+{
+    memset(inv, 0, sizeof(*inv));
+
+    return sscanf(line, "%255s %lld %d %d %d %d %lld %lld %d %d %d %d %d %d",
+        name, &inv->time, &inv->cpus, &inv->sockets, &inv->cores,
+        &inv->numa_nodes, &inv->mem_total_kb, &inv->mem_avail_kb,
+        &inv->load1, &inv->load5, &inv->load15, &inv->slots,
+        &inv->running, &inv->queued) == 14 && inv->cpus > 0 ? 0 : -1;
+}
+
+/*****************************************************************************/
+
+static void inventory_print_line(FILE *fp, const char *name,
+        node_inventory_t *inv)
+{
+    fprintf(fp, "%s %lld %d %d %d %d %lld %lld %d %d %d %d %d %d\n",
+        name, inv->time, inv->cpus, inv->sockets, inv->cores,
+        inv->numa_nodes, inv->mem_total_kb, inv->mem_avail_kb,
+        inv->load1, inv->load5, inv->load15, inv->slots, inv->running,
+        inv->queued);
+}
+
+/*****************************************************************************/
+/* the last known inventory of every host in the hostfile */
+
+void inventory_load(launcher_session_t *s)
+{
+    int h;
+    int *idx;
+    FILE *fp;
+    node_inventory_t inv;
+    char name[MAX_HOSTNAME_LEN];
+    char line[INVENTORY_LINE];
+
+    if (s->inv_file[0] == '\0')
+        snprintf(s->inv_file, sizeof(s->inv_file), INVENTORY_FILE ".%d",
+            (int)getuid());
+
+    if ((fp = fopen(s->inv_file, "r")) == NULL)
+        return;
+    if ((idx = host_index(s)) == NULL) {
+        fclose(fp);
+        return;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (line[0] == '#' || inventory_parse(line, name, &inv) == -1)
+            continue;
+        h = host_find(s, idx, name);
+        if (h == -1)
+            continue;
+        s->hosts.inv[h] = inv;
+        s->hosts.inv_state[h] = INV_CACHED;
+    }
+    free(idx);
+    fclose(fp);
+}
+
+/*****************************************************************************/
+/* rewrites the cache with this run's inventories; lines of hosts not in
+ * this hostfile are kept */
+
+void inventory_save(launcher_session_t *s)
+{
+    int i;
+    int *idx;
+    int fresh = 0;
+    FILE *in;
+    FILE *out;
+    node_inventory_t inv;
+    char name[MAX_HOSTNAME_LEN];
+    char line[INVENTORY_LINE];
+    char tmp[MAX_FILENAME_LEN + 16];
+
+    for(i = 0; i < s->hosts.count; i++)
+        fresh += s->hosts.inv_state[i] == INV_FRESH;
+    if (fresh == 0 || (idx = host_index(s)) == NULL)
+        return;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", s->inv_file, (int)getpid());
+    if ((out = fopen(tmp, "w")) == NULL) {
+        fprintf(stderr, "launcher: inventory cache %s, %s(%d) \n",
+            tmp, strerror(errno), errno);
+        free(idx);
+        return;
+    }
+
+    fprintf(out, "# host time cpus sockets cores numa mem_total_kb"
+        " mem_avail_kb load1 load5 load15 slots running queued\n");
+    for(i = 0; i < s->hosts.count; i++) {
+        /* a host listed twice is written once */
+        if (s->hosts.inv_state[i] != INV_NONE &&
+                host_find(s, idx, s->hosts.name[i]) == i)
+            inventory_print_line(out, s->hosts.name[i], &s->hosts.inv[i]);
+    }
+
+    if ((in = fopen(s->inv_file, "r")) != NULL) {
+        while (fgets(line, sizeof(line), in) != NULL) {
+            if (line[0] != '#' && inventory_parse(line, name, &inv) == 0 &&
+                    host_find(s, idx, name) == -1)
+                fputs(line, out);
+        }
+        fclose(in);
+    }
+    free(idx);
+
+    if (fclose(out) != 0 || rename(tmp, s->inv_file) == -1) {
+        fprintf(stderr, "launcher: inventory cache %s, %s(%d) \n",
+            s->inv_file, strerror(errno), errno);
+        unlink(tmp);
+    }
+}
+
+/*****************************************************************************/
+/* a fresh one from the listener; 1 if it is the host's first this run */
+
+int inventory_update(launcher_session_t *s, int h, node_inventory_t *inv)
+{
+    int first;
+
+    if (h == -1 || inv->cpus <= 0)
+        return 0;
+
+    first = s->hosts.inv_state[h] != INV_FRESH;
+    s->hosts.inv[h] = *inv;
+    s->hosts.inv_state[h] = INV_FRESH;
+
+    return first;
+}
+
+/*****************************************************************************/
+/* why the host should be left out, NULL if it can take the job */
+
+const char * inventory_unfit(launcher_session_t *s, int h)
+{
+    node_inventory_t *inv = &s->hosts.inv[h];
+
+    if (s->hosts.inv_state[h] != INV_FRESH)
+        return NULL;
+
+    if (s->max_load > 0 && inv->load1 > s->max_load * inv->cpus * 100)
+        return "is loaded past -max-load";
+    if (s->np_auto && inv->slots > 0 && inv->running >= inv->slots)
+        return "has no free slot";
+
+    return NULL;
+}
+
+/*****************************************************************************/
+
+void inventory_print(launcher_session_t *s, int h)
+{
+    node_inventory_t *inv = &s->hosts.inv[h];
+
+    if (s->hosts.inv_state[h] == INV_NONE)
+        return;
+
+    fprintf(stdout, "launcher: %s has %d cpus (%d sockets, %d cores), %d numa"
+        " nodes, %.1f of %.1f GB free, load %.2f, %d of %d slots busy%s \n",
+        s->hosts.name[h], inv->cpus, inv->sockets, inv->cores,
+        inv->numa_nodes, inv->mem_avail_kb / 1e6, inv->mem_total_kb / 1e6,
+        inv->load1 / 100.0, inv->running, inv->slots,
+        s->hosts.inv_state[h] == INV_CACHED ? ", cached" : "");
+}
+
+/*****************************************************************************/
+/* -np auto; a cpu per instance, less what the load already takes, within
+ * the listener's free slots */
+
+int inventory_np(launcher_session_t *s, int h)
+{
+    int n;
+    node_inventory_t *inv = &s->hosts.inv[h];
+
+    if (s->hosts.inv_state[h] == INV_NONE) {
+        fprintf(stderr, "launcher: no inventory of %s, 1 instance \n",
+            s->hosts.name[h]);
+        return 1;
+    }
+
+    n = inv->cpus;
+    if (s->hosts.inv_state[h] == INV_FRESH)
+        n -= (inv->load1 + 50) / 100;
+    if (inv->slots > 0 && n > inv->slots - inv->running)
+        n = inv->slots - inv->running;
+
+    return n < 1 ? 1 : n;
+}
+
+/*****************************************************************************/
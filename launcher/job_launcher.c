@@ -20,19 +20,56 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <getopt.h>
+#include <time.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 
 #include "job_launcher.h"
 #include "common.h"
 
 /*****************************************************************************/
 
-#define MAX_CMD_ARGS  (6)
-#define MAX_INSTANCES (100)
-
 #define COMLINK_PORT     (25000)
-#define COMLINK_BUF_SIZE (1024)
+#define COMLINK_BUF_SIZE (64 * 1024) /* kvs fences arrive in 1 MB parts */
+
+/* straggler check period; a rank is flagged once it runs this much past
+ * the percentile runtime, and never before STRAGGLER_MIN_NS */
+#define STRAGGLER_TICK_MS   (500)
+#define STRAGGLER_SLACK_PCT (150)
+#define STRAGGLER_MIN_NS    (1000000000LL)
+#define STRAGGLER_PCT       (90)
+
+#define STOP_TIMEOUT_MS (10000) /* give up on hosts that never confirm */
+
+#define HELLO_TIMEOUT_MS (2000) /* hosts silent this long are left out */
+
+/* connect timeouts; a host that failed last run is tried last, and given
+ * less, see job_health.c */
+#define CONNECT_TIMEOUT_MS (5000)
+#define SUSPECT_TIMEOUT_MS (1000)
+
+#define MAX_LOAD (2.0) /* per cpu, hosts past it are left out */
+
+#define SAMPLE_MS (1000) /* resource samples of -top and -sample-file */
+
+/* clock probes per round; a round goes out after HELLO and then every
+ * CLOCK_REFRESH_MS to follow the drift of the node clocks */
+#define CLOCK_PROBES     (8)
+#define CLOCK_REFRESH_MS (5000)
+
+#define STAGE_CHUNK COMLINK_BULK_FRAME /* executable bytes per STAGE_DATA */
+
+/* broadcast bytes per frame; a relay forwards a chunk once it is in, so
+ * smaller chunks fill the chain sooner */
+#define BCAST_CHUNK  (1 << 20)
+#define BCAST_FANOUT (1)
 
 /*****************************************************************************/
 
@@ -48,29 +85,126 @@ static launcher_session_t * get_launcher_session()
 
 /*****************************************************************************/
 
-static void launcher_session_cleanup(launcher_session_t *session)
+static void host_table_free(host_table_t *t)
 {
     int i;
+    table_col_t cols[] = {
+        TABLE_COL(t->fd), TABLE_COL(t->name), TABLE_COL(t->ip),
+        TABLE_COL(t->port), TABLE_COL(t->version), TABLE_COL(t->caps),
+        TABLE_COL(t->stage), TABLE_COL(t->running), TABLE_COL(t->queue),
+        TABLE_COL(t->inv), TABLE_COL(t->inv_state), TABLE_COL(t->sample),
+        TABLE_COL(t->health), TABLE_COL(t->health_state)
+    };
+
+    for(i = 0; i < t->count; i++)
+        free(t->name[i]);
+
+    table_free(cols, sizeof(cols) / sizeof(cols[0]), &t->capacity);
+    t->count = 0;
+}
+
+/*****************************************************************************/
+
+static int rank_table_alloc(rank_table_t *t, int count)
+{
+    table_col_t cols[] = {
+        TABLE_COL(t->state), TABLE_COL(t->host), TABLE_COL(t->spec_host),
+        TABLE_COL(t->status), TABLE_COL(t->start_ns),
+        TABLE_COL(t->runtime_ns)
+    };
+
+    if (table_reserve(cols, sizeof(cols) / sizeof(cols[0]),
+            &t->capacity, count) == -1)
+        return -1;
+    t->count = count;
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+static void rank_table_free(rank_table_t *t)
+{
+    table_col_t cols[] = {
+        TABLE_COL(t->state), TABLE_COL(t->host), TABLE_COL(t->spec_host),
+        TABLE_COL(t->status), TABLE_COL(t->start_ns),
+        TABLE_COL(t->runtime_ns)
+    };
+
+    table_free(cols, sizeof(cols) / sizeof(cols[0]), &t->capacity);
+    t->count = 0;
+}
+
+/*****************************************************************************/
 
+static void launcher_session_cleanup(launcher_session_t *session)
+{
     if (!session->valid)
         return;
 
     session->valid = 0;    
-    for(i = 0; i < session->host_count; i++) {
-      if (session->host_info[i])
-	  free(session->host_info[i]);
-          session->host_info[i] = NULL;
-    }
-
+    stdin_cleanup(session);
     comlink_client_shutdown();
+
+    inventory_save(session);
+    health_save(session);
+    sample_cleanup(session);
+    host_table_free(&session->hosts);
+    rank_table_free(&session->ranks);
+    free(session->fd_host);
+    free(session->fastest);
+    free(session->bcast_plan);
+    free(session->bcast_host);
+    graph_free(session);
+    session->bcast_plan = NULL;
+    session->bcast_host = NULL;
+    if (session->stage_fd != -1)
+        close(session->stage_fd);
+    session->stage_fd = -1;
+    session->fd_host = NULL;
+    session->fastest = NULL;
+    session->nr_fds = 0;
 }
 
 /*****************************************************************************/
 
 static int usage(char *program)
 {
-    fprintf(stderr, "\n%s: -np <instances> -hostfile <hostfile>"
-        " <exe-name including path> \n", program);
+    fprintf(stderr, "\n%s: -np <instances|auto> -hostfile <hostfile> [-gang]"
+        " [-straggler <pct>] [-idempotent] [-abort-on-failure] [-stage]"
+        " [-broadcast <file> [-broadcast-fanout <k>]] [-stdin]"
+        " [-max-load <l>] [-walltime <s>] [-instance-timeout <s>] [-top]"
+        " [-sample-file <path>] [-sample-interval <ms>] [-all-hosts]"
+        " <exe-name including path> \n"
+        "       -graph <file> -hostfile <hostfile> [-gang] [-abort-on-failure]"
+        " [-broadcast <file>] [-walltime <s>] [-instance-timeout <s>] [-top]"
+        " [-sample-file <path>] [-sample-interval <ms>] [-all-hosts] \n"
+        "    -graph       run the stages in file, each once the ones it needs"
+        " are done \n"
+        "    -np auto     an instance per idle cpu of each host, from its"
+        " inventory \n"
+        "    -max-load    leave out hosts whose load per cpu is past l,"
+        " 0 keeps all (default 2) \n"
+        "    -gang        stage all instances and release them together \n"
+        "    -straggler   flag ranks running well past the pct percentile"
+        " runtime \n"
+        "    -idempotent  re-run stragglers on idle slots, first one wins \n"
+        "    -abort-on-failure  stop the whole job once any rank fails \n"
+        "    -stage       send the executable to hosts that don't have it"
+        " cached \n"
+        "    -broadcast   copy an input file to every host before the start,"
+        " relayed host to host \n"
+        "    -broadcast-fanout  relays per host, 1 is a chain (default) \n"
+        "    -stdin       stream the launcher's stdin to every instance \n"
+        "    -walltime    stop whatever still runs s seconds into the job \n"
+        "    -instance-timeout  stop each instance s seconds after its"
+        " start \n"
+        "    -top         live view of the cpu, memory and i/o of the job and"
+        " its busiest hosts \n"
+        "    -sample-file  append every host's resource samples to path \n"
+        "    -sample-interval  between samples, in ms (default 1000) \n"
+        "    -all-hosts   try hosts that kept failing in earlier runs too \n",
+        program);
 
     return 0;
 }
@@ -81,48 +215,226 @@ static int usage(char *program)
 static int parse_cmdline(int argc, char *argv[],
         launcher_session_t *session)
 {
-    if (argc < MAX_CMD_ARGS) {
+    int opt;
+    static struct option options[] = {
+        { "np",       required_argument, NULL, 'n' },
+        { "hostfile", required_argument, NULL, 'h' },
+        { "gang",     no_argument,       NULL, 'g' },
+        { "straggler",  required_argument, NULL, 's' },
+        { "idempotent", no_argument,       NULL, 'i' },
+        { "abort-on-failure", no_argument, NULL, 'a' },
+        { "stage",      no_argument,       NULL, 'e' },
+        { "broadcast",  required_argument, NULL, 'b' },
+        { "broadcast-fanout", required_argument, NULL, 'f' },
+        { "graph",      required_argument, NULL, 'G' },
+        { "stdin",      no_argument,       NULL, 'I' },
+        { "max-load",   required_argument, NULL, 'L' },
+        { "walltime",   required_argument, NULL, 'W' },
+        { "instance-timeout", required_argument, NULL, 'T' },
+        { "top",        no_argument,       NULL, 't' },
+        { "sample-file", required_argument, NULL, 'F' },
+        { "sample-interval", required_argument, NULL, 'P' },
+        { "all-hosts",  no_argument,       NULL, 'A' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    session->max_load = MAX_LOAD;
+
+    /* single dash long options; stop at the executable */
+    while ((opt = getopt_long_only(argc, argv, "+", options, NULL)) != -1) {
+        switch(opt) {
+            case 'n':
+                session->np_auto = strcmp(optarg, "auto") == 0;
+                session->instances = session->np_auto ? 0 : atoi(optarg);
+                if (!session->np_auto && session->instances <= 0) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+
+            case 'h':
+                snprintf(session->host_file, MAX_FILENAME_LEN, "%s", optarg);
+                break;
+
+            case 'g':
+                session->gang = 1;
+                break;
+
+            case 's':
+                session->straggler_pct = atoi(optarg);
+                if (session->straggler_pct <= 0 ||
+                        session->straggler_pct >= 100) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+
+            case 'i':
+                session->idempotent = 1;
+                break;
+
+            case 'a':
+                session->abort_on_failure = 1;
+                break;
+
+            case 'e':
+                session->stage = 1;
+                break;
+
+            case 'b':
+                snprintf(session->bcast_file, MAX_FILENAME_LEN, "%s", optarg);
+                break;
+
+            case 'f':
+                session->bcast_fanout = atoi(optarg);
+                if (session->bcast_fanout < 1 ||
+                        session->bcast_fanout > BCAST_MAX_FANOUT) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+
+            case 'G':
+                snprintf(session->graph_file, MAX_FILENAME_LEN, "%s", optarg);
+                break;
+
+            case 'I':
+                session->stdin_on = 1;
+                break;
+
+            case 'L':
+                session->max_load = atof(optarg);
+                if (session->max_load < 0) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+
+            case 'W':
+                session->walltime_ms = atof(optarg) * 1000;
+                if (session->walltime_ms <= 0) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+
+            case 'T':
+                session->inst_timeout_ms = atof(optarg) * 1000;
+                if (session->inst_timeout_ms <= 0) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+
+            case 't':
+                session->sample_top = 1;
+                break;
+
+            case 'F':
+                snprintf(session->sample_file, MAX_FILENAME_LEN, "%s",
+                    optarg);
+                break;
+
+            case 'P':
+                session->sample_ms = atoi(optarg);
+                if (session->sample_ms <= 0) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+
+            case 'A':
+                session->all_hosts = 1;
+                break;
+
+            default:
+                usage(argv[0]);
+                return -1;
+        }
+    }
+
+    if (session->bcast_fanout == 0)
+        session->bcast_fanout = BCAST_FANOUT;
+
+    if ((session->sample_top || session->sample_file[0] != '\0') &&
+            session->sample_ms == 0)
+        session->sample_ms = SAMPLE_MS;
+
+    /* the stream is read once, by the instances running when it comes
+     * in; no stage or speculative copy later on could have it */
+    if (session->stdin_on &&
+            (session->graph_file[0] != '\0' || session->idempotent)) {
         usage(argv[0]);
         return -1;
     }
 
-    /* TODO: use getopt instead */
-    
-    if (strncmp(argv[1], "-np", 3) == 0)
-        session->instances = atoi(argv[2]); 
+    /* np and the executable come per stage; straggler percentiles and
+     * staging are for a single executable */
+    if (session->graph_file[0] != '\0') {
+        if (optind != argc || session->instances != 0 || session->np_auto ||
+                session->straggler_pct != 0 || session->idempotent ||
+                session->stage || session->host_file[0] == '\0') {
+            usage(argv[0]);
+            return -1;
+        }
+        fprintf(stdout, "launcher: graph = %s, hostfile = %s \n",
+            session->graph_file, session->host_file);
+        return 0;
+    }
 
-    if (strncmp(argv[3], "-hostfile", 9) == 0)
-        strcpy(session->host_file, argv[4]);
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    snprintf(session->exe_name, MAX_FILENAME_LEN, "%s", argv[optind]);
+    if (session->idempotent && session->straggler_pct == 0)
+        session->straggler_pct = STRAGGLER_PCT;
 
-    strcpy(session->exe_name, argv[5]);
     /* validate the options */
-    if ((session->instances < 0 &&
-            session->instances > MAX_INSTANCES) ||
+    if ((session->instances <= 0 && !session->np_auto) ||
+            session->instances > MAX_RANKS ||
             strncmp(session->host_file, "", 1) == 0 || 
             strncmp(session->exe_name, "", 1) == 0) {      
         return -1;
     }
 
-    fprintf(stdout, "launcher: instances = %d, hostfile = %s, exec = %s \n", 
-        session->instances, session->host_file, session->exe_name);
+    if (session->np_auto)
+        fprintf(stdout, "launcher: instances = auto, hostfile = %s, exec = %s"
+            " \n", session->host_file, session->exe_name);
+    else
+        fprintf(stdout, "launcher: instances = %d, hostfile = %s, exec = %s"
+            " \n", session->instances, session->host_file,
+            session->exe_name);
 
     return 0;
 }
 
 /*****************************************************************************/
 
-static int alloc_host_entry(launcher_session_t *session, int host_index)
+static int alloc_host_entry(launcher_session_t *session, char *hostname)
 {
-    int k;
-
-    k = sizeof(host_info_t);
-    session->host_info[host_index] = (host_info_t *)malloc(k);    
-    if (session->host_info[host_index] == NULL) {
+    host_table_t *t = &session->hosts;
+    table_col_t cols[] = {
+        TABLE_COL(t->fd), TABLE_COL(t->name), TABLE_COL(t->ip),
+        TABLE_COL(t->port), TABLE_COL(t->version), TABLE_COL(t->caps),
+        TABLE_COL(t->stage), TABLE_COL(t->running), TABLE_COL(t->queue),
+        TABLE_COL(t->inv), TABLE_COL(t->inv_state), TABLE_COL(t->sample),
+        TABLE_COL(t->health), TABLE_COL(t->health_state)
+    };
+
+    if (table_reserve(cols, sizeof(cols) / sizeof(cols[0]),
+            &t->capacity, t->count + 1) == -1 ||
+            (t->name[t->count] = strdup(hostname)) == NULL) {
         fprintf(stderr, "launcher: error allocating session, %s(%d) \n",
 	    strerror(errno), errno);
         return -1;  
     }
 
+    t->fd[t->count] = -1;
+    t->stage[t->count] = -1;
+    t->count += 1;
+
     return 0;
 } 
 
@@ -145,96 +457,104 @@ static int parse_hostfile(char *file)
     }
 
     memset(buffer, '\n', MAX_HOSTNAME_LEN);
-    session->host_count = 0;
     
     while(fgets(buffer, MAX_HOSTNAME_LEN, fp) != NULL) {
-	status = alloc_host_entry(session, session->host_count);
-	if (status == 0) {
-	    count = session->host_count;
-	    strcpy(session->host_info[count]->hostname, buffer);
-            fprintf(stdout, "launcher: host name: %s \n",
-                session->host_info[session->host_count]->hostname);
-            session->host_count += 1;
-        }
+        buffer[strcspn(buffer, " \t\r\n")] = '\0';
+        if (buffer[0] == '\0')
+            continue;
+
+	status = alloc_host_entry(session, buffer);
+	if (status == 0)
+            fprintf(stdout, "launcher: host name: %s \n", buffer);
         memset(buffer, '\n', MAX_HOSTNAME_LEN);
     }
 
     fclose(fp);
-    count = session->host_count;
+    count = session->hosts.count;
 
     /* using count for count and index; hence +1 */
     return count;
 }
 
 /*****************************************************************************/
+/* the allgather on the bulk channel, cut between keys so a stop never
+ * waits behind more than one frame of it */
 
-static void launcher_rxmsg_callback(int fd,
-        unsigned int msg_type, char *buf, int len)
+static int launcher_kvs_send(int fd, char *buf, int len)
 {
-    launcher_session_t *s = get_launcher_session();
-
-    /* FIX, find a better way to report the status */
-    
-    /* for now, just print the termination status */
-    fprintf(stdout, "%s \n", buf);
-    
-    s->nr_ackd += 1;
-    if (s->nr_active <= s->nr_ackd) {
-        fprintf(stdout, "launcher: recvd ack from all \n");
-        launcher_session_cleanup(s);
-    }
-}
+    int n;
+    int off = 0;
+    comlink_header_t header;
 
-/*****************************************************************************/
+    do {
+        n = wire_kvs_cut(buf + off, len - off, COMLINK_BULK_FRAME);
+        header.type = off + n < len ? KVS_ALLGATHER_PART : KVS_ALLGATHER;
+        header.len = n;
+        if (n == 0 && off + n < len)
+            return -1;
+        if (comlink_send_bulk(fd, &header, buf + off, n) == -1)
+            return -1;
+        off += n;
+    } while (off < len);
 
-static void launcher_shutdown_callback(int fd)
-{
-    fprintf(stderr, "launcher: peer shotdown, cleaning-up \n");
-    if (fd > 0)
-        comlink_client_close(fd);
+    return 0;
 }
 
 /*****************************************************************************/
-/* launcher session setup is essentially setting up comlink */
+/* one fence per node, in parts if it is large; once every node of the
+ * stage is in, all puts go back out as one allgather, so a wire-up costs
+ * O(nodes) messages. A node that can't have it is told the fence failed */
 
-static int launcher_session_setup(launcher_session_t *session)
+static void launcher_kvs_fence(launcher_session_t *s, job_stage_t *st,
+        char *buf, int len, int last)
 {
-    int fd;
     int i;
-    struct sockaddr skt_addr;
-    struct sockaddr_in *remote_addr;
-    
-    comlink_params_t *cl_params = &session->cl_params;
+    int fd;
+    char *p;
+    comlink_header_t header;
 
-    session->nr_ackd = 0;
-    session->nr_active = 0;
-    session->valid = 1;
-    
-    memset(cl_params, 0, sizeof(comlink_params_t));
-    cl_params->buffer = comlink_buf;
-    cl_params->buf_len = COMLINK_BUF_SIZE;
-    cl_params->local_port = COMLINK_PORT;
-    cl_params->remote_port = COMLINK_PORT;
-    cl_params->receive_cb = launcher_rxmsg_callback;
-    cl_params->shutdown_cb = launcher_shutdown_callback;
-    
-    for(i = 0; i < session->host_count; i++) {
-        if (hostname_to_netaddr(session->host_info[i]->hostname,
-                &skt_addr) != 0)
-            continue;    
-
-        remote_addr = (struct sockaddr_in *)&skt_addr;
-        cl_params->remote_ip = ntohl(remote_addr->sin_addr.s_addr);
-        fd = comlink_client_setup(cl_params);
-        session->skt_conns[i] = fd;
+    if (st == NULL)
+        return;
+
+    if (!st->kvs_failed && st->kvs_len + len > st->kvs_size) {
+        p = realloc(st->kvs_buf, st->kvs_len + len);
+        if (p == NULL) {
+            fprintf(stderr, "launcher: kvs allgather out of memory \n");
+            st->kvs_failed = 1;
+        } else {
+            st->kvs_buf = p;
+            st->kvs_size = st->kvs_len + len;
+        }
+    }
+
+    if (!st->kvs_failed) {
+        memcpy(st->kvs_buf + st->kvs_len, buf, len);
+        st->kvs_len += len;
+    }
+    if (!last)
+        return;
+
+    st->kvs_fenced += 1;
+    if (st->kvs_fenced < st->nr_hosts)
+        return;
+
+    header.type = KVS_FAILED;
+    header.len = 0;
+    for(i = 0; i < st->nr_hosts; i++) {
+        fd = s->hosts.fd[st->host[i]];
         if (fd == -1)
-            fprintf(stderr, "launcher: comlink client setup failed for ip %08x \n",
-                cl_params->remote_ip);
-        else
-          session->nr_active += 1;
+            continue;
+        if (!st->kvs_failed &&
+                launcher_kvs_send(fd, st->kvs_buf, st->kvs_len) == 0)
+            continue;
+        fprintf(stderr, "launcher: kvs fence failed on %s \n",
+            s->hosts.name[st->host[i]]);
+        comlink_send(fd, &header, "", 0);
     }
-    
-    return 0;
+
+    st->kvs_len = 0;
+    st->kvs_fenced = 0;
+    st->kvs_failed = 0;
 }
 
 /*****************************************************************************/
@@ -256,94 +576,1711 @@ static int launcher_send_ctrlmsg(int fd, char *msg, launcher_session_t *session)
     int ret = 0;
     comlink_header_t header;
     
-    len = sizeof(msg);
+    len = strlen(msg) + 1;
     fill_header(&header, CTRL_MESSAGE, len);
-    ret = comlink_sendto_server(fd, &header, msg, len);
+    ret = comlink_send(fd, &header, msg, len);
 
     return ret;
 }
 
 /*****************************************************************************/
+/* structured payloads go out as wire records */
 
-static int launcher_session_start(launcher_session_t *session)
+static int launcher_send_msg(int fd, int type, const wire_schema_t *schema,
+        void *msg)
 {
-    int i;
     int len;
-    int ret = 0;
+    char buf[WIRE_MAX_RECORD];
     comlink_header_t header;
 
-    for(i = 0; i < session->host_count; i++) {
-        fprintf(stdout, "host(%d) = %s \n",
-            i, session->host_info[i]->hostname);
-        
-        len = sizeof(session->instances);
-        fill_header(&header, PROC_INSTANCES, len);
-        ret = comlink_sendto_server(i, &header, (char *)&session->instances, len);
+    len = wire_put(schema, msg, buf, sizeof(buf));
+    if (len == -1)
+        return -1;
+    fill_header(&header, type, len);
 
-        len = strlen(session->exe_name);
-        fill_header(&header, EXEC_FILENAME, len);
-        ret = comlink_sendto_server(i, &header, session->exe_name, len);
+    return comlink_send(fd, &header, buf, len);
+}
 
-        if (launcher_send_ctrlmsg(i, "start", session) == -1)
-            fprintf(stderr,
-                "launcher: start cmd failed; host will be ignored \n");
+/*****************************************************************************/
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*****************************************************************************/
+/* gang barrier; every node of the stage has staged its instances,
+ * release them all in one batch of sends */
+
+static void launcher_gang_ready(launcher_session_t *s, job_stage_t *st)
+{
+    int i;
+
+    if (st == NULL)
+        return;
+
+    st->gang_ready += 1;
+    if (st->gang_ready < st->nr_hosts)
+        return;
+
+    for(i = 0; i < st->nr_hosts; i++) {
+        if (s->hosts.fd[st->host[i]] != -1)
+            launcher_send_ctrlmsg(s->hosts.fd[st->host[i]], "release", s);
     }
+    st->gang_release_ns = now_ns();
+}
 
-    /* start the client process to wait for reply messages */
-    comlink_client_start();
-    
-    return ret;
+/*****************************************************************************/
+/* node stamps are moved to launcher time before they are compared */
+
+static void launcher_gang_times(job_stage_t *st, int fd, gang_times_t *t)
+{
+    comlink_clock_t c;
+
+    if (st == NULL || t->count == 0)
+        return;
+
+    if (comlink_clock_get(fd, &c) == 0) {
+        t->first_ns -= c.offset_ns;
+        t->last_ns -= c.offset_ns;
+        if (c.err_ns > st->gang_err_ns)
+            st->gang_err_ns = c.err_ns;
+    } else {
+        st->gang_unsynced += 1;
+    }
+
+    if (st->gang_ranks == 0 || t->first_ns < st->gang_first_ns)
+        st->gang_first_ns = t->first_ns;
+    if (st->gang_ranks == 0 || t->last_ns > st->gang_last_ns)
+        st->gang_last_ns = t->last_ns;
+    st->gang_ranks += t->count;
 }
 
 /*****************************************************************************/
-/* handles SIGINT */
+/* staging and broadcast bytes to the hosts, and what compression made of
+ * them on the way */
 
-static void launcher_signal_handler(int signal)
+static void launcher_print_bulk(launcher_session_t *s)
 {
     int i;
-    launcher_session_t *session = get_launcher_session();
+    int codec = COMLINK_CODEC_NONE;
+    long long bytes = 0;
+    long long zip_in = 0;
+    long long zip_out = 0;
+    comlink_chan_stats_t cs;
+
+    for(i = 0; i < s->hosts.count; i++) {
+        if (s->hosts.fd[i] == -1 ||
+                comlink_stats(s->hosts.fd[i], COMLINK_CHAN_BULK, &cs) == -1)
+            continue;
+        bytes += cs.bytes;
+        zip_in += cs.zip_in;
+        zip_out += cs.zip_out;
+        if (cs.zip_in > 0 && codec == COMLINK_CODEC_NONE)
+            codec = cs.codec;
+    }
 
-    fprintf(stdout, "Ctrl+C, exiting \n");
-    for(i = 0; i < session->host_count; i++)
-        launcher_send_ctrlmsg(i, "stop", session);
-        
-    launcher_session_cleanup(session);
+    if (bytes == 0)
+        return;
+
+    if (zip_in == 0)
+        fprintf(stdout, "launcher: %.1f MB of bulk data to the hosts, sent"
+            " as is \n", bytes / 1e6);
+    else
+        fprintf(stdout, "launcher: %.1f MB of bulk data to the hosts, %.1f MB"
+            " of it %s compressed to %.1f MB, %.2fx \n", bytes / 1e6,
+            zip_in / 1e6, comlink_codec_name(codec), zip_out / 1e6,
+            (double)zip_in / zip_out);
 }
 
 /*****************************************************************************/
+/* job summary, printed once every host has reported */
 
-int main(int argc, char *argv[])
+static void launcher_print_summary(launcher_session_t *s)
 {
-    struct sigaction sa;
-    
-    launcher_session_t *session = get_launcher_session();
-     
-    /* simple cmdline parser; use getopt instead */
-    if (parse_cmdline(argc, argv, session) == -1) {
-        fprintf(stderr, "invalid command options \n");
-        exit(2);
+    int i;
+    int nr_failed = 0;
+    job_stage_t *st;
+    long long max_wait = 0;
+    long long max_run = 0;
+    long long sum_run = 0;
+    rank_table_t *t = &s->ranks;
+
+    /* column passes; status and runtime are dense per rank, and stay 0
+     * for the ranks of skipped stages */
+    for(i = 0; i < t->count; i++)
+        nr_failed += t->status[i] != 0 || (t->state[i] & RANK_TIMEDOUT);
+    for(i = 0; i < t->count; i++) {
+        sum_run += t->runtime_ns[i];
+        if (t->runtime_ns[i] > max_run)
+            max_run = t->runtime_ns[i];
+    }
+    if (s->nr_done > 0)
+        fprintf(stdout, "launcher: %d of %d ranks failed, runtime mean"
+            " %.3f s, max %.3f s \n", nr_failed, s->nr_done,
+            sum_run / 1e9 / s->nr_done, max_run / 1e9);
+
+    for(i = 0; i < s->hosts.count; i++) {
+        if (s->hosts.queue[i].max_wait_ns > max_wait)
+            max_wait = s->hosts.queue[i].max_wait_ns;
+    }
+    if (s->nr_timeout_inst + s->nr_timeout_wall > 0)
+        fprintf(stdout, "launcher: %d ranks timed out, %d past"
+            " -instance-timeout, %d at the walltime \n",
+            s->nr_timeout_inst + s->nr_timeout_wall, s->nr_timeout_inst,
+            s->nr_timeout_wall);
+
+    if (s->nr_waited > 0)
+        fprintf(stdout, "launcher: %d ranks queued for a slot, mean wait"
+            " %.3f s, max %.3f s \n", s->nr_waited,
+            s->queue_wait_ns / 1e9 / s->nr_waited, max_wait / 1e9);
+
+    for(i = 0; i < s->nr_stages && s->gang; i++) {
+        st = &s->stages[i];
+        if (st->gang_ranks > 0)
+            fprintf(stdout, "launcher: %s%sgang start skew %.3f ms across %d"
+                " ranks, last start %.3f ms after release, clocks +-%.3f ms"
+                " \n", s->nr_stages > 1 ? st->name : "",
+                s->nr_stages > 1 ? " " : "",
+                (st->gang_last_ns - st->gang_first_ns) / 1e6, st->gang_ranks,
+                (st->gang_last_ns - st->gang_release_ns) / 1e6,
+                st->gang_err_ns / 1e6);
+        if (st->gang_unsynced > 0)
+            fprintf(stdout, "launcher: %d nodes gave gang times in their own"
+                " clock, offset unknown \n", st->gang_unsynced);
     }
 
-    /* reads hostfile returns the number of hosts */
-    if (parse_hostfile(session->host_file) <= 0) {
-        fprintf(stderr, "no hosts found in the hostfile \n");
-        exit(2);
+    if (s->stage)
+        fprintf(stdout, "launcher: executable sent to %d of %d hosts,"
+            " %.1f MB, the rest had it cached \n", s->nr_stage_fetch,
+            s->nr_active, s->stage_bytes / 1e6);
+
+    if (s->bcast_plan != NULL)
+        fprintf(stdout, "launcher: broadcast reached %d of %d hosts, %d"
+            " failed to keep it, %d fed directly \n", s->nr_bcast_done,
+            s->bcast_plan->nr_nodes, s->nr_bcast_failed, s->nr_bcast_lost);
+
+    if (s->stdin_on)
+        fprintf(stdout, "launcher: %lld bytes of stdin streamed, %d hosts"
+            " took all of it \n", s->stdin_sent, s->nr_stdin_hosts);
+
+    if (s->straggler_pct > 0)
+        fprintf(stdout, "launcher: %d stragglers past p%d, %d speculative"
+            " copies, %d finished first \n", s->nr_stragglers,
+            s->straggler_pct, s->nr_speculated, s->nr_spec_won);
+
+    sample_print(s);
+    launcher_print_bulk(s);
+}
+
+/*****************************************************************************/
+
+static long long mono_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*****************************************************************************/
+/* cb runs once on the loop thread after ms; -1 if it can't be armed */
+
+static int launcher_oneshot(int ms, void (*cb)(int fd))
+{
+    int fd;
+    struct itimerspec its;
+
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd == -1)
+        return -1;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = ms / 1000;
+    its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+    if (timerfd_settime(fd, 0, &its, NULL) == -1 ||
+            comlink_watch_fd(fd, cb) == -1) {
+        close(fd);
+        return -1;
     }
 
-    /* session setup */
-    if (launcher_session_setup(session) != 0)
-        exit(2);
+    return fd;
+}
 
-    /* regster the signal handler for handing terminal signals */
-    memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = launcher_signal_handler;
-    if (sigaction(SIGINT, &sa, NULL) == -1) {
-        fprintf(stdout,
-            "Warning, session will be unstable \n");
+/*****************************************************************************/
+
+static void launcher_stop_report(launcher_session_t *s)
+{
+    if (s->fail_rank != -1)
+        fprintf(stdout, "launcher: rank %d on %s failed first, %s %d, job"
+            " gone %.3f ms later \n", s->fail_rank,
+            s->hosts.name[s->fail_host],
+            WIFEXITED(s->fail_status) ? "exit status" : "signal",
+            WIFEXITED(s->fail_status) ? WEXITSTATUS(s->fail_status) :
+            WTERMSIG(s->fail_status), (mono_ns() - s->fail_ns) / 1e6);
+
+    fprintf(stdout, "launcher: job torn down in %.3f ms, %d of %d hosts"
+        " confirmed \n", (mono_ns() - s->stop_ns) / 1e6, s->nr_stopped,
+        s->nr_stopping);
+    fprintf(stdout, "launcher: %d process groups stopped, %d needed SIGKILL,"
+        " slowest node %.3f ms \n", s->stop_groups, s->stop_killed,
+        s->stop_node_ns / 1e6);
+}
+
+/*****************************************************************************/
+
+static void launcher_stop_timeout(int fd)
+{
+    launcher_session_t *s = get_launcher_session();
+
+    fprintf(stderr, "launcher: %d hosts did not confirm the stop \n",
+        s->nr_stopping - s->nr_stopped);
+    launcher_stop_report(s);
+    launcher_session_cleanup(s);
+}
+
+/*****************************************************************************/
+/* a listener has no instances left */
+
+static void launcher_stop_done(launcher_session_t *s, stop_report_t *r)
+{
+    if (s->stop_ns == 0)
+        return;
+
+    s->nr_stopped += 1;
+    s->stop_groups += r->groups;
+    s->stop_killed += r->killed;
+    if (r->time_ns > s->stop_node_ns)
+        s->stop_node_ns = r->time_ns;
+
+    if (s->nr_stopped < s->nr_stopping)
+        return;
+
+    launcher_stop_report(s);
+    launcher_session_cleanup(s);
+}
+
+/*****************************************************************************/
+/* stop to every host at once; the sends are only queued here and go out
+ * in the loop's next flush pass, none waits for another host's reply */
+
+static void launcher_job_stop(launcher_session_t *s)
+{
+    int i;
+
+    if (s->stop_ns != 0)
+        return;
+
+    s->stop_ns = mono_ns();
+    s->nr_stopping = 0;
+    for(i = 0; i < s->hosts.count; i++) {
+        if (s->hosts.fd[i] != -1 &&
+                launcher_send_ctrlmsg(s->hosts.fd[i], "stop", s) != -1)
+            s->nr_stopping += 1;
     }
-    
-    /* starts the remote execution; waits until done */
-    launcher_session_start(session);
+
+    if (s->nr_stopping == 0) {
+        launcher_session_cleanup(s);
+        return;
+    }
+
+    launcher_oneshot(STOP_TIMEOUT_MS, launcher_stop_timeout);
+}
+
+/*****************************************************************************/
+/* the SIGINT handler only kicks the event fd; the stop runs in the loop */
+
+static void launcher_stop_ready(int fd)
+{
+    uint64_t val;
+    launcher_session_t *s = get_launcher_session();
+
+    while (read(fd, &val, sizeof(val)) > 0)
+        ;
+
+    fprintf(stdout, "Ctrl+C, stopping the job \n");
+    launcher_job_stop(s);
+}
+
+/*****************************************************************************/
+
+static int launcher_stop_setup(launcher_session_t *s)
+{
+    s->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (s->stop_fd == -1)
+        return -1;
+
+    if (comlink_watch_fd(s->stop_fd, launcher_stop_ready) == -1) {
+        close(s->stop_fd);
+        s->stop_fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+static int launcher_host_index(launcher_session_t *s, int fd)
+{
+    if (fd < 0 || fd >= s->nr_fds)
+        return -1;
+
+    return s->fd_host[fd];
+}
+
+/*****************************************************************************/
+/* listeners number ranks within the stage; the rank table holds all of
+ * them, each stage from its rank_off */
+
+static int launcher_rank_index(launcher_session_t *s, job_stage_t *st,
+        rank_event_t *ev)
+{
+    if (st == NULL || ev->rank < 0 || ev->rank >= st->job_size ||
+            st->rank_off + ev->rank >= s->ranks.count ||
+            (ev->copy != 0 && ev->copy != 1))
+        return -1;
+
+    return st->rank_off + ev->rank;
+}
+
+/*****************************************************************************/
+
+static void launcher_rank_start(launcher_session_t *s, int fd,
+        rank_event_t *ev)
+{
+    int h = launcher_host_index(s, fd);
+    int r = launcher_rank_index(s, graph_host_stage(s, h), ev);
+    rank_table_t *t = &s->ranks;
+
+    if (h == -1 || r == -1)
+        return;
+
+    if (ev->time_ns > 0) {
+        s->nr_waited += 1;
+        s->queue_wait_ns += ev->time_ns;
+    }
+
+    t->state[r] |= RANK_RUN0 << ev->copy;
+    if (ev->copy != 0)
+        return; /* slot already taken when the copy was requested */
+
+    t->host[r] = h;
+    t->start_ns[r] = mono_ns();
+    s->hosts.running[h] += 1;
+}
+
+/*****************************************************************************/
+
+static void launcher_node_queue(launcher_session_t *s, int fd,
+        node_queue_t *q)
+{
+    int h = launcher_host_index(s, fd);
+
+    if (h == -1)
+        return;
+
+    if (q->queued > 0 && s->hosts.queue[h].peak_queued == 0)
+        fprintf(stdout, "launcher: %s runs %d instances at once, %d queued \n",
+            s->hosts.name[h], q->slots, q->queued);
+    /* each stage on the host starts its own report */
+    if (q->max_wait_ns < s->hosts.queue[h].max_wait_ns)
+        q->max_wait_ns = s->hosts.queue[h].max_wait_ns;
+    s->hosts.queue[h] = *q;
+}
+
+/*****************************************************************************/
+/* pick a slot for a speculative copy; another host first, since a slow
+ * node is the usual reason for a straggler */
+
+static int launcher_idle_host(launcher_session_t *s, int avoid)
+{
+    int i;
+    int best = -1;
+
+    for(i = 0; i < s->hosts.count; i++) {
+        if (s->hosts.fd[i] == -1 || s->hosts.queue[i].queued > 0 ||
+                s->hosts.running[i] >= s->hosts.queue[i].slots ||
+                !(s->hosts.caps[i] & WIRE_CAP_SPECULATE))
+            continue;
+        if (best == -1 || (best == avoid && i != avoid) ||
+                (i != avoid && s->hosts.running[i] < s->hosts.running[best]))
+            best = i;
+    }
+
+    return best;
+}
+
+/*****************************************************************************/
+
+static void launcher_speculate(launcher_session_t *s, int rank)
+{
+    int h;
+    rank_table_t *t = &s->ranks;
+    rank_event_t ev;
+
+    h = launcher_idle_host(s, t->host[rank]);
+    if (h == -1)
+        return; /* no free slot yet, retried on the next tick */
+
+    memset(&ev, 0, sizeof(ev));
+    ev.rank = rank;
+    ev.copy = 1;
+    if (launcher_send_msg(s->hosts.fd[h], SPAWN_RANK, &wire_rank_event,
+            &ev) == -1)
+        return;
+
+    t->state[rank] |= RANK_SPECULATED;
+    t->spec_host[rank] = h;
+    s->hosts.running[h] += 1;
+    s->nr_speculated += 1;
+    fprintf(stdout, "launcher: speculative copy of rank %d on %s \n",
+        rank, s->hosts.name[h]);
+}
+
+/*****************************************************************************/
+/* the stage goes to its hosts as a job of its own; the listeners keep
+ * their sessions from one stage to the next */
+
+static void launcher_stage_start(launcher_session_t *s, job_stage_t *st)
+{
+    int i;
+    int h;
+    int_msg_t n;
+    job_layout_t layout;
+    job_limits_t limits;
+    comlink_header_t header;
+
+    st->state = STAGE_RUNNING;
+    st->start_ns = mono_ns();
+
+    /* a stage that starts after the walltime still gets a moment of it,
+     * its ranks are then reported as timed out */
+    limits.walltime_ms = 0;
+    limits.instance_timeout_ms = s->inst_timeout_ms;
+    if (s->walltime_ms > 0) {
+        limits.walltime_ms = s->walltime_ms -
+            (st->start_ns - s->job_start_ns) / 1000000;
+        if (limits.walltime_ms <= 0)
+            limits.walltime_ms = 1;
+    }
+    if (s->nr_stages > 1)
+        fprintf(stdout, "launcher: starting stage %s, %d ranks on %d hosts"
+            " \n", st->name, st->job_size, st->nr_hosts);
+
+    layout.rank_base = 0;
+    layout.job_size = st->job_size;
+    for(i = 0; i < st->nr_hosts; i++) {
+        h = st->host[i];
+        s->hosts.stage[h] = st - s->stages;
+        n.value = st->np[i];
+
+        launcher_send_msg(s->hosts.fd[h], PROC_INSTANCES, &wire_int, &n);
+        launcher_send_msg(s->hosts.fd[h], JOB_LAYOUT, &wire_job_layout,
+            &layout);
+        layout.rank_base += st->np[i];
+
+        if (limits.walltime_ms > 0 || limits.instance_timeout_ms > 0) {
+            if (s->hosts.caps[h] & WIRE_CAP_LIMITS)
+                launcher_send_msg(s->hosts.fd[h], JOB_LIMITS,
+                    &wire_job_limits, &limits);
+            else
+                fprintf(stderr, "launcher: %s can't enforce the time"
+                    " limits \n", s->hosts.name[h]);
+        }
+
+        if (s->stdin_on && s->stdin_fd[h] != -1) {
+            fill_header(&header, STDIN_OPEN, 0);
+            comlink_send(s->hosts.fd[h], &header, NULL, 0);
+        }
+
+        if (s->stage && (s->hosts.caps[h] & WIRE_CAP_STAGE)) {
+            launcher_send_msg(s->hosts.fd[h], STAGE_OFFER,
+                &wire_stage_offer, &s->stage_offer);
+        } else {
+            fill_header(&header, EXEC_FILENAME, strlen(st->exe_name));
+            comlink_send(s->hosts.fd[h], &header, st->exe_name,
+                strlen(st->exe_name));
+        }
+
+        if (launcher_send_ctrlmsg(s->hosts.fd[h],
+                s->gang ? "stage" : "start", s) == -1)
+            fprintf(stderr,
+                "launcher: start cmd failed; host will be ignored \n");
+    }
+}
+
+/*****************************************************************************/
+/* starts every stage whose dependencies are done and whose hosts are
+ * free; the job is over with the last stage */
+
+static void launcher_dispatch(launcher_session_t *s)
+{
+    int i;
+
+    for(i = 0; i < s->nr_stages; i++) {
+        if (s->stages[i].state == STAGE_WAITING &&
+                graph_ready(s, &s->stages[i]))
+            launcher_stage_start(s, &s->stages[i]);
+    }
+
+    if (s->nr_finished < s->nr_stages)
+        return;
+
+    fprintf(stdout, "launcher: recvd ack from all \n");
+    launcher_print_summary(s);
+    launcher_session_cleanup(s);
+}
+
+/*****************************************************************************/
+/* a stage is over once its hosts have reported and every rank has a
+ * result; its hosts are free for the next one */
+
+static void launcher_check_done(launcher_session_t *s, job_stage_t *st)
+{
+    int i;
+
+    /* a stopping job ends with the teardown reports instead */
+    if (st == NULL || st->state != STAGE_RUNNING || s->stop_ns != 0 ||
+            st->nr_ackd < st->nr_hosts ||
+            (s->ranks.count > 0 && st->nr_done < st->job_size))
+        return;
+
+    st->state = st->nr_failed > 0 ? STAGE_FAILED : STAGE_DONE;
+    st->end_ns = mono_ns();
+    s->nr_finished += 1;
+    for(i = 0; i < st->nr_hosts; i++)
+        s->hosts.stage[st->host[i]] = -1;
+
+    if (s->nr_stages > 1)
+        fprintf(stdout, "launcher: stage %s %s in %.3f s, %d of %d ranks"
+            " failed \n", st->name, st->nr_failed > 0 ? "failed" : "done",
+            (st->end_ns - st->start_ns) / 1e9, st->nr_failed, st->job_size);
+
+    launcher_dispatch(s);
+}
+
+/*****************************************************************************/
+/* keeps the straggler_k + 1 fastest runtimes in a max-heap; its top is
+ * then the pct percentile of the whole job */
+
+static void launcher_fastest_add(launcher_session_t *s, long long v)
+{
+    int i;
+    int c;
+    long long *h = s->fastest;
+
+    if (h == NULL)
+        return;
+
+    if (s->nr_fastest <= s->straggler_k) {
+        for(i = s->nr_fastest++; i > 0 && h[(i - 1) / 2] < v;
+                i = (i - 1) / 2)
+            h[i] = h[(i - 1) / 2];
+        h[i] = v;
+        return;
+    }
+
+    if (v >= h[0])
+        return;
+
+    for(i = 0; (c = 2 * i + 1) < s->nr_fastest; i = c) {
+        if (c + 1 < s->nr_fastest && h[c + 1] > h[c])
+            c += 1;
+        if (h[c] <= v)
+            break;
+        h[i] = h[c];
+    }
+    h[i] = v;
+}
+
+/*****************************************************************************/
+/* first successful copy wins and the other one is killed; a failed copy
+ * only counts once no other copy is left running */
+
+static void launcher_rank_exit(launcher_session_t *s, int fd,
+        rank_event_t *ev)
+{
+    int h = launcher_host_index(s, fd);
+    int other = !ev->copy;
+    int failed = ev->status != 0 || ev->timeout != TIMEOUT_NONE;
+    int r;
+    unsigned char *state;
+    job_stage_t *st = graph_host_stage(s, h);
+    rank_table_t *t = &s->ranks;
+    rank_event_t kill_ev;
+
+    r = launcher_rank_index(s, st, ev);
+    if (h == -1 || r == -1)
+        return;
+
+    state = &t->state[r];
+    *state &= ~(RANK_RUN0 << ev->copy);
+    s->hosts.running[h] -= 1;
+    if (*state & RANK_DONE)
+        return;
+
+    if (failed && (*state & (RANK_RUN0 << other)))
+        return;
+
+    *state |= RANK_DONE;
+    t->status[r] = ev->status;
+    t->runtime_ns[r] = ev->time_ns;
+    s->nr_done += 1;
+    st->nr_done += 1;
+    st->nr_failed += failed;
+    launcher_fastest_add(s, ev->time_ns);
+    if (ev->copy != 0)
+        s->nr_spec_won += 1;
+
+    if (ev->timeout != TIMEOUT_NONE) {
+        *state |= RANK_TIMEDOUT;
+        if (ev->timeout == TIMEOUT_WALLTIME)
+            s->nr_timeout_wall += 1;
+        else
+            s->nr_timeout_inst += 1;
+        fprintf(stdout, "launcher: rank %d on %s timed out after %.3f s, %s"
+            " \n", ev->rank, s->hosts.name[h], ev->time_ns / 1e9,
+            ev->timeout == TIMEOUT_WALLTIME ? "walltime" : "instance timeout");
+    }
+
+    /* ranks killed by the stop itself don't count as the first failure */
+    if (failed && s->abort_on_failure && s->stop_ns == 0) {
+        s->fail_rank = ev->rank;
+        s->fail_host = h;
+        s->fail_status = ev->status;
+        s->fail_ns = mono_ns();
+        fprintf(stdout, "launcher: rank %d failed on %s, aborting the job \n",
+            ev->rank, s->hosts.name[h]);
+        launcher_job_stop(s);
+        return;
+    }
+
+    if (*state & (RANK_RUN0 << other)) {
+        memset(&kill_ev, 0, sizeof(kill_ev));
+        kill_ev.rank = ev->rank;
+        kill_ev.copy = other;
+        launcher_send_msg(s->hosts.fd[other ? t->spec_host[r] :
+            t->host[r]], KILL_RANK, &wire_rank_event, &kill_ev);
+    }
+
+    launcher_check_done(s, st);
+}
+
+/*****************************************************************************/
+/* the pct percentile of the whole job is known once that share of the
+ * ranks has finished; whatever is still running well past it is flagged */
+
+static void launcher_straggler_tick(int fd)
+{
+    int i;
+    uint64_t ticks;
+    long long now;
+    long long limit;
+    long long pct_ns;
+    unsigned char *state;
+    rank_table_t *t;
+    launcher_session_t *s = get_launcher_session();
+
+    t = &s->ranks;
+    if (read(fd, &ticks, sizeof(ticks)) != sizeof(ticks) ||
+            s->nr_fastest <= s->straggler_k || s->nr_done == s->job_size ||
+            s->stop_ns != 0)
+        return;
+
+    pct_ns = s->fastest[0];
+    limit = pct_ns * STRAGGLER_SLACK_PCT / 100;
+    if (limit < STRAGGLER_MIN_NS)
+        limit = STRAGGLER_MIN_NS;
+
+    /* one pass over the state and start columns */
+    now = mono_ns();
+    state = t->state;
+    for(i = 0; i < t->count; i++) {
+        if ((state[i] & (RANK_DONE | RANK_RUN0)) != RANK_RUN0 ||
+                now - t->start_ns[i] <= limit)
+            continue;
+
+        if (!(state[i] & RANK_FLAGGED)) {
+            state[i] |= RANK_FLAGGED;
+            s->nr_stragglers += 1;
+            fprintf(stdout, "launcher: rank %d on %s straggling, %.2f s "
+                "vs p%d %.2f s \n", i, s->hosts.name[t->host[i]],
+                (now - t->start_ns[i]) / 1e9, s->straggler_pct,
+                pct_ns / 1e9);
+        }
+
+        if (s->idempotent && !(state[i] & RANK_SPECULATED))
+            launcher_speculate(s, i);
+    }
+}
+
+/*****************************************************************************/
+
+static int launcher_straggler_setup(launcher_session_t *s)
+{
+    int fd;
+    struct itimerspec its;
+
+    if (rank_table_alloc(&s->ranks, s->job_size) == -1)
+        return -1;
+
+    if (s->straggler_pct == 0)
+        return 0;
+
+    s->straggler_k = (s->job_size * (long long)s->straggler_pct + 99) /
+        100 - 1;
+    s->nr_fastest = 0;
+    s->fastest = calloc(s->straggler_k + 1, sizeof(long long));
+    if (s->fastest == NULL)
+        return -1;
+
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "launcher: timerfd, %s(%d) \n",
+            strerror(errno), errno);
+        return -1;
+    }
+
+    memset(&its, 0, sizeof(its));
+    its.it_interval.tv_nsec = STRAGGLER_TICK_MS * 1000000L;
+    its.it_value = its.it_interval;
+    if (timerfd_settime(fd, 0, &its, NULL) == -1 ||
+            comlink_watch_fd(fd, launcher_straggler_tick) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*****************************************************************************/
+/* hashes the executable once; its fd stays open for sendfile */
+
+static int launcher_stage_setup(launcher_session_t *s)
+{
+    int n;
+    char *buf;
+    struct stat st;
+    sha256_ctx_t ctx;
+    char hex[SHA256_HEX_LEN];
+    stage_offer_t *offer = &s->stage_offer;
+
+    s->stage_fd = open(s->exe_name, O_RDONLY | O_CLOEXEC);
+    if (s->stage_fd == -1 || fstat(s->stage_fd, &st) == -1 ||
+            !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "launcher: can't stage %s, %s(%d) \n",
+            s->exe_name, strerror(errno), errno);
+        return -1;
+    }
+
+    buf = malloc(STAGE_CHUNK);
+    if (buf == NULL)
+        return -1;
+
+    sha256_init(&ctx);
+    while ((n = read(s->stage_fd, buf, STAGE_CHUNK)) > 0)
+        sha256_update(&ctx, buf, n);
+    free(buf);
+    if (n == -1)
+        return -1;
+
+    memset(offer, 0, sizeof(stage_offer_t));
+    sha256_final(&ctx, offer->hash);
+    offer->size = st.st_size;
+    offer->mode = st.st_mode & 0777;
+    snprintf(offer->path, sizeof(offer->path), "%s", s->exe_name);
+
+    sha256_hex(offer->hash, hex);
+    fprintf(stdout, "launcher: staging %lld bytes, sha256 %s \n",
+        offer->size, hex);
+
+    return 0;
+}
+
+/*****************************************************************************/
+/* an empty chunk tells the listener to give up and run the path; it goes
+ * behind whatever was queued. A link that can't take even that is
+ * dropped, the listener would wait for the rest forever */
+
+static void launcher_stage_abort(launcher_session_t *s, int fd, int h)
+{
+    char none = 0;
+    comlink_header_t header;
+
+    fprintf(stderr, "launcher: staging to %s failed, it runs %s \n",
+        s->hosts.name[h], s->stage_offer.path);
+    fill_header(&header, STAGE_DATA, 0);
+    if (comlink_send_bulk(fd, &header, &none, 0) == 0)
+        return;
+
+    fprintf(stderr, "launcher: dropping %s \n", s->hosts.name[h]);
+    comlink_client_close(fd);
+}
+
+/*****************************************************************************/
+/* a listener misses the executable; the chunks go out by sendfile, all
+ * from the one descriptor however many hosts fetch */
+
+static void launcher_stage_fetch(launcher_session_t *s, int fd,
+        stage_offer_t *req)
+{
+    int h = launcher_host_index(s, fd);
+    int len;
+    long long off;
+    comlink_header_t header;
+
+    if (h == -1 || s->stage_fd == -1 ||
+            memcmp(req->hash, s->stage_offer.hash, SHA256_LEN) != 0)
+        return;
+
+    fprintf(stdout, "launcher: sending the executable to %s \n",
+        s->hosts.name[h]);
+    s->nr_stage_fetch += 1;
+    s->stage_bytes += s->stage_offer.size;
+
+    for(off = 0; off < s->stage_offer.size; off += len) {
+        len = s->stage_offer.size - off < STAGE_CHUNK ?
+            s->stage_offer.size - off : STAGE_CHUNK;
+        fill_header(&header, STAGE_DATA, len);
+        if (comlink_send_file(fd, &header, s->stage_fd, off, len,
+                COMLINK_FILE_KEEP) == -1) {
+            launcher_stage_abort(s, fd, h);
+            return;
+        }
+    }
+}
+
+/*****************************************************************************/
+
+static int launcher_bcast_setup(launcher_session_t *s)
+{
+    struct stat st;
+
+    s->bcast_fd = open(s->bcast_file, O_RDONLY | O_CLOEXEC);
+    if (s->bcast_fd == -1 || fstat(s->bcast_fd, &st) == -1 ||
+            !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "launcher: can't broadcast %s, %s(%d) \n",
+            s->bcast_file, strerror(errno), errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*****************************************************************************/
+/* the relay tree covers the hosts that can relay, in hostfile order */
+
+static int launcher_bcast_tree(launcher_session_t *s)
+{
+    int i;
+    int n = 0;
+    struct stat st;
+    bcast_plan_t *plan;
+    bcast_node_t *nodes;
+
+    if (fstat(s->bcast_fd, &st) == -1)
+        return -1;
+
+    plan = calloc(1, sizeof(bcast_plan_t) +
+            s->nr_active * sizeof(bcast_node_t));
+    s->bcast_host = calloc(s->nr_active, sizeof(int));
+    if (plan == NULL || s->bcast_host == NULL) {
+        free(plan);
+        return -1;
+    }
+
+    nodes = (bcast_node_t *)(plan + 1);
+    for(i = 0; i < s->hosts.count && n < s->nr_active; i++) {
+        if (s->hosts.fd[i] == -1)
+            continue;
+        if (!(s->hosts.caps[i] & WIRE_CAP_BCAST)) {
+            fprintf(stderr, "launcher: %s can't take the broadcast \n",
+                s->hosts.name[i]);
+            continue;
+        }
+        nodes[n].ip = s->hosts.ip[i];
+        nodes[n].port = s->hosts.port[i];
+        s->bcast_host[n++] = i;
+    }
+
+    if (n == 0) {
+        free(plan);
+        return -1;
+    }
+
+    plan->id = (unsigned int)now_ns() ^ (unsigned int)getpid();
+    plan->nr_nodes = n;
+    plan->fanout = s->bcast_fanout;
+    plan->size = st.st_size;
+    plan->mode = st.st_mode & 0777;
+    snprintf(plan->path, sizeof(plan->path), "%s", s->bcast_file);
+    s->bcast_plan = plan;
+
+    fprintf(stdout, "launcher: broadcasting %lld bytes of %s, %s of %d \n",
+        plan->size, plan->path, plan->fanout == 1 ? "chain" : "tree",
+        plan->nr_nodes);
+
+    return 0;
+}
+
+/*****************************************************************************/
+/* every host gets its plan from the launcher, so it holds the start back
+ * even if its parent's copy comes later */
+
+static void launcher_bcast_plan(launcher_session_t *s, int index)
+{
+    int n;
+    int len;
+    int size;
+    char *buf;
+    comlink_header_t header;
+    bcast_plan_t *plan = s->bcast_plan;
+
+    size = wire_bcast_plan.max_len + plan->nr_nodes * wire_bcast_node.max_len;
+    buf = malloc(size);
+    if (buf == NULL)
+        return;
+
+    plan->index = index;
+    len = wire_put(&wire_bcast_plan, plan, buf, size);
+    n = wire_put_array(&wire_bcast_node, plan + 1, plan->nr_nodes,
+            buf + len, size - len);
+    if (len != -1 && n != -1) {
+        fill_header(&header, BCAST_PLAN, len + n);
+        comlink_send(s->hosts.fd[s->bcast_host[index]], &header, buf,
+            len + n);
+    }
+    free(buf);
+}
+
+/*****************************************************************************/
+/* the whole file to one tree node, straight from the page cache */
+
+static void launcher_bcast_feed(launcher_session_t *s, int index)
+{
+    int h = s->bcast_host[index];
+    int len;
+    long long off;
+    comlink_header_t header;
+
+    for(off = 0; off < s->bcast_plan->size; off += len) {
+        len = s->bcast_plan->size - off < BCAST_CHUNK ?
+            s->bcast_plan->size - off : BCAST_CHUNK;
+        fill_header(&header, BCAST_DATA, len);
+        if (comlink_send_file(s->hosts.fd[h], &header, s->bcast_fd, off,
+                len, COMLINK_FILE_KEEP) == -1) {
+            fprintf(stderr, "launcher: broadcast to %s failed \n",
+                s->hosts.name[h]);
+            return;
+        }
+    }
+}
+
+/*****************************************************************************/
+/* a relay can't reach one of its children; the launcher takes over */
+
+static void launcher_bcast_lost(launcher_session_t *s, int index)
+{
+    if (s->bcast_plan == NULL || index < 0 ||
+            index >= s->bcast_plan->nr_nodes)
+        return;
+
+    fprintf(stdout, "launcher: relay to %s failed, sending it directly \n",
+        s->hosts.name[s->bcast_host[index]]);
+    s->nr_bcast_lost += 1;
+    launcher_bcast_feed(s, index);
+}
+
+/*****************************************************************************/
+
+static void launcher_bcast_done(launcher_session_t *s, bcast_report_t *r)
+{
+    double ms;
+    bcast_plan_t *plan = s->bcast_plan;
+
+    if (plan == NULL || r->index < 0 || r->index >= plan->nr_nodes)
+        return;
+
+    s->nr_bcast_done += 1;
+    if (r->failed) {
+        s->nr_bcast_failed += 1;
+        fprintf(stderr, "launcher: %s could not keep %s \n",
+            s->hosts.name[s->bcast_host[r->index]], plan->path);
+    }
+
+    if (s->nr_bcast_done < plan->nr_nodes)
+        return;
+
+    ms = (mono_ns() - s->bcast_ns) / 1e6;
+    fprintf(stdout, "launcher: broadcast of %.1f MB to %d hosts took %.3f ms,"
+        " %.1f MB/s per host \n", plan->size / 1e6, plan->nr_nodes, ms,
+        ms > 0 ? plan->size / 1e3 / ms : 0);
+}
+
+/*****************************************************************************/
+/* the job itself; every host has said what it can do by now. The rank
+ * table holds the ranks of every stage, the broadcast goes to every host
+ * ahead of the first stage */
+
+static void launcher_job_start(launcher_session_t *session)
+{
+    int i;
+    job_stage_t *st;
+
+    session->job_size = 0;
+    for(i = 0; i < session->nr_stages; i++) {
+        st = &session->stages[i];
+        if (graph_hosts(session, st) == -1)
+            fprintf(stderr, "launcher: error allocating stage %s \n",
+                st->name);
+        st->rank_off = session->job_size;
+        session->job_size += st->job_size;
+    }
+
+    if (launcher_straggler_setup(session) == -1)
+        fprintf(stderr, "launcher: rank tracking unavailable \n");
+
+    if (session->stdin_on && stdin_setup(session) == -1) {
+        fprintf(stderr, "launcher: instances get no stdin \n");
+        session->stdin_on = 0;
+    }
+
+    if (session->bcast_fd != -1 && launcher_bcast_tree(session) == -1)
+        fprintf(stderr, "launcher: broadcast of %s failed \n",
+            session->bcast_file);
+
+    for(i = 0; i < session->hosts.count; i++)
+        fprintf(stdout, "host(%d) = %s \n",
+            i, session->hosts.name[i]);
+
+    for(i = 0; session->bcast_plan != NULL &&
+            i < session->bcast_plan->nr_nodes; i++)
+        launcher_bcast_plan(session, i);
+
+    /* may finish the job right away if no stage can run */
+    session->job_start_ns = mono_ns();
+    if (session->sample_ms > 0)
+        sample_start(session);
+    launcher_dispatch(session);
+    if (!session->valid)
+        return;
+
+    if (session->stdin_on && stdin_start(session) == -1)
+        fprintf(stderr, "launcher: instances get no stdin \n");
+
+    /* only the tree roots hear from the launcher, the rest is relayed */
+    if (session->bcast_plan != NULL) {
+        session->bcast_ns = mono_ns();
+        for(i = 0; i < session->bcast_fanout &&
+                i < session->bcast_plan->nr_nodes; i++)
+            launcher_bcast_feed(session, i);
+    }
+}
+
+/*****************************************************************************/
+/* a new round of clock probes to every node that answers them */
+
+static void launcher_clock_tick(int fd)
+{
+    int i;
+    uint64_t ticks;
+    launcher_session_t *s = get_launcher_session();
+
+    if (read(fd, &ticks, sizeof(ticks)) != sizeof(ticks))
+        return;
+
+    for(i = 0; i < s->hosts.count; i++) {
+        if (s->hosts.fd[i] != -1 && (s->hosts.caps[i] & WIRE_CAP_CLOCK))
+            comlink_clock_probe(s->hosts.fd[i], CLOCK_PROBES);
+    }
+}
+
+/*****************************************************************************/
+
+static int launcher_clock_setup(void)
+{
+    int fd;
+    struct itimerspec its;
+
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd == -1)
+        return -1;
+
+    memset(&its, 0, sizeof(its));
+    its.it_interval.tv_sec = CLOCK_REFRESH_MS / 1000;
+    its.it_interval.tv_nsec = (CLOCK_REFRESH_MS % 1000) * 1000000L;
+    its.it_value = its.it_interval;
+    if (timerfd_settime(fd, 0, &its, NULL) == -1 ||
+            comlink_watch_fd(fd, launcher_clock_tick) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*****************************************************************************/
+/* hosts too loaded for the job are left out, unless that is all of them */
+
+static void launcher_place(launcher_session_t *s)
+{
+    int i;
+    int n = 0;
+    const char *why;
+
+    for(i = 0; i < s->hosts.count; i++)
+        n += s->hosts.fd[i] != -1 && inventory_unfit(s, i) != NULL;
+    if (n > 0 && n == s->nr_active)
+        fprintf(stderr, "launcher: every host is busy, using them anyway \n");
+
+    for(i = 0; i < s->hosts.count; i++) {
+        if (s->hosts.fd[i] == -1)
+            continue;
+        inventory_print(s, i);
+        why = inventory_unfit(s, i);
+        if (why == NULL || n == s->nr_active)
+            continue;
+        fprintf(stderr, "launcher: %s %s, leaving it out \n",
+            s->hosts.name[i], why);
+        comlink_client_close(s->hosts.fd[i]);
+        s->hosts.fd[i] = -1;
+        s->nr_active -= 1;
+        n -= 1;
+    }
+}
+
+/*****************************************************************************/
+/* hosts that never answered are left out; a gang needs every host */
+
+static void launcher_hello_done(launcher_session_t *s)
+{
+    int i;
+
+    if (s->started || s->stop_ns != 0)
+        return;
+    s->started = 1;
+
+    if (s->hello_fd != -1)
+        comlink_unwatch_fd(s->hello_fd);
+    s->hello_fd = -1;
+
+    for(i = 0; i < s->hosts.count; i++) {
+        if (s->hosts.fd[i] == -1)
+            continue;
+        if (s->hosts.version[i] == 0) {
+            fprintf(stderr, "launcher: no hello from %s, leaving it out \n",
+                s->hosts.name[i]);
+            health_fail(s, i);
+        } else if (s->nr_stages > 1 && !(s->hosts.caps[i] & WIRE_CAP_JOBS))
+            fprintf(stderr, "launcher: %s runs one job per session, leaving"
+                " it out \n", s->hosts.name[i]);
+        else
+            continue;
+        comlink_client_close(s->hosts.fd[i]);
+        s->hosts.fd[i] = -1;
+        s->nr_active -= 1;
+    }
+
+    if (s->nr_active == 0) {
+        fprintf(stderr, "launcher: no usable hosts \n");
+        launcher_session_cleanup(s);
+        return;
+    }
+
+    launcher_place(s);
+
+    for(i = 0; i < s->hosts.count && s->gang; i++) {
+        if (s->hosts.fd[i] != -1 && !(s->hosts.caps[i] & WIRE_CAP_GANG)) {
+            fprintf(stderr, "launcher: %s can't gang start, starting"
+                " without the barrier \n", s->hosts.name[i]);
+            s->gang = 0;
+        }
+    }
+
+    if (launcher_clock_setup() == -1)
+        fprintf(stderr, "launcher: node clock offsets won't be refreshed \n");
+
+    launcher_job_start(s);
+}
+
+/*****************************************************************************/
+
+static void launcher_hello_timeout(int fd)
+{
+    launcher_session_t *s = get_launcher_session();
+
+    comlink_unwatch_fd(fd);
+    s->hello_fd = -1;
+    launcher_hello_done(s);
+}
+
+/*****************************************************************************/
+/* newer peers may send fields and caps we don't know; they are ignored */
+
+static void launcher_hello(launcher_session_t *s, int fd, hello_t *hello)
+{
+    int h = launcher_host_index(s, fd);
+
+    if (h == -1 || s->hosts.version[h] != 0 || hello->version == 0)
+        return;
+
+    s->hosts.version[h] = hello->version;
+    s->hosts.caps[h] = hello->caps;
+    health_ok(s, h);
+    if (hello->caps & WIRE_CAP_CLOCK)
+        comlink_clock_probe(fd, CLOCK_PROBES);
+    if (hello->caps & WIRE_CAP_INVENTORY)
+        s->nr_inv_wanted += 1;
+    if (hello->version != WIRE_VERSION)
+        fprintf(stdout, "launcher: %s speaks wire version %u, caps %#x \n",
+            s->hosts.name[h], hello->version, hello->caps);
+
+    /* the inventory follows, the job waits for it too */
+    s->nr_hello += 1;
+    if (s->nr_hello >= s->nr_active && s->nr_inventory >= s->nr_inv_wanted)
+        launcher_hello_done(s);
+}
+
+/*****************************************************************************/
+
+static void launcher_inventory(launcher_session_t *s, int fd,
+        node_inventory_t *inv)
+{
+    if (!inventory_update(s, launcher_host_index(s, fd), inv))
+        return;
+
+    s->nr_inventory += 1;
+    if (s->nr_hello >= s->nr_active && s->nr_inventory >= s->nr_inv_wanted)
+        launcher_hello_done(s);
+}
+
+/*****************************************************************************/
+
+static void launcher_rxmsg_callback(int fd,
+        unsigned int msg_type, char *buf, int len)
+{
+    char *cur = buf;
+    char *end = buf + len;
+    union {
+        hello_t hello;
+        int_msg_t n;
+        gang_times_t gang;
+        rank_event_t rank;
+        node_queue_t queue;
+        stop_report_t stop;
+        stage_offer_t offer;
+        bcast_report_t bcast;
+        stdin_ack_t ack;
+        node_inventory_t inv;
+        node_sample_t sample;
+    }m;
+    launcher_session_t *s = get_launcher_session();
+    job_stage_t *st = graph_host_stage(s, launcher_host_index(s, fd));
+
+    /* records are decoded straight out of the receive buffer */
+    switch(msg_type) {
+        case HELLO:
+            if (wire_get(&wire_hello, &cur, end, &m.hello) == 1)
+                launcher_hello(s, fd, &m.hello);
+            return;
+
+        case KVS_FENCE_PART:
+        case KVS_FENCE:
+            launcher_kvs_fence(s, st, buf, len, msg_type == KVS_FENCE);
+            return;
+
+        case GANG_READY:
+            launcher_gang_ready(s, st);
+            return;
+
+        case GANG_TIMES:
+            if (wire_get(&wire_gang_times, &cur, end, &m.gang) == 1)
+                launcher_gang_times(st, fd, &m.gang);
+            return;
+
+        case RANK_START:
+            while (wire_get(&wire_rank_event, &cur, end, &m.rank) == 1)
+                launcher_rank_start(s, fd, &m.rank);
+            return;
+
+        case RANK_EXIT:
+            /* may end the session, so stop once it is gone */
+            while (s->valid &&
+                    wire_get(&wire_rank_event, &cur, end, &m.rank) == 1)
+                launcher_rank_exit(s, fd, &m.rank);
+            return;
+
+        case NODE_QUEUE:
+            if (wire_get(&wire_node_queue, &cur, end, &m.queue) == 1)
+                launcher_node_queue(s, fd, &m.queue);
+            return;
+
+        case STOP_DONE:
+            if (wire_get(&wire_stop_report, &cur, end, &m.stop) == 1)
+                launcher_stop_done(s, &m.stop);
+            return;
+
+        case STAGE_FETCH:
+            if (wire_get(&wire_stage_offer, &cur, end, &m.offer) == 1)
+                launcher_stage_fetch(s, fd, &m.offer);
+            return;
+
+        case BCAST_DONE:
+            if (wire_get(&wire_bcast_report, &cur, end, &m.bcast) == 1)
+                launcher_bcast_done(s, &m.bcast);
+            return;
+
+        case BCAST_LOST:
+            if (wire_get(&wire_int, &cur, end, &m.n) == 1)
+                launcher_bcast_lost(s, m.n.value);
+            return;
+
+        case NODE_INVENTORY:
+            if (wire_get(&wire_node_inventory, &cur, end, &m.inv) == 1)
+                launcher_inventory(s, fd, &m.inv);
+            return;
+
+        case STDIN_ACK:
+            if (wire_get(&wire_stdin_ack, &cur, end, &m.ack) == 1)
+                stdin_ack(s, launcher_host_index(s, fd), &m.ack);
+            return;
+
+        case NODE_SAMPLE:
+            if (wire_get(&wire_node_sample, &cur, end, &m.sample) == 1)
+                sample_update(s, launcher_host_index(s, fd), &m.sample);
+            return;
+    }
+
+    /* FIX, find a better way to report the status */
+    
+    /* for now, just print the termination status */
+    fprintf(stdout, "%s \n", buf);
+    
+    if (st != NULL)
+        st->nr_ackd += 1;
+    launcher_check_done(s, st);
+}
+
+/*****************************************************************************/
+
+static void launcher_shutdown_callback(int fd)
+{
+    launcher_session_t *s = get_launcher_session();
+
+    fprintf(stderr, "launcher: peer shotdown, cleaning-up \n");
+    if (s->stdin_on)
+        stdin_host_gone(s, launcher_host_index(s, fd));
+    if (fd > 0)
+        comlink_client_close(fd);
+}
+
+/*****************************************************************************/
+/* socket -> host index, so replies are routed without a scan */
+
+static int launcher_map_fd(launcher_session_t *s, int fd, int host)
+{
+    int i;
+    int n;
+    int *p;
+
+    if (fd >= s->nr_fds) {
+        n = s->nr_fds ? s->nr_fds : 64;
+        while (n <= fd)
+            n *= 2;
+        p = realloc(s->fd_host, n * sizeof(int));
+        if (p == NULL)
+            return -1;
+        for(i = s->nr_fds; i < n; i++)
+            p[i] = -1;
+        s->fd_host = p;
+        s->nr_fds = n;
+    }
+
+    s->fd_host[fd] = host;
+
+    return 0;
+}
+
+/*****************************************************************************/
+/* hostfile entries are host or host:port; the port defaults to the
+ * listener's, several simulated listeners may share one host */
+
+static int launcher_host_addr(char *name, unsigned int *ip, int *port)
+{
+    char *p;
+    char host[MAX_HOSTNAME_LEN];
+    struct sockaddr skt_addr;
+
+    snprintf(host, sizeof(host), "%s", name);
+    *port = COMLINK_PORT;
+    p = strrchr(host, ':');
+    if (p != NULL) {
+        *p++ = '\0';
+        *port = atoi(p);
+        if (*port <= 0 || *port > 65535) {
+            fprintf(stderr, "launcher: bad port in %s \n", name);
+            return -1;
+        }
+    }
+
+    if (hostname_to_netaddr(host, &skt_addr) != 0)
+        return -1;
+    *ip = ntohl(((struct sockaddr_in *)&skt_addr)->sin_addr.s_addr);
+
+    return 0;
+}
+
+/*****************************************************************************/
+/* a socket per host; the default soft limit stops at about 1000 */
+
+static void launcher_raise_nofile(int hosts)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1 ||
+            rl.rlim_cur >= (rlim_t)hosts + 64)
+        return;
+
+    rl.rlim_cur = rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl) == -1 ||
+            rl.rlim_cur < (rlim_t)hosts + 64)
+        fprintf(stderr, "launcher: fd limit %ld is low for %d hosts \n",
+            (long)rl.rlim_cur, hosts);
+}
+
+/*****************************************************************************/
+/* one connect; its time and failure go into the host's health */
+
+static void launcher_connect(launcher_session_t *session, int i)
+{
+    int fd;
+    long long t;
+    comlink_params_t *cl_params = &session->cl_params;
+
+    cl_params->remote_ip = session->hosts.ip[i];
+    cl_params->remote_port = session->hosts.port[i];
+    cl_params->connect_timeout_ms =
+        session->hosts.health_state[i] == HEALTH_OK ?
+        CONNECT_TIMEOUT_MS : SUSPECT_TIMEOUT_MS;
+
+    t = mono_ns();
+    fd = comlink_client_setup(cl_params);
+    session->hosts.fd[i] = fd;
+    if (fd == -1) {
+        fprintf(stderr, "launcher: comlink client setup failed for %s \n",
+            session->hosts.name[i]);
+        health_fail(session, i);
+        return;
+    }
+
+    health_rtt(session, i, mono_ns() - t);
+    if (launcher_map_fd(session, fd, i) == 0)
+        session->nr_active += 1;
+}
+
+/*****************************************************************************/
+/* launcher session setup is essentially setting up comlink; healthy hosts
+ * first, then the ones that failed last run. Hosts that keep failing are
+ * only tried if nothing else answers */
+
+static int launcher_session_setup(launcher_session_t *session)
+{
+    int i;
+    int pass;
+    
+    comlink_params_t *cl_params = &session->cl_params;
+
+    session->nr_active = 0;
+    session->nr_finished = 0;
+    session->interrupted = 0;
+    session->nr_done = 0;
+    session->nr_waited = 0;
+    session->queue_wait_ns = 0;
+    session->stop_fd = -1;
+    session->stop_ns = 0;
+    session->nr_stopped = 0;
+    session->stop_groups = 0;
+    session->stop_killed = 0;
+    session->stop_node_ns = 0;
+    session->fail_rank = -1;
+    session->stage_fd = -1;
+    session->nr_stage_fetch = 0;
+    session->stage_bytes = 0;
+    session->bcast_fd = -1;
+    session->nr_bcast_done = 0;
+    session->nr_bcast_failed = 0;
+    session->nr_bcast_lost = 0;
+    session->nr_hello = 0;
+    session->hello_fd = -1;
+    session->started = 0;
+    session->valid = 1;
+    
+    memset(cl_params, 0, sizeof(comlink_params_t));
+    cl_params->buffer = comlink_buf;
+    cl_params->buf_len = COMLINK_BUF_SIZE;
+    cl_params->local_port = COMLINK_PORT;
+    cl_params->remote_port = COMLINK_PORT;
+    cl_params->receive_cb = launcher_rxmsg_callback;
+    cl_params->shutdown_cb = launcher_shutdown_callback;
+    
+    launcher_raise_nofile(session->hosts.count);
+    for(i = 0; i < session->hosts.count; i++) {
+        session->hosts.fd[i] = -1;
+        if (launcher_host_addr(session->hosts.name[i], &session->hosts.ip[i],
+                &session->hosts.port[i]) != 0)
+            session->hosts.port[i] = 0; /* never connected to */
+    }
+
+    for(pass = HEALTH_OK; pass <= HEALTH_SKIP; pass++) {
+        if (pass == HEALTH_SKIP && session->nr_skipped > 0) {
+            if (session->nr_active > 0)
+                break;
+            fprintf(stderr, "launcher: no other host answered, trying the"
+                " %d that kept failing \n", session->nr_skipped);
+            session->nr_skipped = 0;
+        }
+        for(i = 0; i < session->hosts.count; i++) {
+            if (session->hosts.health_state[i] == pass &&
+                    session->hosts.port[i] != 0)
+                launcher_connect(session, i);
+        }
+    }
+
+    for(i = 0; i < session->hosts.count && session->nr_skipped > 0; i++) {
+        if (session->hosts.health_state[i] == HEALTH_SKIP)
+            fprintf(stderr, "launcher: skipping %s, it failed %d times in a"
+                " row \n", session->hosts.name[i],
+                session->hosts.health[i].fails);
+    }
+
+    if (session->nr_active == 0) {
+        fprintf(stderr, "launcher: no reachable hosts \n");
+        return -1;
+    }
+    
+    return 0;
+}
+
+/*****************************************************************************/
+
+static int launcher_session_start(launcher_session_t *session)
+{
+    int i;
+    hello_t hello;
+
+    /* the job goes out once the hosts answered, see launcher_hello */
+    hello.version = WIRE_VERSION;
+    hello.caps = WIRE_CAPS;
+    for(i = 0; i < session->hosts.count; i++) {
+        if (session->hosts.fd[i] != -1)
+            launcher_send_msg(session->hosts.fd[i], HELLO, &wire_hello,
+                &hello);
+    }
+
+    session->hello_fd = launcher_oneshot(HELLO_TIMEOUT_MS,
+            launcher_hello_timeout);
+    if (session->hello_fd == -1)
+        fprintf(stderr, "launcher: no hello timeout, waiting for all \n");
+
+    /* start the client process to wait for reply messages; the queued
+     * commands above go out in one batch once the loop runs */
+    comlink_client_start();
+    
+    return 0;
+}
+
+/*****************************************************************************/
+/* handles SIGINT */
+
+static void launcher_signal_handler(int signal)
+{
+    uint64_t val = 1;
+    launcher_session_t *session = get_launcher_session();
+
+    /* the stop broadcast runs in the loop; a second Ctrl+C, or no way to
+     * reach the loop, just breaks it */
+    if (session->interrupted || session->stop_fd == -1 ||
+            write(session->stop_fd, &val, sizeof(val)) < 0)
+        comlink_client_shutdown();
+    session->interrupted = 1;
+}
+
+/*****************************************************************************/
+
+int main(int argc, char *argv[])
+{
+    struct sigaction sa;
+    
+    launcher_session_t *session = get_launcher_session();
+     
+    /* simple cmdline parser; use getopt instead */
+    if (parse_cmdline(argc, argv, session) == -1) {
+        fprintf(stderr, "invalid command options \n");
+        exit(2);
+    }
+
+    /* reads hostfile returns the number of hosts */
+    if (parse_hostfile(session->host_file) <= 0) {
+        fprintf(stderr, "no hosts found in the hostfile \n");
+        exit(2);
+    }
+
+    /* the last inventories seen; fresh ones replace them after HELLO */
+    inventory_load(session);
+    health_load(session);
+
+    /* host subsets of the stages refer to hostfile lines */
+    if ((session->graph_file[0] != '\0' ?
+            graph_parse(session, session->graph_file) :
+            graph_single(session)) == -1)
+        exit(2);
+
+    /* session setup */
+    if (launcher_session_setup(session) != 0)
+        exit(2);
+
+    /* hosts skipped for their health get a connect while the job runs */
+    health_probe_start(session);
+
+    if (launcher_stop_setup(session) == -1)
+        fprintf(stderr, "launcher: Ctrl+C will not stop the remote job \n");
+
+    /* hosts may still have the path itself */
+    if (session->stage && launcher_stage_setup(session) == -1) {
+        fprintf(stderr, "launcher: staging disabled \n");
+        session->stage = 0;
+    }
+
+    if (session->sample_ms > 0 && sample_setup(session) == -1)
+        exit(2);
+
+    if (session->bcast_file[0] != '\0' &&
+            launcher_bcast_setup(session) == -1) {
+        fprintf(stderr, "launcher: broadcast failed \n");
+        exit(2);
+    }
+
+    /* regster the signal handler for handing terminal signals */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = launcher_signal_handler;
+    if (sigaction(SIGINT, &sa, NULL) == -1) {
+        fprintf(stdout,
+            "Warning, session will be unstable \n");
+    }
+    
+    /* starts the remote execution; waits until done */
+    launcher_session_start(session);
+    comlink_flush();
+
+    /* kept open by the launcher until the broadcast frames were sent */
+    if (session->bcast_fd != -1)
+        close(session->bcast_fd);
 
     /* done with the session; cleans-up */
     launcher_session_cleanup(session);
@@ -4,44 +4,345 @@
 #ifndef _JOB_LAUNCHER_H_
 #define _JOB_LAUNCHER_H_
 
+#include <stdio.h>
+#include <pthread.h>
 #include "comlink.h"
+#include "common.h"
+#include "table.h"
+#include "sha256.h"
+#include "wire.h"
 
 /******************************************************************/
 
-#define MAX_HOSTS        (100)
+#define MAX_RANKS        (1 << 20)
 #define MAX_HOSTNAME_LEN (256)
 #define MAX_FILENAME_LEN (256)
 
 /******************************************************************/
-/* host info table */
+/* host info table, one column per field */
 
-typedef struct host_info_s {
-    char hostname[MAX_HOSTNAME_LEN];
-}host_info_t;
+enum {
+    INV_NONE = 0,
+    INV_CACHED, /* from an earlier run */
+    INV_FRESH   /* sent by the listener this run */
+};
+
+/* how a host fared in earlier runs, cached across them. A host that
+ * failed lately is tried last with a short timeout, one that keeps
+ * failing is skipped for a while and re-probed in the background */
+
+enum {
+    HEALTH_OK = 0,
+    HEALTH_SUSPECT,  /* failed last time */
+    HEALTH_SKIP      /* failed in a row, still backing off */
+};
+
+typedef struct host_health_s {
+    long long last_ok;   /* CLOCK_REALTIME seconds, 0 if never */
+    long long last_fail;
+    int fails;           /* in a row */
+    int rtt_us;          /* connect time, smoothed */
+}host_health_t;
+
+typedef struct host_table_s {
+    int count;
+    int capacity;
+    int *fd;              /* -1 if not connected */
+    char **name;
+    unsigned int *ip;     /* host byte order, for the broadcast relays */
+    int *port;            /* listener port, from host:port or the default */
+    unsigned int *version; /* 0 until the listener's HELLO */
+    unsigned int *caps;   /* WIRE_CAP_* from the listener's HELLO */
+    int *stage;           /* stage running on it, -1 if idle */
+    int *running;         /* copies started or requested */
+    node_queue_t *queue;  /* last admission report */
+    node_inventory_t *inv;
+    unsigned char *inv_state; /* INV_* */
+    node_sample_t *sample; /* last resource sample, seq 0 if none */
+    host_health_t *health;
+    unsigned char *health_state; /* HEALTH_* for this run */
+}host_table_t;
+
+/******************************************************************/
+/* per rank progress, one column per field; copy 0 is the original,
+ * copy 1 a speculative re-run on another slot */
+
+enum {
+    RANK_RUN0       = 0x01, /* RANK_RUN0 << copy while running */
+    RANK_RUN1       = 0x02,
+    RANK_DONE       = 0x04,
+    RANK_FLAGGED    = 0x08, /* reported as a straggler */
+    RANK_SPECULATED = 0x10,
+    RANK_TIMEDOUT   = 0x20  /* the copy that counts ran into a time limit */
+};
+
+typedef struct rank_table_s {
+    int count;
+    int capacity;
+    unsigned char *state;  /* RANK_* */
+    int *host;             /* host index of copy 0 */
+    int *spec_host;        /* host index of copy 1 */
+    int *status;           /* wait status of the copy that won */
+    long long *start_ns;   /* copy 0 start, launcher monotonic clock */
+    long long *runtime_ns;
+}rank_table_t;
+
+/******************************************************************/
+/* one stage of a -graph job: a job of its own on a subset of the hosts,
+ * started once every stage it depends on has succeeded. A plain job is
+ * a single stage on every host */
+
+#define MAX_STAGE_NAME (32)
+#define MAX_STAGE_DEPS (16)
+
+enum {
+    STAGE_WAITING = 0,
+    STAGE_RUNNING,
+    STAGE_DONE,
+    STAGE_FAILED,  /* a rank failed, or none of its hosts is left */
+    STAGE_SKIPPED  /* a stage it depends on did not succeed */
+};
+
+typedef struct job_stage_s {
+    char name[MAX_STAGE_NAME];
+    char exe_name[MAX_FILENAME_LEN];
+    char host_spec[MAX_HOSTNAME_LEN]; /* hostfile lines, "0-3,6" or "*" */
+    int instances;     /* per host, as -np; 0 is auto */
+    int deps[MAX_STAGE_DEPS]; /* earlier stages, by index */
+    int nr_deps;
+
+    int state;         /* STAGE_* */
+    int *host;         /* the connected hosts of host_spec */
+    int *np;           /* instances on each of them */
+    int nr_hosts;
+    int rank_off;      /* its rank 0 in the rank table */
+    int job_size;
+    int nr_ackd;
+    int nr_done;
+    int nr_failed;
+    long long start_ns;
+    long long end_ns;
+
+    /* gang start barrier and the measured start skew */
+    int gang_ready;
+    int gang_ranks;
+    long long gang_release_ns;
+    long long gang_first_ns; /* in launcher time */
+    long long gang_last_ns;
+    long long gang_err_ns;   /* worst clock error bound of those nodes */
+    int gang_unsynced;       /* nodes whose clock offset is unknown */
+
+    /* kvs wire-up; node fences gathered for the allgather */
+    int kvs_fenced;
+    int kvs_len;
+    int kvs_size;
+    char *kvs_buf;
+    int kvs_failed;  /* a part was lost, the fence fails on every node */
+}job_stage_t;
 
 /******************************************************************/
 /* place holder for the context storage */
 
 typedef struct lanucher_session_s {
-    int skt_conns[MAX_HOSTS];
     /* comlink params for lancher<->listener session */
     comlink_params_t cl_params;
 
     /* local session flags */  
     int valid;
+    volatile int interrupted;
     
     /* remote host info */
     int instances;
-    int host_count;
-    host_info_t *host_info[MAX_HOSTS];
+    host_table_t hosts;
+    int *fd_host;  /* socket -> host index */
+    int nr_fds;
     char exe_name[MAX_FILENAME_LEN];
     char host_file[MAX_FILENAME_LEN];
 
     /* remote status info */
     int nr_active;
-    int nr_ackd;
+
+    /* -graph; stages go out as soon as their dependencies are done, on
+     * hosts no other stage is using */
+    char graph_file[MAX_FILENAME_LEN];
+    job_stage_t *stages;
+    int nr_stages;
+    int nr_finished; /* stages past STAGE_RUNNING */
+
+    /* the job goes out once every host said HELLO, or at the timeout */
+    int nr_hello;
+    int hello_fd;
+    int started;
+
+    /* gang start barrier, per stage */
+    int gang;
+
+    /* rank progress reported by the listeners, all stages */
+    int job_size;
+    int nr_done;
+    rank_table_t ranks;
+
+    /* admission control on the nodes */
+    int nr_waited;           /* ranks that had to queue for a slot */
+    long long queue_wait_ns; /* summed over those */
+
+    /* straggler detection; -idempotent jobs get speculative copies.
+     * The pct percentile runtime is the top of a max-heap holding the
+     * fastest finished ranks */
+    int straggler_pct;
+    int straggler_k;
+    int idempotent;
+    long long *fastest;
+    int nr_fastest;
+    int nr_stragglers;
+    int nr_speculated;
+    int nr_spec_won;
+
+    /* job teardown; stop goes to every host in one pass, each listener
+     * reports once its instances are gone */
+    int stop_fd;          /* eventfd kicked by the SIGINT handler */
+    long long stop_ns;    /* 0 until the stop went out */
+    int nr_stopping;
+    int nr_stopped;
+    int stop_groups;
+    int stop_killed;
+    long long stop_node_ns; /* slowest node, local time */
+
+    /* -abort-on-failure; the first failed rank stops the whole job */
+    int abort_on_failure;
+    int fail_rank;        /* -1 until a rank fails */
+    int fail_host;
+    int fail_status;
+    long long fail_ns;
+
+    /* -stage; listeners fetch the executable unless they have its hash */
+    int stage;
+    int stage_fd;
+    stage_offer_t stage_offer;
+    int nr_stage_fetch;
+    long long stage_bytes;
+
+    /* -broadcast; the file goes down a chain (fanout 1) or a tree of
+     * listeners, the launcher only feeds the roots */
+    char bcast_file[MAX_FILENAME_LEN];
+    int bcast_fanout;
+    int bcast_fd;
+    bcast_plan_t *bcast_plan; /* followed by the nodes */
+    int *bcast_host;          /* tree index -> host index */
+    int nr_bcast_done;
+    int nr_bcast_failed;
+    int nr_bcast_lost;        /* fed by the launcher, the relay failed */
+    long long bcast_ns;
+
+    /* -stdin; read by a thread of its own and streamed to every host, at
+     * most a host's window past what it acked. The lock covers these */
+    int stdin_on;
+    int stdin_stop;
+    pthread_mutex_t stdin_lock;
+    pthread_cond_t stdin_cond;
+    int *stdin_fd;           /* per host, -1 if it doesn't get the stream */
+    int *stdin_window;       /* 0 until the host's first ack */
+    long long *stdin_acked;
+    long long stdin_sent;
+    int nr_stdin_hosts;
+
+    /* node inventories, fresh after HELLO or cached from earlier runs;
+     * -np auto sizes each host from them, and hosts loaded past max_load
+     * per cpu are left out */
+    int np_auto;
+    double max_load;     /* 0 keeps every host */
+    int nr_inventory;
+    int nr_inv_wanted;   /* hosts whose HELLO offered one */
+    char inv_file[MAX_FILENAME_LEN];
+
+    /* -walltime and -instance-timeout, enforced by the listeners; each
+     * stage gets what is left of the walltime when it goes out */
+    long long walltime_ms;
+    long long inst_timeout_ms;
+    long long job_start_ns;
+    int nr_timeout_inst;
+    int nr_timeout_wall;
+
+    /* -top and -sample-file; the listeners sample their instances every
+     * sample_ms and send the node's sums. The job totals follow the last
+     * sample of every host */
+    int sample_ms;       /* 0 is off */
+    int sample_top;
+    char sample_file[MAX_FILENAME_LEN];
+    FILE *sample_fp;
+    long long sample_draw_ns;
+    double sample_cores; /* the job right now */
+    long long sample_rss_kb;
+    double peak_cores;
+    long long peak_rss_kb;
+    long long sample_cost_ns; /* what sampling took, all nodes */
+    long long sample_span_ns; /* the intervals it covered */
+
+    /* host health; skipped hosts are probed by a thread of its own,
+     * which only touches their rows and is joined before the save */
+    char health_file[MAX_FILENAME_LEN];
+    int all_hosts;       /* -all-hosts, the cache decides nothing */
+    int nr_skipped;
+    int nr_probed_ok;
+    pthread_t probe_thread;
+    int probe_live;
+    volatile int probe_stop;
 }launcher_session_t;
 
+/******************************************************************/
+/* job_graph.c -- the stages of a job and the order they run in */
+
+int graph_parse(launcher_session_t *s, char *file);
+int graph_single(launcher_session_t *s);
+int graph_hosts(launcher_session_t *s, job_stage_t *st);
+int graph_ready(launcher_session_t *s, job_stage_t *st);
+job_stage_t * graph_host_stage(launcher_session_t *s, int host);
+void graph_free(launcher_session_t *s);
+
+/******************************************************************/
+/* job_hosts.c -- hostfile lines looked up by host name */
+
+int * host_index(launcher_session_t *s);
+int host_find(launcher_session_t *s, int *idx, const char *name);
+
+/******************************************************************/
+/* job_inventory.c -- node inventories, cached across runs */
+
+void inventory_load(launcher_session_t *s);
+void inventory_save(launcher_session_t *s);
+int inventory_update(launcher_session_t *s, int h, node_inventory_t *inv);
+const char * inventory_unfit(launcher_session_t *s, int h);
+void inventory_print(launcher_session_t *s, int h);
+int inventory_np(launcher_session_t *s, int h);
+
+/******************************************************************/
+/* job_health.c -- host health, cached across runs */
+
+void health_load(launcher_session_t *s);
+void health_save(launcher_session_t *s);
+void health_rtt(launcher_session_t *s, int h, long long ns);
+void health_ok(launcher_session_t *s, int h);
+void health_fail(launcher_session_t *s, int h);
+int health_probe_start(launcher_session_t *s);
+
+/******************************************************************/
+/* job_stdin.c -- the launcher's stdin streamed to the hosts */
+
+int stdin_setup(launcher_session_t *s);
+int stdin_start(launcher_session_t *s);
+void stdin_ack(launcher_session_t *s, int h, stdin_ack_t *ack);
+void stdin_host_gone(launcher_session_t *s, int h);
+void stdin_cleanup(launcher_session_t *s);
+
+/******************************************************************/
+/* job_sample.c -- live resource use of the job, -top and -sample-file */
+
+int sample_setup(launcher_session_t *s);
+void sample_start(launcher_session_t *s);
+void sample_update(launcher_session_t *s, int h, node_sample_t *ns);
+void sample_print(launcher_session_t *s);
+void sample_cleanup(launcher_session_t *s);
+
 /******************************************************************/
 
 #endif /* _JOB_LAUNCHER_H_ */
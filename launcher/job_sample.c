@@ -0,0 +1,227 @@
+/*
+ * job_sample: live resource use of the job, -top and -sample-file
+ */
+
+/* job_sample.c -- every listener samples its running instances and sends
+ *                 the node's sums at the interval it was given: cpu time
+ *                 and bytes read and written since its last sample, and
+ *                 resident memory. The job totals are kept up to date
+ *                 from the last sample of each host, so a sample costs
+ *                 the same however many hosts there are.
+ *
+ *                 -top redraws a view of the job and its busiest hosts
+ *                 once per interval; -sample-file appends every sample as
+ *                 a line, for plotting:
+ *
+ *                 # time_s host instances cores rss_kb max_rss_kb ...
+ *                 12.004 node07 64 63.812 8312844 131072 17 ...
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "job_launcher.h"
+#include "common.h"
+
+/*****************************************************************************/
+
+#define SAMPLE_TOP_HOSTS (20) /* rows of the -top view */
+
+/*****************************************************************************/
+
+static long long mono_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*****************************************************************************/
+
+static double sample_cores(node_sample_t *ns)
+{
+    return ns->interval_ns > 0 ? (double)ns->cpu_ns / ns->interval_ns : 0;
+}
+
+/*****************************************************************************/
+
+int sample_setup(launcher_session_t *s)
+{
+    if (s->sample_file[0] == '\0')
+        return 0;
+
+    s->sample_fp = fopen(s->sample_file, "w");
+    if (s->sample_fp == NULL) {
+        fprintf(stderr, "launcher: %s, %s(%d) \n", s->sample_file,
+            strerror(errno), errno);
+        return -1;
+    }
+    fprintf(s->sample_fp, "# time_s host instances cores rss_kb max_rss_kb"
+        " max_rss_rank read_bps write_bps top_rank top_cores cost_us\n");
+
+    return 0;
+}
+
+/*****************************************************************************/
+/* ahead of the first stage, so the first instances are sampled too */
+
+void sample_start(launcher_session_t *s)
+{
+    int h;
+    int n = 0;
+    int_msg_t interval;
+    comlink_header_t header;
+    char buf[WIRE_MAX_RECORD];
+
+    interval.value = s->sample_ms;
+    header.type = JOB_SAMPLE;
+    header.len = wire_put(&wire_int, &interval, buf, sizeof(buf));
+    for(h = 0; h < s->hosts.count; h++) {
+        if (s->hosts.fd[h] == -1)
+            continue;
+        if (!(s->hosts.caps[h] & WIRE_CAP_SAMPLE))
+            n += 1;
+        else
+            comlink_send(s->hosts.fd[h], &header, buf, header.len);
+    }
+
+    if (n > 0)
+        fprintf(stderr, "launcher: %d hosts can't sample their instances"
+            " \n", n);
+}
+
+/*****************************************************************************/
+/* busiest hosts first */
+
+static launcher_session_t *sort_session;
+
+static int cmp_cores(const void *a, const void *b)
+{
+    double x = sample_cores(&sort_session->hosts.sample[*(const int *)a]);
+    double y = sample_cores(&sort_session->hosts.sample[*(const int *)b]);
+
+    return x > y ? -1 : x < y;
+}
+
+/*****************************************************************************/
+
+static void sample_draw(launcher_session_t *s)
+{
+    int h;
+    int i;
+    int n = 0;
+    int inst = 0;
+    int *idx;
+    double rd = 0;
+    double wr = 0;
+    node_sample_t *ns;
+
+    idx = malloc(s->hosts.count * sizeof(int));
+    if (idx == NULL)
+        return;
+
+    for(h = 0; h < s->hosts.count; h++) {
+        ns = &s->hosts.sample[h];
+        if (ns->seq == 0 || ns->interval_ns <= 0)
+            continue;
+        idx[n++] = h;
+        inst += ns->instances;
+        rd += ns->read_bytes * 1e9 / ns->interval_ns;
+        wr += ns->write_bytes * 1e9 / ns->interval_ns;
+    }
+    sort_session = s;
+    qsort(idx, n, sizeof(int), cmp_cores);
+
+    /* in place on a terminal, one view after the other otherwise */
+    if (isatty(STDOUT_FILENO))
+        fprintf(stdout, "\033[H\033[2J");
+    fprintf(stdout, "top %.1f s: %d hosts, %d instances, %.2f cores,"
+        " %.1f MB resident, read %.1f MB/s, write %.1f MB/s \n",
+        (mono_ns() - s->job_start_ns) / 1e9, n, inst, s->sample_cores,
+        s->sample_rss_kb / 1024.0, rd / 1e6, wr / 1e6);
+    fprintf(stdout, "%-24s %5s %8s %9s %9s %7s %10s %10s %7s \n", "host",
+        "inst", "cpu%", "rss MB", "max MB", "rank", "read MB/s",
+        "write MB/s", "busiest");
+    for(i = 0; i < n && i < SAMPLE_TOP_HOSTS; i++) {
+        ns = &s->hosts.sample[idx[i]];
+        fprintf(stdout, "%-24s %5d %8.1f %9.1f %9.1f %7d %10.2f %10.2f %7d"
+            " \n",
+            s->hosts.name[idx[i]], ns->instances, sample_cores(ns) * 100,
+            ns->rss_kb / 1024.0, ns->max_rss_kb / 1024.0, ns->max_rss_rank,
+            ns->read_bytes * 1e3 / ns->interval_ns,
+            ns->write_bytes * 1e3 / ns->interval_ns, ns->top_cpu_rank);
+    }
+    if (n > SAMPLE_TOP_HOSTS)
+        fprintf(stdout, "... %d more hosts \n", n - SAMPLE_TOP_HOSTS);
+    fflush(stdout);
+    free(idx);
+}
+
+/*****************************************************************************/
+/* NODE_SAMPLE; replaces the host's share of the job totals */
+
+void sample_update(launcher_session_t *s, int h, node_sample_t *ns)
+{
+    long long now = mono_ns();
+    node_sample_t *last;
+
+    if (h == -1 || ns->interval_ns <= 0)
+        return;
+
+    last = &s->hosts.sample[h];
+    s->sample_cores += sample_cores(ns) - sample_cores(last);
+    s->sample_rss_kb += ns->rss_kb - last->rss_kb;
+    *last = *ns;
+    if (s->sample_cores > s->peak_cores)
+        s->peak_cores = s->sample_cores;
+    if (s->sample_rss_kb > s->peak_rss_kb)
+        s->peak_rss_kb = s->sample_rss_kb;
+    s->sample_cost_ns += ns->cost_ns;
+    s->sample_span_ns += ns->interval_ns;
+
+    if (s->sample_fp != NULL)
+        fprintf(s->sample_fp, "%.3f %s %d %.3f %lld %lld %d %.0f %.0f %d"
+            " %.3f %lld\n", (now - s->job_start_ns) / 1e9,
+            s->hosts.name[h], ns->instances, sample_cores(ns), ns->rss_kb,
+            ns->max_rss_kb, ns->max_rss_rank,
+            ns->read_bytes * 1e9 / ns->interval_ns,
+            ns->write_bytes * 1e9 / ns->interval_ns, ns->top_cpu_rank,
+            (double)ns->top_cpu_ns / ns->interval_ns, ns->cost_ns / 1000);
+
+    if (s->sample_top &&
+            now - s->sample_draw_ns >= s->sample_ms * 1000000LL) {
+        s->sample_draw_ns = now;
+        sample_draw(s);
+    }
+}
+
+/*****************************************************************************/
+/* job summary */
+
+void sample_print(launcher_session_t *s)
+{
+    if (s->sample_span_ns == 0)
+        return;
+
+    fprintf(stdout, "launcher: peak %.2f cores and %.1f MB resident across"
+        " the job, sampling took %.3f%% of a core per node \n",
+        s->peak_cores, s->peak_rss_kb / 1024.0,
+        100.0 * s->sample_cost_ns / s->sample_span_ns);
+}
+
+/*****************************************************************************/
+
+void sample_cleanup(launcher_session_t *s)
+{
+    if (s->sample_fp != NULL)
+        fclose(s->sample_fp);
+    s->sample_fp = NULL;
+}
+
+/*****************************************************************************/
@@ -0,0 +1,231 @@
+/*
+ * job_stdin: the launcher's stdin streamed to the hosts, -stdin
+ */
+
+/* job_stdin.c -- stdin is read once, by a thread of its own since it may
+ *                be a terminal or a pipe that blocks, and each chunk goes
+ *                to every host on the bulk channel. A host acks how much
+ *                all its instances have; the thread never gets more than
+ *                the host's window ahead of that, so a slow instance
+ *                slows the reading down rather than piling up memory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "job_launcher.h"
+#include "common.h"
+
+/*****************************************************************************/
+
+#define STDIN_CHUNK (256 * 1024) /* bytes per STDIN_DATA */
+
+/*****************************************************************************/
+/* the hosts that can take it; the stream starts with the job */
+
+int stdin_setup(launcher_session_t *s)
+{
+    int i;
+
+    s->stdin_fd = malloc(s->hosts.count * sizeof(int));
+    s->stdin_window = calloc(s->hosts.count, sizeof(int));
+    s->stdin_acked = calloc(s->hosts.count, sizeof(long long));
+    if (s->stdin_fd == NULL || s->stdin_window == NULL ||
+            s->stdin_acked == NULL)
+        return -1;
+
+    pthread_mutex_init(&s->stdin_lock, NULL);
+    pthread_cond_init(&s->stdin_cond, NULL);
+    s->stdin_sent = 0;
+    s->nr_stdin_hosts = 0;
+    for(i = 0; i < s->hosts.count; i++) {
+        s->stdin_fd[i] = -1;
+        if (s->hosts.fd[i] == -1)
+            continue;
+        if (!(s->hosts.caps[i] & WIRE_CAP_STDIN)) {
+            fprintf(stderr, "launcher: %s can't take stdin \n",
+                s->hosts.name[i]);
+            continue;
+        }
+        s->stdin_fd[i] = s->hosts.fd[i];
+        s->nr_stdin_hosts += 1;
+    }
+
+    return 0;
+}
+
+/*****************************************************************************/
+/* called with the lock held */
+
+static void stdin_drop(launcher_session_t *s, int h)
+{
+    if (s->stdin_fd[h] == -1)
+        return;
+
+    s->stdin_fd[h] = -1;
+    s->nr_stdin_hosts -= 1;
+    pthread_cond_signal(&s->stdin_cond);
+}
+
+/*****************************************************************************/
+/* bytes every host has room for; 0 until they all gave their window, -1
+ * once no host is left. Called with the lock held */
+
+static long long stdin_room(launcher_session_t *s)
+{
+    int i;
+    long long n;
+    long long room = -1;
+
+    if (s->stdin_stop)
+        return -1;
+
+    for(i = 0; i < s->hosts.count; i++) {
+        if (s->stdin_fd[i] == -1)
+            continue;
+        n = s->stdin_acked[i] + s->stdin_window[i] - s->stdin_sent;
+        if (n < 0)
+            n = 0;
+        if (room == -1 || n < room)
+            room = n;
+    }
+
+    return room;
+}
+
+/*****************************************************************************/
+/* called with the lock held */
+
+static void stdin_send(launcher_session_t *s, int type, char *buf, int len)
+{
+    int i;
+    comlink_header_t header;
+
+    header.type = type;
+    header.len = len;
+    for(i = 0; i < s->hosts.count; i++) {
+        if (s->stdin_fd[i] != -1 &&
+                comlink_send_bulk(s->stdin_fd[i], &header, buf, len) == -1)
+            stdin_drop(s, i);
+    }
+    s->stdin_sent += len;
+}
+
+/*****************************************************************************/
+
+static void * stdin_read_main(void *arg)
+{
+    int n;
+    long long room;
+    char *buf;
+    launcher_session_t *s = (launcher_session_t *)arg;
+
+    buf = malloc(STDIN_CHUNK);
+    if (buf == NULL) {
+        fprintf(stderr, "launcher: stdin buffer, %s(%d) \n",
+            strerror(errno), errno);
+        return NULL;
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&s->stdin_lock);
+        while ((room = stdin_room(s)) == 0)
+            pthread_cond_wait(&s->stdin_cond, &s->stdin_lock);
+        pthread_mutex_unlock(&s->stdin_lock);
+        if (room == -1)
+            break;
+
+        while ((n = read(STDIN_FILENO, buf, room < STDIN_CHUNK ?
+                room : STDIN_CHUNK)) == -1 && errno == EINTR)
+            ;
+        if (n == -1)
+            fprintf(stderr, "launcher: reading stdin, %s(%d) \n",
+                strerror(errno), errno);
+
+        /* the session may have ended while the read was blocked */
+        pthread_mutex_lock(&s->stdin_lock);
+        if (!s->stdin_stop)
+            stdin_send(s, n > 0 ? STDIN_DATA : STDIN_EOF, buf,
+                n > 0 ? n : 0);
+        pthread_mutex_unlock(&s->stdin_lock);
+        if (n <= 0)
+            break;
+    }
+    free(buf);
+
+    return NULL;
+}
+
+/*****************************************************************************/
+/* the job has gone out, STDIN_OPEN ahead of it. The thread is detached;
+ * one still blocked on a terminal ends with the process */
+
+int stdin_start(launcher_session_t *s)
+{
+    int ret;
+    pthread_t thread;
+
+    ret = pthread_create(&thread, NULL, stdin_read_main, (void *)s);
+    if (ret != 0) {
+        fprintf(stderr, "launcher: stdin thread, %s(%d) \n",
+            strerror(ret), ret);
+        return -1;
+    }
+    pthread_detach(thread);
+
+    return 0;
+}
+
+/*****************************************************************************/
+/* a window of 0 means the host couldn't set the stream up */
+
+void stdin_ack(launcher_session_t *s, int h, stdin_ack_t *ack)
+{
+    if (h == -1 || s->stdin_fd == NULL)
+        return;
+
+    pthread_mutex_lock(&s->stdin_lock);
+    if (ack->window <= 0) {
+        if (s->stdin_fd[h] != -1)
+            fprintf(stderr, "launcher: %s gets no stdin \n",
+                s->hosts.name[h]);
+        stdin_drop(s, h);
+    } else if (ack->drained >= s->stdin_acked[h]) {
+        s->stdin_acked[h] = ack->drained;
+        s->stdin_window[h] = ack->window;
+        pthread_cond_signal(&s->stdin_cond);
+    }
+    pthread_mutex_unlock(&s->stdin_lock);
+}
+
+/*****************************************************************************/
+
+void stdin_host_gone(launcher_session_t *s, int h)
+{
+    if (h == -1 || s->stdin_fd == NULL)
+        return;
+
+    pthread_mutex_lock(&s->stdin_lock);
+    stdin_drop(s, h);
+    pthread_mutex_unlock(&s->stdin_lock);
+}
+
+/*****************************************************************************/
+/* before comlink goes away; the thread sends nothing after this. The
+ * arrays stay, it may still be blocked in read */
+
+void stdin_cleanup(launcher_session_t *s)
+{
+    if (s->stdin_fd == NULL)
+        return;
+
+    pthread_mutex_lock(&s->stdin_lock);
+    s->stdin_stop = 1;
+    pthread_cond_signal(&s->stdin_cond);
+    pthread_mutex_unlock(&s->stdin_lock);
+}
+
+/*****************************************************************************/
@@ -0,0 +1,161 @@
+/*
+ * admission: slot budget of the node and the queue of ranks waiting for it
+ */
+
+/* admission.c -- the budget comes from the online cpus and the available
+ *                memory unless set on the command line. Spawn requests
+ *                beyond it wait in a heap ordered by priority, then by
+ *                arrival; with the fifo policy every request has the same
+ *                priority.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "listener.h"
+
+/*****************************************************************************/
+
+#define ADMISSION_QUEUE_INIT (64)
+
+/*****************************************************************************/
+
+static long long meminfo_available_kb(void)
+{
+    long long kb = -1;
+    char line[128];
+    FILE *fp;
+
+    fp = fopen("/proc/meminfo", "r");
+    if (fp == NULL)
+        return -1;
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "MemAvailable: %lld kB", &kb) == 1)
+            break;
+    }
+    fclose(fp);
+
+    return kb;
+}
+
+/*****************************************************************************/
+/* slots = min(cpus, available memory / memory per slot) */
+
+int admission_setup(listener_session_t *session, int slots, int mem_per_slot)
+{
+    long cpus;
+    long long kb;
+    long long by_mem;
+
+    if (slots <= 0) {
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        slots = cpus > 0 ? cpus : 1;
+
+        kb = meminfo_available_kb();
+        if (kb > 0 && mem_per_slot > 0) {
+            by_mem = kb / 1024 / mem_per_slot;
+            if (by_mem < slots)
+                slots = by_mem > 0 ? by_mem : 1;
+        }
+    }
+
+    session->slots = slots;
+
+    fprintf(stdout, "listener: %d slots, %s queue \n", session->slots,
+        session->queue_policy == ADMISSION_PRIORITY ? "priority" : "fifo");
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+static int admission_before(spawn_req_t *a, spawn_req_t *b)
+{
+    if (a->prio != b->prio)
+        return a->prio > b->prio;
+
+    return (int)(a->seq - b->seq) < 0;
+}
+
+/*****************************************************************************/
+/* called with the session lock held */
+
+int admission_push(listener_session_t *session, spawn_req_t *req)
+{
+    int i;
+    int n;
+    spawn_req_t *q;
+
+    if (session->nr_queued == session->queue_size) {
+        n = session->queue_size ? session->queue_size * 2 :
+            ADMISSION_QUEUE_INIT;
+        q = realloc(session->queue, n * sizeof(spawn_req_t));
+        if (q == NULL)
+            return -1;
+        session->queue = q;
+        session->queue_size = n;
+    }
+
+    if (session->queue_policy != ADMISSION_PRIORITY)
+        req->prio = 0;
+    req->seq = session->queue_seq++;
+
+    /* sift up */
+    q = session->queue;
+    for(i = session->nr_queued++; i > 0; i = (i - 1) / 2) {
+        if (!admission_before(req, &q[(i - 1) / 2]))
+            break;
+        q[i] = q[(i - 1) / 2];
+    }
+    q[i] = *req;
+
+    if (session->nr_queued > session->peak_queued)
+        session->peak_queued = session->nr_queued;
+
+    return 0;
+}
+
+/*****************************************************************************/
+/* called with the session lock held */
+
+int admission_pop(listener_session_t *session, spawn_req_t *req)
+{
+    int i;
+    int c;
+    spawn_req_t last;
+    spawn_req_t *q = session->queue;
+
+    if (session->nr_queued == 0)
+        return -1;
+
+    *req = q[0];
+    last = q[--session->nr_queued];
+
+    /* sift down */
+    for(i = 0; (c = 2 * i + 1) < session->nr_queued; i = c) {
+        if (c + 1 < session->nr_queued && admission_before(&q[c + 1], &q[c]))
+            c += 1;
+        if (!admission_before(&q[c], &last))
+            break;
+        q[i] = q[c];
+    }
+    q[i] = last;
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+void admission_cleanup(listener_session_t *session)
+{
+    free(session->queue);
+    session->queue = NULL;
+    session->queue_size = 0;
+    session->nr_queued = 0;
+}
+
+/*****************************************************************************/
@@ -0,0 +1,354 @@
+/*
+ * bcast: input file broadcast relayed down a chain or tree of listeners
+ */
+
+/* bcast.c -- every chunk is written to the file first and then sent on
+ *            to the children from there with sendfile, so a relay
+ *            forwards chunk i while chunk i + 1 is still coming in. The
+ *            launcher sends the file once per tree root instead of once
+ *            per node. Each relay passes the plan on ahead of the data,
+ *            since it may beat the launcher's copy to the child.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "listener.h"
+#include "common.h"
+
+/*****************************************************************************/
+
+static long long mono_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*****************************************************************************/
+
+void bcast_setup(listener_session_t *session)
+{
+    int i;
+
+    session->bcast_plan = NULL;
+    session->bcast_pending = 0;
+    session->bcast_fd = -1;
+    session->nr_bcast_children = 0;
+    for(i = 0; i < BCAST_MAX_FANOUT; i++)
+        session->bcast_child[i] = -1;
+}
+
+/*****************************************************************************/
+
+static int bcast_send(int fd, int type, const wire_schema_t *schema,
+        void *msg)
+{
+    char buf[WIRE_MAX_RECORD];
+    comlink_header_t header;
+
+    header.type = type;
+    header.len = wire_put(schema, msg, buf, sizeof(buf));
+
+    return comlink_send(fd, &header, buf, header.len);
+}
+
+/*****************************************************************************/
+/* the plan record and a node record for every receiver */
+
+static int bcast_send_plan(int fd, bcast_plan_t *plan)
+{
+    int n;
+    int len;
+    int size;
+    int ret = -1;
+    char *buf;
+    comlink_header_t header;
+
+    size = wire_bcast_plan.max_len + plan->nr_nodes * wire_bcast_node.max_len;
+    buf = malloc(size);
+    if (buf == NULL)
+        return -1;
+
+    len = wire_put(&wire_bcast_plan, plan, buf, size);
+    n = wire_put_array(&wire_bcast_node, plan + 1, plan->nr_nodes,
+            buf + len, size - len);
+    if (len != -1 && n != -1) {
+        header.type = BCAST_PLAN;
+        header.len = len + n;
+        ret = comlink_send(fd, &header, buf, len + n);
+    }
+    free(buf);
+
+    return ret;
+}
+
+/*****************************************************************************/
+/* opens the link to a child and hands it its plan ahead of the data */
+
+static int bcast_connect(listener_session_t *session, int index)
+{
+    int fd;
+    int ret;
+    comlink_params_t params = session->cl_params;
+    bcast_plan_t *plan = session->bcast_plan;
+    bcast_node_t *node = (bcast_node_t *)(plan + 1) + index;
+
+    params.remote_ip = node->ip;
+    params.remote_port = node->port;
+    fd = comlink_client_setup(&params);
+    if (fd == -1)
+        return -1;
+
+    plan->index = index;
+    ret = bcast_send_plan(fd, plan);
+    plan->index = session->bcast_index;
+    if (ret == -1) {
+        comlink_client_close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*****************************************************************************/
+/* last byte is in; the children may still be reading from the fd */
+
+static void bcast_finish(listener_session_t *session)
+{
+    bcast_report_t report;
+    bcast_plan_t *plan = session->bcast_plan;
+
+    if (session->bcast_fd != -1 && !session->bcast_write_failed &&
+            (fchmod(session->bcast_fd, plan->mode & 0777) == -1 ||
+             rename(session->bcast_tmp, plan->path) == -1)) {
+        fprintf(stderr, "listener: broadcast %s, %s(%d) \n",
+            plan->path, strerror(errno), errno);
+        unlink(session->bcast_tmp);
+        session->bcast_failed = 1;
+    }
+
+    session->bcast_pending = 0;
+    memset(&report, 0, sizeof(report));
+    report.index = session->bcast_index;
+    report.failed = session->bcast_failed;
+    report.time_ns = mono_ns() - session->bcast_ns;
+    if (!report.failed)
+        fprintf(stdout, "listener: received %lld bytes of %s in %.3f ms,"
+            " relaying to %d \n", plan->size, plan->path,
+            report.time_ns / 1e6, session->nr_bcast_children);
+
+    bcast_send(session->skt_fd, BCAST_DONE, &wire_bcast_report, &report);
+}
+
+/*****************************************************************************/
+/* returns 1 while the file is coming in; a plan seen before is ignored */
+
+int bcast_plan(listener_session_t *session, char *buf, int len)
+{
+    int i;
+    int c;
+    int fd;
+    int_msg_t lost;
+    bcast_plan_t head;
+    bcast_plan_t *plan;
+    bcast_node_t *nodes;
+    char *cur = buf;
+    char *end = buf + len;
+
+    /* every node record takes at least a byte */
+    if (wire_get(&wire_bcast_plan, &cur, end, &head) != 1 ||
+            head.nr_nodes <= 0 || head.nr_nodes > end - cur ||
+            head.index < 0 || head.index >= head.nr_nodes ||
+            head.fanout < 1 || head.fanout > BCAST_MAX_FANOUT ||
+            head.size < 0 || head.path[0] == '\0') {
+        fprintf(stderr, "listener: malformed broadcast plan \n");
+        return 0;
+    }
+
+    if (session->bcast_plan != NULL && session->bcast_plan->id == head.id)
+        return session->bcast_pending;
+
+    bcast_cleanup(session);
+    plan = malloc(sizeof(bcast_plan_t) +
+            head.nr_nodes * sizeof(bcast_node_t));
+    if (plan == NULL)
+        return 0;
+    *plan = head;
+    nodes = (bcast_node_t *)(plan + 1);
+    for(i = 0; i < plan->nr_nodes; i++) {
+        if (wire_get(&wire_bcast_node, &cur, end, &nodes[i]) != 1) {
+            fprintf(stderr, "listener: malformed broadcast plan \n");
+            free(plan);
+            return 0;
+        }
+    }
+    session->bcast_plan = plan;
+
+    session->bcast_index = plan->index;
+    session->bcast_ns = mono_ns();
+    session->bcast_got = 0;
+    session->bcast_failed = 0;
+    session->bcast_write_failed = 0;
+    session->bcast_pending = 1;
+
+    /* chunks are relayed from the file even if it can't be kept */
+    snprintf(session->bcast_tmp, sizeof(session->bcast_tmp), "%s.%d.part",
+        plan->path, (int)getpid());
+    session->bcast_fd = open(session->bcast_tmp,
+            O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (session->bcast_fd == -1) {
+        fprintf(stderr, "listener: %s, %s(%d) \n",
+            session->bcast_tmp, strerror(errno), errno);
+        session->bcast_failed = 1;
+    }
+
+    if (plan->size == 0) {
+        bcast_finish(session);
+        return 0;
+    }
+
+    /* a child out of reach is fed by the launcher instead */
+    for(i = 0; i < plan->fanout; i++) {
+        c = plan->fanout * (plan->index + 1) + i;
+        if (c >= plan->nr_nodes)
+            break;
+        fd = bcast_connect(session, c);
+        if (fd != -1) {
+            session->bcast_child[session->nr_bcast_children++] = fd;
+            continue;
+        }
+        fprintf(stderr, "listener: broadcast child %d unreachable \n", c);
+        lost.value = c;
+        bcast_send(session->skt_fd, BCAST_LOST, &wire_int, &lost);
+    }
+
+    return 1;
+}
+
+/*****************************************************************************/
+
+static int bcast_write(listener_session_t *session, char *buf, int len)
+{
+    int ret;
+    int off = 0;
+
+    while (off < len) {
+        ret = pwrite(session->bcast_fd, buf + off, len - off,
+                session->bcast_got + off);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret == -1)
+            return -1;
+        off += ret;
+    }
+
+    return 0;
+}
+
+/*****************************************************************************/
+/* one chunk from the parent; returns 1 once the file is complete */
+
+int bcast_data(listener_session_t *session, int fd, char *buf, int len)
+{
+    int i;
+    int child;
+    comlink_header_t header;
+    bcast_plan_t *plan = session->bcast_plan;
+
+    if (!session->bcast_pending)
+        return 0;
+
+    if (session->bcast_got + len > plan->size) {
+        fprintf(stderr, "listener: more broadcast bytes than planned \n");
+        session->bcast_failed = 1;
+        bcast_finish(session);
+        return 1;
+    }
+
+    /* chunks already queued to the children still send from bcast_fd, so
+     * it stays open until the links are gone */
+    if (session->bcast_fd != -1 && !session->bcast_write_failed &&
+            bcast_write(session, buf, len) == -1) {
+        fprintf(stderr, "listener: %s, %s(%d) \n",
+            session->bcast_tmp, strerror(errno), errno);
+        session->bcast_write_failed = 1;
+        session->bcast_failed = 1;
+    }
+
+    /* zero-copy from the page cache; a copy of buf if there's no file */
+    header.type = BCAST_DATA;
+    header.len = len;
+    for(i = 0; i < session->nr_bcast_children; i++) {
+        child = session->bcast_child[i];
+        if (child == -1)
+            continue;
+        if (session->bcast_fd != -1 && !session->bcast_write_failed)
+            comlink_send_file(child, &header, session->bcast_fd,
+                session->bcast_got, len, COMLINK_FILE_KEEP);
+        else
+            comlink_send_bulk(child, &header, buf, len);
+    }
+
+    session->bcast_got += len;
+    if (session->bcast_got < plan->size)
+        return 0;
+
+    /* the parent is done with us; the launcher link stays */
+    if (fd != session->skt_fd)
+        comlink_client_close(fd);
+    bcast_finish(session);
+
+    return 1;
+}
+
+/*****************************************************************************/
+/* a child closes its link once it has the whole file */
+
+void bcast_link_gone(listener_session_t *session, int fd)
+{
+    int i;
+
+    for(i = 0; i < session->nr_bcast_children; i++) {
+        if (session->bcast_child[i] == fd)
+            session->bcast_child[i] = -1;
+    }
+}
+
+/*****************************************************************************/
+/* the links go first; comlink never reads a kept fd of a closed link */
+
+void bcast_cleanup(listener_session_t *session)
+{
+    int i;
+
+    for(i = 0; i < session->nr_bcast_children; i++) {
+        if (session->bcast_child[i] != -1)
+            comlink_client_close(session->bcast_child[i]);
+        session->bcast_child[i] = -1;
+    }
+    session->nr_bcast_children = 0;
+
+    if (session->bcast_fd != -1) {
+        close(session->bcast_fd);
+        if (session->bcast_pending || session->bcast_write_failed)
+            unlink(session->bcast_tmp);
+    }
+    session->bcast_fd = -1;
+    session->bcast_write_failed = 0;
+    session->bcast_pending = 0;
+
+    free(session->bcast_plan);
+    session->bcast_plan = NULL;
+}
+
+/*****************************************************************************/
@@ -0,0 +1,289 @@
+/*
+ * inventory: what the node has, reported to the launcher for placement
+ */
+
+/* inventory.c -- cpus and their topology from sysfs, memory from
+ *                /proc/meminfo, the load averages and the listener's own
+ *                slots. HELLO is answered first; the inventory is
+ *                gathered on a thread of its own and follows it, so the
+ *                connect path never waits on /proc or /sys.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/eventfd.h>
+
+#include "listener.h"
+#include "common.h"
+
+/*****************************************************************************/
+
+#define SYS_CPU_DIR  "/sys/devices/system/cpu"
+#define SYS_NODE_DIR "/sys/devices/system/node"
+
+/*****************************************************************************/
+
+static int read_int(const char *path, int *value)
+{
+    int ret;
+    FILE *fp;
+
+    if ((fp = fopen(path, "r")) == NULL)
+        return -1;
+    ret = fscanf(fp, "%d", value);
+    fclose(fp);
+
+    return ret == 1 ? 0 : -1;
+}
+
+/*****************************************************************************/
+
+static int cmp_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*****************************************************************************/
+/* online cpus, and the distinct packages and (package, core) pairs among
+ * them */
+
+static void inventory_cpus(node_inventory_t *inv)
+{
+    int i;
+    int n = 0;
+    int cpu;
+    int pkg;
+    int core;
+    int online;
+    int size = 0;
+    long long *keys = NULL;
+    long long *p;
+    char path[256];
+    DIR *dir;
+    struct dirent *de;
+
+    inv->cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    inv->sockets = 1;
+    inv->cores = inv->cpus;
+
+    if ((dir = opendir(SYS_CPU_DIR)) == NULL)
+        return;
+
+    while ((de = readdir(dir)) != NULL) {
+        if (sscanf(de->d_name, "cpu%d", &cpu) != 1)
+            continue;
+        /* cpu0 often has no online file, it can't go offline */
+        snprintf(path, sizeof(path), SYS_CPU_DIR "/cpu%d/online", cpu);
+        if (read_int(path, &online) == 0 && !online)
+            continue;
+        snprintf(path, sizeof(path),
+            SYS_CPU_DIR "/cpu%d/topology/physical_package_id", cpu);
+        if (read_int(path, &pkg) == -1)
+            continue;
+        snprintf(path, sizeof(path), SYS_CPU_DIR "/cpu%d/topology/core_id",
+            cpu);
+        if (read_int(path, &core) == -1)
+            continue;
+
+        if (n == size) {
+            p = realloc(keys, (size * 2 + 64) * sizeof(long long));
+            if (p == NULL)
+                break;
+            keys = p;
+            size = size * 2 + 64;
+        }
+        keys[n++] = (long long)pkg << 32 | (unsigned int)core;
+    }
+    closedir(dir);
+
+    if (n > 0) {
+        qsort(keys, n, sizeof(long long), cmp_ll);
+        inv->cpus = n;
+        inv->cores = 1;
+        inv->sockets = 1;
+        for(i = 1; i < n; i++) {
+            inv->cores += keys[i] != keys[i - 1];
+            inv->sockets += (keys[i] >> 32) != (keys[i - 1] >> 32);
+        }
+    }
+    free(keys);
+}
+
+/*****************************************************************************/
+
+static void inventory_numa(node_inventory_t *inv)
+{
+    int node;
+    DIR *dir;
+    struct dirent *de;
+
+    inv->numa_nodes = 0;
+    if ((dir = opendir(SYS_NODE_DIR)) != NULL) {
+        while ((de = readdir(dir)) != NULL)
+            inv->numa_nodes += sscanf(de->d_name, "node%d", &node) == 1;
+        closedir(dir);
+    }
+
+    /* no numa support in the kernel is one node */
+    if (inv->numa_nodes == 0)
+        inv->numa_nodes = 1;
+}
+
+/*****************************************************************************/
+
+static void inventory_mem(node_inventory_t *inv)
+{
+    long long kb;
+    FILE *fp;
+    char line[256];
+
+    if ((fp = fopen("/proc/meminfo", "r")) == NULL)
+        return;
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "MemTotal: %lld kB", &kb) == 1)
+            inv->mem_total_kb = kb;
+        else if (sscanf(line, "MemAvailable: %lld kB", &kb) == 1)
+            inv->mem_avail_kb = kb;
+    }
+    fclose(fp);
+}
+
+/*****************************************************************************/
+/* the launcher connection that said HELLO; skt_fd may be another one by
+ * the time the inventory is ready, and the fd may have been closed and
+ * reused, so the loop thread sends it only to the same generation */
+
+typedef struct inventory_req_s {
+    listener_session_t *session;
+    int fd;
+    int gen;
+    int done_fd;  /* eventfd, kicked once inv is filled in */
+    node_inventory_t inv;
+    struct inventory_req_s *next;
+}inventory_req_t;
+
+static inventory_req_t *pending; /* loop thread only */
+
+/*****************************************************************************/
+
+static void * inventory_main(void *arg)
+{
+    double load[3];
+    uint64_t val = 1;
+    inventory_req_t *req = (inventory_req_t *)arg;
+    node_inventory_t *inv = &req->inv;
+    listener_session_t *session = req->session;
+
+    inventory_cpus(inv);
+    inventory_numa(inv);
+    inventory_mem(inv);
+    if (getloadavg(load, 3) == 3) {
+        inv->load1 = load[0] * 100 + 0.5;
+        inv->load5 = load[1] * 100 + 0.5;
+        inv->load15 = load[2] * 100 + 0.5;
+    }
+    inv->time = time(NULL);
+
+    pthread_mutex_lock(&session->lock);
+    inv->slots = session->slots;
+    inv->running = session->nr_running;
+    inv->queued = session->nr_queued;
+    pthread_mutex_unlock(&session->lock);
+
+    /* the loop thread sends it, see inventory_ready */
+    if (write(req->done_fd, &val, sizeof(val)) < 0)
+        fprintf(stderr, "listener: inventory lost, %s(%d) \n",
+            strerror(errno), errno);
+
+    return NULL;
+}
+
+/*****************************************************************************/
+/* on the loop thread; the link that said HELLO may be gone by now */
+
+static void inventory_ready(int done_fd)
+{
+    int len;
+    char buf[WIRE_MAX_RECORD];
+    comlink_header_t header;
+    inventory_req_t *req;
+    inventory_req_t **p;
+
+    for(p = &pending; *p != NULL && (*p)->done_fd != done_fd; p = &(*p)->next)
+        ;
+    if ((req = *p) == NULL)
+        return;
+    *p = req->next;
+    comlink_unwatch_fd(done_fd);
+
+    if (comlink_conn_gen(req->fd) != req->gen) {
+        fprintf(stderr, "listener: launcher link closed, inventory dropped"
+            " \n");
+        free(req);
+        return;
+    }
+
+    len = wire_put(&wire_node_inventory, &req->inv, buf, sizeof(buf));
+    header.type = NODE_INVENTORY;
+    header.len = len;
+    if (len == -1 || comlink_send(req->fd, &header, buf, len) == -1)
+        fprintf(stderr, "listener: failed to send the inventory \n");
+    free(req);
+}
+
+/*****************************************************************************/
+/* HELLO has been answered; the inventory follows it on its own time */
+
+void inventory_send(listener_session_t *session, int fd)
+{
+    int ret;
+    pthread_t thread;
+    pthread_attr_t attr;
+    inventory_req_t *req;
+
+    req = calloc(1, sizeof(inventory_req_t));
+    if (req == NULL)
+        return;
+    req->session = session;
+    req->fd = fd;
+    req->gen = comlink_conn_gen(fd);
+    req->done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (req->done_fd == -1) {
+        fprintf(stderr, "listener: inventory eventfd, %s(%d) \n",
+            strerror(errno), errno);
+        free(req);
+        return;
+    }
+    if (comlink_watch_fd(req->done_fd, inventory_ready) == -1) {
+        close(req->done_fd);
+        free(req);
+        return;
+    }
+    req->next = pending;
+    pending = req;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    ret = pthread_create(&thread, &attr, inventory_main, (void *)req);
+    pthread_attr_destroy(&attr);
+    if (ret != 0) {
+        fprintf(stderr, "listener: inventory thread, %s(%d) \n",
+            strerror(ret), ret);
+        pending = req->next;
+        comlink_unwatch_fd(req->done_fd);
+        free(req);
+    }
+}
+
+/*****************************************************************************/
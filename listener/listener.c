@@ -5,6 +5,8 @@
 
 /* listener.c -- uses comlink to establish a connection with the launcher */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -12,10 +14,15 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <stdint.h>
 #include <sys/wait.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <netdb.h>
+#include <getopt.h>
 
 #include "listener.h"
 #include "common.h"
@@ -23,12 +30,26 @@
 /*****************************************************************************/
 
 #define COMLINK_PORT     (25000)
-#define COMLINK_BUF_SIZE (1024)
+#define COMLINK_BUF_SIZE (64 * 1024) /* staged and broadcast files */
+
+#define INSTANCE_ENV_VARS (5) /* rank, size, local rank/size, pmi socket */
+
+#define SLOT_MEM_MB (256) /* default memory budget per slot */
+
+#define EVENT_RING_SIZE (4096)
+#define EVENT_BATCH     (256)  /* rank events per frame */
+
+#define KILL_GRACE_MS (1000) /* SIGTERM to SIGKILL on stop */
+
+#define METRICS_INTERVAL_MS (10000) /* metrics file rewrite */
+
+#define CACHE_DIR "/tmp/jl_cache" /* staged executables, by hash */
 
 /*****************************************************************************/
 
 static char comlink_buf[COMLINK_BUF_SIZE];
 static listener_session_t listener_session;
+static __thread int on_proc_thread; /* spawn/reaper thread */
 
 /*****************************************************************************/
 
@@ -39,31 +60,363 @@ static listener_session_t * get_listener_session(void)
 
 /*****************************************************************************/
 
+static long long mono_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*****************************************************************************/
+
 static void listener_session_cleanup(listener_session_t *session)
 {
     comlink_server_shutdown();
+    pmi_server_cleanup();
 }
 
 /*****************************************************************************/
-/* cleanup the spawned processes */
+/* the reaper exits once nothing is left running */
 
-static void cleanup_spawned_instances(listener_session_t *session)
+static void spawn_task_finish(listener_session_t *session)
+{
+    pthread_mutex_lock(&session->lock);
+    session->spawn_task_stop = 1;
+    pthread_cond_signal(&session->cond);
+    pthread_mutex_unlock(&session->lock);
+}
+
+/*****************************************************************************/
+
+static int send_frame(listener_session_t *session, int type,
+        void *buf, int len)
+{
+    comlink_header_t header;
+
+    header.type = type;
+    header.len = len;
+    if (comlink_send(session->skt_fd, &header, buf, len) == -1) {
+        fprintf(stderr, "listener: failed to send msg(%d), %s(%d) \n",
+            type, strerror(errno), errno);
+        return -1;
+    }
+    metrics_add(METRIC_MSGS_OUT, 1);
+    metrics_add(METRIC_BYTES_OUT, sizeof(comlink_header_t) + len);
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+static int send_msg(listener_session_t *session, int type,
+        const wire_schema_t *schema, void *msg)
+{
+    int len;
+    char buf[WIRE_MAX_RECORD];
+
+    len = wire_put(schema, msg, buf, sizeof(buf));
+    if (len == -1)
+        return -1;
+
+    return send_frame(session, type, buf, len);
+}
+
+/*****************************************************************************/
+/* loop thread only */
+
+static void send_event(listener_session_t *session, proc_event_t *pe)
+{
+    switch(pe->type) {
+        case RANK_START:
+        case RANK_EXIT:
+            send_msg(session, pe->type, &wire_rank_event, &pe->u.rank);
+            break;
+
+        case NODE_QUEUE:
+            send_msg(session, pe->type, &wire_node_queue, &pe->u.queue);
+            break;
+
+        case GANG_READY:
+            send_msg(session, pe->type, &wire_int, &pe->u.staged);
+            break;
+
+        case GANG_TIMES:
+            send_msg(session, pe->type, &wire_gang_times, &pe->u.gang);
+            break;
+
+        case STATUS_MESSAGE:
+            send_frame(session, pe->type, session->status,
+                strlen(session->status) + 1);
+            break;
+
+        case STOP_DONE:
+            /* last word to the launcher, then the listener goes away */
+            send_msg(session, pe->type, &wire_stop_report, &pe->u.stop);
+            spawn_task_finish(session);
+            listener_session_cleanup(session);
+            break;
+    }
+}
+
+/*****************************************************************************/
+
+static void send_batch(listener_session_t *session, int type,
+        rank_event_t *batch, int n)
+{
+    int len;
+    char buf[EVENT_BATCH * WIRE_MAX_LEN(rank_event_t, RANK_EVENT_FIELDS)];
+
+    len = wire_put_array(&wire_rank_event, batch, n, buf, sizeof(buf));
+    if (len != -1)
+        send_frame(session, type, buf, len);
+}
+
+/*****************************************************************************/
+/* runs of rank events go out as one frame each */
+
+static void batch_event(listener_session_t *session, proc_event_t *pe,
+        rank_event_t *batch, int *n, int *type)
+{
+    metrics_observe(METRIC_REAPER_LAG_NS, mono_ns() - pe->posted_ns);
+    if (*n > 0 && (pe->type != *type || *n == EVENT_BATCH)) {
+        send_batch(session, *type, batch, *n);
+        *n = 0;
+    }
+
+    if (pe->type == RANK_START || pe->type == RANK_EXIT) {
+        *type = pe->type;
+        batch[(*n)++] = pe->u.rank;
+        return;
+    }
+    send_event(session, pe);
+}
+
+/*****************************************************************************/
+/* drains the event ring, then what the reaper put aside while it was
+ * full; the reaper doesn't use the ring again until that is taken, so
+ * the ring is emptied once more first: what is left in it is older */
+
+static void send_events(listener_session_t *session)
 {
     int i;
+    int n = 0;
+    int type = 0;
+    int drained = 0;
+    int nr_overflow;
+    proc_event_t pe;
+    proc_event_t *overflow;
+    rank_event_t batch[EVENT_BATCH];
 
-    for(i = 0; i < session->instances; i++) {
-        if (kill(session->spawned[i], SIGTERM) == -1)
-            kill(session->spawned[i], SIGKILL);
+    while (spsc_pop(&session->events, &pe) == 0) {
+        drained += 1;
+        batch_event(session, &pe, batch, &n, &type);
     }
+
+    if (__atomic_load_n(&session->nr_overflow, __ATOMIC_ACQUIRE) > 0) {
+        while (spsc_pop(&session->events, &pe) == 0) {
+            drained += 1;
+            batch_event(session, &pe, batch, &n, &type);
+        }
+
+        pthread_mutex_lock(&session->overflow_lock);
+        overflow = session->overflow;
+        nr_overflow = session->nr_overflow;
+        session->overflow = NULL;
+        session->overflow_size = 0;
+        __atomic_store_n(&session->nr_overflow, 0, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&session->overflow_lock);
+
+        for(i = 0; i < nr_overflow; i++)
+            batch_event(session, &overflow[i], batch, &n, &type);
+        drained += nr_overflow;
+        free(overflow);
+    }
+
+    if (n > 0)
+        send_batch(session, type, batch, n);
+    metrics_peak(METRIC_EVENT_BATCH, drained);
 }
 
 /*****************************************************************************/
+/* event fd callback; drain until the ring stays empty once parked */
 
-static int report_exec_status(int fd, char *msg)
+static void listener_event_ready(int fd)
 {
-    if (send(fd, msg, strlen(msg), 0) == -1) {
-        fprintf(stderr, "listener: failed to send status, %s(%d) \n",
-            strerror(errno), errno);
+    uint64_t val;
+    listener_session_t *session = get_listener_session();
+
+    while (read(fd, &val, sizeof(val)) > 0)
+        ;
+
+    do {
+        send_events(session);
+    } while (!spsc_idle(&session->events));
+}
+
+/*****************************************************************************/
+
+static void wake_event_loop(listener_session_t *session)
+{
+    uint64_t val = 1;
+
+    if (write(session->event_fd, &val, sizeof(val)) < 0)
+        return;
+}
+
+/*****************************************************************************/
+/* the ring is full, or was and the loop thread hasn't caught up; 0 once
+ * the event is queued behind the others */
+
+static int overflow_event(listener_session_t *session, proc_event_t *pe)
+{
+    int size;
+    proc_event_t *p;
+
+    pthread_mutex_lock(&session->overflow_lock);
+    if (session->nr_overflow == session->overflow_size) {
+        size = session->overflow_size * 2 + EVENT_BATCH;
+        p = realloc(session->overflow, size * sizeof(proc_event_t));
+        if (p == NULL) {
+            pthread_mutex_unlock(&session->overflow_lock);
+            return -1;
+        }
+        session->overflow = p;
+        session->overflow_size = size;
+    }
+    session->overflow[session->nr_overflow] = *pe;
+    __atomic_store_n(&session->nr_overflow, session->nr_overflow + 1,
+        __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&session->overflow_lock);
+
+    return 0;
+}
+
+/*****************************************************************************/
+/* the spawn/reaper thread never touches the socket: its events go through
+ * the ring to the loop thread. Events raised on the loop thread go out
+ * directly, after whatever the ring still holds. The reaper may hold
+ * session->lock, which the loop thread takes too, so it must not wait
+ * for the ring to drain */
+
+static void post_event(listener_session_t *session, proc_event_t *pe)
+{
+    int ret;
+
+    if (!on_proc_thread) {
+        send_events(session);
+        send_event(session, pe);
+        return;
+    }
+
+    pe->posted_ns = mono_ns();
+    if (__atomic_load_n(&session->nr_overflow, __ATOMIC_ACQUIRE) == 0 &&
+            (ret = spsc_push(&session->events, pe)) != -1) {
+        if (ret == 1)
+            wake_event_loop(session);
+        return;
+    }
+
+    /* out of memory as well; all that is left is to wait for the loop */
+    while (overflow_event(session, pe) == -1)
+        usleep(100);
+    wake_event_loop(session);
+}
+
+/*****************************************************************************/
+
+static void report_rank_event(listener_session_t *session, int type,
+        rank_event_t *ev)
+{
+    proc_event_t pe;
+
+    pe.type = type;
+    pe.u.rank = *ev;
+    post_event(session, &pe);
+}
+
+/*****************************************************************************/
+/* environment for the instances: rank info first, then our own */
+
+static char ** alloc_instance_env(listener_session_t *session)
+{
+    int i;
+    int n;
+    char **envp;
+
+    for(n = 0; environ[n] != NULL; n++)
+        ;
+
+    envp = calloc(n + INSTANCE_ENV_VARS + 1, sizeof(char *));
+    if (envp == NULL)
+        return NULL;
+
+    for(i = 0; i < INSTANCE_ENV_VARS; i++) {
+        envp[i] = malloc(MAX_FILENAME_LEN + 32);
+        if (envp[i] == NULL)
+            return NULL;
+    }
+    for(i = 0; i < n; i++)
+        envp[INSTANCE_ENV_VARS + i] = environ[i];
+
+    snprintf(envp[1], MAX_FILENAME_LEN + 32, "%s=%d",
+        PMI_ENV_SIZE, session->job_size);
+    snprintf(envp[3], MAX_FILENAME_LEN + 32, "%s=%d",
+        PMI_ENV_LOCAL_SIZE, session->instances);
+    snprintf(envp[4], MAX_FILENAME_LEN + 32, "%s=%s",
+        PMI_ENV_SOCKET, session->pmi_path);
+
+    return envp;
+}
+
+/*****************************************************************************/
+
+static void set_instance_rank(char **envp, int rank, int local_rank)
+{
+    snprintf(envp[0], MAX_FILENAME_LEN + 32, "%s=%d",
+        PMI_ENV_RANK, rank);
+    snprintf(envp[2], MAX_FILENAME_LEN + 32, "%s=%d",
+        PMI_ENV_LOCAL_RANK, local_rank);
+}
+
+/*****************************************************************************/
+
+static void free_instance_env(char **envp)
+{
+    int i;
+
+    if (envp == NULL)
+        return;
+
+    for(i = 0; i < INSTANCE_ENV_VARS; i++)
+        free(envp[i]);
+    free(envp);
+}
+
+/*****************************************************************************/
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*****************************************************************************/
+/* gang start: the children block on a shared release pipe; closing its
+ * write end wakes all of them at once */
+
+static int gang_stage(listener_session_t *session)
+{
+    if (pipe2(session->gang_release, O_CLOEXEC) == -1)
+        return -1;
+
+    if (pipe2(session->gang_report, O_CLOEXEC) == -1) {
+        close(session->gang_release[0]);
+        close(session->gang_release[1]);
         return -1;
     }
 
@@ -71,56 +424,753 @@ static int report_exec_status(int fd, char *msg)
 }
 
 /*****************************************************************************/
-/* actual instaces handler */
+/* runs in the forked child, before exec */
 
-static void * spawn_task_main(void *arg)
+static void gang_child_wait(listener_session_t *session)
+{
+    char c;
+    long long ts;
+
+    close(session->gang_release[1]);
+    while (read(session->gang_release[0], &c, 1) == -1 && errno == EINTR)
+        ;
+
+    ts = now_ns();
+    if (write(session->gang_report[1], &ts, sizeof(ts)) != sizeof(ts))
+        _exit(126);
+}
+
+/*****************************************************************************/
+/* all children staged; tell the launcher and wait for the wake-up times */
+
+static void gang_collect(listener_session_t *session)
+{
+    int staged = session->instances;
+    long long ts;
+    gang_times_t times;
+    proc_event_t pe;
+
+    close(session->gang_report[1]);
+
+    pe.type = GANG_READY;
+    pe.u.staged.value = staged;
+    post_event(session, &pe);
+
+    memset(&times, 0, sizeof(times));
+    while (times.count < staged &&
+            read(session->gang_report[0], &ts, sizeof(ts)) == sizeof(ts)) {
+        if (times.count == 0 || ts < times.first_ns)
+            times.first_ns = ts;
+        if (times.count == 0 || ts > times.last_ns)
+            times.last_ns = ts;
+        times.count += 1;
+    }
+    close(session->gang_report[0]);
+
+    pe.type = GANG_TIMES;
+    pe.u.gang = times;
+    post_event(session, &pe);
+}
+
+/*****************************************************************************/
+/* launcher barrier complete; runs on the comlink thread */
+
+static void gang_release(listener_session_t *session)
+{
+    if (!session->gang || session->gang_release[1] == -1)
+        return;
+
+    close(session->gang_release[1]);
+    close(session->gang_release[0]);
+    session->gang_release[1] = -1;
+}
+
+/*****************************************************************************/
+/* arms the deadline timer for ns on the monotonic clock, disarms it for 0;
+ * called with the session lock held */
+
+static void deadline_set(listener_session_t *session, long long ns)
+{
+    struct itimerspec its;
+
+    if (session->deadline_fd == -1)
+        return;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = ns / 1000000000LL;
+    its.it_value.tv_nsec = ns % 1000000000LL;
+    if (timerfd_settime(session->deadline_fd, TFD_TIMER_ABSTIME, &its,
+            NULL) == -1) {
+        fprintf(stderr, "listener: deadline timer, %s(%d) \n",
+            strerror(errno), errno);
+        return;
+    }
+    session->deadline_ns = ns;
+}
+
+/*****************************************************************************/
+/* a new deadline; only moves the timer if it comes first */
+
+static void deadline_at(listener_session_t *session, long long ns)
+{
+    if (session->deadline_ns == 0 || ns < session->deadline_ns)
+        deadline_set(session, ns);
+}
+
+/*****************************************************************************/
+/* forks one copy of a rank; called with the session lock held */
+
+static int spawn_instance(listener_session_t *session, char **envp,
+        int rank, int copy, int gang)
+{
+    int idx;
+    int *live;
+    int local_rank;
+    int in_fd = -1;
+    pid_t pid;
+    char *argv[2] = { session->exe_name, NULL };
+    long long spawn_ns = mono_ns();
+    inst_table_t *t = &session->spawned;
+    table_col_t cols[] = {
+        TABLE_COL(t->pid), TABLE_COL(t->rank), TABLE_COL(t->flags),
+        TABLE_COL(t->started_ns), TABLE_COL(t->term_ns)
+    };
+
+    idx = t->count;
+    if (table_reserve(cols, sizeof(cols) / sizeof(cols[0]),
+            &t->capacity, idx + 1) == -1)
+        return -1;
+
+    if (session->nr_running == session->live_size) {
+        live = realloc(session->live,
+                (session->live_size * 2 + 16) * sizeof(int));
+        if (live == NULL)
+            return -1;
+        session->live = live;
+        session->live_size = session->live_size * 2 + 16;
+    }
+
+    /* speculative copies can't have the stream from the start */
+    if (copy == 0)
+        in_fd = stdin_attach(session);
+
+    /* rows of the table follow the spawn order, which copies and the
+     * queue change; the local rank comes from the rank itself. A copy of
+     * another host's rank gets an index within this host instead */
+    local_rank = rank - session->rank_base;
+    if (local_rank < 0 || local_rank >= session->instances)
+        local_rank = session->instances > 0 ? idx % session->instances : 0;
+    set_instance_rank(envp, rank, local_rank);
+    pid = fork();
+    if (pid == 0) {
+        /* own group, so a stop also reaches whatever the instance forks */
+        setpgid(0, 0);
+        if (in_fd != -1)
+            dup2(in_fd, STDIN_FILENO);
+        if (gang)
+            gang_child_wait(session);
+        /* use the 'p' variant jst to be safe */
+        execvpe(argv[0], argv, envp);
+        _exit(127);
+    }
+    if (in_fd != -1)
+        close(in_fd);
+    if (pid == -1)
+        return -1;
+    setpgid(pid, pid); /* either side may run first */
+
+    t->pid[idx] = pid;
+    t->rank[idx] = rank;
+    t->flags[idx] = copy ? INST_COPY : 0;
+    t->started_ns[idx] = mono_ns();
+    t->term_ns[idx] = 0;
+    if (session->inst_timeout_ms > 0)
+        deadline_at(session, t->started_ns[idx] +
+            session->inst_timeout_ms * 1000000LL);
+    metrics_add(METRIC_SPAWNED, 1);
+    metrics_observe(METRIC_SPAWN_NS, t->started_ns[idx] - spawn_ns);
+    t->count += 1;
+    session->live[session->nr_running++] = idx;
+    pthread_cond_signal(&session->cond);
+
+    return idx;
+}
+
+/*****************************************************************************/
+/* reaps one child; returns its slot or -1 */
+
+static int reap_instance(listener_session_t *session, rank_event_t *ev)
 {
     int i;
+    int idx = -1;
     int status;
-    int diff;
-    int nr_success = 0;    
     pid_t wpid;
+    inst_table_t *t = &session->spawned;
+
+    while ((wpid = wait(&status)) == -1 && errno == EINTR)
+        ;
+    if (wpid == -1)
+        return -1;
+
+    pthread_mutex_lock(&session->lock);
+    for(i = 0; i < session->nr_running; i++) {
+        if (t->pid[session->live[i]] == wpid)
+            break;
+    }
+    if (i < session->nr_running) {
+        idx = session->live[i];
+        session->live[i] = session->live[--session->nr_running];
+        t->pid[idx] = 0;
+        /* the leader is gone; don't leave the rest of its group behind */
+        if (session->stopping || (t->flags[idx] & INST_TIMEDOUT))
+            killpg(wpid, SIGKILL);
+        ev->rank = t->rank[idx];
+        ev->copy = t->flags[idx] & INST_COPY;
+        ev->status = status;
+        ev->time_ns = mono_ns() - t->started_ns[idx];
+        ev->timeout = !(t->flags[idx] & INST_TIMEDOUT) ? TIMEOUT_NONE :
+            (t->flags[idx] & INST_WALLTIME) ? TIMEOUT_WALLTIME :
+            TIMEOUT_INSTANCE;
+    }
+    pthread_mutex_unlock(&session->lock);
+
+    return idx;
+}
+
+/*****************************************************************************/
+/* one of the node's own ranks is over; the last one reports the node's
+ * status. Called with the session lock held */
+
+static void instance_done(listener_session_t *session, int ok)
+{
+    int diff;
+    proc_event_t pe;
+
+    session->nr_done += 1;
+    if (!ok)
+        session->nr_failed += 1;
+    if (session->nr_done < session->instances)
+        return;
+
+    /* FIX, dirty hack for the status msg */
+    diff = session->nr_failed;
+    if (diff != 0 && session->nr_timed_out != 0)
+        snprintf(session->status, MAX_STATUS_LEN,
+            "status(%s): abnormal exit in %d instances, %d timed out",
+            "", diff, session->nr_timed_out);
+    else if (diff != 0)
+        snprintf(session->status, MAX_STATUS_LEN,
+            "status(%s): abnormal exit in %d instances",
+            "", diff);
+    else
+        snprintf(session->status, MAX_STATUS_LEN,
+            "status(%s): normal exit", "");
+
+    pe.type = STATUS_MESSAGE;
+    post_event(session, &pe);
+}
+
+/*****************************************************************************/
+
+static void report_queue(listener_session_t *session)
+{
+    proc_event_t pe;
+    node_queue_t *q = &pe.u.queue;
+
+    if (session->nr_queued == session->reported_queued)
+        return;
+    session->reported_queued = session->nr_queued;
+
+    q->slots = session->slots;
+    q->running = session->nr_running;
+    q->queued = session->nr_queued;
+    q->peak_queued = session->peak_queued;
+    q->max_wait_ns = session->max_wait_ns;
+
+    pe.type = NODE_QUEUE;
+    post_event(session, &pe);
+}
+
+/*****************************************************************************/
+/* a gang, a job using the wire-up or one reading the launcher's stdin is
+ * started as a whole: its running instances wait on the others and could
+ * never release a slot */
+
+static int admission_limit(listener_session_t *session)
+{
+    if ((session->gang || session->wireup || session->fan.on) &&
+            session->slots < session->instances)
+        return session->instances;
+
+    return session->slots;
+}
+
+/*****************************************************************************/
+/* called with the session lock held */
+
+static void start_request(listener_session_t *session, spawn_req_t *req,
+        long long wait_ns)
+{
+    rank_event_t ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.rank = req->rank;
+    ev.copy = req->copy;
+    ev.time_ns = wait_ns;
+    if (wait_ns > session->max_wait_ns)
+        session->max_wait_ns = wait_ns;
+
+    if (spawn_instance(session, session->envp, req->rank, req->copy,
+            session->gang && req->copy == 0) == -1) {
+        fprintf(stderr, "listener: failed to spawn rank %d \n", ev.rank);
+        ev.status = 127 << 8;
+        ev.time_ns = 0;
+        report_rank_event(session, RANK_EXIT, &ev);
+        if (req->copy == 0)
+            instance_done(session, 0);
+        return;
+    }
+
+    if (req->copy != 0)
+        fprintf(stdout, "listener: speculative copy of rank %d \n", ev.rank);
+    report_rank_event(session, RANK_START, &ev);
+}
+
+/*****************************************************************************/
+/* the walltime is up; whatever still waits for a slot never runs. Called
+ * with the session lock held */
+
+static void expire_queued(listener_session_t *session)
+{
+    spawn_req_t req;
+    rank_event_t ev;
+
+    while (admission_pop(session, &req) == 0) {
+        memset(&ev, 0, sizeof(ev));
+        ev.rank = req.rank;
+        ev.copy = req.copy;
+        ev.status = 127 << 8;
+        ev.timeout = TIMEOUT_WALLTIME;
+        report_rank_event(session, RANK_EXIT, &ev);
+        if (req.copy == 0) {
+            session->nr_timed_out += 1;
+            instance_done(session, 0);
+        }
+    }
+}
+
+/*****************************************************************************/
+/* starts queued ranks while slots are free; called with the session lock
+ * held */
+
+static void admit_pending(listener_session_t *session)
+{
+    spawn_req_t req;
+
+    if (session->expired)
+        expire_queued(session);
+
+    while (session->nr_running < admission_limit(session) &&
+            admission_pop(session, &req) == 0)
+        start_request(session, &req, mono_ns() - req.queued_ns);
+
+    metrics_set(METRIC_RUNNING, session->nr_running);
+    metrics_set(METRIC_QUEUED, session->nr_queued);
+    metrics_set(METRIC_PEAK_QUEUED, session->peak_queued);
+    report_queue(session);
+}
+
+/*****************************************************************************/
+/* starts the rank right away if a slot is free, queues it otherwise;
+ * called with the session lock held */
+
+static void queue_instance(listener_session_t *session, int rank, int copy)
+{
+    spawn_req_t req;
+    rank_event_t ev;
+
+    memset(&req, 0, sizeof(req));
+    req.rank = rank;
+    req.copy = copy;
+    req.prio = copy;
+    req.queued_ns = mono_ns();
+    if (session->nr_queued == 0 &&
+            session->nr_running < admission_limit(session)) {
+        start_request(session, &req, 0);
+        return;
+    }
+
+    if (admission_push(session, &req) == 0)
+        return;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.rank = rank;
+    ev.copy = copy;
+    ev.status = 127 << 8;
+    report_rank_event(session, RANK_EXIT, &ev);
+    if (copy == 0)
+        instance_done(session, 0);
+}
+
+/*****************************************************************************/
+/* fills in the stop report once the last instance is gone; called with the
+ * session lock held, the caller posts it after unlocking */
+
+static int stop_finished(listener_session_t *session, proc_event_t *pe)
+{
+    if (session->stopping != 1 || session->nr_running > 0)
+        return 0;
+
+    session->stopping = 2;
+    session->stop.time_ns = mono_ns() - session->stop_ns;
+    fprintf(stdout, "listener: stopped %d process groups in %.3f ms,"
+        " %d needed SIGKILL \n", session->stop.groups,
+        session->stop.time_ns / 1e6, session->stop.killed);
+
+    memset(pe, 0, sizeof(*pe));
+    pe->type = STOP_DONE;
+    pe->u.stop = session->stop;
+
+    return 1;
+}
+
+/*****************************************************************************/
+/* actual instaces handler; queues the local ranks, then stays around as
+ * the reaper, starting queued ranks as slots free up */
+
+static void * spawn_task_main(void *arg)
+{
+    int i;
+    int idx;
+    int done;
+    rank_event_t ev;
+    proc_event_t pe;
 
     listener_session_t *session = (listener_session_t *)arg;
-    char *argv[2] = { session->exe_name, NULL };
 
+    on_proc_thread = 1;
+    session->nr_done = 0;
     session->nr_failed = 0;
-    strncpy(session->status, "not spawned\0", 12);
-
-        do {
-//    while(!session->spawn_task_stop) {
-        for(i = 0; i < session->instances; i++) {
-            session->spawned[i] = fork();
-            if (session->spawned[i] == 0) {
-                /* use the 'p' variant jst to be safe */
-                execvp(argv[0], argv);
-            }
+    session->nr_timed_out = 0;
+    snprintf(session->status, MAX_STATUS_LEN, "not spawned");
+
+    /* built before forking; the child only execs */
+    session->envp = alloc_instance_env(session);
+    if (session->envp == NULL) {
+        fprintf(stderr, "listener: failed to build instance env \n");
+        return NULL;
+    }
+
+    if (session->gang && gang_stage(session) == -1) {
+        fprintf(stderr, "listener: gang staging failed, %s(%d) \n",
+            strerror(errno), errno);
+        session->gang = 0;
+    }
+
+    if (session->gang && session->instances > session->slots)
+        fprintf(stderr, "listener: gang of %d exceeds %d slots, starting"
+            " all of it \n", session->instances, session->slots);
+
+    pthread_mutex_lock(&session->lock);
+    for(i = 0; i < session->instances; i++)
+        queue_instance(session, session->rank_base + i, 0);
+    admit_pending(session);
+    pthread_mutex_unlock(&session->lock);
+
+    if (stdin_start(session) == -1)
+        fprintf(stderr, "listener: instances get no stdin \n");
+
+    if (session->gang)
+        gang_collect(session);
+
+    for (;;) {
+        pthread_mutex_lock(&session->lock);
+        while (session->nr_running == 0 && !session->spawn_task_stop)
+            pthread_cond_wait(&session->cond, &session->lock);
+        idx = session->nr_running;
+        pthread_mutex_unlock(&session->lock);
+        if (idx == 0)
+            break;
+
+        idx = reap_instance(session, &ev);
+        if (idx == -1)
+            continue;
+
+        fprintf(stdout, "proc rank %d copy %d exit status = %d%s \n",
+            ev.rank, ev.copy, WIFEXITED(ev.status) ?
+            WEXITSTATUS(ev.status) : -1, ev.timeout ? ", timed out" : "");
+        report_rank_event(session, RANK_EXIT, &ev);
+        metrics_add(METRIC_EXITED, 1);
+        metrics_add(METRIC_FAILED, ev.status != 0);
+        metrics_observe(METRIC_RUNTIME_NS, ev.time_ns);
+
+        pthread_mutex_lock(&session->lock);
+        /* speculative copies are accounted for by the launcher; one that
+         * timed out failed, whatever it did with the SIGTERM */
+        session->nr_timed_out += ev.copy == 0 && ev.timeout;
+        if (ev.copy == 0)
+            instance_done(session, !ev.timeout && (WIFEXITED(ev.status) ||
+                (session->spawned.flags[idx] & INST_SUPERSEDED)));
+        admit_pending(session);
+        done = stop_finished(session, &pe);
+        pthread_mutex_unlock(&session->lock);
+
+        if (done)
+            post_event(session, &pe);
+    }
+
+    pthread_mutex_lock(&session->lock);
+    free_instance_env(session->envp);
+    session->envp = NULL;
+    pthread_mutex_unlock(&session->lock);
+
+    return NULL;
+}
+
+/*****************************************************************************/
+/* first pmi request; queued ranks would never reach the fence */
+
+static void wireup_started(listener_session_t *session)
+{
+    pthread_mutex_lock(&session->lock);
+    session->wireup = 1;
+    if (session->nr_queued > 0) {
+        fprintf(stderr, "listener: job uses the wire-up, starting %d queued"
+            " instances past the %d slots \n", session->nr_queued,
+            session->slots);
+        admit_pending(session);
+    }
+    pthread_mutex_unlock(&session->lock);
+}
+
+/*****************************************************************************/
+/* launcher asked for another copy of a straggling rank */
+
+static void spawn_speculative(listener_session_t *session, rank_event_t *req)
+{
+    rank_event_t ev;
+
+    pthread_mutex_lock(&session->lock);
+    if (session->envp != NULL && !session->stopping && !session->expired) {
+        queue_instance(session, req->rank, req->copy);
+        admit_pending(session);
+        pthread_mutex_unlock(&session->lock);
+        return;
+    }
+    pthread_mutex_unlock(&session->lock);
+
+    memset(&ev, 0, sizeof(ev));
+    ev.rank = req->rank;
+    ev.copy = req->copy;
+    ev.status = 127 << 8;
+    report_rank_event(session, RANK_EXIT, &ev);
+}
+
+/*****************************************************************************/
+/* the other copy of the rank finished first */
+
+static void kill_instance(listener_session_t *session, rank_event_t *req)
+{
+    int i;
+    int idx;
+    inst_table_t *t = &session->spawned;
+
+    pthread_mutex_lock(&session->lock);
+    for(i = 0; i < session->nr_running; i++) {
+        idx = session->live[i];
+        if (t->rank[idx] != req->rank ||
+                (t->flags[idx] & INST_COPY) != req->copy)
+            continue;
+        t->flags[idx] |= INST_SUPERSEDED;
+        killpg(t->pid[idx], SIGTERM);
+    }
+    pthread_mutex_unlock(&session->lock);
+}
+
+/*****************************************************************************/
+/* grace period is over; SIGKILL whatever ignored the SIGTERM */
+
+static void stop_escalate(listener_session_t *session)
+{
+    int i;
+
+    pthread_mutex_lock(&session->lock);
+    for(i = 0; i < session->nr_running; i++)
+        killpg(session->spawned.pid[session->live[i]], SIGKILL);
+    session->stop.killed = session->nr_running;
+    pthread_mutex_unlock(&session->lock);
+}
+
+/*****************************************************************************/
+
+static void listener_kill_timer(int fd)
+{
+    listener_session_t *session = get_listener_session();
+
+    comlink_unwatch_fd(fd);
+    session->kill_fd = -1;
+    stop_escalate(session);
+}
+
+/*****************************************************************************/
+/* next thing due: the walltime, an instance's timeout or the SIGKILL of
+ * one that timed out. Called with the session lock held */
+
+static void deadline_arm(listener_session_t *session)
+{
+    int i;
+    int idx;
+    long long due;
+    long long next = session->job_deadline_ns;
+    inst_table_t *t = &session->spawned;
+
+    for(i = 0; i < session->nr_running; i++) {
+        idx = session->live[i];
+        if (t->flags[idx] & INST_KILLED)
+            continue;
+        if (t->flags[idx] & INST_TIMEDOUT)
+            due = t->term_ns[idx] + session->kill_grace_ms * 1000000LL;
+        else if (session->inst_timeout_ms > 0)
+            due = t->started_ns[idx] + session->inst_timeout_ms * 1000000LL;
+        else
+            continue;
+        if (next == 0 || due < next)
+            next = due;
+    }
+
+    deadline_set(session, next);
+}
+
+/*****************************************************************************/
+/* SIGTERM to the groups past their limit, SIGKILL to those that outlived
+ * the grace period; the reaper reports them as timed out. Called with the
+ * session lock held */
+
+static void deadline_check(listener_session_t *session)
+{
+    int i;
+    int idx;
+    long long now = mono_ns();
+    inst_table_t *t = &session->spawned;
+
+    /* a stop has its own escalation */
+    if (session->stopping) {
+        deadline_set(session, 0);
+        return;
+    }
+
+    if (session->job_deadline_ns != 0 && now >= session->job_deadline_ns) {
+        session->job_deadline_ns = 0;
+        if (session->nr_running > 0 || session->nr_queued > 0) {
+            fprintf(stderr, "listener: walltime is up, stopping %d instances,"
+                " %d queued \n", session->nr_running, session->nr_queued);
+            session->expired = 1;
         }
+    }
 
-        /* wait for the exit of all the child */
-        while((wpid = wait(&status)) > 0) {
-            if (WIFEXITED(status)) {
-                nr_success += 1;
-                fprintf(stdout, "proc [%d] exit status = %d \n",
-                    wpid, WEXITSTATUS(status));
-            }
+    for(i = 0; i < session->nr_running; i++) {
+        idx = session->live[i];
+        if (t->flags[idx] & INST_KILLED)
+            continue;
+
+        if (t->flags[idx] & INST_TIMEDOUT) {
+            if (now < t->term_ns[idx] + session->kill_grace_ms * 1000000LL)
+                continue;
+            t->flags[idx] |= INST_KILLED;
+            killpg(t->pid[idx], SIGKILL);
+            continue;
         }
 
-        /* FIX, dirty hack for the status msg */
-        diff = session->instances - nr_success;
-        if (diff != 0)
-            sprintf(session->status,
-                "status(%s): abnormal exit in %d instances",
-                "", diff);
+        if (session->expired)
+            t->flags[idx] |= INST_WALLTIME;
+        else if (session->inst_timeout_ms == 0 || now < t->started_ns[idx] +
+                session->inst_timeout_ms * 1000000LL)
+            continue;
         else
-            sprintf(session->status,
-                "status(%s): normal exit", "");
+            fprintf(stderr, "listener: rank %d copy %d past its %.3f s"
+                " timeout \n", t->rank[idx], t->flags[idx] & INST_COPY,
+                session->inst_timeout_ms / 1e3);
+        t->flags[idx] |= INST_TIMEDOUT;
+        t->term_ns[idx] = now;
+        killpg(t->pid[idx], SIGTERM);
+    }
+
+    if (session->expired)
+        admit_pending(session);
+    deadline_arm(session);
+}
 
-        report_exec_status(session->skt_fd, session->status);
-        break;
-    }while(0);
+/*****************************************************************************/
 
-    return NULL;
+static void listener_deadline_timer(int fd)
+{
+    uint64_t val;
+    listener_session_t *session = get_listener_session();
+
+    while (read(fd, &val, sizeof(val)) > 0)
+        ;
+
+    pthread_mutex_lock(&session->lock);
+    session->deadline_ns = 0;
+    deadline_check(session);
+    pthread_mutex_unlock(&session->lock);
+}
+
+/*****************************************************************************/
+/* stop from the launcher; SIGTERM to every instance's group at once, the
+ * reaper reports back once they are all gone */
+
+static void stop_instances(listener_session_t *session)
+{
+    int i;
+    int done;
+    proc_event_t pe;
+    struct itimerspec its;
+
+    pthread_mutex_lock(&session->lock);
+    if (session->stopping) {
+        pthread_mutex_unlock(&session->lock);
+        return;
+    }
+
+    session->stopping = 1;
+    session->stop_ns = mono_ns();
+    session->nr_queued = 0; /* never started, nothing to kill */
+    session->stop.groups = session->nr_running;
+    session->stop.killed = 0;
+    for(i = 0; i < session->nr_running; i++)
+        killpg(session->spawned.pid[session->live[i]], SIGTERM);
+    done = stop_finished(session, &pe);
+    pthread_mutex_unlock(&session->lock);
+
+    if (done) {
+        post_event(session, &pe);
+        return;
+    }
+
+    if (session->kill_grace_ms == 0) {
+        stop_escalate(session);
+        return;
+    }
+
+    session->kill_fd = timerfd_create(CLOCK_MONOTONIC,
+            TFD_NONBLOCK | TFD_CLOEXEC);
+    if (session->kill_fd == -1) {
+        fprintf(stderr, "listener: timerfd, %s(%d) \n",
+            strerror(errno), errno);
+        stop_escalate(session);
+        return;
+    }
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = session->kill_grace_ms / 1000;
+    its.it_value.tv_nsec = (session->kill_grace_ms % 1000) * 1000000L;
+    if (timerfd_settime(session->kill_fd, 0, &its, NULL) == -1 ||
+            comlink_watch_fd(session->kill_fd, listener_kill_timer) == -1) {
+        close(session->kill_fd);
+        session->kill_fd = -1;
+        stop_escalate(session);
+    }
 }
 
 /*****************************************************************************/
@@ -129,10 +1179,45 @@ static void * spawn_task_main(void *arg)
 static int spawn_task_setup(void)
 {
     int ret;
+    int busy;
 
     listener_session_t *session = get_listener_session();
 
+    /* jobs of a session run one after another; the last one's reaper is
+     * parked with nothing left to reap */
+    if (session->spawn_task_live) {
+        pthread_mutex_lock(&session->lock);
+        busy = session->nr_running > 0 || session->nr_queued > 0;
+        pthread_mutex_unlock(&session->lock);
+        if (busy) {
+            fprintf(stderr, "listener: previous job still running, start"
+                " ignored \n");
+            return -1;
+        }
+        spawn_task_finish(session);
+        pthread_join(session->spawn_task, NULL);
+        session->spawn_task_live = 0;
+        pmi_job_reset();
+    }
+
+    /* the sampler reads the instance rows under the lock */
+    pthread_mutex_lock(&session->lock);
+    session->spawned.count = 0;
+    session->nr_running = 0;
+    session->expired = 0;
+    session->job_deadline_ns = 0;
+    if (session->walltime_ms > 0) {
+        session->job_deadline_ns = mono_ns() +
+            session->walltime_ms * 1000000LL;
+        deadline_at(session, session->job_deadline_ns);
+    }
+    pthread_mutex_unlock(&session->lock);
+
     session->spawn_task_stop = 0;
+    session->wireup = 0;
+    session->peak_queued = 0;
+    session->reported_queued = -1; /* the launcher wants the slot count */
+    session->max_wait_ns = 0;
     ret = pthread_attr_init(&session->spawn_task_attr);
     if(ret != 0) {
         fprintf(stderr,"listener: ptherad attr_init, %s(%d) \n",
@@ -147,6 +1232,7 @@ static int spawn_task_setup(void)
             strerror(errno), errno);
         return -1;
     }
+    session->spawn_task_live = 1;
 
     return 0;
 }
@@ -158,15 +1244,29 @@ static int listener_handle_ctrlmsg(char *buf, listener_session_t *s)
 {
     int ret = 0;
     
+    /* nothing starts before the staged executable and the broadcast
+     * file are in */
+    if ((s->stage_pending || s->bcast_pending) &&
+            (strcmp(buf, "start") == 0 || strcmp(buf, "stage") == 0)) {
+        snprintf(s->deferred_ctrl, sizeof(s->deferred_ctrl), "%s", buf);
+        return 0;
+    }
+
     /* do normal strcmp; improve later */
     if (strcmp(buf, "start") == 0) {
+        s->gang = 0;
+        ret = spawn_task_setup();
+    }
+    else if (strcmp(buf, "stage") == 0) {
+        s->gang = 1;
+        s->gang_release[1] = -1;
         ret = spawn_task_setup();
     }
+    else if (strcmp(buf, "release") == 0) {
+        gang_release(s);
+    }
     else if (strcmp(buf, "stop") == 0) {
-        cleanup_spawned_instances(s);
-        s->spawn_task_stop = 1;
-        listener_session_cleanup(s);
-        ret = 0;
+        stop_instances(s);
     }
     else
         return -1;
@@ -174,33 +1274,176 @@ static int listener_handle_ctrlmsg(char *buf, listener_session_t *s)
     return ret;
 }
 
+/*****************************************************************************/
+/* staging or the broadcast is over; runs the start they held back */
+
+static void listener_resume(listener_session_t *s)
+{
+    char ctrl[sizeof(s->deferred_ctrl)];
+
+    if (s->stage_pending || s->bcast_pending || s->deferred_ctrl[0] == '\0')
+        return;
+
+    strcpy(ctrl, s->deferred_ctrl);
+    s->deferred_ctrl[0] = '\0';
+    listener_handle_ctrlmsg(ctrl, s);
+}
+
 /*****************************************************************************/
 
 static void listener_rxmsg_callback(int fd,
         unsigned int msg_type, char *buf, int len)
 {
     char temp_buf[256];
+    char *cur = buf;
+    char *end = buf + len;
+    union {
+        hello_t hello;
+        int_msg_t n;
+        job_layout_t layout;
+        rank_event_t rank;
+        stage_offer_t offer;
+        job_limits_t limits;
+    }m;
     
     listener_session_t *session = get_listener_session();
+
+    metrics_add(METRIC_MSGS_IN, 1);
+    metrics_add(METRIC_BYTES_IN, sizeof(comlink_header_t) + len);
+
+    /* requests from local instances */
+    if (pmi_handle_msg(fd, msg_type, buf, len) == 0) {
+        if (!session->wireup)
+            wireup_started(session);
+        return;
+    }
     
+    /* may come from the parent relay rather than the launcher */
+    switch(msg_type) {
+        case BCAST_PLAN:
+            bcast_plan(session, buf, len);
+            listener_resume(session);
+            return;
+
+        case BCAST_DATA:
+            if (bcast_data(session, fd, buf, len) == 1)
+                listener_resume(session);
+            return;
+    }
+
     session->skt_fd = fd;
     
     switch(msg_type) {
+        case HELLO:
+            if (wire_get(&wire_hello, &cur, end, &m.hello) != 1)
+                break;
+            if (m.hello.version != WIRE_VERSION)
+                fprintf(stdout, "listener: launcher speaks wire version %u \n",
+                    m.hello.version);
+            m.hello.version = WIRE_VERSION;
+            m.hello.caps = WIRE_CAPS;
+            send_msg(session, HELLO, &wire_hello, &m.hello);
+            inventory_send(session, fd);
+            break;
+
         case PROC_INSTANCES:
-            session->instances = *(int *)buf;
+            if (wire_get(&wire_int, &cur, end, &m.n) != 1)
+                break;
+            session->instances = m.n.value;
             fprintf(stdout, "listener: instances = %d \n",
                 session->instances);    
+            /* a new job; the last one's stream and limits are over */
+            stdin_cleanup(session);
+            session->walltime_ms = 0;
+            session->inst_timeout_ms = 0;
+            break;
+
+        case JOB_LIMITS:
+            if (wire_get(&wire_job_limits, &cur, end, &m.limits) != 1)
+                break;
+            session->walltime_ms = m.limits.walltime_ms;
+            session->inst_timeout_ms = m.limits.instance_timeout_ms;
+            fprintf(stdout, "listener: walltime %.3f s, instance timeout"
+                " %.3f s \n", session->walltime_ms / 1e3,
+                session->inst_timeout_ms / 1e3);
             break;
             
+        case JOB_SAMPLE:
+            if (wire_get(&wire_int, &cur, end, &m.n) == 1)
+                sample_start(session, fd, m.n.value);
+            break;
+
+        case JOB_LAYOUT:
+            if (wire_get(&wire_job_layout, &cur, end, &m.layout) != 1)
+                break;
+            session->rank_base = m.layout.rank_base;
+            session->job_size = m.layout.job_size;
+            fprintf(stdout, "listener: ranks %d..%d of %d \n",
+                session->rank_base,
+                session->rank_base + session->instances - 1,
+                session->job_size);
+            break;
+
+        case KVS_ALLGATHER_PART:
+        case KVS_ALLGATHER:
+            pmi_allgather(buf, len, msg_type == KVS_ALLGATHER);
+            break;
+
+        case KVS_FAILED:
+            pmi_fence_failed();
+            break;
+
+        case SPAWN_RANK:
+            if (wire_get(&wire_rank_event, &cur, end, &m.rank) == 1)
+                spawn_speculative(session, &m.rank);
+            break;
+
+        case KILL_RANK:
+            if (wire_get(&wire_rank_event, &cur, end, &m.rank) == 1)
+                kill_instance(session, &m.rank);
+            break;
+
+        case STAGE_OFFER:
+            if (wire_get(&wire_stage_offer, &cur, end, &m.offer) == 1)
+                stage_offer(session, &m.offer);
+            break;
+
+        case STAGE_DATA:
+            if (stage_data(session, buf, len) == 1)
+                listener_resume(session);
+            break;
+
+        case STDIN_OPEN:
+            stdin_open(session);
+            break;
+
+        case STDIN_DATA:
+            stdin_data(session, buf, len);
+            break;
+
+        case STDIN_EOF:
+            stdin_eof(session);
+            break;
+
+        /* frames go up to COMLINK_MAX_FRAME; these have fixed buffers */
         case EXEC_FILENAME:
-            strcpy(session->exe_name, buf);
+            if (len >= (int)sizeof(session->exe_name)) {
+                fprintf(stderr, "listener: exec name too long (%d) \n", len);
+                break;
+            }
+            snprintf(session->exe_name, sizeof(session->exe_name), "%.*s",
+                len, buf);
             fprintf(stdout, "listener: exec name = %s \n",
                 session->exe_name);    
             break;
 
         case CTRL_MESSAGE:
-            memset(temp_buf, '\n', 256);
-            strcpy(temp_buf, buf);
+            if (len >= (int)sizeof(temp_buf)) {
+                fprintf(stderr, "listener: ctrl message too long (%d) \n",
+                    len);
+                break;
+            }
+            snprintf(temp_buf, sizeof(temp_buf), "%.*s", len, buf);
             listener_handle_ctrlmsg(temp_buf, session);
             break;
             
@@ -215,9 +1458,20 @@ static void listener_rxmsg_callback(int fd,
 
 static void listener_shutdown_callback(int fd)
 {
+    listener_session_t *session = get_listener_session();
+
+    /* comlink closes the socket once this returns */
+    if (fd != session->skt_fd) {
+        pmi_client_gone(fd);
+        bcast_link_gone(session, fd);
+        return;
+    }
+
     fprintf(stderr, "server: peer shotdown, cleaning-up \n");
-    if (fd != -1)
-        close(fd);
+    bcast_cleanup(session);
+    stdin_cleanup(session);
+    sample_cleanup(session);
+    spawn_task_finish(session);
 }
 
 /*****************************************************************************/
@@ -239,6 +1493,42 @@ static int listener_session_setup(listener_session_t *session)
             "listener: comlink server setup failed \n");
         return -1;
     }
+
+    pthread_mutex_init(&session->lock, NULL);
+    pthread_mutex_init(&session->overflow_lock, NULL);
+    pthread_cond_init(&session->cond, NULL);
+
+    /* reaper -> loop thread events */
+    session->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (session->event_fd == -1 ||
+            spsc_init(&session->events, EVENT_RING_SIZE,
+                sizeof(proc_event_t)) == -1 ||
+            comlink_watch_fd(session->event_fd, listener_event_ready) == -1) {
+        fprintf(stderr, "listener: event channel setup failed \n");
+        return -1;
+    }
+
+    /* one timer for every time limit, armed once a job has one */
+    session->deadline_fd = timerfd_create(CLOCK_MONOTONIC,
+            TFD_NONBLOCK | TFD_CLOEXEC);
+    if (session->deadline_fd != -1 &&
+            comlink_watch_fd(session->deadline_fd,
+                listener_deadline_timer) == -1) {
+        close(session->deadline_fd);
+        session->deadline_fd = -1;
+    }
+    if (session->deadline_fd == -1)
+        fprintf(stderr, "listener: time limits will not be enforced \n");
+
+    /* instances still run without wire-up if this fails */
+    session->skt_fd = -1;
+    session->kill_fd = -1;
+    pmi_server_setup(session);
+    metrics_setup(session->metrics_file, session->metrics_interval_ms);
+    stage_setup(session);
+    bcast_setup(session);
+    stdin_setup(session);
+    sample_setup(session);
     
     return 0;
 }
@@ -253,6 +1543,104 @@ static int listener_session_start(listener_session_t *session)
     return 0;
 }
 
+/*****************************************************************************/
+
+static int usage(char *program)
+{
+    fprintf(stderr, "\n%s: [-slots <n>] [-mem-per-slot <MB>]"
+        " [-queue fifo|priority] [-kill-grace <ms>] \n"
+        "    [-metrics-file <path>] [-metrics-interval <ms>]"
+        " [-cache-dir <path>] \n"
+        "    -slots         instances run at once, default from cpus and"
+        " memory \n"
+        "    -mem-per-slot  memory budget of one instance, default %d MB \n"
+        "    -queue         order of the waiting instances \n"
+        "    -kill-grace    SIGTERM to SIGKILL on stop, default %d ms \n"
+        "    -metrics-file  rewrite Prometheus text metrics to this file \n"
+        "    -metrics-interval  how often, default %d ms \n"
+        "    -cache-dir     staged executables, default %s \n",
+        program, SLOT_MEM_MB, KILL_GRACE_MS, METRICS_INTERVAL_MS,
+        CACHE_DIR);
+
+    return 0;
+}
+
+/*****************************************************************************/
+/* cmdline parser; sets up the slot budget */
+
+static int parse_cmdline(int argc, char *argv[],
+        listener_session_t *session)
+{
+    int opt;
+    int slots = 0;
+    int mem_per_slot = SLOT_MEM_MB;
+    static struct option options[] = {
+        { "slots",        required_argument, NULL, 's' },
+        { "mem-per-slot", required_argument, NULL, 'm' },
+        { "queue",        required_argument, NULL, 'q' },
+        { "kill-grace",   required_argument, NULL, 'k' },
+        { "metrics-file", required_argument, NULL, 'f' },
+        { "metrics-interval", required_argument, NULL, 'i' },
+        { "cache-dir",    required_argument, NULL, 'c' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    session->queue_policy = ADMISSION_FIFO;
+    session->kill_grace_ms = KILL_GRACE_MS;
+    session->metrics_interval_ms = METRICS_INTERVAL_MS;
+    snprintf(session->cache_dir, MAX_FILENAME_LEN, "%s", CACHE_DIR);
+    while ((opt = getopt_long_only(argc, argv, "", options, NULL)) != -1) {
+        switch(opt) {
+            case 's':
+                slots = atoi(optarg);
+                break;
+
+            case 'm':
+                mem_per_slot = atoi(optarg);
+                break;
+
+            case 'k':
+                session->kill_grace_ms = atoi(optarg);
+                break;
+
+            case 'f':
+                snprintf(session->metrics_file, MAX_FILENAME_LEN, "%s",
+                    optarg);
+                break;
+
+            case 'i':
+                session->metrics_interval_ms = atoi(optarg);
+                break;
+
+            case 'c':
+                snprintf(session->cache_dir, MAX_FILENAME_LEN, "%s", optarg);
+                break;
+
+            case 'q':
+                if (strcmp(optarg, "priority") == 0)
+                    session->queue_policy = ADMISSION_PRIORITY;
+                else if (strcmp(optarg, "fifo") != 0) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+
+            default:
+                usage(argv[0]);
+                return -1;
+        }
+    }
+
+    if (optind != argc || slots < 0 || mem_per_slot < 0 ||
+            session->kill_grace_ms < 0 ||
+            session->metrics_interval_ms <= 0) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    return admission_setup(session, slots, mem_per_slot);
+}
+
 /*****************************************************************************/
 /* handles SIGINT */
 
@@ -266,12 +1654,15 @@ static void listener_signal_handler(int signal)
 
 /*****************************************************************************/
 
-int main(void)
+int main(int argc, char *argv[])
 {
     struct sigaction sa;
 
     listener_session_t *session = get_listener_session();
 
+    if (parse_cmdline(argc, argv, session) == -1)
+        exit(2);
+
     /* session setup */
     if (listener_session_setup(session) != 0)
         exit(2);
@@ -286,9 +1677,16 @@ int main(void)
         
     /* starts the execution; waits until done */
     listener_session_start(session);
+    comlink_flush(); /* the stop report may still be queued */
 
     /* done with the session; cleans-up */
     listener_session_cleanup(session);
+    admission_cleanup(session);
+    stage_cleanup(session);
+    bcast_cleanup(session);
+    stdin_cleanup(session);
+    sample_cleanup(session);
+    metrics_cleanup();
 
     return 0;
 }
@@ -3,13 +3,134 @@
 
 #include <pthread.h>
 #include "comlink.h"
+#include "common.h"
+#include "table.h"
+#include "spsc.h"
+#include "sha256.h"
+#include "wire.h"
 
 /*****************************************************************************/
 
-#define MAX_INSTANCES    (100)
 #define MAX_FILENAME_LEN (256)
+#define MAX_STATUS_LEN   (128)
 #define MAX_HOSTNAME_LEN (256)
 
+/*****************************************************************************/
+/* a rank waiting for a slot */
+
+enum {
+    ADMISSION_FIFO = 0,
+    ADMISSION_PRIORITY  /* speculative copies, on the critical path, first */
+};
+
+typedef struct spawn_req_s {
+    int rank;
+    int copy;
+    int prio;
+    unsigned int seq;
+    long long queued_ns;
+}spawn_req_t;
+
+/*****************************************************************************/
+/* every instance started on the node, one column per field; speculative
+ * copies started on request are appended like any other */
+
+enum {
+    INST_COPY       = 0x01, /* copy 1, a speculative re-run */
+    INST_SUPERSEDED = 0x02, /* killed, the other copy won */
+    INST_TIMEDOUT   = 0x04, /* SIGTERM for running past a time limit */
+    INST_WALLTIME   = 0x08, /* that limit was the job's walltime */
+    INST_KILLED     = 0x10  /* SIGKILL after the grace period */
+};
+
+typedef struct inst_table_s {
+    int count;
+    int capacity;
+    pid_t *pid;            /* 0 once reaped */
+    int *rank;
+    unsigned char *flags;  /* INST_* */
+    long long *started_ns;
+    long long *term_ns;    /* when INST_TIMEDOUT was set */
+}inst_table_t;
+
+/*****************************************************************************/
+/* what the spawn/reaper thread hands to the loop thread; type is the
+ * frame type it turns into */
+
+typedef struct proc_event_s {
+    int type;
+    long long posted_ns; /* for the reaper lag */
+    union {
+        rank_event_t rank;
+        node_queue_t queue;
+        gang_times_t gang;
+        stop_report_t stop;
+        int_msg_t staged;
+    }u;
+}proc_event_t;
+
+/*****************************************************************************/
+/* the launcher's stdin; every chunk is written once into the stream pipe
+ * and tee'd from there into a pipe per instance, so the bytes are never
+ * copied again. The stream is drained as far as every instance has it */
+
+typedef struct stdin_fan_s {
+    int on;            /* the job reads it */
+    int stream[2];
+    int window;        /* capacity of the stream pipe */
+    int null_fd;       /* drained bytes are spliced here */
+    int wake_fd;       /* new bytes, eof or stop for the fan-out thread */
+    pthread_t thread;
+    int live;          /* created and not joined yet */
+    int stop;
+
+    /* under the lock; bytes the stream pipe had no room for wait in
+     * spill, never more than the window */
+    pthread_mutex_t lock;
+    char *spill;
+    int spill_len;
+    long long got;     /* from the launcher */
+    long long drained; /* out of the stream pipe */
+    int eof;
+    int nr_sinks;
+    int sinks_size;
+    int *sink;         /* write end of an instance's stdin, -1 once gone */
+    long long *sink_got;
+}stdin_fan_t;
+
+/*****************************************************************************/
+/* live resource sampling; a thread of its own reads /proc at the interval
+ * the launcher asked for and sends the node's sums. The columns follow
+ * the rows of the instance table, the /proc files of a running instance
+ * stay open from one sample to the next */
+
+typedef struct sampler_s {
+    int interval_ms;   /* 0 while off */
+    int fd;            /* the launcher connection that asked */
+    pthread_t thread;
+    int live;          /* created and not joined yet */
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    /* sampler thread only */
+    unsigned int seq;
+    int sent_idle;     /* the last sample had no instances */
+    int nr_fds;
+    int max_fds;       /* files kept open, the rest reopened each time */
+    int *rows;         /* running at this sample */
+    int rows_size;
+    int capacity;
+    pid_t *pid;        /* 0 if the row is not tracked */
+    int *rank;
+    int *stat_fd;      /* -1 if not open */
+    int *io_fd;
+    unsigned int *seen; /* seq of the last sample it ran at */
+    long long *cpu_ticks; /* as of the last sample */
+    long long *rchar;
+    long long *wchar;
+}sampler_t;
+
 /*****************************************************************************/
 /* listener session params */
 
@@ -21,20 +142,205 @@ typedef struct listener_session_s {
     
     /* host info */
     int instances;
+    int rank_base; /* global rank of the first local instance */
+    int job_size;
+    char pmi_path[MAX_FILENAME_LEN];
     char hostname[MAX_HOSTNAME_LEN];
     char exe_name[MAX_FILENAME_LEN];
     
     /* for managing the proc spawn thread */
     int spawn_task_stop;
+    int spawn_task_live; /* created and not joined yet */
     pthread_t spawn_task;
     pthread_attr_t spawn_task_attr;
+    spsc_ring_t events;  /* its events, drained by the loop thread */
+    /* the reaper may post holding lock, so it never waits on a full
+     * ring; what doesn't fit goes here, after everything in the ring */
+    pthread_mutex_t overflow_lock;
+    proc_event_t *overflow;
+    int nr_overflow;
+    int overflow_size;
+    int event_fd;        /* wakes the loop, owned by comlink */
+
+    /* gang start; children wait on the release pipe before exec */
+    int gang;
+    int gang_release[2];
+    int gang_report[2];
+    int wireup; /* an instance talked to the pmi server */
 
-    /* for the status spawned processes */
-    pid_t spawned[MAX_INSTANCES];
+    /* for the status spawned processes; live holds the rows still
+     * running, so the reaper and kills never scan the whole table */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    inst_table_t spawned;
+    int *live;
+    int nr_running;
+    int live_size;
+    int nr_done;
     int nr_failed;
-    char status[32];
+    char status[MAX_STATUS_LEN];
+    char **envp; /* shared by all forks, rank vars set under the lock */
+
+    /* admission control; ranks beyond the slot budget wait in the queue */
+    int slots;
+    int queue_policy; /* ADMISSION_* */
+    spawn_req_t *queue;
+    int nr_queued;
+    int queue_size;
+    unsigned int queue_seq;
+    int peak_queued;
+    int reported_queued;
+    long long max_wait_ns;
+
+    /* teardown; SIGTERM to every group, SIGKILL after the grace period */
+    int stopping;
+    int kill_grace_ms;
+    int kill_fd; /* grace timer, owned by comlink while armed */
+    long long stop_ns;
+    stop_report_t stop;
+
+    /* time limits of the job; one timerfd on the loop thread, armed for
+     * the nearest of the walltime, the instance deadlines and the SIGKILL
+     * of what timed out. Under the lock like the table they come from */
+    long long walltime_ms;     /* from JOB_LIMITS, for the next start */
+    long long inst_timeout_ms;
+    long long job_deadline_ns; /* 0 if none or past */
+    int expired;               /* the walltime is up, queue is dropped */
+    int deadline_fd;
+    long long deadline_ns;     /* what it is armed for, 0 if not */
+    int nr_timed_out;
+
+    /* executable staging into the content addressed cache; start and
+     * stage wait in deferred_ctrl until the bytes are in */
+    char cache_dir[MAX_FILENAME_LEN];
+    int stage_pending;
+    int stage_fd;
+    long long stage_got;
+    stage_offer_t stage_offer;
+    sha256_ctx_t stage_sha;
+    char stage_tmp[MAX_FILENAME_LEN + SHA256_HEX_LEN + 16];
+    char deferred_ctrl[16];
+
+    /* input file broadcast; chunks are written to the file and relayed
+     * to the children from it, start waits like it does for staging */
+    bcast_plan_t *bcast_plan; /* followed by its nodes */
+    int bcast_index;
+    int bcast_pending;
+    int bcast_failed;
+    int bcast_fd;
+    int bcast_write_failed; /* fd kept open for the chunks queued from it */
+    long long bcast_got;
+    long long bcast_ns;
+    int nr_bcast_children;
+    int bcast_child[BCAST_MAX_FANOUT]; /* -1 once a child is done */
+    char bcast_tmp[MAX_FILENAME_LEN + 32];
+
+    /* launcher's stdin fanned out to the instances */
+    stdin_fan_t fan;
+
+    /* resource use of the running instances, streamed to the launcher */
+    sampler_t sampler;
+
+    /* metrics file, rewritten every interval */
+    char metrics_file[MAX_FILENAME_LEN];
+    int metrics_interval_ms;
 }listener_session_t;
 
+/*****************************************************************************/
+/* pmi.c -- key-value wire-up service for the local instances */
+
+int pmi_server_setup(listener_session_t *session);
+void pmi_server_cleanup(void);
+int pmi_handle_msg(int fd, unsigned int type, char *buf, int len);
+void pmi_allgather(char *buf, int len, int last);
+void pmi_fence_failed(void);
+void pmi_client_gone(int fd);
+void pmi_job_reset(void);
+
+/*****************************************************************************/
+/* admission.c -- slot budget and the queue in front of it */
+
+int admission_setup(listener_session_t *session, int slots, int mem_per_slot);
+int admission_push(listener_session_t *session, spawn_req_t *req);
+int admission_pop(listener_session_t *session, spawn_req_t *req);
+void admission_cleanup(listener_session_t *session);
+
+/*****************************************************************************/
+/* stage.c -- content addressed cache of staged executables */
+
+int stage_setup(listener_session_t *session);
+int stage_offer(listener_session_t *session, stage_offer_t *offer);
+int stage_data(listener_session_t *session, char *buf, int len);
+void stage_cleanup(listener_session_t *session);
+
+/*****************************************************************************/
+/* bcast.c -- input file broadcast relayed down a chain or tree */
+
+void bcast_setup(listener_session_t *session);
+int bcast_plan(listener_session_t *session, char *buf, int len);
+int bcast_data(listener_session_t *session, int fd, char *buf, int len);
+void bcast_link_gone(listener_session_t *session, int fd);
+void bcast_cleanup(listener_session_t *session);
+
+/*****************************************************************************/
+/* stdin.c -- launcher's stdin fanned out to the local instances */
+
+void stdin_setup(listener_session_t *session);
+int stdin_open(listener_session_t *session);
+int stdin_attach(listener_session_t *session);
+int stdin_start(listener_session_t *session);
+void stdin_data(listener_session_t *session, char *buf, int len);
+void stdin_eof(listener_session_t *session);
+void stdin_cleanup(listener_session_t *session);
+
+/*****************************************************************************/
+/* inventory.c -- what the node has, reported to the launcher */
+
+void inventory_send(listener_session_t *session, int fd);
+
+/*****************************************************************************/
+/* sample.c -- live resource use of the running instances */
+
+void sample_setup(listener_session_t *session);
+void sample_start(listener_session_t *session, int fd, int interval_ms);
+void sample_cleanup(listener_session_t *session);
+
+/*****************************************************************************/
+/* metrics.c -- per thread counters and latency histograms */
+
+enum {
+    METRIC_SPAWNED = 0,
+    METRIC_EXITED,
+    METRIC_FAILED,
+    METRIC_MSGS_IN,    /* launcher and pmi traffic */
+    METRIC_MSGS_OUT,
+    METRIC_BYTES_IN,   /* headers included */
+    METRIC_BYTES_OUT,
+    METRIC_NR_COUNTERS
+};
+
+enum {
+    METRIC_RUNNING = 0,
+    METRIC_QUEUED,
+    METRIC_PEAK_QUEUED,
+    METRIC_EVENT_BATCH, /* most events drained from the ring at once */
+    METRIC_NR_GAUGES
+};
+
+enum {
+    METRIC_SPAWN_NS = 0,  /* spawn request to fork returning */
+    METRIC_RUNTIME_NS,    /* exec to exit */
+    METRIC_REAPER_LAG_NS, /* reaper event to its frame being queued */
+    METRIC_NR_HISTS
+};
+
+int metrics_setup(char *file, int interval_ms);
+void metrics_cleanup(void);
+void metrics_add(int counter, long long n);
+void metrics_observe(int hist, long long ns);
+void metrics_set(int gauge, long long v);
+void metrics_peak(int gauge, long long v);
+
 /*****************************************************************************/
 
 #endif /* _LISTENER_H_ */
@@ -0,0 +1,842 @@
+/*
+ * listener_sim: thousands of simulated listeners in one process
+ */
+
+/* listener_sim.c -- every connection the launcher opens is a node. They
+ *                   all share one comlink loop and one timer; ranks are
+ *                   entries in an event heap instead of processes, with
+ *                   spawn delay, runtime and exit status drawn from the
+ *                   distributions given on the command line. The frames
+ *                   are the real ones, so job_launcher can be profiled
+ *                   against 10k nodes on one box:
+ *
+ *                   ./listener_sim -ports 4 -nodes 10000 -hostfile h
+ *                   ./job_launcher -np 8 -hostfile h /bin/true
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+
+#include "comlink.h"
+#include "common.h"
+#include "wire.h"
+
+/*****************************************************************************/
+
+#define SIM_PORT         (26000)
+#define SIM_BUF_SIZE     (64 * 1024)
+#define SIM_MAX_PORTS    (1024)
+#define SIM_STRAGGLE_X   (10) /* a straggler runs this many times longer */
+
+/* what the simulated nodes can do; no staging, broadcast or speculation,
+ * so the launcher falls back to plain starts for them */
+#define SIM_CAPS (WIRE_CAP_GANG | WIRE_CAP_CLOCK | WIRE_CAP_JOBS)
+
+enum {
+    SIM_SPAWN = 1, /* rank is forked and reports its start */
+    SIM_EXIT       /* rank is over */
+};
+
+/*****************************************************************************/
+/* one pending rank event; dropped if the node's gen moved on */
+
+typedef struct sim_event_s {
+    long long due_ns;
+    int fd;
+    int gen;
+    int index;   /* node local */
+    int kind;    /* SIM_* */
+    long long ns; /* queue wait at spawn, runtime at exit */
+}sim_event_t;
+
+/* a simulated listener, indexed by fd */
+
+typedef struct sim_node_s {
+    int used;
+    int gen;
+    int mute;      /* never answers, for the launcher's hello timeout */
+    int instances;
+    int rank_base;
+    int gang;
+    int staged;
+    int next;      /* instances admitted so far */
+    int nr_running;
+    int nr_done;
+    int nr_failed;
+    int reported_queued;
+    long long start_ns;
+}sim_node_t;
+
+typedef struct sim_params_s {
+    int port;
+    int nr_ports;
+    int slots;          /* 0: every instance at once */
+    int spawn_us;       /* mean fork + exec time, spawns are serial */
+    int runtime_ms;
+    int jitter_pct;     /* runtime spread, +- */
+    double fail_pct;    /* exit(1) */
+    double crash_pct;   /* SIGKILL */
+    double spawn_fail_pct; /* exec fails, like a missing executable */
+    double straggle_pct;
+    double mute_pct;
+    unsigned int seed;
+}sim_params_t;
+
+typedef struct sim_s {
+    sim_params_t p;
+    comlink_params_t cl_params;
+    int timer_fd;
+    long long armed_ns;
+
+    sim_node_t *nodes;
+    int nr_slots;
+
+    sim_event_t *heap;
+    int nr_events;
+    int heap_size;
+
+    unsigned long long rng;
+
+    /* totals, printed once every node is done */
+    int nr_nodes;
+    int nr_nodes_done;
+    long long nr_ranks;
+    long long nr_failed;
+    long long nr_frames;
+}sim_t;
+
+/*****************************************************************************/
+
+static char sim_buf[SIM_BUF_SIZE];
+static sim_t sim;
+
+/*****************************************************************************/
+
+static long long mono_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*****************************************************************************/
+/* gang wake-ups are compared against the launcher's wall clock */
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*****************************************************************************/
+/* xorshift64*, seeded from -seed so runs can be repeated */
+
+static double sim_rand(void)
+{
+    sim.rng ^= sim.rng >> 12;
+    sim.rng ^= sim.rng << 25;
+    sim.rng ^= sim.rng >> 27;
+
+    return ((sim.rng * 2685821657736338717ULL) >> 11) / 9007199254740992.0;
+}
+
+/*****************************************************************************/
+
+static int sim_chance(double pct)
+{
+    return pct > 0 && sim_rand() * 100 < pct;
+}
+
+/*****************************************************************************/
+/* mean, spread by +- pct */
+
+static long long sim_spread(long long mean, int pct)
+{
+    return mean + (long long)(mean * pct / 100.0 * (2 * sim_rand() - 1));
+}
+
+/*****************************************************************************/
+
+static sim_node_t * sim_node(int fd)
+{
+    int i;
+    int n;
+    sim_node_t *p;
+
+    if (fd >= sim.nr_slots) {
+        n = sim.nr_slots ? sim.nr_slots : 1024;
+        while (n <= fd)
+            n *= 2;
+        p = realloc(sim.nodes, n * sizeof(sim_node_t));
+        if (p == NULL)
+            return NULL;
+        for(i = sim.nr_slots; i < n; i++)
+            memset(&p[i], 0, sizeof(sim_node_t));
+        sim.nodes = p;
+        sim.nr_slots = n;
+    }
+
+    p = &sim.nodes[fd];
+    if (!p->used) {
+        p->used = 1;
+        p->mute = sim_chance(sim.p.mute_pct);
+        p->reported_queued = -1;
+        if (!p->mute)
+            sim.nr_nodes += 1;
+    }
+
+    return p;
+}
+
+/*****************************************************************************/
+
+static int sim_send(int fd, int type, char *buf, int len)
+{
+    comlink_header_t header;
+
+    header.type = type;
+    header.len = len;
+    sim.nr_frames += 1;
+
+    return comlink_send(fd, &header, buf, len);
+}
+
+/*****************************************************************************/
+
+static int sim_send_msg(int fd, int type, const wire_schema_t *schema,
+        void *msg)
+{
+    int len;
+    char buf[WIRE_MAX_RECORD];
+
+    len = wire_put(schema, msg, buf, sizeof(buf));
+    if (len == -1)
+        return -1;
+
+    return sim_send(fd, type, buf, len);
+}
+
+/*****************************************************************************/
+/* min-heap on the due time */
+
+static int sim_push(sim_event_t *ev)
+{
+    int i;
+    int n;
+    sim_event_t *p;
+
+    if (sim.nr_events == sim.heap_size) {
+        n = sim.heap_size ? sim.heap_size * 2 : 4096;
+        p = realloc(sim.heap, n * sizeof(sim_event_t));
+        if (p == NULL)
+            return -1;
+        sim.heap = p;
+        sim.heap_size = n;
+    }
+
+    for(i = sim.nr_events++; i > 0 &&
+            sim.heap[(i - 1) / 2].due_ns > ev->due_ns; i = (i - 1) / 2)
+        sim.heap[i] = sim.heap[(i - 1) / 2];
+    sim.heap[i] = *ev;
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+static void sim_pop(sim_event_t *ev)
+{
+    int i;
+    int c;
+    sim_event_t last = sim.heap[--sim.nr_events];
+
+    *ev = sim.heap[0];
+    for(i = 0; (c = 2 * i + 1) < sim.nr_events; i = c) {
+        if (c + 1 < sim.nr_events &&
+                sim.heap[c + 1].due_ns < sim.heap[c].due_ns)
+            c += 1;
+        if (sim.heap[c].due_ns >= last.due_ns)
+            break;
+        sim.heap[i] = sim.heap[c];
+    }
+    sim.heap[i] = last;
+}
+
+/*****************************************************************************/
+
+static void sim_schedule(int fd, int index, int kind, long long due_ns,
+        long long ns)
+{
+    sim_event_t ev;
+
+    ev.due_ns = due_ns;
+    ev.fd = fd;
+    ev.gen = sim.nodes[fd].gen;
+    ev.index = index;
+    ev.kind = kind;
+    ev.ns = ns;
+    if (sim_push(&ev) == -1)
+        fprintf(stderr, "sim: event heap, %s(%d) \n",
+            strerror(errno), errno);
+}
+
+/*****************************************************************************/
+/* one timer for every node; it follows the top of the heap */
+
+static void sim_arm(void)
+{
+    long long due = sim.nr_events > 0 ? sim.heap[0].due_ns : 0;
+    struct itimerspec its;
+
+    if (due == sim.armed_ns)
+        return;
+    sim.armed_ns = due;
+
+    /* a zero value disarms, and an overdue event needs a wake-up now */
+    memset(&its, 0, sizeof(its));
+    if (due > 0) {
+        its.it_value.tv_sec = due / 1000000000LL;
+        its.it_value.tv_nsec = due % 1000000000LL;
+        if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+            its.it_value.tv_nsec = 1;
+    }
+    timerfd_settime(sim.timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/*****************************************************************************/
+/* the launcher wants every change of the queue depth */
+
+static void sim_report_queue(int fd, sim_node_t *n)
+{
+    node_queue_t q;
+    int queued = n->instances - n->next;
+
+    if (queued == n->reported_queued)
+        return;
+    n->reported_queued = queued;
+
+    memset(&q, 0, sizeof(q));
+    q.slots = sim.p.slots ? sim.p.slots : n->instances;
+    q.running = n->nr_running;
+    q.queued = queued;
+    q.peak_queued = n->instances - q.slots > 0 ? n->instances - q.slots : 0;
+    sim_send_msg(fd, NODE_QUEUE, &wire_node_queue, &q);
+}
+
+/*****************************************************************************/
+/* spawns are serial on a node, one spawn delay after the other */
+
+static void sim_admit(int fd, sim_node_t *n, long long now)
+{
+    int limit = sim.p.slots && !n->gang ? sim.p.slots : n->instances;
+    long long due = now;
+
+    while (n->next < n->instances && n->nr_running < limit) {
+        due += sim_spread(sim.p.spawn_us * 1000LL, 50);
+        sim_schedule(fd, n->next++, SIM_SPAWN, due, now - n->start_ns);
+        n->nr_running += 1;
+    }
+    sim_report_queue(fd, n);
+}
+
+/*****************************************************************************/
+
+static void sim_node_done(int fd, sim_node_t *n)
+{
+    char status[128];
+
+    if (n->nr_failed != 0)
+        snprintf(status, sizeof(status),
+            "status(): abnormal exit in %d instances", n->nr_failed);
+    else
+        snprintf(status, sizeof(status), "status(): normal exit");
+    sim_send(fd, STATUS_MESSAGE, status, strlen(status) + 1);
+
+    sim.nr_nodes_done += 1;
+    if (sim.nr_nodes_done < sim.nr_nodes)
+        return;
+
+    fprintf(stdout, "sim: %d nodes done, %lld ranks, %lld failed,"
+        " %lld frames sent \n", sim.nr_nodes_done, sim.nr_ranks,
+        sim.nr_failed, sim.nr_frames);
+    sim.nr_nodes_done = 0;
+    sim.nr_ranks = 0;
+    sim.nr_failed = 0;
+    sim.nr_frames = 0;
+}
+
+/*****************************************************************************/
+
+static void sim_exit(int fd, sim_node_t *n, sim_event_t *ev, int status)
+{
+    rank_event_t re;
+
+    memset(&re, 0, sizeof(re));
+    re.rank = n->rank_base + ev->index;
+    re.status = status;
+    re.time_ns = ev->ns;
+    sim_send_msg(fd, RANK_EXIT, &wire_rank_event, &re);
+
+    n->nr_running -= 1;
+    n->nr_done += 1;
+    sim.nr_ranks += 1;
+    if (status != 0) {
+        n->nr_failed += 1;
+        sim.nr_failed += 1;
+    }
+
+    if (n->nr_done == n->instances)
+        sim_node_done(fd, n);
+    else
+        sim_admit(fd, n, mono_ns());
+}
+
+/*****************************************************************************/
+
+static long long sim_runtime(void)
+{
+    long long ns = sim_spread(sim.p.runtime_ms * 1000000LL, sim.p.jitter_pct);
+
+    return sim_chance(sim.p.straggle_pct) ? ns * SIM_STRAGGLE_X : ns;
+}
+
+/*****************************************************************************/
+
+static void sim_spawn(int fd, sim_node_t *n, sim_event_t *ev, long long now)
+{
+    long long runtime;
+    int_msg_t staged;
+    rank_event_t re;
+
+    if (sim_chance(sim.p.spawn_fail_pct)) {
+        ev->ns = 0;
+        sim_exit(fd, n, ev, 127 << 8);
+        return;
+    }
+
+    memset(&re, 0, sizeof(re));
+    re.rank = n->rank_base + ev->index;
+    re.time_ns = ev->ns;
+    sim_send_msg(fd, RANK_START, &wire_rank_event, &re);
+
+    /* a gang waits for the release before anything runs */
+    if (!n->gang) {
+        runtime = sim_runtime();
+        sim_schedule(fd, ev->index, SIM_EXIT, now + runtime, runtime);
+        return;
+    }
+
+    n->staged += 1;
+    if (n->staged == n->instances) {
+        staged.value = n->staged;
+        sim_send_msg(fd, GANG_READY, &wire_int, &staged);
+    }
+}
+
+/*****************************************************************************/
+/* runs every event that is due, then follows the heap again */
+
+static void sim_timer(int fd)
+{
+    int status;
+    long long now = mono_ns();
+    unsigned long long expired;
+    sim_event_t ev;
+    sim_node_t *n;
+
+    if (read(fd, &expired, sizeof(expired)) == -1 && errno != EAGAIN)
+        return;
+    sim.armed_ns = 0;
+
+    while (sim.nr_events > 0 && sim.heap[0].due_ns <= now) {
+        sim_pop(&ev);
+        n = &sim.nodes[ev.fd];
+        if (!n->used || n->gen != ev.gen)
+            continue;
+
+        if (ev.kind == SIM_SPAWN) {
+            sim_spawn(ev.fd, n, &ev, now);
+            continue;
+        }
+
+        status = 0;
+        if (sim_chance(sim.p.crash_pct))
+            status = SIGKILL;
+        else if (sim_chance(sim.p.fail_pct))
+            status = 1 << 8;
+        ev.ns += now - ev.due_ns; /* the timer may be late */
+        sim_exit(ev.fd, n, &ev, status);
+    }
+
+    sim_arm();
+}
+
+/*****************************************************************************/
+
+static void sim_start(int fd, sim_node_t *n, int gang)
+{
+    n->gen += 1;
+    n->gang = gang;
+    n->staged = 0;
+    n->next = 0;
+    n->nr_running = 0;
+    n->nr_done = 0;
+    n->nr_failed = 0;
+    n->reported_queued = -1;
+    n->start_ns = mono_ns();
+
+    if (n->instances <= 0) {
+        sim_node_done(fd, n);
+        return;
+    }
+    sim_admit(fd, n, n->start_ns);
+}
+
+/*****************************************************************************/
+/* every staged rank wakes up; the exits follow from the release */
+
+static void sim_release(int fd, sim_node_t *n)
+{
+    int i;
+    long long now = mono_ns();
+    long long wake;
+    long long runtime;
+    gang_times_t times;
+
+    if (!n->gang || n->staged < n->instances)
+        return;
+
+    memset(&times, 0, sizeof(times));
+    for(i = 0; i < n->instances; i++) {
+        wake = now_ns() + sim_spread(sim.p.spawn_us * 100LL, 50);
+        if (times.count == 0 || wake < times.first_ns)
+            times.first_ns = wake;
+        if (times.count == 0 || wake > times.last_ns)
+            times.last_ns = wake;
+        times.count += 1;
+        runtime = sim_runtime();
+        sim_schedule(fd, i, SIM_EXIT, now + runtime, runtime);
+    }
+    n->gang = 0;
+    sim_send_msg(fd, GANG_TIMES, &wire_gang_times, &times);
+}
+
+/*****************************************************************************/
+/* the node's ranks are dropped at once; nothing needed SIGKILL */
+
+static void sim_stop(int fd, sim_node_t *n)
+{
+    stop_report_t report;
+
+    memset(&report, 0, sizeof(report));
+    report.groups = n->nr_running;
+    n->gen += 1;
+    n->nr_running = 0;
+    sim_send_msg(fd, STOP_DONE, &wire_stop_report, &report);
+}
+
+/*****************************************************************************/
+
+static void sim_ctrl(int fd, sim_node_t *n, char *buf)
+{
+    if (strcmp(buf, "start") == 0)
+        sim_start(fd, n, 0);
+    else if (strcmp(buf, "stage") == 0)
+        sim_start(fd, n, 1);
+    else if (strcmp(buf, "release") == 0)
+        sim_release(fd, n);
+    else if (strcmp(buf, "stop") == 0)
+        sim_stop(fd, n);
+}
+
+/*****************************************************************************/
+
+static void sim_rxmsg_callback(int fd, unsigned int msg_type, char *buf,
+        int len)
+{
+    char *cur = buf;
+    char *end = buf + len;
+    union {
+        hello_t hello;
+        int_msg_t n;
+        job_layout_t layout;
+    }m;
+    sim_node_t *n = sim_node(fd);
+
+    if (n == NULL || n->mute)
+        return;
+
+    switch(msg_type) {
+        case HELLO:
+            m.hello.version = WIRE_VERSION;
+            m.hello.caps = SIM_CAPS;
+            sim_send_msg(fd, HELLO, &wire_hello, &m.hello);
+            break;
+
+        case PROC_INSTANCES:
+            if (wire_get(&wire_int, &cur, end, &m.n) == 1)
+                n->instances = m.n.value;
+            break;
+
+        case JOB_LAYOUT:
+            if (wire_get(&wire_job_layout, &cur, end, &m.layout) == 1)
+                n->rank_base = m.layout.rank_base;
+            break;
+
+        case CTRL_MESSAGE:
+            sim_ctrl(fd, n, buf);
+            break;
+    }
+
+    sim_arm();
+}
+
+/*****************************************************************************/
+/* the launcher went away; its pending ranks go with it */
+
+static void sim_shutdown_callback(int fd)
+{
+    int gen;
+    sim_node_t *n;
+
+    if (fd >= sim.nr_slots || !sim.nodes[fd].used)
+        return;
+    n = &sim.nodes[fd];
+
+    if (!n->mute)
+        sim.nr_nodes -= 1;
+    if (!n->mute && n->start_ns != 0 && n->nr_done == n->instances &&
+            sim.nr_nodes_done > 0)
+        sim.nr_nodes_done -= 1;
+
+    /* the next node on this fd must not see the old events */
+    gen = n->gen;
+    memset(n, 0, sizeof(sim_node_t));
+    n->gen = gen + 1;
+}
+
+/*****************************************************************************/
+
+static void sim_signal_handler(int signal)
+{
+    comlink_server_shutdown();
+}
+
+/*****************************************************************************/
+/* one line per node, the ports taken in turn */
+
+static int sim_hostfile(char *path, int nodes)
+{
+    int i;
+    FILE *fp;
+
+    fp = fopen(path, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "sim: %s, %s(%d) \n", path, strerror(errno), errno);
+        return -1;
+    }
+
+    for(i = 0; i < nodes; i++)
+        fprintf(fp, "127.0.0.1:%d\n", sim.p.port + i % sim.p.nr_ports);
+
+    return fclose(fp);
+}
+
+/*****************************************************************************/
+/* a launcher talking to 10k nodes needs as many sockets here */
+
+static void sim_raise_nofile(void)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+/*****************************************************************************/
+
+static int usage(char *program)
+{
+    fprintf(stderr, "\n%s: [-port <base>] [-ports <n>] [-nodes <n>"
+        " -hostfile <file>] [-slots <n>] [-spawn-delay <us>]"
+        " [-runtime <ms>] [-jitter <pct>] [-fail <pct>] [-crash <pct>]"
+        " [-spawn-fail <pct>] [-straggle <pct>] [-mute <pct>]"
+        " [-seed <n>] \n"
+        "    -ports       listen on base .. base + n - 1, default %d, 1 \n"
+        "    -hostfile    write one host:port line for each of -nodes \n"
+        "    -slots       instances run at once per node, default all \n"
+        "    -spawn-delay fork and exec time of one instance \n"
+        "    -runtime     mean runtime, spread by -jitter \n"
+        "    -fail        ranks that exit(1), -crash ones killed by SIGKILL,"
+        " -spawn-fail ones that never start \n"
+        "    -straggle    ranks that run %dx longer \n"
+        "    -mute        nodes that never answer \n",
+        program, SIM_PORT, SIM_STRAGGLE_X);
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+static int parse_cmdline(int argc, char *argv[], sim_params_t *p,
+        char **hostfile, int *nodes)
+{
+    int opt;
+    static struct option options[] = {
+        { "port",        required_argument, NULL, 'p' },
+        { "ports",       required_argument, NULL, 'P' },
+        { "nodes",       required_argument, NULL, 'n' },
+        { "hostfile",    required_argument, NULL, 'h' },
+        { "slots",       required_argument, NULL, 's' },
+        { "spawn-delay", required_argument, NULL, 'd' },
+        { "runtime",     required_argument, NULL, 'r' },
+        { "jitter",      required_argument, NULL, 'j' },
+        { "fail",        required_argument, NULL, 'f' },
+        { "crash",       required_argument, NULL, 'c' },
+        { "spawn-fail",  required_argument, NULL, 'e' },
+        { "straggle",    required_argument, NULL, 'g' },
+        { "mute",        required_argument, NULL, 'm' },
+        { "seed",        required_argument, NULL, 'S' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    memset(p, 0, sizeof(*p));
+    p->port = SIM_PORT;
+    p->nr_ports = 1;
+    p->spawn_us = 1000;
+    p->runtime_ms = 100;
+    p->jitter_pct = 20;
+    p->seed = 1;
+    while ((opt = getopt_long_only(argc, argv, "", options, NULL)) != -1) {
+        switch(opt) {
+            case 'p':
+                p->port = atoi(optarg);
+                break;
+            case 'P':
+                p->nr_ports = atoi(optarg);
+                break;
+            case 'n':
+                *nodes = atoi(optarg);
+                break;
+            case 'h':
+                *hostfile = optarg;
+                break;
+            case 's':
+                p->slots = atoi(optarg);
+                break;
+            case 'd':
+                p->spawn_us = atoi(optarg);
+                break;
+            case 'r':
+                p->runtime_ms = atoi(optarg);
+                break;
+            case 'j':
+                p->jitter_pct = atoi(optarg);
+                break;
+            case 'f':
+                p->fail_pct = atof(optarg);
+                break;
+            case 'c':
+                p->crash_pct = atof(optarg);
+                break;
+            case 'e':
+                p->spawn_fail_pct = atof(optarg);
+                break;
+            case 'g':
+                p->straggle_pct = atof(optarg);
+                break;
+            case 'm':
+                p->mute_pct = atof(optarg);
+                break;
+            case 'S':
+                p->seed = strtoul(optarg, NULL, 0);
+                break;
+
+            default:
+                usage(argv[0]);
+                return -1;
+        }
+    }
+
+    if (optind != argc || p->port <= 0 || p->nr_ports <= 0 ||
+            p->nr_ports > SIM_MAX_PORTS || p->port + p->nr_ports > 65536 ||
+            p->slots < 0 || p->spawn_us < 0 || p->runtime_ms < 0 ||
+            p->jitter_pct < 0 || p->jitter_pct > 100 ||
+            (*hostfile != NULL && *nodes <= 0)) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+int main(int argc, char *argv[])
+{
+    int i;
+    int nodes = 0;
+    char *hostfile = NULL;
+    struct sigaction sa;
+    comlink_params_t *cl_params = &sim.cl_params;
+
+    if (parse_cmdline(argc, argv, &sim.p, &hostfile, &nodes) == -1)
+        exit(2);
+    setvbuf(stdout, NULL, _IOLBF, 0); /* progress, even into a file */
+    sim.rng = sim.p.seed ? sim.p.seed : 1;
+
+    if (hostfile != NULL && sim_hostfile(hostfile, nodes) == -1)
+        exit(2);
+    sim_raise_nofile();
+
+    memset(cl_params, 0, sizeof(comlink_params_t));
+    cl_params->buffer = sim_buf;
+    cl_params->buf_len = SIM_BUF_SIZE;
+    cl_params->receive_cb = sim_rxmsg_callback;
+    cl_params->shutdown_cb = sim_shutdown_callback;
+    for(i = 0; i < sim.p.nr_ports; i++) {
+        cl_params->local_port = sim.p.port + i;
+        if (comlink_server_setup(cl_params) == -1)
+            exit(2);
+    }
+
+    sim.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (sim.timer_fd == -1 || comlink_watch_fd(sim.timer_fd, sim_timer) == -1) {
+        fprintf(stderr, "sim: timerfd, %s(%d) \n", strerror(errno), errno);
+        exit(2);
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sim_signal_handler;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    fprintf(stdout, "sim: nodes on ports %d..%d \n", sim.p.port,
+        sim.p.port + sim.p.nr_ports - 1);
+    comlink_server_start();
+    comlink_server_shutdown();
+
+    free(sim.nodes);
+    free(sim.heap);
+
+    return 0;
+}
+
+/*****************************************************************************/
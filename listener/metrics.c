@@ -0,0 +1,476 @@
+/*
+ * metrics: counters, gauges and latency histograms of the listener
+ */
+
+/* metrics.c -- every thread updates its own shard, so the spawn path never
+ *              takes a lock or shares a cache line with the loop thread.
+ *              Readers merge the shards on demand; a query on the local
+ *              unix socket gets the Prometheus text, and the same text is
+ *              rewritten to a file periodically if one is given.
+ *
+ *              Histograms are log-linear like HDR histograms: 16 buckets
+ *              per power of two, so any recorded value is within 1/16 of
+ *              its bucket.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/timerfd.h>
+
+#include "listener.h"
+
+/*****************************************************************************/
+
+#define METRICS_SUB_BITS   (4)
+#define METRICS_SUB_COUNT  (1 << METRICS_SUB_BITS)
+#define METRICS_BUCKETS    ((64 - METRICS_SUB_BITS + 1) * METRICS_SUB_COUNT)
+#define METRICS_MAX_SHARDS (8)  /* threads beyond it share the last one */
+#define METRICS_TEXT_SIZE  (8192)
+
+/*****************************************************************************/
+
+typedef struct metrics_hist_s {
+    unsigned long long count;
+    unsigned long long sum;
+    unsigned long long max;
+    unsigned long long bucket[METRICS_BUCKETS];
+}metrics_hist_t;
+
+typedef struct metrics_shard_s {
+    unsigned long long counter[METRIC_NR_COUNTERS];
+    metrics_hist_t hist[METRIC_NR_HISTS];
+}__attribute__((aligned(64))) metrics_shard_t;
+
+typedef struct metrics_s {
+    pthread_mutex_t lock; /* shard registration only */
+    metrics_shard_t *shards[METRICS_MAX_SHARDS];
+    int nr_shards;
+    long long gauge[METRIC_NR_GAUGES];
+
+    char sock_path[MAX_FILENAME_LEN];
+    char file[MAX_FILENAME_LEN];
+    metrics_shard_t total; /* merge buffer, loop thread only */
+    char text[METRICS_TEXT_SIZE];
+}metrics_t;
+
+/*****************************************************************************/
+
+static metrics_t metrics = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static __thread metrics_shard_t *my_shard;
+
+static const char *counter_names[METRIC_NR_COUNTERS] = {
+    [METRIC_SPAWNED]   = "instances_spawned_total",
+    [METRIC_EXITED]    = "instances_exited_total",
+    [METRIC_FAILED]    = "instances_failed_total",
+    [METRIC_MSGS_IN]   = "messages_in_total",
+    [METRIC_MSGS_OUT]  = "messages_out_total",
+    [METRIC_BYTES_IN]  = "bytes_in_total",
+    [METRIC_BYTES_OUT] = "bytes_out_total",
+};
+
+static const char *gauge_names[METRIC_NR_GAUGES] = {
+    [METRIC_RUNNING]     = "instances_running",
+    [METRIC_QUEUED]      = "instances_queued",
+    [METRIC_PEAK_QUEUED] = "instances_queued_peak",
+    [METRIC_EVENT_BATCH] = "event_batch_peak",
+};
+
+static const char *hist_names[METRIC_NR_HISTS] = {
+    [METRIC_SPAWN_NS]      = "spawn_seconds",
+    [METRIC_RUNTIME_NS]    = "instance_runtime_seconds",
+    [METRIC_REAPER_LAG_NS] = "reaper_lag_seconds",
+};
+
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+/*****************************************************************************/
+
+static metrics_shard_t * metrics_shard_new(void)
+{
+    metrics_shard_t *shard;
+
+    pthread_mutex_lock(&metrics.lock);
+    if (metrics.nr_shards == METRICS_MAX_SHARDS) {
+        shard = metrics.shards[METRICS_MAX_SHARDS - 1];
+    } else {
+        shard = aligned_alloc(64, sizeof(metrics_shard_t));
+        if (shard != NULL) {
+            memset(shard, 0, sizeof(metrics_shard_t));
+            metrics.shards[metrics.nr_shards++] = shard;
+        }
+    }
+    pthread_mutex_unlock(&metrics.lock);
+
+    return shard;
+}
+
+/*****************************************************************************/
+/* the calling thread's shard; updates are relaxed atomics so a shared
+ * overflow shard and the readers stay consistent */
+
+static inline metrics_shard_t * metrics_shard(void)
+{
+    if (my_shard == NULL)
+        my_shard = metrics_shard_new();
+
+    return my_shard;
+}
+
+/*****************************************************************************/
+
+static int metrics_bucket(unsigned long long v)
+{
+    int shift;
+
+    if (v < METRICS_SUB_COUNT)
+        return v;
+
+    shift = 63 - __builtin_clzll(v) - METRICS_SUB_BITS;
+
+    return (shift + 1) * METRICS_SUB_COUNT +
+        (int)((v >> shift) - METRICS_SUB_COUNT);
+}
+
+/*****************************************************************************/
+/* middle of the bucket's range */
+
+static unsigned long long metrics_bucket_value(int idx)
+{
+    int shift;
+    unsigned long long top;
+
+    if (idx < METRICS_SUB_COUNT)
+        return idx;
+
+    shift = idx / METRICS_SUB_COUNT - 1;
+    top = METRICS_SUB_COUNT + idx % METRICS_SUB_COUNT;
+
+    return (top << shift) + ((1ULL << shift) >> 1);
+}
+
+/*****************************************************************************/
+
+void metrics_add(int counter, long long n)
+{
+    metrics_shard_t *shard = metrics_shard();
+
+    if (shard != NULL)
+        __atomic_fetch_add(&shard->counter[counter], n, __ATOMIC_RELAXED);
+}
+
+/*****************************************************************************/
+
+void metrics_observe(int hist, long long ns)
+{
+    unsigned long long v = ns > 0 ? ns : 0;
+    unsigned long long max;
+    metrics_hist_t *h;
+    metrics_shard_t *shard = metrics_shard();
+
+    if (shard == NULL)
+        return;
+
+    h = &shard->hist[hist];
+    __atomic_fetch_add(&h->bucket[metrics_bucket(v)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, v, __ATOMIC_RELAXED);
+
+    max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (v > max && !__atomic_compare_exchange_n(&h->max, &max, v, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/*****************************************************************************/
+
+void metrics_set(int gauge, long long v)
+{
+    __atomic_store_n(&metrics.gauge[gauge], v, __ATOMIC_RELAXED);
+}
+
+/*****************************************************************************/
+/* gauge that only ever goes up */
+
+void metrics_peak(int gauge, long long v)
+{
+    long long cur = __atomic_load_n(&metrics.gauge[gauge], __ATOMIC_RELAXED);
+
+    while (v > cur && !__atomic_compare_exchange_n(&metrics.gauge[gauge],
+            &cur, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/*****************************************************************************/
+
+static void metrics_merge(metrics_shard_t *total)
+{
+    int i;
+    int j;
+    int k;
+    unsigned long long v;
+    metrics_hist_t *src;
+    metrics_hist_t *dst;
+
+    memset(total, 0, sizeof(metrics_shard_t));
+
+    pthread_mutex_lock(&metrics.lock);
+    for(i = 0; i < metrics.nr_shards; i++) {
+        for(j = 0; j < METRIC_NR_COUNTERS; j++)
+            total->counter[j] += __atomic_load_n(
+                &metrics.shards[i]->counter[j], __ATOMIC_RELAXED);
+
+        for(j = 0; j < METRIC_NR_HISTS; j++) {
+            src = &metrics.shards[i]->hist[j];
+            dst = &total->hist[j];
+            dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+            dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+            v = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+            if (v > dst->max)
+                dst->max = v;
+            for(k = 0; k < METRICS_BUCKETS; k++)
+                dst->bucket[k] += __atomic_load_n(&src->bucket[k],
+                    __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&metrics.lock);
+}
+
+/*****************************************************************************/
+/* bucket counts may run ahead of count while a writer is mid update;
+ * the walk is bounded by the buckets, not by count */
+
+static unsigned long long metrics_quantile(metrics_hist_t *h, double q)
+{
+    int i;
+    unsigned long long seen = 0;
+    unsigned long long rank = q * h->count;
+    unsigned long long v;
+
+    for(i = 0; i < METRICS_BUCKETS; i++) {
+        seen += h->bucket[i];
+        if (seen > rank)
+            break;
+    }
+    if (i == METRICS_BUCKETS)
+        return h->max;
+
+    v = metrics_bucket_value(i);
+
+    return v < h->max ? v : h->max;
+}
+
+/*****************************************************************************/
+/* Prometheus text format; returns the length */
+
+static int metrics_render(char *buf, int size)
+{
+    int i;
+    int j;
+    int n = 0;
+    metrics_hist_t *h;
+    metrics_shard_t *t = &metrics.total;
+
+    metrics_merge(t);
+
+#define EMIT(...) \
+    do { \
+        if (n < size) \
+            n += snprintf(buf + n, size - n, __VA_ARGS__); \
+    } while (0)
+
+    for(i = 0; i < METRIC_NR_COUNTERS; i++) {
+        EMIT("# TYPE jl_listener_%s counter\n", counter_names[i]);
+        EMIT("jl_listener_%s %llu\n", counter_names[i], t->counter[i]);
+    }
+
+    for(i = 0; i < METRIC_NR_GAUGES; i++) {
+        EMIT("# TYPE jl_listener_%s gauge\n", gauge_names[i]);
+        EMIT("jl_listener_%s %lld\n", gauge_names[i],
+            __atomic_load_n(&metrics.gauge[i], __ATOMIC_RELAXED));
+    }
+
+    for(i = 0; i < METRIC_NR_HISTS; i++) {
+        h = &t->hist[i];
+        EMIT("# TYPE jl_listener_%s summary\n", hist_names[i]);
+        for(j = 0; j < (int)(sizeof(quantiles) / sizeof(quantiles[0])); j++)
+            EMIT("jl_listener_%s{quantile=\"%g\"} %.9f\n", hist_names[i],
+                quantiles[j], metrics_quantile(h, quantiles[j]) / 1e9);
+        EMIT("jl_listener_%s_sum %.9f\n", hist_names[i], h->sum / 1e9);
+        EMIT("jl_listener_%s_count %llu\n", hist_names[i], h->count);
+        EMIT("# TYPE jl_listener_%s_max gauge\n", hist_names[i]);
+        EMIT("jl_listener_%s_max %.9f\n", hist_names[i], h->max / 1e9);
+    }
+
+#undef EMIT
+
+    return n < size ? n : size - 1;
+}
+
+/*****************************************************************************/
+/* each connection gets one snapshot, then is closed */
+
+static void metrics_query_ready(int fd)
+{
+    int cfd;
+    int len;
+
+    while ((cfd = accept4(fd, NULL, NULL, SOCK_CLOEXEC)) != -1) {
+        len = metrics_render(metrics.text, sizeof(metrics.text));
+        if (send(cfd, metrics.text, len, MSG_NOSIGNAL | MSG_DONTWAIT) == -1)
+            fprintf(stderr, "listener: metrics query, %s(%d) \n",
+                strerror(errno), errno);
+        close(cfd);
+    }
+}
+
+/*****************************************************************************/
+/* written aside and renamed, so scrapers never see a partial file */
+
+static void metrics_write_file(void)
+{
+    int len;
+    FILE *fp;
+    char tmp[MAX_FILENAME_LEN + 8];
+
+    if (metrics.file[0] == '\0')
+        return;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", metrics.file);
+    fp = fopen(tmp, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "listener: metrics file %s, %s(%d) \n",
+            tmp, strerror(errno), errno);
+        return;
+    }
+
+    len = metrics_render(metrics.text, sizeof(metrics.text));
+    if (fwrite(metrics.text, 1, len, fp) != (size_t)len) {
+        fclose(fp);
+        unlink(tmp);
+        return;
+    }
+
+    if (fclose(fp) != 0 || rename(tmp, metrics.file) == -1) {
+        fprintf(stderr, "listener: metrics file %s, %s(%d) \n",
+            metrics.file, strerror(errno), errno);
+        unlink(tmp);
+    }
+}
+
+/*****************************************************************************/
+
+static void metrics_file_tick(int fd)
+{
+    uint64_t ticks;
+
+    if (read(fd, &ticks, sizeof(ticks)) != sizeof(ticks))
+        return;
+
+    metrics_write_file();
+}
+
+/*****************************************************************************/
+
+static int metrics_sock_setup(void)
+{
+    int fd;
+    struct sockaddr_un addr;
+
+    snprintf(metrics.sock_path, sizeof(metrics.sock_path),
+        "/tmp/jl_metrics.%d.sock", (int)getpid());
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, metrics.sock_path);
+    unlink(metrics.sock_path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+            listen(fd, 8) == -1 ||
+            comlink_watch_fd(fd, metrics_query_ready) == -1) {
+        fprintf(stderr, "listener: metrics socket %s, %s(%d) \n",
+            metrics.sock_path, strerror(errno), errno);
+        close(fd);
+        metrics.sock_path[0] = '\0';
+        return -1;
+    }
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+static int metrics_file_setup(char *file, int interval_ms)
+{
+    int fd;
+    struct itimerspec its;
+
+    snprintf(metrics.file, sizeof(metrics.file), "%s", file);
+
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "listener: timerfd, %s(%d) \n",
+            strerror(errno), errno);
+        return -1;
+    }
+
+    memset(&its, 0, sizeof(its));
+    its.it_interval.tv_sec = interval_ms / 1000;
+    its.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+    its.it_value = its.it_interval;
+    if (timerfd_settime(fd, 0, &its, NULL) == -1 ||
+            comlink_watch_fd(fd, metrics_file_tick) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    metrics_write_file();
+
+    return 0;
+}
+
+/*****************************************************************************/
+/* after comlink is up; the query socket and file timer run on its loop */
+
+int metrics_setup(char *file, int interval_ms)
+{
+    if (metrics_sock_setup() == 0)
+        fprintf(stdout, "listener: metrics on %s \n", metrics.sock_path);
+
+    if (file == NULL || file[0] == '\0')
+        return 0;
+
+    if (interval_ms <= 0 || metrics_file_setup(file, interval_ms) == -1) {
+        fprintf(stderr, "listener: metrics file disabled \n");
+        metrics.file[0] = '\0';
+        return -1;
+    }
+
+    return 0;
+}
+
+/*****************************************************************************/
+/* the file keeps the final numbers; comlink closes the watched fds */
+
+void metrics_cleanup(void)
+{
+    metrics_write_file();
+
+    if (metrics.sock_path[0] != '\0')
+        unlink(metrics.sock_path);
+    metrics.sock_path[0] = '\0';
+}
+
+/*****************************************************************************/
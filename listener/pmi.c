@@ -0,0 +1,404 @@
+/*
+ * pmi: key-value wire-up service for the instances spawned by the listener
+ */
+
+/* pmi.c -- instances put/get/fence over a local unix socket. Puts are
+ *          buffered until every local instance has entered the fence, then
+ *          the node's puts go to the launcher as one KVS_FENCE and come
+ *          back merged with all other nodes as one KVS_ALLGATHER. Both go
+ *          on the bulk channel, in parts of at most one bulk frame.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "listener.h"
+#include "common.h"
+
+/*****************************************************************************/
+
+#define PMI_TABLE_INIT (1024) /* power of 2 */
+
+/*****************************************************************************/
+
+typedef struct pmi_kv_s {
+    char *key;
+    char *value;
+}pmi_kv_t;
+
+typedef struct pmi_server_s {
+    listener_session_t *session;
+    char path[MAX_FILENAME_LEN];
+
+    /* puts since the last fence, key\0value\0... */
+    char *pending;
+    int pending_len;
+    int pending_size;
+
+    /* local instances blocked in the fence */
+    int nr_fenced;
+    int *waiters;
+    int waiters_size;
+
+    /* globally visible keys, open addressing */
+    pmi_kv_t *table;
+    int table_size;
+    int nr_keys;
+}pmi_server_t;
+
+/*****************************************************************************/
+
+static pmi_server_t pmi_server;
+
+/*****************************************************************************/
+
+static unsigned int pmi_hash(const char *key)
+{
+    unsigned int h = 2166136261u;
+
+    while (*key)
+        h = (h ^ (unsigned char)*key++) * 16777619u;
+
+    return h;
+}
+
+/*****************************************************************************/
+
+static pmi_kv_t * pmi_lookup(pmi_kv_t *table, int size, const char *key)
+{
+    unsigned int i = pmi_hash(key) & (size - 1);
+
+    while (table[i].key != NULL && strcmp(table[i].key, key) != 0)
+        i = (i + 1) & (size - 1);
+
+    return &table[i];
+}
+
+/*****************************************************************************/
+
+static int pmi_table_grow(pmi_server_t *pmi)
+{
+    int i;
+    int size;
+    pmi_kv_t *table;
+    pmi_kv_t *kv;
+
+    size = pmi->table_size ? pmi->table_size * 2 : PMI_TABLE_INIT;
+    table = calloc(size, sizeof(pmi_kv_t));
+    if (table == NULL)
+        return -1;
+
+    for(i = 0; i < pmi->table_size; i++) {
+        if (pmi->table[i].key == NULL)
+            continue;
+        kv = pmi_lookup(table, size, pmi->table[i].key);
+        *kv = pmi->table[i];
+    }
+
+    free(pmi->table);
+    pmi->table = table;
+    pmi->table_size = size;
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+static int pmi_store(pmi_server_t *pmi, char *key, char *value)
+{
+    pmi_kv_t *kv;
+
+    if ((pmi->nr_keys + 1) * 10 > pmi->table_size * 7 &&
+            pmi_table_grow(pmi) == -1)
+        return -1;
+
+    kv = pmi_lookup(pmi->table, pmi->table_size, key);
+    if (kv->key != NULL) {
+        free(kv->value);
+        kv->value = strdup(value);
+        return 0;
+    }
+
+    kv->key = strdup(key);
+    kv->value = strdup(value);
+    pmi->nr_keys += 1;
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+static int pmi_grow(void **buf, int *size, int need, int elem)
+{
+    int n;
+    void *p;
+
+    if (need <= *size)
+        return 0;
+
+    n = *size ? *size : 64;
+    while (n < need)
+        n *= 2;
+
+    p = realloc(*buf, (size_t)n * elem);
+    if (p == NULL)
+        return -1;
+
+    *buf = p;
+    *size = n;
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+static int pmi_reply(int fd, unsigned int type, char *buf, int len)
+{
+    comlink_header_t header;
+
+    header.type = type;
+    header.len = len;
+    metrics_add(METRIC_MSGS_OUT, 1);
+    metrics_add(METRIC_BYTES_OUT, sizeof(comlink_header_t) + len);
+
+    return comlink_send(fd, &header, buf, len);
+}
+
+/*****************************************************************************/
+/* the local fence is over either way; a payload in the reply fails it */
+
+static void pmi_fence_release(pmi_server_t *pmi, int ok)
+{
+    int i;
+
+    for(i = 0; i < pmi->nr_fenced; i++) {
+        if (pmi->waiters[i] != -1)
+            pmi_reply(pmi->waiters[i], PMI_FENCE_DONE, ok ? "" : "failed",
+                ok ? 0 : sizeof("failed"));
+    }
+
+    pmi->nr_fenced = 0;
+}
+
+/*****************************************************************************/
+/* every local instance is in the fence; push the node's puts upstream */
+
+static void pmi_fence_node(pmi_server_t *pmi)
+{
+    int n;
+    int off = 0;
+    comlink_header_t header;
+
+    /* a pair came in one frame, so a part always takes at least one */
+    do {
+        n = wire_kvs_cut(pmi->pending + off, pmi->pending_len - off,
+                COMLINK_BULK_FRAME);
+        header.type = off + n < pmi->pending_len ? KVS_FENCE_PART : KVS_FENCE;
+        header.len = n;
+        metrics_add(METRIC_MSGS_OUT, 1);
+        metrics_add(METRIC_BYTES_OUT, sizeof(comlink_header_t) + n);
+        if (comlink_send_bulk(pmi->session->skt_fd, &header,
+                pmi->pending + off, n) == -1) {
+            fprintf(stderr, "listener: failed to forward kvs fence \n");
+            pmi_fence_release(pmi, 0);
+            break;
+        }
+        off += n;
+    } while (off < pmi->pending_len);
+
+    pmi->pending_len = 0;
+}
+
+/*****************************************************************************/
+
+static void pmi_handle_put(pmi_server_t *pmi, char *buf, int len)
+{
+    int klen = strnlen(buf, len);
+    int vlen;
+
+    /* key\0value\0, kept as is for the fence; comlink terminates the
+     * payload so the value is always bounded */
+    if (klen == 0 || klen >= len) {
+        fprintf(stderr, "listener: malformed pmi put \n");
+        return;
+    }
+
+    vlen = strlen(buf + klen + 1);
+    len = klen + vlen + 2;
+    if (pmi_grow((void **)&pmi->pending, &pmi->pending_size,
+            pmi->pending_len + len, 1) == -1)
+        return;
+
+    memcpy(pmi->pending + pmi->pending_len, buf, len);
+    pmi->pending_len += len;
+}
+
+/*****************************************************************************/
+
+static void pmi_handle_get(pmi_server_t *pmi, int fd, char *buf)
+{
+    pmi_kv_t *kv = NULL;
+
+    if (pmi->table_size > 0)
+        kv = pmi_lookup(pmi->table, pmi->table_size, buf);
+
+    if (kv == NULL || kv->key == NULL)
+        pmi_reply(fd, PMI_GET_REPLY, "", 0);
+    else
+        pmi_reply(fd, PMI_GET_REPLY, kv->value, strlen(kv->value) + 1);
+}
+
+/*****************************************************************************/
+
+static void pmi_handle_fence(pmi_server_t *pmi, int fd)
+{
+    if (pmi_grow((void **)&pmi->waiters, &pmi->waiters_size,
+            pmi->nr_fenced + 1, sizeof(int)) == -1)
+        return;
+
+    pmi->waiters[pmi->nr_fenced++] = fd;
+    if (pmi->nr_fenced == pmi->session->instances)
+        pmi_fence_node(pmi);
+}
+
+/*****************************************************************************/
+/* returns -1 if the message is not a pmi request */
+
+int pmi_handle_msg(int fd, unsigned int type, char *buf, int len)
+{
+    pmi_server_t *pmi = &pmi_server;
+
+    switch(type) {
+        case PMI_PUT:
+            pmi_handle_put(pmi, buf, len);
+            break;
+
+        case PMI_GET:
+            pmi_handle_get(pmi, fd, buf);
+            break;
+
+        case PMI_FENCE:
+            pmi_handle_fence(pmi, fd);
+            break;
+
+        default:
+            return -1;
+    }
+
+    return 0;
+}
+
+/*****************************************************************************/
+/* merged puts of all nodes, a part at a time, each cut between keys; the
+ * last part releases the local fence */
+
+void pmi_allgather(char *buf, int len, int last)
+{
+    int i;
+    int klen;
+    int vlen;
+    pmi_server_t *pmi = &pmi_server;
+
+    for(i = 0; i < len; i += klen + vlen + 2) {
+        klen = strnlen(buf + i, len - i);
+        if (i + klen + 1 >= len)
+            break;
+        vlen = strnlen(buf + i + klen + 1, len - i - klen - 1);
+        pmi_store(pmi, buf + i, buf + i + klen + 1);
+    }
+
+    if (last)
+        pmi_fence_release(pmi, 1);
+}
+
+/*****************************************************************************/
+/* the launcher couldn't complete the fence; the instances get an error
+ * rather than wait for it */
+
+void pmi_fence_failed(void)
+{
+    fprintf(stderr, "listener: kvs fence failed \n");
+    pmi_fence_release(&pmi_server, 0);
+}
+
+/*****************************************************************************/
+/* an instance went away; never wake a recycled fd */
+
+void pmi_client_gone(int fd)
+{
+    int i;
+    pmi_server_t *pmi = &pmi_server;
+
+    for(i = 0; i < pmi->nr_fenced; i++) {
+        if (pmi->waiters[i] == fd)
+            pmi->waiters[i] = -1;
+    }
+}
+
+/*****************************************************************************/
+/* a new job on the session; the last one's keys must not leak into it */
+
+void pmi_job_reset(void)
+{
+    int i;
+    pmi_server_t *pmi = &pmi_server;
+
+    for(i = 0; i < pmi->table_size; i++) {
+        free(pmi->table[i].key);
+        free(pmi->table[i].value);
+        pmi->table[i].key = NULL;
+        pmi->table[i].value = NULL;
+    }
+    pmi->nr_keys = pmi->pending_len = pmi->nr_fenced = 0;
+}
+
+/*****************************************************************************/
+
+int pmi_server_setup(listener_session_t *session)
+{
+    pmi_server_t *pmi = &pmi_server;
+
+    pmi->session = session;
+    snprintf(pmi->path, sizeof(pmi->path), "/tmp/jl_pmi.%d.sock",
+        (int)getpid());
+
+    if (comlink_local_setup(pmi->path) == -1) {
+        fprintf(stderr, "listener: pmi socket setup failed \n");
+        pmi->path[0] = '\0';
+        return -1;
+    }
+
+    strcpy(session->pmi_path, pmi->path);
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+void pmi_server_cleanup(void)
+{
+    int i;
+    pmi_server_t *pmi = &pmi_server;
+
+    if (pmi->path[0] != '\0')
+        unlink(pmi->path);
+    pmi->path[0] = '\0';
+
+    for(i = 0; i < pmi->table_size; i++) {
+        free(pmi->table[i].key);
+        free(pmi->table[i].value);
+    }
+    free(pmi->table);
+    free(pmi->pending);
+    free(pmi->waiters);
+    pmi->table = NULL;
+    pmi->pending = NULL;
+    pmi->waiters = NULL;
+    pmi->table_size = pmi->pending_size = pmi->waiters_size = 0;
+    pmi->nr_keys = pmi->pending_len = pmi->nr_fenced = 0;
+}
+
+/*****************************************************************************/
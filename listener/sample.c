@@ -0,0 +1,404 @@
+/*
+ * sample: live resource use of the running instances
+ */
+
+/* sample.c -- a thread of its own wakes at the interval the launcher asked
+ *             for, reads /proc/<pid>/stat and /proc/<pid>/io of every
+ *             running instance and sends one NODE_SAMPLE with the node's
+ *             sums: cpu time and bytes read and written since the last
+ *             sample, resident memory now, and the busiest and largest
+ *             instance. Nothing per instance crosses the wire.
+ *
+ *             The files of an instance are opened once and read again
+ *             with pread, so a sample costs two reads per instance and no
+ *             path lookups. The thread times itself, and stretches the
+ *             interval if a sample would take more than 1% of a core.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "listener.h"
+#include "common.h"
+
+/*****************************************************************************/
+
+#define SAMPLE_MIN_MS   (100)
+#define SAMPLE_COST_PCT (1)   /* of a core, at most */
+#define SAMPLE_STAT_BUF (1024)
+
+/*****************************************************************************/
+
+static long long clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*****************************************************************************/
+
+void sample_setup(listener_session_t *session)
+{
+    pthread_condattr_t attr;
+    sampler_t *sp = &session->sampler;
+
+    memset(sp, 0, sizeof(*sp));
+    sp->fd = -1;
+    pthread_mutex_init(&sp->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&sp->cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+/*****************************************************************************/
+
+static void sample_close(sampler_t *sp, int *fd)
+{
+    if (*fd == -1)
+        return;
+
+    close(*fd);
+    *fd = -1;
+    sp->nr_fds -= 1;
+}
+
+/*****************************************************************************/
+
+static void sample_untrack(sampler_t *sp, int row)
+{
+    sample_close(sp, &sp->stat_fd[row]);
+    sample_close(sp, &sp->io_fd[row]);
+    sp->pid[row] = 0;
+}
+
+/*****************************************************************************/
+/* a /proc file of the row's instance, from the start; the file stays open
+ * for the next sample while there are fds to spare */
+
+static int sample_read(sampler_t *sp, int row, int *fd, const char *name,
+        char *buf, int size)
+{
+    int n;
+    char path[64];
+
+    if (*fd == -1) {
+        snprintf(path, sizeof(path), "/proc/%d/%s", (int)sp->pid[row], name);
+        *fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (*fd == -1)
+            return -1;
+        sp->nr_fds += 1;
+    }
+
+    n = pread(*fd, buf, size - 1, 0);
+    if (n <= 0 || sp->nr_fds > sp->max_fds)
+        sample_close(sp, fd);
+    if (n <= 0)
+        return -1;
+    buf[n] = '\0';
+
+    return 0;
+}
+
+/*****************************************************************************/
+/* utime, stime and those of the waited for children, in ticks, and rss in
+ * pages; fields 14-17 and 24, counted after the name, which may have
+ * spaces and parentheses of its own */
+
+static int sample_parse_stat(char *buf, long long *ticks, long long *rss)
+{
+    int field;
+    long long v;
+    char *p = strrchr(buf, ')');
+
+    if (p == NULL || (p = strchr(p + 2, ' ')) == NULL)
+        return -1;
+
+    *ticks = 0;
+    for(field = 4; field <= 24; field++) {
+        v = strtoll(p, &p, 10);
+        if (field >= 14 && field <= 17)
+            *ticks += v;
+    }
+    *rss = v;
+
+    return 0;
+}
+
+/*****************************************************************************/
+/* the rows running now, under the session lock; rows are reused by the
+ * next job, a new pid in one starts it over */
+
+static int sample_rows(listener_session_t *session, sampler_t *sp)
+{
+    int i;
+    int n;
+    int row;
+    int *p;
+    inst_table_t *t = &session->spawned;
+    table_col_t cols[] = {
+        TABLE_COL(sp->pid), TABLE_COL(sp->rank), TABLE_COL(sp->stat_fd),
+        TABLE_COL(sp->io_fd), TABLE_COL(sp->seen), TABLE_COL(sp->cpu_ticks),
+        TABLE_COL(sp->rchar), TABLE_COL(sp->wchar)
+    };
+
+    pthread_mutex_lock(&session->lock);
+    n = session->nr_running;
+    if (n > sp->rows_size) {
+        p = realloc(sp->rows, n * sizeof(int));
+        if (p == NULL)
+            n = 0;
+        else {
+            sp->rows = p;
+            sp->rows_size = n;
+        }
+    }
+    if (table_reserve(cols, sizeof(cols) / sizeof(cols[0]),
+            &sp->capacity, t->count) == -1)
+        n = 0;
+
+    for(i = 0; i < n; i++) {
+        row = session->live[i];
+        if (sp->pid[row] != t->pid[row]) {
+            if (sp->pid[row] != 0)
+                sample_untrack(sp, row);
+            sp->pid[row] = t->pid[row];
+            sp->rank[row] = t->rank[row];
+            sp->stat_fd[row] = -1;
+            sp->io_fd[row] = -1;
+            sp->cpu_ticks[row] = 0;
+            sp->rchar[row] = 0;
+            sp->wchar[row] = 0;
+        }
+        sp->seen[row] = sp->seq;
+        sp->rows[i] = row;
+    }
+    pthread_mutex_unlock(&session->lock);
+
+    return n;
+}
+
+/*****************************************************************************/
+/* one sample of every running instance, summed for the node */
+
+static void sample_node(listener_session_t *session, sampler_t *sp,
+        node_sample_t *ns, long long tick_ns, long long page_kb)
+{
+    int i;
+    int n;
+    int row;
+    long long v;
+    long long rss;
+    long long ticks;
+    long long rchar;
+    long long wchar;
+    char buf[SAMPLE_STAT_BUF];
+
+    sp->seq += 1;
+    n = sample_rows(session, sp);
+    for(i = 0; i < n; i++) {
+        row = sp->rows[i];
+        if (sample_read(sp, row, &sp->stat_fd[row], "stat", buf,
+                sizeof(buf)) == -1 ||
+                sample_parse_stat(buf, &ticks, &rss) == -1)
+            continue;
+
+        ns->instances += 1;
+        v = (ticks - sp->cpu_ticks[row]) * tick_ns;
+        sp->cpu_ticks[row] = ticks;
+        ns->cpu_ns += v;
+        if (v > ns->top_cpu_ns) {
+            ns->top_cpu_ns = v;
+            ns->top_cpu_rank = sp->rank[row];
+        }
+        ns->rss_kb += rss * page_kb;
+        if (rss * page_kb > ns->max_rss_kb) {
+            ns->max_rss_kb = rss * page_kb;
+            ns->max_rss_rank = sp->rank[row];
+        }
+
+        /* rchar and wchar are the first two lines */
+        if (sample_read(sp, row, &sp->io_fd[row], "io", buf,
+                sizeof(buf)) == -1 ||
+                sscanf(buf, "rchar: %lld wchar: %lld", &rchar, &wchar) != 2)
+            continue;
+        ns->read_bytes += rchar - sp->rchar[row];
+        ns->write_bytes += wchar - sp->wchar[row];
+        sp->rchar[row] = rchar;
+        sp->wchar[row] = wchar;
+    }
+
+    /* what is no longer running lets go of its files */
+    for(row = 0; row < sp->capacity; row++) {
+        if (sp->pid[row] != 0 && sp->seen[row] != sp->seq)
+            sample_untrack(sp, row);
+    }
+    ns->seq = sp->seq;
+}
+
+/*****************************************************************************/
+/* a node with nothing running says so once; comlink_send is safe from
+ * this thread */
+
+static void sample_send(sampler_t *sp, node_sample_t *ns)
+{
+    int len;
+    char buf[WIRE_MAX_RECORD];
+    comlink_header_t header;
+
+    if (ns->instances == 0 && sp->sent_idle)
+        return;
+    sp->sent_idle = ns->instances == 0;
+
+    len = wire_put(&wire_node_sample, ns, buf, sizeof(buf));
+    header.type = NODE_SAMPLE;
+    header.len = len;
+    if (len != -1)
+        comlink_send(sp->fd, &header, buf, len);
+}
+
+/*****************************************************************************/
+
+static void * sample_main(void *arg)
+{
+    long long wait;
+    long long interval;
+    long long next;
+    long long last;
+    long long now;
+    long long cpu;
+    long long tick_ns;
+    long long page_kb;
+    node_sample_t ns;
+    struct timespec ts;
+    struct rlimit rl;
+    listener_session_t *session = (listener_session_t *)arg;
+    sampler_t *sp = &session->sampler;
+
+    tick_ns = 1000000000LL / sysconf(_SC_CLK_TCK);
+    page_kb = sysconf(_SC_PAGESIZE) / 1024;
+
+    /* a quarter of the fds for kept open files; pmi sockets and stdin
+     * pipes of the instances need theirs */
+    sp->max_fds = 256;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+        sp->max_fds = rl.rlim_cur / 4;
+
+    last = clock_ns(CLOCK_MONOTONIC);
+    next = last;
+    pthread_mutex_lock(&sp->lock);
+    while (!sp->stop) {
+        interval = sp->interval_ms * 1000000LL;
+        next += interval;
+        ts.tv_sec = next / 1000000000LL;
+        ts.tv_nsec = next % 1000000000LL;
+        while (!sp->stop && pthread_cond_timedwait(&sp->cond, &sp->lock,
+                &ts) == 0)
+            ;
+        if (sp->stop)
+            break;
+        pthread_mutex_unlock(&sp->lock);
+
+        cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+        memset(&ns, 0, sizeof(ns));
+        sample_node(session, sp, &ns, tick_ns, page_kb);
+        now = clock_ns(CLOCK_MONOTONIC);
+        ns.interval_ns = now - last;
+        last = now;
+        ns.cost_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu;
+        sample_send(sp, &ns);
+
+        /* a late wake-up doesn't bunch the next samples up, and a costly
+         * sample pushes the next one out */
+        wait = ns.cost_ns * (100 / SAMPLE_COST_PCT);
+        if (next < now)
+            next = now;
+        if (next + interval < now + wait)
+            next = now + wait - interval;
+        pthread_mutex_lock(&sp->lock);
+    }
+    pthread_mutex_unlock(&sp->lock);
+
+    return NULL;
+}
+
+/*****************************************************************************/
+/* JOB_SAMPLE; a new interval applies from the next sample, 0 stops */
+
+void sample_start(listener_session_t *session, int fd, int interval_ms)
+{
+    int ret;
+    sampler_t *sp = &session->sampler;
+
+    if (interval_ms <= 0) {
+        sample_cleanup(session);
+        return;
+    }
+    if (interval_ms < SAMPLE_MIN_MS)
+        interval_ms = SAMPLE_MIN_MS;
+
+    pthread_mutex_lock(&sp->lock);
+    sp->interval_ms = interval_ms;
+    sp->fd = fd;
+    pthread_mutex_unlock(&sp->lock);
+    if (sp->live)
+        return;
+
+    sp->stop = 0;
+    sp->sent_idle = 0;
+    ret = pthread_create(&sp->thread, NULL, sample_main, (void *)session);
+    if (ret != 0) {
+        fprintf(stderr, "listener: sampler thread, %s(%d) \n",
+            strerror(ret), ret);
+        return;
+    }
+    sp->live = 1;
+    fprintf(stdout, "listener: sampling every %d ms \n", interval_ms);
+}
+
+/*****************************************************************************/
+/* the launcher is gone or asked to stop; the files are let go */
+
+void sample_cleanup(listener_session_t *session)
+{
+    int row;
+    sampler_t *sp = &session->sampler;
+    table_col_t cols[] = {
+        TABLE_COL(sp->pid), TABLE_COL(sp->rank), TABLE_COL(sp->stat_fd),
+        TABLE_COL(sp->io_fd), TABLE_COL(sp->seen), TABLE_COL(sp->cpu_ticks),
+        TABLE_COL(sp->rchar), TABLE_COL(sp->wchar)
+    };
+
+    if (!sp->live)
+        return;
+
+    pthread_mutex_lock(&sp->lock);
+    sp->stop = 1;
+    sp->interval_ms = 0;
+    pthread_cond_signal(&sp->cond);
+    pthread_mutex_unlock(&sp->lock);
+    pthread_join(sp->thread, NULL);
+    sp->live = 0;
+
+    for(row = 0; row < sp->capacity; row++) {
+        if (sp->pid[row] != 0)
+            sample_untrack(sp, row);
+    }
+    table_free(cols, sizeof(cols) / sizeof(cols[0]), &sp->capacity);
+    free(sp->rows);
+    sp->rows = NULL;
+    sp->rows_size = 0;
+}
+
+/*****************************************************************************/
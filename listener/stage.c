@@ -0,0 +1,212 @@
+/*
+ * stage: content addressed cache of the executables sent by the launcher
+ */
+
+/* stage.c -- the launcher offers the SHA-256 of the executable; a copy
+ *            already in the cache directory is used as is, otherwise the
+ *            bytes are fetched once, hashed while written aside, and
+ *            renamed into place under their hash. Listeners sharing the
+ *            directory never see a partial file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "listener.h"
+#include "common.h"
+
+/*****************************************************************************/
+
+int stage_setup(listener_session_t *session)
+{
+    session->stage_fd = -1;
+    session->stage_pending = 0;
+
+    if (mkdir(session->cache_dir, 0700) == -1 && errno != EEXIST) {
+        fprintf(stderr, "listener: cache dir %s, %s(%d) \n",
+            session->cache_dir, strerror(errno), errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+static void stage_cache_path(listener_session_t *session,
+        unsigned char *hash, char *path, int len)
+{
+    char hex[SHA256_HEX_LEN];
+
+    sha256_hex(hash, hex);
+    snprintf(path, len, "%s/%s", session->cache_dir, hex);
+}
+
+/*****************************************************************************/
+/* staging failed; run the launcher's path, it may exist here anyway */
+
+static void stage_fallback(listener_session_t *session)
+{
+    if (session->stage_fd != -1) {
+        close(session->stage_fd);
+        unlink(session->stage_tmp);
+    }
+    session->stage_fd = -1;
+    session->stage_pending = 0;
+
+    snprintf(session->exe_name, MAX_FILENAME_LEN, "%s",
+        session->stage_offer.path);
+    fprintf(stderr, "listener: staging failed, running %s \n",
+        session->exe_name);
+}
+
+/*****************************************************************************/
+/* hash checked, into the cache under its name */
+
+static void stage_commit(listener_session_t *session)
+{
+    unsigned char hash[SHA256_LEN];
+    char path[MAX_FILENAME_LEN];
+    stage_offer_t *offer = &session->stage_offer;
+
+    sha256_final(&session->stage_sha, hash);
+    if (memcmp(hash, offer->hash, SHA256_LEN) != 0) {
+        fprintf(stderr, "listener: staged bytes do not match the hash \n");
+        stage_fallback(session);
+        return;
+    }
+
+    stage_cache_path(session, offer->hash, path, sizeof(path));
+    if (fchmod(session->stage_fd, offer->mode & 0777) == -1 ||
+            close(session->stage_fd) == -1 ||
+            rename(session->stage_tmp, path) == -1) {
+        fprintf(stderr, "listener: cache %s, %s(%d) \n",
+            path, strerror(errno), errno);
+        session->stage_fd = -1;
+        unlink(session->stage_tmp);
+        stage_fallback(session);
+        return;
+    }
+
+    session->stage_fd = -1;
+    session->stage_pending = 0;
+    snprintf(session->exe_name, MAX_FILENAME_LEN, "%s", path);
+    fprintf(stdout, "listener: staged %lld bytes as %s \n",
+        offer->size, session->exe_name);
+}
+
+/*****************************************************************************/
+/* returns 1 while the bytes are being fetched, 0 once exe_name is set */
+
+int stage_offer(listener_session_t *session, stage_offer_t *offer)
+{
+    char buf[WIRE_MAX_RECORD];
+    comlink_header_t header;
+    char path[MAX_FILENAME_LEN];
+
+    session->stage_offer = *offer;
+    session->stage_offer.path[sizeof(offer->path) - 1] = '\0';
+
+    stage_cache_path(session, offer->hash, path, sizeof(path));
+    if (access(path, X_OK) == 0) {
+        snprintf(session->exe_name, MAX_FILENAME_LEN, "%s", path);
+        fprintf(stdout, "listener: exec name = %s, cached \n",
+            session->exe_name);
+        return 0;
+    }
+
+    snprintf(session->stage_tmp, sizeof(session->stage_tmp), "%s.%d.part",
+        path, (int)getpid());
+    session->stage_fd = open(session->stage_tmp,
+            O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0700);
+    if (session->stage_fd == -1) {
+        fprintf(stderr, "listener: %s, %s(%d) \n",
+            session->stage_tmp, strerror(errno), errno);
+        stage_fallback(session);
+        return 0;
+    }
+
+    sha256_init(&session->stage_sha);
+    session->stage_got = 0;
+    if (offer->size == 0) {
+        stage_commit(session);
+        return 0;
+    }
+
+    header.type = STAGE_FETCH;
+    header.len = wire_put(&wire_stage_offer, offer, buf, sizeof(buf));
+    if (comlink_send(session->skt_fd, &header, buf, header.len) == -1) {
+        stage_fallback(session);
+        return 0;
+    }
+
+    session->stage_pending = 1;
+
+    return 1;
+}
+
+/*****************************************************************************/
+/* one chunk of the executable; returns 1 once staging is over, either way */
+
+int stage_data(listener_session_t *session, char *buf, int len)
+{
+    int ret;
+    int off = 0;
+
+    if (!session->stage_pending)
+        return 0;
+
+    /* the launcher couldn't send the rest */
+    if (len == 0) {
+        stage_fallback(session);
+        return 1;
+    }
+
+    if (session->stage_got + len > session->stage_offer.size) {
+        fprintf(stderr, "listener: more staged bytes than offered \n");
+        stage_fallback(session);
+        return 1;
+    }
+
+    while (off < len) {
+        ret = write(session->stage_fd, buf + off, len - off);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret == -1) {
+            fprintf(stderr, "listener: %s, %s(%d) \n",
+                session->stage_tmp, strerror(errno), errno);
+            stage_fallback(session);
+            return 1;
+        }
+        off += ret;
+    }
+
+    sha256_update(&session->stage_sha, buf, len);
+    session->stage_got += len;
+    if (session->stage_got < session->stage_offer.size)
+        return 0;
+
+    stage_commit(session);
+
+    return 1;
+}
+
+/*****************************************************************************/
+
+void stage_cleanup(listener_session_t *session)
+{
+    if (session->stage_fd == -1)
+        return;
+
+    close(session->stage_fd);
+    unlink(session->stage_tmp);
+    session->stage_fd = -1;
+}
+
+/*****************************************************************************/
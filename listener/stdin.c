@@ -0,0 +1,472 @@
+/*
+ * stdin: the launcher's stdin fanned out to the local instances
+ */
+
+/* stdin.c -- the stream comes in once per node on the bulk channel and is
+ *            written once into the stream pipe. A thread tee()s it from
+ *            there into a pipe per instance, sharing the pages instead of
+ *            copying them, and splice()s away what every instance has.
+ *            Acks tell the launcher how far that is; it never has more
+ *            than the stream pipe holds in flight, so memory stays flat
+ *            however long the stream is. An instance that is behind
+ *            holds the others back, an instance that is gone is dropped.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+
+#include "listener.h"
+#include "common.h"
+
+/*****************************************************************************/
+
+#define STDIN_WINDOW (1 << 20) /* asked of the stream pipe, and every sink */
+
+/*****************************************************************************/
+
+void stdin_setup(listener_session_t *session)
+{
+    stdin_fan_t *f = &session->fan;
+
+    memset(f, 0, sizeof(*f));
+    f->stream[0] = -1;
+    f->stream[1] = -1;
+    f->null_fd = -1;
+    f->wake_fd = -1;
+    pthread_mutex_init(&f->lock, NULL);
+}
+
+/*****************************************************************************/
+
+static void stdin_wake(stdin_fan_t *f)
+{
+    uint64_t val = 1;
+
+    if (f->wake_fd != -1 && write(f->wake_fd, &val, sizeof(val)) < 0)
+        return;
+}
+
+/*****************************************************************************/
+/* comlink_send is safe from the fan-out thread too */
+
+static void stdin_ack(listener_session_t *session, long long drained,
+        int window)
+{
+    char buf[WIRE_MAX_RECORD];
+    stdin_ack_t ack;
+    comlink_header_t header;
+
+    ack.drained = drained;
+    ack.window = window;
+    header.type = STDIN_ACK;
+    header.len = wire_put(&wire_stdin_ack, &ack, buf, sizeof(buf));
+    comlink_send(session->skt_fd, &header, buf, header.len);
+}
+
+/*****************************************************************************/
+/* the next job reads the stream; a window of 0 tells the launcher to
+ * leave the node out */
+
+int stdin_open(listener_session_t *session)
+{
+    stdin_fan_t *f = &session->fan;
+
+    stdin_cleanup(session);
+
+    if (pipe2(f->stream, O_CLOEXEC | O_NONBLOCK) == -1) {
+        fprintf(stderr, "listener: stdin pipe, %s(%d) \n",
+            strerror(errno), errno);
+        stdin_ack(session, 0, 0);
+        return -1;
+    }
+
+    /* a smaller pipe only means a smaller window */
+    fcntl(f->stream[1], F_SETPIPE_SZ, STDIN_WINDOW);
+    f->window = fcntl(f->stream[1], F_GETPIPE_SZ);
+    f->null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    f->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    f->spill = malloc(f->window > 0 ? f->window : 1);
+    if (f->window <= 0 || f->null_fd == -1 || f->wake_fd == -1 ||
+            f->spill == NULL) {
+        fprintf(stderr, "listener: stdin setup, %s(%d) \n",
+            strerror(errno), errno);
+        stdin_cleanup(session);
+        stdin_ack(session, 0, 0);
+        return -1;
+    }
+
+    f->on = 1;
+    stdin_ack(session, 0, f->window);
+
+    return 0;
+}
+
+/*****************************************************************************/
+/* a pipe for an instance about to be forked, before the stream starts;
+ * returns the read end for the child, -1 if it gets no stream. Runs on
+ * the spawn thread */
+
+int stdin_attach(listener_session_t *session)
+{
+    int fds[2];
+    int *sink;
+    long long *got;
+    stdin_fan_t *f = &session->fan;
+
+    pthread_mutex_lock(&f->lock);
+    if (!f->on || f->live) {
+        pthread_mutex_unlock(&f->lock);
+        return -1;
+    }
+
+    if (f->nr_sinks == f->sinks_size) {
+        sink = realloc(f->sink, (f->sinks_size * 2 + 16) * sizeof(int));
+        if (sink != NULL)
+            f->sink = sink;
+        got = realloc(f->sink_got,
+                (f->sinks_size * 2 + 16) * sizeof(long long));
+        if (got != NULL)
+            f->sink_got = got;
+        if (sink == NULL || got == NULL) {
+            pthread_mutex_unlock(&f->lock);
+            return -1;
+        }
+        f->sinks_size = f->sinks_size * 2 + 16;
+    }
+
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        fprintf(stderr, "listener: instance stdin pipe, %s(%d) \n",
+            strerror(errno), errno);
+        pthread_mutex_unlock(&f->lock);
+        return -1;
+    }
+    /* an instance that reads late doesn't stall the rest right away */
+    fcntl(fds[1], F_SETPIPE_SZ, f->window);
+
+    f->sink[f->nr_sinks] = fds[1];
+    f->sink_got[f->nr_sinks] = 0;
+    f->nr_sinks += 1;
+    pthread_mutex_unlock(&f->lock);
+
+    return fds[0];
+}
+
+/*****************************************************************************/
+/* called with the lock held */
+
+static void stdin_sink_gone(stdin_fan_t *f, int i)
+{
+    close(f->sink[i]);
+    f->sink[i] = -1;
+}
+
+/*****************************************************************************/
+/* spill first, so the bytes keep their order */
+
+static int stdin_fill(stdin_fan_t *f)
+{
+    int n;
+
+    if (f->spill_len == 0)
+        return 0;
+
+    n = write(f->stream[1], f->spill, f->spill_len);
+    if (n <= 0)
+        return 0;
+    memmove(f->spill, f->spill + n, f->spill_len - n);
+    f->spill_len -= n;
+
+    return n;
+}
+
+/*****************************************************************************/
+/* the stream pipe starts at drained; only the sinks that are there can
+ * be fed from it. Ones that are full are added to pfd to wait on.
+ * Called with the lock held */
+
+static int stdin_tee(stdin_fan_t *f, long long queued, struct pollfd *pfd,
+        int *nr_pfd)
+{
+    int i;
+    int fed = 0;
+    ssize_t n;
+
+    for(i = 0; i < f->nr_sinks && queued > 0; i++) {
+        if (f->sink[i] == -1 || f->sink_got[i] != f->drained)
+            continue;
+        n = tee(f->stream[0], f->sink[i], queued, SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            f->sink_got[i] += n;
+            fed = 1;
+        } else if (n == -1 && errno == EAGAIN) {
+            pfd[*nr_pfd].fd = f->sink[i];
+            pfd[*nr_pfd].events = POLLOUT;
+            *nr_pfd += 1;
+        } else {
+            stdin_sink_gone(f, i);
+            fed = 1;
+        }
+    }
+
+    return fed;
+}
+
+/*****************************************************************************/
+/* drops what every sink has from the stream pipe; all of it once no sink
+ * is left. Called with the lock held */
+
+static void stdin_drain(stdin_fan_t *f, long long queued)
+{
+    int i;
+    ssize_t n;
+    long long low = f->drained + queued;
+    char scratch[4096];
+
+    for(i = 0; i < f->nr_sinks; i++) {
+        if (f->sink[i] != -1 && f->sink_got[i] < low)
+            low = f->sink_got[i];
+    }
+
+    while (f->drained < low) {
+        n = splice(f->stream[0], NULL, f->null_fd, NULL, low - f->drained,
+                SPLICE_F_NONBLOCK);
+        /* /dev/null without splice support */
+        if (n == -1 && errno == EINVAL)
+            n = read(f->stream[0], scratch, low - f->drained <
+                (long long)sizeof(scratch) ? low - f->drained :
+                (long long)sizeof(scratch));
+        if (n <= 0)
+            break;
+        f->drained += n;
+    }
+}
+
+/*****************************************************************************/
+/* 1 once the stream is over and every sink has all of it */
+
+static int stdin_done(stdin_fan_t *f)
+{
+    int i;
+    int n = 0;
+
+    if (!f->eof || f->spill_len > 0 || f->drained < f->got)
+        return 0;
+
+    for(i = 0; i < f->nr_sinks; i++) {
+        if (f->sink[i] == -1)
+            continue;
+        stdin_sink_gone(f, i);
+        n += 1;
+    }
+    fprintf(stdout, "listener: stdin, %lld bytes to %d instances \n",
+        f->got, n);
+
+    return 1;
+}
+
+/*****************************************************************************/
+
+static void * stdin_fan_main(void *arg)
+{
+    int done;
+    int moved;
+    int nr_pfd;
+    long long queued;
+    long long acked = 0;
+    long long drained;
+    uint64_t val;
+    sigset_t set;
+    struct pollfd *pfd;
+    listener_session_t *session = (listener_session_t *)arg;
+    stdin_fan_t *f = &session->fan;
+
+    /* a sink without a reader raises SIGPIPE at the writer; EPIPE is
+     * enough to drop it */
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    /* sinks are all attached by now */
+    pfd = malloc((f->nr_sinks + 1) * sizeof(struct pollfd));
+    if (pfd == NULL) {
+        fprintf(stderr, "listener: stdin fan-out, %s(%d) \n",
+            strerror(errno), errno);
+        return NULL;
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&f->lock);
+        if (f->stop) {
+            pthread_mutex_unlock(&f->lock);
+            break;
+        }
+
+        pfd[0].fd = f->wake_fd;
+        pfd[0].events = POLLIN;
+        nr_pfd = 1;
+        moved = stdin_fill(f);
+        queued = f->got - f->spill_len - f->drained;
+        moved |= stdin_tee(f, queued, pfd, &nr_pfd);
+        drained = f->drained;
+        stdin_drain(f, queued);
+        /* sinks that were ahead may be fed now */
+        moved |= f->drained != drained;
+        drained = f->drained;
+        done = stdin_done(f);
+        pthread_mutex_unlock(&f->lock);
+
+        if (drained != acked) {
+            stdin_ack(session, drained, f->window);
+            acked = drained;
+        }
+        if (done)
+            break;
+        if (moved)
+            continue;
+
+        while (poll(pfd, nr_pfd, -1) == -1 && errno == EINTR)
+            ;
+        if (pfd[0].revents & POLLIN)
+            while (read(f->wake_fd, &val, sizeof(val)) > 0)
+                ;
+    }
+    free(pfd);
+
+    return NULL;
+}
+
+/*****************************************************************************/
+/* the instances are all forked; runs on the spawn thread */
+
+int stdin_start(listener_session_t *session)
+{
+    int ret;
+    stdin_fan_t *f = &session->fan;
+
+    pthread_mutex_lock(&f->lock);
+    if (!f->on || f->live) {
+        pthread_mutex_unlock(&f->lock);
+        return 0;
+    }
+
+    ret = pthread_create(&f->thread, NULL, stdin_fan_main, (void *)session);
+    if (ret != 0) {
+        fprintf(stderr, "listener: stdin fan-out thread, %s(%d) \n",
+            strerror(ret), ret);
+        pthread_mutex_unlock(&f->lock);
+        return -1;
+    }
+    f->live = 1;
+    pthread_mutex_unlock(&f->lock);
+
+    return 0;
+}
+
+/*****************************************************************************/
+/* a chunk from the launcher; the window leaves room for it in the pipe
+ * or the spill */
+
+void stdin_data(listener_session_t *session, char *buf, int len)
+{
+    int n = 0;
+    stdin_fan_t *f = &session->fan;
+
+    if (!f->on)
+        return;
+
+    pthread_mutex_lock(&f->lock);
+    if (f->spill_len == 0)
+        n = write(f->stream[1], buf, len);
+    if (n < 0)
+        n = 0;
+    if (f->spill_len + len - n > f->window) {
+        fprintf(stderr, "listener: stdin past the window, %d bytes"
+            " dropped \n", len - n);
+        len = n;
+    } else {
+        memcpy(f->spill + f->spill_len, buf + n, len - n);
+        f->spill_len += len - n;
+    }
+    f->got += len;
+    pthread_mutex_unlock(&f->lock);
+
+    stdin_wake(f);
+}
+
+/*****************************************************************************/
+
+void stdin_eof(listener_session_t *session)
+{
+    stdin_fan_t *f = &session->fan;
+
+    if (!f->on)
+        return;
+
+    pthread_mutex_lock(&f->lock);
+    f->eof = 1;
+    pthread_mutex_unlock(&f->lock);
+
+    stdin_wake(f);
+}
+
+/*****************************************************************************/
+/* the job is over or the launcher is gone; instances still reading get
+ * eof */
+
+void stdin_cleanup(listener_session_t *session)
+{
+    int i;
+    stdin_fan_t *f = &session->fan;
+
+    if (f->live) {
+        pthread_mutex_lock(&f->lock);
+        f->stop = 1;
+        pthread_mutex_unlock(&f->lock);
+        stdin_wake(f);
+        pthread_join(f->thread, NULL);
+        f->live = 0;
+    }
+
+    for(i = 0; i < f->nr_sinks; i++) {
+        if (f->sink[i] != -1)
+            close(f->sink[i]);
+    }
+    for(i = 0; i < 2; i++) {
+        if (f->stream[i] != -1)
+            close(f->stream[i]);
+        f->stream[i] = -1;
+    }
+    if (f->null_fd != -1)
+        close(f->null_fd);
+    if (f->wake_fd != -1)
+        close(f->wake_fd);
+    f->null_fd = -1;
+    f->wake_fd = -1;
+
+    free(f->spill);
+    free(f->sink);
+    free(f->sink_got);
+    f->spill = NULL;
+    f->sink = NULL;
+    f->sink_got = NULL;
+    f->spill_len = 0;
+    f->nr_sinks = 0;
+    f->sinks_size = 0;
+    f->got = 0;
+    f->drained = 0;
+    f->eof = 0;
+    f->stop = 0;
+    f->on = 0;
+}
+
+/*****************************************************************************/
@@ -0,0 +1,216 @@
+/*
+ * jl_pmi: wire-up client for instances launched by job_launcher
+ */
+
+/* jl_pmi.c -- talks comlink frames to the local listener over the unix
+ *             socket named in JL_PMI_SOCKET */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+#include "comlink.h"
+#include "common.h"
+#include "jl_pmi.h"
+
+/*****************************************************************************/
+
+static int pmi_fd = -1;
+
+/*****************************************************************************/
+
+static int pmi_write_all(char *buf, int len)
+{
+    int ret;
+
+    while (len > 0) {
+        ret = write(pmi_fd, buf, len);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        buf += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+static int pmi_read_all(char *buf, int len)
+{
+    int ret;
+
+    while (len > 0) {
+        ret = read(pmi_fd, buf, len);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        buf += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+static int pmi_send(unsigned int type, char *buf, int len)
+{
+    comlink_header_t header;
+
+    if (pmi_fd == -1)
+        return -1;
+
+    header.type = htonl(type);
+    header.len = htonl(len);
+    if (pmi_write_all((char *)&header, sizeof(header)) == -1 ||
+            pmi_write_all(buf, len) == -1) {
+        fprintf(stderr, "jl_pmi: send failed, %s(%d) \n",
+            strerror(errno), errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*****************************************************************************/
+/* waits for a reply of the given type; returns the payload length */
+
+static int pmi_recv(unsigned int type, char *buf, int len)
+{
+    char c;
+    unsigned int i;
+    comlink_header_t header;
+
+    if (pmi_read_all((char *)&header, sizeof(header)) == -1)
+        return -1;
+
+    header.type = ntohl(header.type);
+    header.len = ntohl(header.len);
+    if (header.type != type) {
+        fprintf(stderr, "jl_pmi: unexpected reply %u \n", header.type);
+        return -1;
+    }
+
+    if (header.len <= (unsigned int)len)
+        return pmi_read_all(buf, header.len) == -1 ? -1 : (int)header.len;
+
+    /* too long for the caller; drain it */
+    for(i = 0; i < header.len; i++) {
+        if (pmi_read_all(&c, 1) == -1)
+            return -1;
+    }
+
+    return -1;
+}
+
+/*****************************************************************************/
+
+int jl_pmi_init(int *rank, int *size)
+{
+    char *path;
+    char *env;
+    struct sockaddr_un addr;
+
+    env = getenv(PMI_ENV_RANK);
+    *rank = env ? atoi(env) : 0;
+    env = getenv(PMI_ENV_SIZE);
+    *size = env ? atoi(env) : 1;
+
+    path = getenv(PMI_ENV_SOCKET);
+    if (path == NULL || strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "jl_pmi: %s not set \n", PMI_ENV_SOCKET);
+        return -1;
+    }
+
+    pmi_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (pmi_fd == -1)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (connect(pmi_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        fprintf(stderr, "jl_pmi: connect %s, %s(%d) \n",
+            path, strerror(errno), errno);
+        close(pmi_fd);
+        pmi_fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+int jl_pmi_put(const char *key, const char *value)
+{
+    int klen = strlen(key);
+    int vlen = strlen(value);
+    char buf[JL_PMI_MAX_KEY + JL_PMI_MAX_VALUE + 2];
+
+    if (klen == 0 || klen >= JL_PMI_MAX_KEY || vlen >= JL_PMI_MAX_VALUE)
+        return -1;
+
+    memcpy(buf, key, klen + 1);
+    memcpy(buf + klen + 1, value, vlen + 1);
+
+    return pmi_send(PMI_PUT, buf, klen + vlen + 2);
+}
+
+/*****************************************************************************/
+/* -1 if the key is unknown; keys appear after the fence they were put in */
+
+int jl_pmi_get(const char *key, char *value, int len)
+{
+    int ret;
+    int klen = strlen(key);
+
+    if (klen == 0 || klen >= JL_PMI_MAX_KEY || len <= 0)
+        return -1;
+
+    if (pmi_send(PMI_GET, (char *)key, klen + 1) == -1)
+        return -1;
+
+    ret = pmi_recv(PMI_GET_REPLY, value, len);
+    if (ret <= 0)
+        return -1;
+
+    value[ret - 1] = '\0';
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+int jl_pmi_fence(void)
+{
+    char c;
+
+    if (pmi_send(PMI_FENCE, "", 0) == -1)
+        return -1;
+
+    return pmi_recv(PMI_FENCE_DONE, &c, 0) == -1 ? -1 : 0;
+}
+
+/*****************************************************************************/
+
+int jl_pmi_finalize(void)
+{
+    if (pmi_fd != -1)
+        close(pmi_fd);
+    pmi_fd = -1;
+
+    return 0;
+}
+
+/*****************************************************************************/
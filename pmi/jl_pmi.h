@@ -0,0 +1,27 @@
+/*
+ * jl_pmi: wire-up client for instances launched by job_launcher
+ */
+#ifndef _JL_PMI_H_
+#define _JL_PMI_H_
+
+/*****************************************************************************/
+/*
+ *  The listener on each node serves a key-value space to its instances.
+ *  Keys put by any rank become visible to every rank after the next
+ *  fence, which all ranks of the job must enter. All calls are blocking
+ *  and return 0 on success, -1 on failure; a fence the launcher couldn't
+ *  complete fails in every rank.
+ */
+
+#define JL_PMI_MAX_KEY   (256)
+#define JL_PMI_MAX_VALUE (4096)
+
+/*****************************************************************************/
+
+int jl_pmi_init(int *rank, int *size);
+int jl_pmi_put(const char *key, const char *value);
+int jl_pmi_get(const char *key, char *value, int len);
+int jl_pmi_fence(void);
+int jl_pmi_finalize(void);
+
+#endif /* _JL_PMI_H_ */